@@ -0,0 +1,95 @@
+#include "opt.h"
+#include "ir.h"
+#include "ssa.h"
+
+#include <stdlib.h>
+
+// A flow-insensitive points-to analysis that is only as strong as it needs
+// to be for the IR the emitter produces: addresses of locals and globals,
+// offset by constants for fields and by anything for array elements.
+
+void analyze_aliases(struct function *function, struct alias_info *info) {
+    size_t n_regs = function->regs.len;
+    info->addresses = calloc(n_regs, sizeof(struct address));
+    info->private = calloc(n_regs, sizeof(bool));
+    bool *is_imm = calloc(n_regs, sizeof(bool));
+    int64_t *imm = calloc(n_regs, sizeof(int64_t));
+    bool *escapes = calloc(n_regs, sizeof(bool));
+
+    // in reverse postorder every definition is seen before its uses, except
+    // for PHI operands, and the result of a PHI points anywhere
+    block_list_t order = {};
+    reverse_postorder(function, &order);
+    for_each_n (b, &order) {
+        for_each_n (instr, &function->blocks.data[*b].instrs) {
+            struct address *out = &info->addresses[ir_def(instr)];
+            reg x = instr->r[1], y = instr->r[2];
+
+            if (instr->op == IMM && !function->constants.data[x].name) {
+                is_imm[instr->r[0]] = true;
+                imm[instr->r[0]] = (int64_t)function->constants.data[x].i;
+            } else if (instr->op == ADDR && x) {
+                *out = (struct address){ .base = x, .known_offset = true };
+            } else if (instr->op == MOVE && instr->width == 8) {
+                *out = info->addresses[x];
+            } else if ((instr->op == ADD || instr->op == SUB) && instr->width == 8) {
+                if (instr->op == ADD && info->addresses[y].base && !info->addresses[x].base) {
+                    reg t = x;
+                    x = y;
+                    y = t;
+                }
+                if (info->addresses[x].base && !info->addresses[y].base) {
+                    *out = info->addresses[x];
+                    if (!is_imm[y]) out->known_offset = false;
+                    else out->offset += instr->op == ADD ? imm[y] : -imm[y];
+                }
+            }
+        }
+    }
+
+    // once every address is known, any use of one that isn't a load, a store
+    // or the computation of another address into the same slot lets it escape
+    for_each_n (block, &function->blocks) {
+        for_each_n (instr, &block->instrs) {
+            bool derives = (instr->op == MOVE || instr->op == ADD || instr->op == SUB) &&
+                           info->addresses[ir_def(instr)].base;
+            if (derives) continue;
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                reg *use = ir_use(function, instr, u);
+                bool address = (instr->op == LD && u == 0) || (instr->op == ST && use == &instr->r[0]);
+                if (!address && info->addresses[*use].base) escapes[info->addresses[*use].base] = true;
+            }
+        }
+    }
+
+    for (size_t r = 1; r < n_regs; r++) {
+        info->private[r] = !escapes[r] && is_stack_slot(function->regs.data[r].scope);
+    }
+
+    list_clear(&order);
+    free(is_imm);
+    free(imm);
+    free(escapes);
+}
+
+void free_aliases(struct alias_info *info) {
+    free(info->addresses);
+    free(info->private);
+}
+
+bool may_alias(struct alias_info *info, reg x, int x_width, reg y, int y_width) {
+    struct address *a = &info->addresses[x], *b = &info->addresses[y];
+    if (a->base && b->base) {
+        if (a->base != b->base) return false;
+        if (!a->known_offset || !b->known_offset) return true;
+        return a->offset < b->offset + y_width && b->offset < a->offset + x_width;
+    }
+    // a pointer from anywhere else can't reach a private slot
+    reg base = a->base ? a->base : b->base;
+    return !base || !info->private[base];
+}
+
+bool call_may_clobber(struct alias_info *info, reg address) {
+    reg base = info->addresses[address].base;
+    return !base || !info->private[base];
+}
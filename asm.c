@@ -0,0 +1,293 @@
+#include "x86.h"
+#include "ir.h"
+#include "tu.h"
+#include "type.h"
+
+#include <stdlib.h>
+
+// Printing machine code as GNU assembler source, AT&T syntax.
+
+#define TTYPE(n) type_at(&tu->types, n)
+
+typedef list(int) symbol_list_t;
+
+static const char *const reg_names[4][16] = {
+    { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+      "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" },
+    { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+      "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" },
+    { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+      "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" },
+    { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+      "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" },
+};
+
+static const char *const cond_names[] = {
+    [X86_E] = "e", [X86_NE] = "ne",
+    [X86_L] = "l", [X86_LE] = "le", [X86_G] = "g", [X86_GE] = "ge",
+    [X86_B] = "b", [X86_BE] = "be", [X86_A] = "a", [X86_AE] = "ae",
+    [X86_P] = "p", [X86_NP] = "np",
+    [X86_S] = "s",
+};
+
+static const char *const mnemonics[] = {
+    [X86_MOV] = "mov", [X86_LEA] = "lea",
+    [X86_ADD] = "add", [X86_SUB] = "sub", [X86_IMUL] = "imul",
+    [X86_AND] = "and", [X86_OR] = "or", [X86_XOR] = "xor",
+    [X86_SHL] = "shl", [X86_SHR] = "shr", [X86_SAR] = "sar",
+    [X86_NEG] = "neg", [X86_NOT] = "not",
+    [X86_CMP] = "cmp", [X86_TEST] = "test", [X86_XCHG] = "xchg",
+    [X86_DIV] = "div", [X86_IDIV] = "idiv",
+    [X86_PUSH] = "push",
+    [X86_ADDS] = "adds", [X86_SUBS] = "subs", [X86_MULS] = "muls", [X86_DIVS] = "divs",
+    [X86_UCOMIS] = "ucomis",
+};
+
+static char size_suffix(int size) {
+    switch (size) {
+    case 1: return 'b';
+    case 2: return 'w';
+    case 4: return 'l';
+    default: return 'q';
+    }
+}
+
+static char float_suffix(int size) {
+    return size == 4 ? 's' : 'd';
+}
+
+static const char *reg_name(enum machine_reg r, int size) {
+    if (r >= XMM0) return machine_reg_names[r];
+    return reg_names[size == 1 ? 0 : size == 2 ? 1 : size == 4 ? 2 : 3][r];
+}
+
+static void print_symbol(struct tu *tu, FILE *out, int symbol) {
+    if (is_string_symbol(tu, symbol)) fprintf(out, ".Lstr%i", symbol);
+    else fputs(tu_string(tu, symbol), out);
+}
+
+static void print_operand(struct tu *tu, FILE *out, int function_id, struct x86_operand *x, int size) {
+    switch (x->kind) {
+    case X86_REG:
+        fprintf(out, "%%%s", reg_name(x->reg, size));
+        break;
+    case X86_IMM:
+        fprintf(out, "$%lli", (long long)x->imm);
+        break;
+    case X86_MEM:
+        if (x->imm) fprintf(out, "%lli", (long long)x->imm);
+        if (x->scale) fprintf(out, "(%%%s,%%%s,%i)", reg_name(x->reg, 8), reg_name(x->index, 8), x->scale);
+        else fprintf(out, "(%%%s)", reg_name(x->reg, 8));
+        break;
+    case X86_RIP:
+        if (x->symbol) print_symbol(tu, out, x->symbol);
+        else fprintf(out, ".L%i_%i", function_id, x->label);
+        if (x->indirect) fputs("@GOTPCREL", out);
+        else if (x->imm) fprintf(out, "%+lli", (long long)x->imm);
+        fputs("(%rip)", out);
+        break;
+    case X86_TARGET:
+        if (!x->symbol) {
+            fprintf(out, ".L%i_%i", function_id, x->label);
+        } else {
+            print_symbol(tu, out, x->symbol);
+            if (x->indirect) fputs("@PLT", out);
+        }
+        break;
+    case X86_NONE:
+        break;
+    }
+}
+
+static void print_instr(struct tu *tu, FILE *out, int function_id, struct x86_instr *i) {
+    struct x86_operand *dst = &i->operands[0], *src = &i->operands[1];
+    // the size each operand is printed at, if it is a register
+    int dst_size = i->size, src_size = i->size;
+
+    if (i->op == X86_LABEL) {
+        fprintf(out, ".L%i_%i:\n", function_id, dst->label);
+        return;
+    }
+    fputc('\t', out);
+    switch (i->op) {
+    case X86_MOV:
+        // a 64 bit immediate that isn't a sign extended 32 bit one
+        if (i->size == 8 && src->kind == X86_IMM && (src->imm < INT32_MIN || src->imm > INT32_MAX)) {
+            fputs("movabsq", out);
+        } else {
+            fprintf(out, "mov%c", size_suffix(i->size));
+        }
+        break;
+    case X86_MOVSX:
+    case X86_MOVZX:
+        if (i->op == X86_MOVSX && i->from_size == 4) fputs("movslq", out);
+        else fprintf(out, "mov%c%c%c", i->op == X86_MOVSX ? 's' : 'z', size_suffix(i->from_size), size_suffix(i->size));
+        src_size = i->from_size;
+        break;
+    case X86_SHL:
+    case X86_SHR:
+    case X86_SAR:
+        fprintf(out, "%s%c", mnemonics[i->op], size_suffix(i->size));
+        src_size = 1;
+        break;
+    case X86_CQO:
+        fputs(i->size == 8 ? "cqto" : "cltd", out);
+        break;
+    case X86_SETCC:
+        fprintf(out, "set%s", cond_names[i->cond]);
+        break;
+    case X86_JCC:
+        fprintf(out, "j%s", cond_names[i->cond]);
+        break;
+    case X86_JMP:
+        fputs("jmp", out);
+        break;
+    case X86_CALL:
+        fputs("call", out);
+        break;
+    case X86_RET:
+        fputs("ret", out);
+        break;
+    case X86_LEAVE:
+        fputs("leave", out);
+        break;
+    case X86_MOVS:
+        fprintf(out, "movs%c", float_suffix(i->size));
+        break;
+    case X86_MOVAPS:
+        fputs("movaps", out);
+        break;
+    case X86_MOVQ:
+        fputs(i->size == 8 ? "movq" : "movd", out);
+        break;
+    case X86_XORPS:
+        fputs("xorps", out);
+        break;
+    case X86_ADDS:
+    case X86_SUBS:
+    case X86_MULS:
+    case X86_DIVS:
+    case X86_UCOMIS:
+        fprintf(out, "%s%c", mnemonics[i->op], float_suffix(i->size));
+        break;
+    case X86_CVTSI2S:
+        fprintf(out, "cvtsi2s%c%c", float_suffix(i->size), size_suffix(i->from_size));
+        src_size = i->from_size;
+        break;
+    case X86_CVTTS2SI:
+        fprintf(out, "cvtts%c2si%c", float_suffix(i->from_size), size_suffix(i->size));
+        break;
+    case X86_CVTS2S:
+        fprintf(out, "cvts%c2s%c", float_suffix(i->from_size), float_suffix(i->size));
+        break;
+    default:
+        fprintf(out, "%s%c", mnemonics[i->op], size_suffix(i->size));
+        break;
+    }
+
+    if (i->op == X86_CALL && dst->kind == X86_REG) {
+        fprintf(out, "\t*%%%s\n", reg_name(dst->reg, 8));
+        return;
+    }
+    // AT&T order: source first
+    if (src->kind != X86_NONE) {
+        fputc('\t', out);
+        print_operand(tu, out, function_id, src, src_size);
+        fputs(", ", out);
+        print_operand(tu, out, function_id, dst, dst_size);
+    } else if (dst->kind != X86_NONE) {
+        fputc('\t', out);
+        print_operand(tu, out, function_id, dst, dst_size);
+    }
+    fputc('\n', out);
+}
+
+static void write_function(struct tu *tu, FILE *out, struct x86_function *function, int function_id) {
+    const char *name = tu_string(tu, function->symbol);
+    fputs("\t.text\n", out);
+    if (function->is_global) fprintf(out, "\t.globl %s\n", name);
+    fprintf(out, "\t.type %s, @function\n%s:\n", name, name);
+    for_each (&function->instrs) print_instr(tu, out, function_id, it);
+    fprintf(out, "\t.size %s, .-%s\n", name, name);
+
+    if (!function->constants.len) return;
+    // every constant takes 8 bytes, so a float can be read as a double,
+    // like an argument
+    fputs("\t.section .rodata\n\t.p2align 3\n", out);
+    for_each (&function->constants) {
+        fprintf(out, ".L%i_%i:\n\t.quad %#llx\n", function_id, it->label, (unsigned long long)it->bits);
+    }
+}
+
+static void add_string(symbol_list_t *strings, int symbol) {
+    for_each (strings) {
+        if (*it == symbol) return;
+    }
+    list_push(strings, symbol);
+}
+
+static void collect_strings(struct tu *tu, struct x86_function *function, symbol_list_t *strings) {
+    for_each_n (instr, &function->instrs) {
+        for (int o = 0; o < 2; o++) {
+            struct x86_operand *x = &instr->operands[o];
+            if (x->kind == X86_RIP && x->symbol && is_string_symbol(tu, x->symbol)) add_string(strings, x->symbol);
+        }
+    }
+}
+
+static void write_global(struct tu *tu, FILE *out, size_t g, symbol_list_t *strings) {
+    struct ir_global *global = &tu->module.globals.data[g];
+    bool is_global;
+    int symbol = scope_symbol(tu, global->scope, &is_global);
+    if (is_redefined(tu, g, symbol)) return;
+
+    const char *name = tu_string(tu, symbol);
+    size_t align = type_align(tu, global->scope->c_type);
+    fputs(global->initialized ? "\t.data\n" : "\t.bss\n", out);
+    if (is_global) fprintf(out, "\t.globl %s\n", name);
+    fprintf(out, "\t.type %s, @object\n\t.size %s, %zu\n", name, name, global->size);
+    if (align > 1) fprintf(out, "\t.balign %zu\n", align);
+    fprintf(out, "%s:\n", name);
+
+    struct ir_constant *init = &global->init;
+    if (!global->initialized || !global->width) {
+        fprintf(out, "\t.zero %zu\n", global->size ? global->size : 1);
+    } else if (init->name) {
+        if (is_string_symbol(tu, init->name)) add_string(strings, init->name);
+        fputs("\t.quad ", out);
+        print_symbol(tu, out, init->name);
+        if (init->i) fprintf(out, "%+lli", (long long)init->i);
+        fputc('\n', out);
+    } else {
+        static const char *const directives[] = { [1] = "byte", [2] = "short", [4] = "long", [8] = "quad" };
+        fprintf(out, "\t.%s %#llx\n", directives[global->width], (unsigned long long)global_bits(global));
+    }
+}
+
+void write_assembly(struct tu *tu, FILE *out) {
+    symbol_list_t strings = {};
+    int function_id = 0;
+    for_each (&tu->module.functions) {
+        struct x86_function code = {};
+        generate_function(tu, *it, &code);
+        free_function(*it);
+        write_function(tu, out, &code, function_id++);
+        collect_strings(tu, &code, &strings);
+        free_x86_function(&code);
+    }
+    // the IR is only needed to generate the code
+    list_clear(&tu->module.functions);
+    for_each (&tu->module.code) {
+        write_function(tu, out, *it, function_id++);
+        collect_strings(tu, *it, &strings);
+    }
+
+    for (size_t g = 0; g < tu->module.globals.len; g++) write_global(tu, out, g, &strings);
+
+    if (strings.len) fputs("\t.section .rodata\n", out);
+    for_each (&strings) {
+        fprintf(out, ".Lstr%i:\n\t.string %s\n", *it, tu_string(tu, *it));
+    }
+    list_clear(&strings);
+    fputs("\t.section .note.GNU-stack,\"\",@progbits\n", out);
+}
@@ -0,0 +1,1686 @@
+#include "x86.h"
+#include "diag.h"
+#include "eval.h"
+#include "ir.h"
+#include "parse.h"
+#include "regalloc.h"
+#include "token.h"
+#include "tu.h"
+#include "type.h"
+#include "walk.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// The code generator for -O0: machine code straight from the AST of a
+// function, in one walk, in the manner of tcc, with no IR, CFG or register
+// allocation in between.
+//
+// Each expression leaves an item on a value stack: a constant, a value in a
+// register or spilled to the frame, a comparison still in the flags, or an
+// lvalue, the object a variable or dereference designates, which is only read
+// once something wants its value. Operators work on the items at the top,
+// loading them into the caller-saved registers as they need them; when those
+// run out, the item deepest in the stack that holds one is spilled. Only the
+// top item can be in the flags, so an instruction that clobbers them never
+// has to wonder whether it may. Every variable lives in the frame, and the
+// stack is empty between statements, so branches only ever join with
+// nothing in registers, except the value a conditional expression leaves in
+// RAX or XMM0.
+
+#define TSCOPE(n) list_ptr(&tu->scopes, n)
+#define TTYPE(n) type_at(&tu->types, n)
+
+enum item_kind : char {
+    // rvalues: a constant, a value in reg, one spilled to rbp + offset, and
+    // an int that is 1 if cond holds in the flags
+    ITEM_CONST,
+    ITEM_REG,
+    ITEM_SPILLED,
+    ITEM_FLAGS,
+    // lvalues: an object at rbp + offset, at symbol, at the address in reg,
+    // or at the address spilled to rbp + offset
+    ITEM_LOCAL,
+    ITEM_GLOBAL,
+    ITEM_DEREF,
+    ITEM_DEREF_SPILLED,
+};
+
+struct item {
+    enum item_kind kind;
+    enum machine_reg reg;
+    enum x86_cond cond;
+    // an ITEM_GLOBAL reached through the GOT
+    bool indirect;
+    // the type of an rvalue, or of the object of an lvalue
+    int type;
+    int offset;
+    int symbol;
+    union {
+        int64_t i;
+        double f;
+    };
+};
+
+struct label {
+    struct node *name;
+    int label;
+    // the first goto, kept for the error if the label is never defined
+    struct node *first_use;
+    bool defined;
+};
+
+struct baseline {
+    struct tu *tu;
+    struct x86_function *out;
+    int return_type;
+    list(struct item) items;
+    // the bytes of frame below rbp so far, the spill slots that are free
+    // again, and the sub of the prologue that is patched to the final size
+    int frame_size;
+    list(int) free_slots;
+    size_t frame_instr;
+    list(struct label) labels;
+};
+
+static const enum machine_reg int_regs[] = { RAX, RDX, RCX, RSI, RDI, R8, R9, R10 };
+static const enum machine_reg float_regs[] = { XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7 };
+
+static uint32_t bit(enum machine_reg r) {
+    return 1u << r;
+}
+
+static struct x86_operand reg_operand(enum machine_reg r) {
+    return (struct x86_operand){ .kind = X86_REG, .reg = r };
+}
+
+static struct x86_operand imm_operand(int64_t imm) {
+    return (struct x86_operand){ .kind = X86_IMM, .imm = imm };
+}
+
+static struct x86_operand mem_operand(enum machine_reg base, int64_t disp) {
+    return (struct x86_operand){ .kind = X86_MEM, .reg = base, .imm = disp };
+}
+
+static struct x86_operand label_operand(int label) {
+    return (struct x86_operand){ .kind = X86_TARGET, .label = label };
+}
+
+static struct x86_instr *put(struct baseline *b, enum x86_op op, int size, struct x86_operand x, struct x86_operand y) {
+    list_push(&b->out->instrs, ((struct x86_instr){ .op = op, .size = (unsigned char)size, .operands = { x, y } }));
+    return &list_last(&b->out->instrs);
+}
+
+static struct x86_instr *put1(struct baseline *b, enum x86_op op, int size, struct x86_operand x) {
+    return put(b, op, size, x, (struct x86_operand){});
+}
+
+static void put0(struct baseline *b, enum x86_op op, int size) {
+    put(b, op, size, (struct x86_operand){}, (struct x86_operand){});
+}
+
+static int new_label(struct baseline *b) {
+    return b->out->n_labels++;
+}
+
+static void place_label(struct baseline *b, int label) {
+    put1(b, X86_LABEL, 0, label_operand(label));
+}
+
+static void jump(struct baseline *b, enum x86_op op, enum x86_cond cond, int label) {
+    put1(b, op, 0, label_operand(label))->cond = cond;
+}
+
+static bool fits_imm32(int64_t imm) {
+    return imm >= INT32_MIN && imm <= INT32_MAX;
+}
+
+static int64_t sign_extend(uint64_t value, int size) {
+    if (size >= 8) return (int64_t)value;
+    int shift = 64 - 8 * size;
+    return (int64_t)(value << shift) >> shift;
+}
+
+// Integer operations narrower than 32 bits are done at 32 bits, and a narrow
+// value in a register has whatever its low bytes were computed from above it.
+static int int_size(int width) {
+    return width <= 4 ? 4 : 8;
+}
+
+static uint64_t float_bits(double f, int size) {
+    uint64_t bits = 0;
+    if (size == 4) {
+        float narrow = (float)f;
+        memcpy(&bits, &narrow, sizeof(narrow));
+    } else {
+        memcpy(&bits, &f, sizeof(f));
+    }
+    return bits;
+}
+
+static struct x86_operand constant_operand(struct baseline *b, uint64_t bits, int size) {
+    for_each (&b->out->constants) {
+        if (it->bits == bits && it->size == size) return (struct x86_operand){ .kind = X86_RIP, .label = it->label };
+    }
+    int label = new_label(b);
+    list_push(&b->out->constants, ((struct x86_constant){ .label = label, .bits = bits, .size = (unsigned char)size }));
+    return (struct x86_operand){ .kind = X86_RIP, .label = label };
+}
+
+static enum x86_cond invert(enum x86_cond cond) {
+    static const enum x86_cond inverse[] = {
+        [X86_E] = X86_NE, [X86_NE] = X86_E,
+        [X86_L] = X86_GE, [X86_LE] = X86_G, [X86_G] = X86_LE, [X86_GE] = X86_L,
+        [X86_B] = X86_AE, [X86_BE] = X86_A, [X86_A] = X86_BE, [X86_AE] = X86_B,
+        [X86_P] = X86_NP, [X86_NP] = X86_P,
+    };
+    return inverse[cond];
+}
+
+static const enum x86_cond signed_conds[] = {
+    [COND_EQ] = X86_E, [COND_NE] = X86_NE,
+    [COND_LT] = X86_L, [COND_LE] = X86_LE, [COND_GT] = X86_G, [COND_GE] = X86_GE,
+};
+
+static const enum x86_cond unsigned_conds[] = {
+    [COND_EQ] = X86_E, [COND_NE] = X86_NE,
+    [COND_LT] = X86_B, [COND_LE] = X86_BE, [COND_GT] = X86_A, [COND_GE] = X86_AE,
+};
+
+// The width an rvalue of this type occupies in a register, like the IR's.
+static int width(struct baseline *b, int type) {
+    struct tu *tu = b->tu;
+    switch (TTYPE(type)->layer) {
+    case TYPE_ARRAY:
+    case TYPE_FUNCTION:
+    case TYPE_POINTER:
+        return 8;
+    case TYPE_VOID:
+        return 0;
+    default:
+        return (int)type_size(tu, type);
+    }
+}
+
+static bool is_float(struct baseline *b, int type) {
+    return type_is_floating(b->tu, type);
+}
+
+static int int_type(struct baseline *b) {
+    return find_or_create_type(b->tu, 0, TYPE_SIGNED_INT, 0);
+}
+
+// An integer constant as a value of type: its low bytes, extended the way
+// the type is.
+static int64_t normalize(struct baseline *b, uint64_t value, int type) {
+    int w = width(b, type);
+    if (type_at(&b->tu->types, type)->layer == TYPE_BOOL) return value != 0;
+    if (w >= 8 || w == 0) return (int64_t)value;
+    if (type_is_signed(b->tu, type)) return sign_extend(value, w);
+    return (int64_t)(value & ((1ull << (8 * w)) - 1));
+}
+
+static struct item *top(struct baseline *b, size_t n) {
+    return &b->items.data[b->items.len - n];
+}
+
+static bool is_lvalue(struct item *it) {
+    return it->kind >= ITEM_LOCAL;
+}
+
+static bool holds(struct item *it, enum machine_reg r) {
+    return (it->kind == ITEM_REG || it->kind == ITEM_DEREF) && it->reg == r;
+}
+
+// The type of the value of an item, as an rvalue.
+static int value_type(struct baseline *b, struct item *it) {
+    return is_lvalue(it) ? type_rvalue(b->tu, it->type) : it->type;
+}
+
+static int new_slot(struct baseline *b) {
+    if (b->free_slots.len) return b->free_slots.data[--b->free_slots.len];
+    b->frame_size += 8;
+    return -b->frame_size;
+}
+
+static void release(struct baseline *b, struct item *it) {
+    if (it->kind == ITEM_SPILLED || it->kind == ITEM_DEREF_SPILLED) list_push(&b->free_slots, it->offset);
+}
+
+static void push(struct baseline *b, struct item item) {
+    list_push(&b->items, item);
+}
+
+static void pop(struct baseline *b) {
+    release(b, top(b, 1));
+    b->items.len--;
+}
+
+// Remove the item n from the top, keeping those above it.
+static void remove_item(struct baseline *b, size_t n) {
+    release(b, top(b, n));
+    memmove(top(b, n), top(b, n - 1), (n - 1) * sizeof(struct item));
+    b->items.len--;
+}
+
+// Put an item under the n items at the top.
+static void insert(struct baseline *b, size_t n, struct item item) {
+    list_push(&b->items, item);
+    memmove(top(b, n), top(b, n + 1), n * sizeof(struct item));
+    *top(b, n + 1) = item;
+}
+
+// End a statement: whatever an expression statement left is discarded.
+static void drop(struct baseline *b) {
+    while (b->items.len) pop(b);
+}
+
+static void spill(struct baseline *b, struct item *it) {
+    int slot = new_slot(b);
+    bool is_xmm = it->reg >= XMM0;
+    put(b, is_xmm ? X86_MOVS : X86_MOV, 8, mem_operand(RBP, slot), reg_operand(it->reg));
+    it->kind = it->kind == ITEM_DEREF ? ITEM_DEREF_SPILLED : ITEM_SPILLED;
+    it->offset = slot;
+}
+
+// A free register of a class other than those in exclude, spilling the
+// deepest item that holds one if there is none.
+static enum machine_reg get_reg(struct baseline *b, bool want_float, uint32_t exclude) {
+    const enum machine_reg *regs = want_float ? float_regs : int_regs;
+    uint32_t used = exclude;
+    for_each (&b->items) {
+        if (it->kind == ITEM_REG || it->kind == ITEM_DEREF) used |= bit(it->reg);
+    }
+    for (size_t r = 0; r < 8; r++) {
+        if (!(used & bit(regs[r]))) return regs[r];
+    }
+    for_each (&b->items) {
+        if ((it->kind != ITEM_REG && it->kind != ITEM_DEREF) || (it->reg >= XMM0) != want_float) continue;
+        if (exclude & bit(it->reg)) continue;
+        enum machine_reg r = it->reg;
+        spill(b, it);
+        return r;
+    }
+    print_internal_error(b->tu, "baseline: out of registers");
+    return regs[0];
+}
+
+static void move_reg(struct baseline *b, enum machine_reg to, enum machine_reg from) {
+    if (to >= XMM0) put(b, X86_MOVAPS, 16, reg_operand(to), reg_operand(from));
+    else put(b, X86_MOV, 8, reg_operand(to), reg_operand(from));
+}
+
+// Move whatever item holds r to another register.
+static void evict(struct baseline *b, enum machine_reg r, uint32_t exclude) {
+    for_each (&b->items) {
+        if (!holds(it, r)) continue;
+        enum machine_reg to = get_reg(b, r >= XMM0, exclude | bit(r));
+        move_reg(b, to, r);
+        it->reg = to;
+        return;
+    }
+}
+
+// Read a value of type from memory into r, extending a narrow integer to
+// 32 bits.
+static void read_memory(struct baseline *b, enum machine_reg r, struct x86_operand from, int type) {
+    int w = width(b, type);
+    if (is_float(b, type)) {
+        put(b, X86_MOVS, w, reg_operand(r), from);
+    } else if (w < 4) {
+        put(b, type_is_signed(b->tu, type) ? X86_MOVSX : X86_MOVZX, 4, reg_operand(r), from)->from_size = (unsigned char)w;
+    } else {
+        put(b, X86_MOV, w, reg_operand(r), from);
+    }
+}
+
+// The memory an lvalue designates, loading its address into a register if
+// it isn't an offset from rbp or rip.
+static struct x86_operand memory(struct baseline *b, size_t n, uint32_t exclude) {
+    struct item *it = top(b, n);
+    switch (it->kind) {
+    case ITEM_LOCAL:
+        return mem_operand(RBP, it->offset);
+    case ITEM_GLOBAL: {
+        struct x86_operand symbol = { .kind = X86_RIP, .symbol = it->symbol, .indirect = it->indirect };
+        if (!it->indirect) return symbol;
+        enum machine_reg r = get_reg(b, false, exclude);
+        put(b, X86_MOV, 8, reg_operand(r), symbol);
+        it->kind = ITEM_DEREF;
+        it->reg = r;
+        break;
+    }
+    case ITEM_DEREF_SPILLED: {
+        enum machine_reg r = get_reg(b, false, exclude);
+        put(b, X86_MOV, 8, reg_operand(r), mem_operand(RBP, it->offset));
+        release(b, it);
+        it->kind = ITEM_DEREF;
+        it->reg = r;
+        break;
+    }
+    default:
+        break;
+    }
+    return mem_operand(it->reg, 0);
+}
+
+// Turn the lvalue n from the top into its address, in a register.
+static enum machine_reg address(struct baseline *b, size_t n, uint32_t exclude) {
+    struct item *it = top(b, n);
+    enum machine_reg r;
+    switch (it->kind) {
+    case ITEM_LOCAL:
+        r = get_reg(b, false, exclude);
+        put(b, X86_LEA, 8, reg_operand(r), mem_operand(RBP, it->offset));
+        break;
+    case ITEM_GLOBAL:
+        r = get_reg(b, false, exclude);
+        put(b, it->indirect ? X86_MOV : X86_LEA, 8, reg_operand(r),
+            (struct x86_operand){ .kind = X86_RIP, .symbol = it->symbol, .indirect = it->indirect });
+        break;
+    case ITEM_DEREF_SPILLED:
+        r = get_reg(b, false, exclude);
+        put(b, X86_MOV, 8, reg_operand(r), mem_operand(RBP, it->offset));
+        release(b, it);
+        break;
+    default:
+        r = it->reg;
+        if (exclude & bit(r)) {
+            enum machine_reg to = get_reg(b, false, exclude | bit(r));
+            move_reg(b, to, r);
+            r = to;
+        }
+    }
+    it->kind = ITEM_REG;
+    it->reg = r;
+    it->type = find_or_create_type(b->tu, it->type, TYPE_POINTER, 0);
+    return r;
+}
+
+// Load the value of the item n from the top into a register that isn't in
+// exclude. Arrays and functions load as their address.
+static enum machine_reg load(struct baseline *b, size_t n, uint32_t exclude) {
+    struct tu *tu = b->tu;
+    struct item *it = top(b, n);
+    int type = value_type(b, it);
+    bool want_float = is_float(b, type);
+    int w = width(b, type);
+
+    if (is_lvalue(it)) {
+        enum layer_type layer = TTYPE(it->type)->layer;
+        if (layer == TYPE_ARRAY || layer == TYPE_FUNCTION) {
+            enum machine_reg r = address(b, n, exclude);
+            top(b, n)->type = type;
+            return r;
+        }
+    }
+
+    enum machine_reg r;
+    switch (it->kind) {
+    case ITEM_CONST:
+        r = get_reg(b, want_float, exclude);
+        if (want_float) put(b, X86_MOVS, w, reg_operand(r), constant_operand(b, float_bits(it->f, w), w));
+        else put(b, X86_MOV, int_size(w), reg_operand(r), imm_operand(sign_extend((uint64_t)it->i, int_size(w))));
+        break;
+    case ITEM_REG:
+        if (!(exclude & bit(it->reg))) return it->reg;
+        r = get_reg(b, want_float, exclude | bit(it->reg));
+        move_reg(b, r, it->reg);
+        break;
+    case ITEM_SPILLED:
+        r = get_reg(b, want_float, exclude);
+        put(b, want_float ? X86_MOVS : X86_MOV, want_float ? w : int_size(w), reg_operand(r),
+            mem_operand(RBP, it->offset));
+        release(b, it);
+        break;
+    case ITEM_FLAGS:
+        r = get_reg(b, false, exclude);
+        put1(b, X86_SETCC, 1, reg_operand(r))->cond = it->cond;
+        put(b, X86_MOVZX, 4, reg_operand(r), reg_operand(r))->from_size = 1;
+        break;
+    default: {
+        struct x86_operand from = memory(b, n, exclude);
+        if (!want_float && it->kind == ITEM_DEREF && !(exclude & bit(it->reg))) r = it->reg;
+        else r = get_reg(b, want_float, exclude | (it->kind == ITEM_DEREF ? bit(it->reg) : 0));
+        read_memory(b, r, from, it->type);
+    }
+    }
+    it->kind = ITEM_REG;
+    it->reg = r;
+    it->type = type;
+    return r;
+}
+
+// Load the item n from the top into r in particular.
+static void load_into(struct baseline *b, size_t n, enum machine_reg r, uint32_t exclude) {
+    struct item *it = top(b, n);
+    if (it->kind == ITEM_REG && it->reg == r) return;
+    evict(b, r, exclude);
+    enum machine_reg got = load(b, n, exclude);
+    if (got == r) return;
+    move_reg(b, r, got);
+    top(b, n)->reg = r;
+}
+
+// Read an item into r without changing the stack, with every register but
+// R11, which an lvalue's address may go through, free: an argument of a call.
+static void fetch(struct baseline *b, struct item *it, enum machine_reg r) {
+    struct tu *tu = b->tu;
+    int type = value_type(b, it);
+    int w = width(b, type);
+    bool want_float = r >= XMM0;
+    struct x86_operand from;
+    switch (it->kind) {
+    case ITEM_CONST:
+        if (want_float) put(b, X86_MOVS, w, reg_operand(r), constant_operand(b, float_bits(it->f, w), w));
+        else put(b, X86_MOV, 8, reg_operand(r), imm_operand(it->i));
+        return;
+    case ITEM_REG:
+        move_reg(b, r, it->reg);
+        return;
+    case ITEM_SPILLED:
+        put(b, want_float ? X86_MOVS : X86_MOV, want_float ? w : 8, reg_operand(r), mem_operand(RBP, it->offset));
+        return;
+    case ITEM_LOCAL:
+        from = mem_operand(RBP, it->offset);
+        break;
+    case ITEM_GLOBAL:
+        from = (struct x86_operand){ .kind = X86_RIP, .symbol = it->symbol, .indirect = it->indirect };
+        if (it->indirect) {
+            put(b, X86_MOV, 8, reg_operand(SCRATCH_REG), from);
+            from = mem_operand(SCRATCH_REG, 0);
+        }
+        break;
+    default:
+        put(b, X86_MOV, 8, reg_operand(SCRATCH_REG), mem_operand(RBP, it->offset));
+        from = mem_operand(SCRATCH_REG, 0);
+    }
+    enum layer_type layer = TTYPE(it->type)->layer;
+    if (layer == TYPE_ARRAY || layer == TYPE_FUNCTION) {
+        if (from.kind == X86_MEM && from.reg == SCRATCH_REG) put(b, X86_MOV, 8, reg_operand(r), reg_operand(SCRATCH_REG));
+        else put(b, X86_LEA, 8, reg_operand(r), from);
+        return;
+    }
+    read_memory(b, r, from, it->type);
+}
+
+// Set the flags from a float and zero: ZF if it is zero, PF if it is NaN.
+static void compare_float_zero(struct baseline *b, enum machine_reg r, int w) {
+    put(b, X86_XORPS, 16, reg_operand(SCRATCH_FLOAT_REG), reg_operand(SCRATCH_FLOAT_REG));
+    put(b, X86_UCOMIS, w, reg_operand(r), reg_operand(SCRATCH_FLOAT_REG));
+}
+
+// Replace the top item by an int that is 1 if cond and also (or either if
+// combine is negative) hold in the flags.
+static void set_condition(struct baseline *b, enum x86_cond cond, enum x86_cond also, int combine) {
+    pop(b);
+    enum machine_reg r = get_reg(b, false, 0);
+    put1(b, X86_SETCC, 1, reg_operand(r))->cond = cond;
+    put1(b, X86_SETCC, 1, reg_operand(SCRATCH_REG))->cond = also;
+    put(b, combine > 0 ? X86_AND : X86_OR, 1, reg_operand(r), reg_operand(SCRATCH_REG));
+    put(b, X86_MOVZX, 4, reg_operand(r), reg_operand(r))->from_size = 1;
+    push(b, (struct item){ .kind = ITEM_REG, .reg = r, .type = int_type(b) });
+}
+
+// Turn a comparison at the top into 0 or 1 in a register, before anything
+// can clobber the flags.
+static void settle(struct baseline *b) {
+    if (b->items.len && top(b, 1)->kind == ITEM_FLAGS) load(b, 1, 0);
+}
+
+static void spill_all(struct baseline *b) {
+    settle(b);
+    for_each (&b->items) {
+        if (it->kind == ITEM_REG || it->kind == ITEM_DEREF) spill(b, it);
+    }
+}
+
+static void swap(struct baseline *b) {
+    settle(b);
+    struct item t = *top(b, 1);
+    *top(b, 1) = *top(b, 2);
+    *top(b, 2) = t;
+}
+
+// Replace the top item by an int that is 1 if it is zero, or if it isn't.
+static void test_zero(struct baseline *b, bool is_zero) {
+    struct item *it = top(b, 1);
+    int type = value_type(b, it);
+    int w = width(b, type);
+    if (it->kind == ITEM_CONST) {
+        bool zero = is_float(b, type) ? it->f == 0 : it->i == 0;
+        *it = (struct item){ .kind = ITEM_CONST, .type = int_type(b), .i = zero == is_zero };
+        return;
+    }
+    if (it->kind == ITEM_FLAGS) {
+        if (is_zero) it->cond = invert(it->cond);
+        it->type = int_type(b);
+        return;
+    }
+    enum machine_reg r = load(b, 1, 0);
+    if (is_float(b, type)) {
+        compare_float_zero(b, r, w);
+        if (is_zero) set_condition(b, X86_E, X86_NP, 1);
+        else set_condition(b, X86_NE, X86_P, -1);
+        return;
+    }
+    put(b, X86_TEST, w, reg_operand(r), reg_operand(r));
+    pop(b);
+    push(b, (struct item){ .kind = ITEM_FLAGS, .cond = is_zero ? X86_E : X86_NE, .type = int_type(b) });
+}
+
+// Jump to label if the top item is zero, or if it isn't, and pop it.
+static void branch(struct baseline *b, int label, bool if_zero) {
+    struct item *it = top(b, 1);
+    int type = value_type(b, it);
+    int w = width(b, type);
+    if (it->kind == ITEM_FLAGS) {
+        enum x86_cond cond = if_zero ? invert(it->cond) : it->cond;
+        pop(b);
+        jump(b, X86_JCC, cond, label);
+        return;
+    }
+    if (it->kind == ITEM_CONST) {
+        bool zero = is_float(b, type) ? it->f == 0 : it->i == 0;
+        pop(b);
+        if (zero == if_zero) jump(b, X86_JMP, 0, label);
+        return;
+    }
+    enum machine_reg r = load(b, 1, 0);
+    pop(b);
+    if (!is_float(b, type)) {
+        put(b, X86_TEST, w, reg_operand(r), reg_operand(r));
+        jump(b, X86_JCC, if_zero ? X86_E : X86_NE, label);
+        return;
+    }
+    // unordered, a NaN, isn't zero
+    compare_float_zero(b, r, w);
+    if (if_zero) {
+        int skip = new_label(b);
+        jump(b, X86_JCC, X86_P, skip);
+        jump(b, X86_JCC, X86_E, label);
+        place_label(b, skip);
+    } else {
+        jump(b, X86_JCC, X86_P, label);
+        jump(b, X86_JCC, X86_NE, label);
+    }
+}
+
+static void int_to_float(struct baseline *b, int from, int to) {
+    int fw = width(b, from), tw = width(b, to);
+    bool is_signed = type_is_signed(b->tu, from);
+    enum machine_reg r = load(b, 1, 0);
+    // narrow integers convert as ints, and unsigned ints as longs
+    int from_size = fw < 4 ? 4 : fw == 4 && !is_signed ? 8 : fw;
+    if (fw < 4) put(b, is_signed ? X86_MOVSX : X86_MOVZX, 4, reg_operand(r), reg_operand(r))->from_size = (unsigned char)fw;
+    else if (fw == 4 && !is_signed) put(b, X86_MOV, 4, reg_operand(r), reg_operand(r));
+    enum machine_reg x = get_reg(b, true, 0);
+    if (fw == 8 && !is_signed) {
+        // one with the top bit set is halved, rounding to odd, and doubled
+        int big = new_label(b), done = new_label(b);
+        put(b, X86_TEST, 8, reg_operand(r), reg_operand(r));
+        jump(b, X86_JCC, X86_S, big);
+        put(b, X86_CVTSI2S, tw, reg_operand(x), reg_operand(r))->from_size = 8;
+        jump(b, X86_JMP, 0, done);
+        place_label(b, big);
+        put(b, X86_MOV, 8, reg_operand(SCRATCH_REG), reg_operand(r));
+        put(b, X86_SHR, 8, reg_operand(SCRATCH_REG), imm_operand(1));
+        put(b, X86_AND, 4, reg_operand(r), imm_operand(1));
+        put(b, X86_OR, 8, reg_operand(SCRATCH_REG), reg_operand(r));
+        put(b, X86_CVTSI2S, tw, reg_operand(x), reg_operand(SCRATCH_REG))->from_size = 8;
+        put(b, X86_ADDS, tw, reg_operand(x), reg_operand(x));
+        place_label(b, done);
+    } else {
+        put(b, X86_CVTSI2S, tw, reg_operand(x), reg_operand(r))->from_size = (unsigned char)from_size;
+    }
+    top(b, 1)->reg = x;
+}
+
+static void float_to_int(struct baseline *b, int from, int to) {
+    int fw = width(b, from), size = int_size(width(b, to));
+    bool is_signed = type_is_signed(b->tu, to);
+    enum machine_reg x = load(b, 1, 0);
+    enum machine_reg r = get_reg(b, false, 0);
+    if (!is_signed && size == 8) {
+        // less 2^63 if it doesn't fit a long, with the top bit put back after
+        int big = new_label(b), done = new_label(b);
+        struct x86_operand limit = constant_operand(b, float_bits(0x1p63, fw), fw);
+        put(b, X86_UCOMIS, fw, reg_operand(x), limit);
+        jump(b, X86_JCC, X86_AE, big);
+        put(b, X86_CVTTS2SI, 8, reg_operand(r), reg_operand(x))->from_size = (unsigned char)fw;
+        jump(b, X86_JMP, 0, done);
+        place_label(b, big);
+        put(b, X86_SUBS, fw, reg_operand(x), limit);
+        put(b, X86_CVTTS2SI, 8, reg_operand(r), reg_operand(x))->from_size = (unsigned char)fw;
+        put(b, X86_MOV, 8, reg_operand(SCRATCH_REG), imm_operand(INT64_MIN));
+        put(b, X86_XOR, 8, reg_operand(r), reg_operand(SCRATCH_REG));
+        place_label(b, done);
+    } else {
+        // an unsigned int converts as a long and keeps the low half
+        int convert = !is_signed && size == 4 ? 8 : size;
+        put(b, X86_CVTTS2SI, convert, reg_operand(r), reg_operand(x))->from_size = (unsigned char)fw;
+    }
+    top(b, 1)->reg = r;
+}
+
+// Convert the top item to an rvalue of type to, as the IR's emit_convert
+// does, C23(N3096) 6.3. Constants are converted here.
+static void convert(struct baseline *b, int to) {
+    struct tu *tu = b->tu;
+    struct item *it = top(b, 1);
+    int from = value_type(b, it);
+    if (!from || !to || from == to || TTYPE(to)->layer == TYPE_VOID) return;
+
+    bool from_float = is_float(b, from), to_float = is_float(b, to);
+    int fw = width(b, from), tw = width(b, to);
+    if (it->kind == ITEM_CONST) {
+        if (TTYPE(to)->layer == TYPE_BOOL) it->i = from_float ? it->f != 0 : it->i != 0;
+        else if (from_float && to_float) it->f = tw == 4 ? (float)it->f : it->f;
+        else if (from_float) it->i = normalize(b, type_is_signed(tu, to) ? (uint64_t)(int64_t)it->f : (uint64_t)it->f, to);
+        else if (to_float) it->f = type_is_signed(tu, from) ? (double)it->i : (double)(uint64_t)it->i;
+        else it->i = normalize(b, (uint64_t)it->i, to);
+        if (to_float && !from_float && tw == 4) it->f = (float)it->f;
+        it->type = to;
+        return;
+    }
+
+    if (TTYPE(to)->layer == TYPE_BOOL && TTYPE(from)->layer != TYPE_BOOL) {
+        test_zero(b, false);
+        top(b, 1)->type = to;
+        return;
+    }
+    if (from_float && to_float) {
+        if (fw != tw) {
+            enum machine_reg x = load(b, 1, 0);
+            put(b, X86_CVTS2S, tw, reg_operand(x), reg_operand(x))->from_size = (unsigned char)fw;
+        }
+    } else if (from_float) {
+        float_to_int(b, from, to);
+    } else if (to_float) {
+        int_to_float(b, from, to);
+    } else if (tw > fw) {
+        enum machine_reg r = load(b, 1, 0);
+        bool is_signed = type_is_signed(tu, from);
+        if (fw < 4 || (fw == 4 && is_signed))
+            put(b, is_signed ? X86_MOVSX : X86_MOVZX, int_size(tw), reg_operand(r), reg_operand(r))->from_size = (unsigned char)fw;
+        else
+            // writing the low 32 bits clears the rest
+            put(b, X86_MOV, 4, reg_operand(r), reg_operand(r));
+    } else if (is_lvalue(top(b, 1))) {
+        // truncation just uses the low bytes, of the value
+        load(b, 1, 0);
+    }
+    top(b, 1)->type = to;
+}
+
+// An integer operand of an ALU instruction of size bytes: an immediate if
+// it fits, or a register outside exclude.
+static struct x86_operand source(struct baseline *b, size_t n, int size, uint32_t exclude) {
+    struct item *it = top(b, n);
+    if (it->kind == ITEM_CONST && fits_imm32(sign_extend((uint64_t)it->i, size)))
+        return imm_operand(sign_extend((uint64_t)it->i, size));
+    return reg_operand(load(b, n, exclude));
+}
+
+static struct x86_operand float_source(struct baseline *b, size_t n, int w, uint32_t exclude) {
+    struct item *it = top(b, n);
+    if (it->kind == ITEM_CONST) return constant_operand(b, float_bits(it->f, w), w);
+    return reg_operand(load(b, n, exclude));
+}
+
+static void division(struct baseline *b, bool is_mod, int size, bool is_signed) {
+    enum machine_reg divisor = load(b, 1, bit(RAX) | bit(RDX));
+    load_into(b, 2, RAX, bit(RDX) | bit(divisor));
+    evict(b, RDX, bit(RAX) | bit(divisor));
+    if (is_signed) put0(b, X86_CQO, size);
+    else put(b, X86_XOR, 4, reg_operand(RDX), reg_operand(RDX));
+    put1(b, is_signed ? X86_IDIV : X86_DIV, size, reg_operand(divisor));
+    pop(b);
+    top(b, 1)->reg = is_mod ? RDX : RAX;
+}
+
+static void shift(struct baseline *b, enum ir_op op, int size, bool is_signed) {
+    enum x86_op x = op == SHL ? X86_SHL : is_signed ? X86_SAR : X86_SHR;
+    struct x86_operand count;
+    if (top(b, 1)->kind == ITEM_CONST) {
+        count = imm_operand(top(b, 1)->i & (size * 8 - 1));
+    } else {
+        load_into(b, 1, RCX, 0);
+        count = reg_operand(RCX);
+    }
+    enum machine_reg r = load(b, 2, bit(RCX));
+    put(b, x, size, reg_operand(r), count);
+    pop(b);
+}
+
+// Replace the top two items by the result of an operation on them, both
+// already of type.
+static void binop(struct baseline *b, enum ir_op op, int type) {
+    int w = width(b, type);
+    if (is_float(b, type)) {
+        enum x86_op x = op == ADD ? X86_ADDS : op == SUB ? X86_SUBS : op == MUL ? X86_MULS : X86_DIVS;
+        enum machine_reg r = load(b, 2, 0);
+        put(b, x, w, reg_operand(r), float_source(b, 1, w, bit(r)));
+        pop(b);
+        top(b, 1)->type = type;
+        return;
+    }
+
+    int size = int_size(w);
+    bool is_signed = type_is_signed(b->tu, type);
+    if (op == DIV || op == MOD) {
+        division(b, op == MOD, size, is_signed);
+    } else if (op == SHL || op == SHR) {
+        shift(b, op, size, is_signed);
+    } else {
+        enum x86_op x = op == ADD ? X86_ADD : op == SUB ? X86_SUB : op == MUL ? X86_IMUL
+                      : op == AND ? X86_AND : op == OR ? X86_OR : X86_XOR;
+        enum machine_reg r = load(b, 2, 0);
+        put(b, x, size, reg_operand(r), source(b, 1, size, bit(r)));
+        pop(b);
+    }
+    top(b, 1)->type = type;
+}
+
+// Replace the top two items by an int that is 1 if they compare with cond.
+// Floats compare with ucomis, which sets the flags like an unsigned compare
+// and the parity flag for NaN; less than is greater than swapped.
+static void compare(struct baseline *b, enum ir_cond cond, int type) {
+    int w = width(b, type);
+    if (!is_float(b, type)) {
+        enum machine_reg r = load(b, 2, 0);
+        put(b, X86_CMP, w, reg_operand(r), source(b, 1, w, bit(r)));
+        pop(b);
+        pop(b);
+        enum x86_cond c = (type_is_signed(b->tu, type) ? signed_conds : unsigned_conds)[cond];
+        push(b, (struct item){ .kind = ITEM_FLAGS, .cond = c, .type = int_type(b) });
+        return;
+    }
+    bool swapped = cond == COND_LT || cond == COND_LE;
+    enum machine_reg r = load(b, swapped ? 1 : 2, 0);
+    put(b, X86_UCOMIS, w, reg_operand(r), float_source(b, swapped ? 2 : 1, w, bit(r)));
+    pop(b);
+    switch (cond) {
+    case COND_EQ: set_condition(b, X86_E, X86_NP, 1); return;
+    case COND_NE: set_condition(b, X86_NE, X86_P, -1); return;
+    default: break;
+    }
+    pop(b);
+    enum x86_cond c = cond == COND_LT || cond == COND_GT ? X86_A : X86_AE;
+    push(b, (struct item){ .kind = ITEM_FLAGS, .cond = c, .type = int_type(b) });
+}
+
+// A binary arithmetic or comparison operator on the top two items, with the
+// usual arithmetic conversions and pointer arithmetic scaled, as the IR's
+// emit_arith does.
+static void arith(struct baseline *b, int token_type) {
+    struct tu *tu = b->tu;
+    enum ir_op op = arith_op(token_type);
+    int long_type = find_or_create_type(tu, 0, TYPE_SIGNED_LONG, 0);
+    int a_type = value_type(b, top(b, 2)), b_type = value_type(b, top(b, 1));
+
+    if (op == ADD && type_is_integer(tu, a_type) && type_is_pointer(tu, b_type)) {
+        swap(b);
+        int t = a_type; a_type = b_type; b_type = t;
+    }
+
+    if ((op == ADD || op == SUB) && type_is_pointer(tu, a_type) && type_is_integer(tu, b_type)) {
+        int64_t size = (int64_t)type_size(tu, TTYPE(a_type)->inner);
+        convert(b, long_type);
+        if (size != 1) {
+            if (top(b, 1)->kind == ITEM_CONST) {
+                top(b, 1)->i *= size;
+            } else {
+                push(b, (struct item){ .kind = ITEM_CONST, .type = long_type, .i = size });
+                binop(b, MUL, long_type);
+            }
+        }
+        binop(b, op, a_type);
+        return;
+    }
+
+    if (op == SUB && type_is_pointer(tu, a_type) && type_is_pointer(tu, b_type)) {
+        int64_t size = (int64_t)type_size(tu, TTYPE(a_type)->inner);
+        binop(b, SUB, long_type);
+        if (size != 1) {
+            push(b, (struct item){ .kind = ITEM_CONST, .type = long_type, .i = size });
+            binop(b, DIV, long_type);
+        }
+        return;
+    }
+
+    int operand_type;
+    if (type_is_pointer(tu, a_type)) operand_type = a_type;
+    else if (type_is_pointer(tu, b_type)) operand_type = b_type;
+    else if (op == SHL || op == SHR) operand_type = type_promote(tu, a_type);
+    else operand_type = type_common(tu, a_type, b_type);
+
+    convert(b, operand_type);
+    swap(b);
+    convert(b, operand_type);
+    swap(b);
+
+    if (op == TEST) compare(b, test_cond(token_type), operand_type);
+    else binop(b, op, operand_type);
+}
+
+// Store the value at the top into the lvalue under it, leaving the value.
+static void store(struct baseline *b) {
+    int type = value_type(b, top(b, 2));
+    int w = width(b, type);
+    struct x86_operand to = memory(b, 2, 0);
+    uint32_t keep = to.kind == X86_MEM && to.reg != RBP ? bit(to.reg) : 0;
+    struct item *it = top(b, 1);
+    if (is_float(b, type)) {
+        put(b, X86_MOVS, w, to, reg_operand(load(b, 1, keep)));
+    } else if (it->kind == ITEM_CONST && fits_imm32(sign_extend((uint64_t)it->i, w < 4 ? 4 : w))) {
+        put(b, X86_MOV, w, to, imm_operand(sign_extend((uint64_t)it->i, w < 4 ? 4 : w)));
+    } else {
+        put(b, X86_MOV, w, to, reg_operand(load(b, 1, keep)));
+    }
+    remove_item(b, 2);
+}
+
+// Push the value of the lvalue at the top as a copy, leaving the lvalue.
+static void push_value(struct baseline *b) {
+    struct item *it = top(b, 1);
+    int type = value_type(b, it);
+    struct x86_operand from = memory(b, 1, 0);
+    uint32_t keep = from.kind == X86_MEM && from.reg != RBP ? bit(from.reg) : 0;
+    enum machine_reg r = get_reg(b, is_float(b, type), keep);
+    read_memory(b, r, from, top(b, 1)->type);
+    push(b, (struct item){ .kind = ITEM_REG, .reg = r, .type = type });
+}
+
+// Make the pointer at the top an lvalue of the object type it points to.
+static void deref(struct baseline *b, int type) {
+    enum machine_reg r = load(b, 1, 0);
+    struct item *it = top(b, 1);
+    it->kind = ITEM_DEREF;
+    it->reg = r;
+    it->type = type;
+}
+
+static void push_variable(struct baseline *b, struct scope *scope) {
+    struct tu *tu = b->tu;
+    if (!names_symbol(tu, scope)) {
+        push(b, (struct item){ .kind = ITEM_LOCAL, .type = scope->c_type, .offset = scope->frame_offset });
+        return;
+    }
+    bool is_global;
+    int symbol = scope_symbol(tu, scope, &is_global);
+    push(b, (struct item){ .kind = ITEM_GLOBAL, .type = scope->c_type, .symbol = symbol, .indirect = is_global });
+}
+
+static void push_value_of(struct baseline *b, struct value *v, int type) {
+    if (v->kind == VALUE_FLOAT) push(b, (struct item){ .kind = ITEM_CONST, .type = type, .f = v->f });
+    else push(b, (struct item){ .kind = ITEM_CONST, .type = type, .i = normalize(b, v->i, type) });
+}
+
+// Give a local a slot in the frame.
+static void allocate(struct baseline *b, struct scope *scope) {
+    struct tu *tu = b->tu;
+    int size = (int)type_size(tu, scope->c_type);
+    int align = (int)type_align(tu, scope->c_type);
+    if (align < 1) align = 1;
+    b->frame_size = (b->frame_size + size + align - 1) / align * align;
+    scope->frame_offset = -b->frame_size;
+}
+
+// The label a goto or label statement names, created the first time it is
+// seen. use is the goto node, or nullptr for the label's definition.
+static int label_of(struct baseline *b, struct node *name, struct node *use) {
+    struct tu *tu = b->tu;
+    struct token *t = name->token;
+    struct label *label = nullptr;
+    for_each (&b->labels) {
+        struct token *o = it->name->token;
+        if (o->len == t->len && memcmp(&tu->source[o->index], &tu->source[t->index], t->len) == 0) {
+            label = it;
+            break;
+        }
+    }
+    if (!label) {
+        list_push(&b->labels, ((struct label){ .name = name, .label = new_label(b), .first_use = use }));
+        label = &list_last(&b->labels);
+    }
+    if (!use && label->defined) {
+        print_error_node(tu, name, "redefinition of label '%.*s'", t->len, &tu->source[t->index]);
+        return new_label(b);
+    }
+    if (!use) label->defined = true;
+    return label->label;
+}
+
+static void ret(struct baseline *b) {
+    put0(b, X86_LEAVE, 0);
+    put0(b, X86_RET, 0);
+}
+
+// Arguments go in the System V registers of their class in order and the
+// rest on the stack, as generate_call passes them. Everything is spilled
+// first, so the argument registers are free to fill from memory.
+static void call(struct baseline *b, size_t n_args, bool has_callee, struct scope *direct, int type) {
+    struct tu *tu = b->tu;
+    spill_all(b);
+    size_t n_items = n_args + has_callee;
+    size_t first = b->items.len - n_items;
+
+    int n_int = 0, n_float = 0;
+    list(struct item *) stack = {};
+    for (size_t a = 0; a < n_args; a++) {
+        struct item *it = &b->items.data[first + a];
+        bool arg_float = is_float(b, value_type(b, it));
+        signed char r = param_register(arg_float, arg_float ? n_float++ : n_int++);
+        if (r == -1) list_push(&stack, it);
+    }
+    int stack_bytes = (int)stack.len * 8;
+    if (stack.len % 2) {
+        put(b, X86_SUB, 8, reg_operand(RSP), imm_operand(8));
+        stack_bytes += 8;
+    }
+    for (size_t s = stack.len; s-- > 0;) {
+        struct item *it = stack.data[s];
+        if (is_float(b, value_type(b, it))) {
+            fetch(b, it, SCRATCH_FLOAT_REG);
+            put(b, X86_SUB, 8, reg_operand(RSP), imm_operand(8));
+            put(b, X86_MOVS, 8, mem_operand(RSP, 0), reg_operand(SCRATCH_FLOAT_REG));
+        } else {
+            fetch(b, it, SCRATCH_REG);
+            put1(b, X86_PUSH, 8, reg_operand(SCRATCH_REG));
+        }
+    }
+    list_clear(&stack);
+
+    n_int = n_float = 0;
+    for (size_t a = 0; a < n_args; a++) {
+        struct item *it = &b->items.data[first + a];
+        bool arg_float = is_float(b, value_type(b, it));
+        signed char r = param_register(arg_float, arg_float ? n_float++ : n_int++);
+        if (r != -1) fetch(b, it, r);
+    }
+
+    struct x86_operand target;
+    if (direct) {
+        bool is_global;
+        target = (struct x86_operand){ .kind = X86_TARGET, .symbol = scope_symbol(tu, direct, &is_global) };
+        target.indirect = is_global;
+    } else {
+        fetch(b, top(b, 1), SCRATCH_REG);
+        target = reg_operand(SCRATCH_REG);
+    }
+    put(b, X86_MOV, 4, reg_operand(RAX), imm_operand(n_float > 8 ? 8 : n_float));
+    put1(b, X86_CALL, 8, target);
+    if (stack_bytes) put(b, X86_ADD, 8, reg_operand(RSP), imm_operand(stack_bytes));
+
+    while (n_items--) pop(b);
+    if (TTYPE(type)->layer == TYPE_VOID) push(b, (struct item){ .kind = ITEM_CONST, .type = type });
+    else push(b, (struct item){ .kind = ITEM_REG, .reg = is_float(b, type) ? XMM0 : RAX, .type = type });
+}
+
+// The walk modes: whether a node's parent wants its object, which a
+// constant can't stand in for, or just its value.
+enum { WANT_VALUE, WANT_OBJECT };
+
+// Generate the code of a function body. Each frame of the walk is a small
+// state machine like emit_node's; expressions leave one item each on the
+// stack, and statements leave it empty.
+static void generate_body(struct baseline *b, struct node *root) {
+    struct tu *tu = b->tu;
+    struct walk walk = {};
+    walk_push(&walk, root);
+
+    // set on a node the parser couldn't make sense of, which leaves the rest
+    // of the function ungenerated
+    bool abandoned = false;
+    struct walk_frame *frame;
+    while ((frame = walk_top(&walk))) {
+        struct node *node = frame->node;
+        struct node *child = nullptr;
+        int child_mode = WANT_VALUE;
+        bool done = false;
+
+#define VISIT(next_phase, n, m) do { frame->phase = (next_phase); child = (n); child_mode = (m); } while (0)
+#define RETURN() do { done = true; } while (0)
+
+        if (!node) {
+            walk_return(&walk, (union walk_value){});
+            continue;
+        }
+
+        if (frame->phase == 0) {
+            settle(b);
+            if (frame->mode == WANT_VALUE && node->c_type &&
+                (node->type == NODE_BINARY_OP || node->type == NODE_UNARY_OP ||
+                 node->type == NODE_TERNARY || node->type == NODE_IDENT)) {
+                struct value *v = eval(tu, node);
+                if (v->kind == VALUE_INT || v->kind == VALUE_FLOAT) {
+                    push_value_of(b, v, type_rvalue(tu, node->c_type));
+                    walk_return(&walk, (union walk_value){});
+                    continue;
+                }
+            }
+        }
+
+        int type = node->c_type ? type_rvalue(tu, node->c_type) : 0;
+
+        switch (node->type) {
+        case NODE_BINARY_OP: {
+            int op = node->token->type;
+            struct node *lhs = node->binop.lhs;
+            struct node *rhs = node->binop.rhs;
+
+            switch (op) {
+            case ',':
+                if (frame->phase == 0) {
+                    VISIT(1, lhs, WANT_VALUE);
+                } else if (frame->phase == 1) {
+                    pop(b);
+                    VISIT(2, rhs, WANT_VALUE);
+                } else {
+                    RETURN();
+                }
+                break;
+            case '=':
+                if (frame->phase == 0) {
+                    VISIT(1, lhs, WANT_OBJECT);
+                } else if (frame->phase == 1) {
+                    VISIT(2, rhs, WANT_VALUE);
+                } else {
+                    convert(b, type);
+                    store(b);
+                    RETURN();
+                }
+                break;
+            case TOKEN_AND_AND:
+            case TOKEN_OR_OR: {
+                // the value is in RAX where the two ways join, with nothing
+                // else in a register
+                bool is_and = op == TOKEN_AND_AND;
+                if (frame->phase == 0) {
+                    spill_all(b);
+                    frame->v[0].i = new_label(b);
+                    frame->v[1].i = new_label(b);
+                    VISIT(1, lhs, WANT_VALUE);
+                } else if (frame->phase == 1) {
+                    branch(b, frame->v[0].i, is_and);
+                    VISIT(2, rhs, WANT_VALUE);
+                } else {
+                    test_zero(b, false);
+                    load_into(b, 1, RAX, 0);
+                    pop(b);
+                    jump(b, X86_JMP, 0, frame->v[1].i);
+                    place_label(b, frame->v[0].i);
+                    put(b, X86_MOV, 4, reg_operand(RAX), imm_operand(!is_and));
+                    place_label(b, frame->v[1].i);
+                    push(b, (struct item){ .kind = ITEM_REG, .reg = RAX, .type = type });
+                    RETURN();
+                }
+                break;
+            }
+            case TOKEN_PLUS_EQUAL:
+            case TOKEN_MINUS_EQUAL:
+            case TOKEN_STAR_EQUAL:
+            case TOKEN_DIVIDE_EQUAL:
+            case TOKEN_MOD_EQUAL:
+            case TOKEN_SHIFT_LEFT_EQUAL:
+            case TOKEN_SHIFT_RIGHT_EQUAL:
+            case TOKEN_BITAND_EQUAL:
+            case TOKEN_BITOR_EQUAL:
+            case TOKEN_BITXOR_EQUAL:
+                if (frame->phase == 0) {
+                    VISIT(1, lhs, WANT_OBJECT);
+                } else if (frame->phase == 1) {
+                    push_value(b);
+                    VISIT(2, rhs, WANT_VALUE);
+                } else {
+                    arith(b, op);
+                    convert(b, type);
+                    store(b);
+                    RETURN();
+                }
+                break;
+            default:
+                if (frame->phase == 0) {
+                    VISIT(1, lhs, WANT_VALUE);
+                } else if (frame->phase == 1) {
+                    VISIT(2, rhs, WANT_VALUE);
+                } else {
+                    arith(b, op);
+                    RETURN();
+                }
+            }
+            break;
+        }
+        case NODE_UNARY_OP:
+        case NODE_POSTFIX_OP: {
+            int op = node->token->type;
+            struct node *inner = node->unary_op.inner;
+            int inner_type = inner->c_type ? type_rvalue(tu, inner->c_type) : 0;
+
+            switch (op) {
+            case '&':
+                if (frame->phase == 0) {
+                    VISIT(1, inner, WANT_OBJECT);
+                } else {
+                    address(b, 1, 0);
+                    top(b, 1)->type = type;
+                    RETURN();
+                }
+                break;
+            case '*':
+                if (frame->phase == 0) {
+                    VISIT(1, inner, WANT_VALUE);
+                } else {
+                    deref(b, node->c_type);
+                    RETURN();
+                }
+                break;
+            case TOKEN_SIZEOF:
+            case TOKEN_ALIGNOF:
+                push_value_of(b, eval(tu, node), type);
+                RETURN();
+                break;
+            case TOKEN_PLUS_PLUS:
+            case TOKEN_MINUS_MINUS:
+                // ++x is x += 1, x++ is the same but results in the old value,
+                // which goes under the lvalue
+                if (frame->phase == 0) {
+                    VISIT(1, inner, WANT_OBJECT);
+                } else {
+                    bool postfix = node->type == NODE_POSTFIX_OP;
+                    push_value(b);
+                    if (postfix) {
+                        struct item *current = top(b, 1);
+                        enum machine_reg r = get_reg(b, current->reg >= XMM0, bit(current->reg));
+                        move_reg(b, r, top(b, 1)->reg);
+                        insert(b, 2, (struct item){ .kind = ITEM_REG, .reg = r, .type = inner_type });
+                    }
+                    if (is_float(b, inner_type)) push(b, (struct item){ .kind = ITEM_CONST, .type = inner_type, .f = 1.0 });
+                    else push(b, (struct item){ .kind = ITEM_CONST, .type = int_type(b), .i = 1 });
+                    arith(b, op);
+                    convert(b, inner_type);
+                    store(b);
+                    if (postfix) pop(b);
+                    RETURN();
+                }
+                break;
+            default:
+                if (frame->phase == 0) {
+                    VISIT(1, inner, WANT_VALUE);
+                    break;
+                }
+
+                switch (op) {
+                case '+':
+                    convert(b, type);
+                    break;
+                case '-':
+                case '~': {
+                    convert(b, type);
+                    int w = width(b, type);
+                    enum machine_reg r = load(b, 1, 0);
+                    if (!is_float(b, type)) {
+                        put1(b, op == '-' ? X86_NEG : X86_NOT, int_size(w), reg_operand(r));
+                        break;
+                    }
+                    // the sign is flipped by way of an integer register,
+                    // which avoids a 16 byte mask constant
+                    enum machine_reg t = get_reg(b, false, 0);
+                    put(b, X86_MOVQ, w, reg_operand(t), reg_operand(r));
+                    if (w == 8) {
+                        put(b, X86_MOV, 8, reg_operand(SCRATCH_REG), imm_operand(INT64_MIN));
+                        put(b, X86_XOR, 8, reg_operand(t), reg_operand(SCRATCH_REG));
+                    } else {
+                        put(b, X86_XOR, 4, reg_operand(t), imm_operand(INT32_MIN));
+                    }
+                    put(b, X86_MOVQ, w, reg_operand(r), reg_operand(t));
+                    break;
+                }
+                case '!':
+                    test_zero(b, true);
+                    break;
+                default:
+                    print_internal_error(tu, "unhandled unary operation: %i", op);
+                }
+                RETURN();
+            }
+            break;
+        }
+        case NODE_IDENT:
+            push_variable(b, TSCOPE(node->ident.scope_id));
+            RETURN();
+            break;
+        case NODE_INT_LITERAL:
+            push(b, (struct item){ .kind = ITEM_CONST, .type = type, .i = normalize(b, node->token->int_.value, type) });
+            RETURN();
+            break;
+        case NODE_FLOAT_LITERAL:
+            push(b, (struct item){ .kind = ITEM_CONST, .type = type, .f = node->token->float_.value });
+            RETURN();
+            break;
+        case NODE_STRING_LITERAL: {
+            int name = tu_intern(tu, &tu->source[node->token->index], node->token->len);
+            enum machine_reg r = get_reg(b, false, 0);
+            put(b, X86_LEA, 8, reg_operand(r), (struct x86_operand){ .kind = X86_RIP, .symbol = name });
+            push(b, (struct item){ .kind = ITEM_REG, .reg = r, .type = type });
+            RETURN();
+            break;
+        }
+        case NODE_SUBSCRIPT:
+            if (frame->phase == 0) {
+                VISIT(1, node->subscript.inner, WANT_VALUE);
+            } else if (frame->phase == 1) {
+                VISIT(2, node->subscript.subscript, WANT_VALUE);
+            } else {
+                arith(b, '+');
+                deref(b, node->c_type);
+                RETURN();
+            }
+            break;
+        case NODE_TERNARY: {
+            // like && and ||, the two ways join with the value in RAX or XMM0
+            bool is_void = TTYPE(type)->layer == TYPE_VOID;
+            enum machine_reg result = is_float(b, type) ? XMM0 : RAX;
+            if (frame->phase == 0) {
+                spill_all(b);
+                frame->v[0].i = new_label(b);
+                frame->v[1].i = new_label(b);
+                VISIT(1, node->ternary.condition, WANT_VALUE);
+            } else if (frame->phase == 1) {
+                branch(b, frame->v[0].i, true);
+                VISIT(2, node->ternary.branch_true, WANT_VALUE);
+            } else {
+                if (!is_void) {
+                    convert(b, type);
+                    load_into(b, 1, result, 0);
+                }
+                pop(b);
+                if (frame->phase == 2) {
+                    jump(b, X86_JMP, 0, frame->v[1].i);
+                    place_label(b, frame->v[0].i);
+                    VISIT(3, node->ternary.branch_false, WANT_VALUE);
+                } else {
+                    place_label(b, frame->v[1].i);
+                    if (is_void) push(b, (struct item){ .kind = ITEM_CONST, .type = type });
+                    else push(b, (struct item){ .kind = ITEM_REG, .reg = result, .type = type });
+                    RETURN();
+                }
+            }
+            break;
+        }
+        case NODE_FUNCTION_CALL: {
+            struct node *inner = node->funcall.inner;
+            int callee_type = type_rvalue(tu, inner->c_type);
+            int function_type = TTYPE(callee_type)->inner;
+            bool direct = inner->type == NODE_IDENT && TTYPE(inner->c_type)->layer == TYPE_FUNCTION &&
+                          names_symbol(tu, TSCOPE(inner->ident.scope_id));
+
+            if (frame->phase == 0) frame->phase = 1;
+
+            if (frame->phase == 2) {
+                int arg_type = value_type(b, top(b, 1));
+                // as by assignment to the parameter, or with the default
+                // argument promotions past the prototype, C23(N3096) 6.5.2.2
+                int param_type;
+                if (frame->index < TTYPE(function_type)->function.params.len) {
+                    param_type = TTYPE(function_type)->function.params.data[frame->index];
+                } else if (TTYPE(arg_type)->layer == TYPE_FLOAT) {
+                    param_type = find_or_create_type(tu, 0, TYPE_DOUBLE, 0);
+                } else if (type_is_integer(tu, arg_type)) {
+                    param_type = type_promote(tu, arg_type);
+                } else {
+                    param_type = arg_type;
+                }
+                convert(b, param_type);
+                frame->index += 1;
+                frame->phase = 1;
+            }
+
+            if (frame->phase == 1) {
+                if (frame->index < node->funcall.args.len) {
+                    VISIT(2, node->funcall.args.data[frame->index], WANT_VALUE);
+                    break;
+                }
+                if (!direct) {
+                    VISIT(3, inner, WANT_VALUE);
+                    break;
+                }
+            }
+
+            call(b, node->funcall.args.len, !direct, direct ? TSCOPE(inner->ident.scope_id) : nullptr, type);
+            RETURN();
+            break;
+        }
+        case NODE_DECLARATION:
+            if (frame->index < node->decl.declarators.len)
+                VISIT(0, node->decl.declarators.data[frame->index++], WANT_VALUE);
+            else
+                RETURN();
+            break;
+        case NODE_DECLARATOR:
+        case NODE_ARRAY_DECLARATOR:
+        case NODE_FUNCTION_DECLARATOR: {
+            if (!node->d.scope_id) {
+                RETURN();
+                break;
+            }
+            struct scope *scope = TSCOPE(node->d.scope_id);
+            if (scope->is_global || scope->sc == ST_STATIC || scope->sc == ST_CONSTEXPR || scope->sc == ST_EXTERNAL) {
+                emit_global(tu, node);
+                RETURN();
+                break;
+            }
+            if (frame->phase == 0) {
+                if (scope->sc == ST_TYPEDEF || TTYPE(scope->c_type)->layer == TYPE_FUNCTION) {
+                    RETURN();
+                    break;
+                }
+                allocate(b, scope);
+                if (!node->d.initializer) {
+                    RETURN();
+                } else if (TTYPE(scope->c_type)->layer == TYPE_ARRAY) {
+                    print_error_node(tu, node->d.initializer, "array initializers are not implemented");
+                    RETURN();
+                } else {
+                    VISIT(1, node->d.initializer, WANT_VALUE);
+                }
+            } else {
+                convert(b, type_rvalue(tu, scope->c_type));
+                insert(b, 1, (struct item){ .kind = ITEM_LOCAL, .type = scope->c_type, .offset = scope->frame_offset });
+                store(b);
+                pop(b);
+                RETURN();
+            }
+            break;
+        }
+        case NODE_STATIC_ASSERT:
+        case NODE_NULL:
+            RETURN();
+            break;
+        case NODE_BLOCK:
+            if (frame->phase == 1) drop(b);
+            if (frame->index < node->block.children.len)
+                VISIT(1, node->block.children.data[frame->index++], WANT_VALUE);
+            else
+                RETURN();
+            break;
+        case NODE_RETURN:
+            if (!node->ret.expr) {
+                ret(b);
+                RETURN();
+            } else if (frame->phase == 0) {
+                VISIT(1, node->ret.expr, WANT_VALUE);
+            } else {
+                int w = width(b, b->return_type);
+                if (TTYPE(b->return_type)->layer != TYPE_VOID) {
+                    convert(b, b->return_type);
+                    if (is_float(b, b->return_type)) {
+                        load_into(b, 1, XMM0, 0);
+                    } else {
+                        load_into(b, 1, RAX, 0);
+                        // callers may rely on a narrow result being
+                        // extended to 32 bits
+                        if (w < 4)
+                            put(b, type_is_signed(tu, b->return_type) ? X86_MOVSX : X86_MOVZX, 4, reg_operand(RAX),
+                                reg_operand(RAX))->from_size = (unsigned char)w;
+                    }
+                }
+                pop(b);
+                ret(b);
+                RETURN();
+            }
+            break;
+        case NODE_IF:
+            // v[0] is the else label, v[1] the end
+            if (frame->phase == 0) {
+                frame->v[0].i = new_label(b);
+                frame->v[1].i = node->if_.block_false ? new_label(b) : frame->v[0].i;
+                VISIT(1, node->if_.cond, WANT_VALUE);
+            } else if (frame->phase == 1) {
+                branch(b, frame->v[0].i, true);
+                VISIT(2, node->if_.block_true, WANT_VALUE);
+            } else if (frame->phase == 2 && node->if_.block_false) {
+                drop(b);
+                jump(b, X86_JMP, 0, frame->v[1].i);
+                place_label(b, frame->v[0].i);
+                VISIT(3, node->if_.block_false, WANT_VALUE);
+            } else {
+                drop(b);
+                place_label(b, frame->v[1].i);
+                RETURN();
+            }
+            break;
+
+        // Loops keep the label `continue` goes to in v[1] and the one `break`
+        // goes to in v[2], like emit_node's.
+        case NODE_WHILE:
+            if (frame->phase == 0) {
+                frame->v[1].i = new_label(b);
+                frame->v[2].i = new_label(b);
+                place_label(b, frame->v[1].i);
+                VISIT(1, node->while_.cond, WANT_VALUE);
+            } else if (frame->phase == 1) {
+                branch(b, frame->v[2].i, true);
+                VISIT(2, node->while_.block, WANT_VALUE);
+            } else {
+                drop(b);
+                jump(b, X86_JMP, 0, frame->v[1].i);
+                place_label(b, frame->v[2].i);
+                RETURN();
+            }
+            break;
+        case NODE_DO:
+            if (frame->phase == 0) {
+                frame->v[1].i = new_label(b);
+                frame->v[2].i = new_label(b);
+                frame->v[3].i = new_label(b);
+                place_label(b, frame->v[3].i);
+                VISIT(1, node->do_.block, WANT_VALUE);
+            } else if (frame->phase == 1) {
+                drop(b);
+                place_label(b, frame->v[1].i);
+                VISIT(2, node->do_.cond, WANT_VALUE);
+            } else {
+                branch(b, frame->v[3].i, false);
+                place_label(b, frame->v[2].i);
+                RETURN();
+            }
+            break;
+        case NODE_FOR:
+            // v[3] is the condition
+            if (frame->phase == 0) {
+                frame->v[1].i = new_label(b);
+                frame->v[2].i = new_label(b);
+                frame->v[3].i = new_label(b);
+                VISIT(1, node->for_.init, WANT_VALUE);
+            } else if (frame->phase == 1) {
+                drop(b);
+                place_label(b, frame->v[3].i);
+                if (node->for_.cond) VISIT(2, node->for_.cond, WANT_VALUE);
+                else VISIT(3, node->for_.block, WANT_VALUE);
+            } else if (frame->phase == 2) {
+                branch(b, frame->v[2].i, true);
+                VISIT(3, node->for_.block, WANT_VALUE);
+            } else if (frame->phase == 3) {
+                drop(b);
+                place_label(b, frame->v[1].i);
+                VISIT(4, node->for_.next, WANT_VALUE);
+            } else {
+                drop(b);
+                jump(b, X86_JMP, 0, frame->v[3].i);
+                place_label(b, frame->v[2].i);
+                RETURN();
+            }
+            break;
+        case NODE_BREAK:
+        case NODE_CONTINUE: {
+            bool is_break = node->type == NODE_BREAK;
+            struct walk_frame *target = nullptr;
+            for (size_t i = walk.stack.len - 1; i-- > 0;) {
+                enum node_type t = walk.stack.data[i].node->type;
+                if (t == NODE_WHILE || t == NODE_DO || t == NODE_FOR || (is_break && t == NODE_SWITCH)) {
+                    target = &walk.stack.data[i];
+                    break;
+                }
+            }
+            if (!target) {
+                print_error_node(tu, node, is_break ? "break statement not within a loop or switch"
+                                                    : "continue statement not within a loop");
+            } else {
+                jump(b, X86_JMP, 0, is_break ? target->v[2].i : target->v[1].i);
+            }
+            RETURN();
+            break;
+        }
+        case NODE_SWITCH: {
+            // v[0] holds the case labels, v[2] the label `break` goes to
+            int control_type = type_promote(tu, type_rvalue(tu, node->switch_.expr->c_type));
+            if (frame->phase == 0) {
+                VISIT(1, node->switch_.expr, WANT_VALUE);
+            } else if (frame->phase == 1) {
+                switch_case_list_t *cases = calloc(1, sizeof(switch_case_list_t));
+                find_cases(tu, node->switch_.block, cases);
+                frame->v[0].ptr = cases;
+                frame->v[2].i = new_label(b);
+
+                convert(b, control_type);
+                int size = int_size(width(b, control_type));
+                enum machine_reg r = load(b, 1, 0);
+                int otherwise = frame->v[2].i;
+                for_each (cases) {
+                    it->block = new_label(b);
+                    if (it->node->type == NODE_DEFAULT) {
+                        otherwise = it->block;
+                        continue;
+                    }
+                    int64_t value = sign_extend(normalize(b, eval(tu, it->node->case_.value)->i, control_type), size);
+                    if (fits_imm32(value)) {
+                        put(b, X86_CMP, size, reg_operand(r), imm_operand(value));
+                    } else {
+                        put(b, X86_MOV, 8, reg_operand(SCRATCH_REG), imm_operand(value));
+                        put(b, X86_CMP, size, reg_operand(r), reg_operand(SCRATCH_REG));
+                    }
+                    jump(b, X86_JCC, X86_E, it->block);
+                }
+                pop(b);
+                jump(b, X86_JMP, 0, otherwise);
+                VISIT(2, node->switch_.block, WANT_VALUE);
+            } else {
+                switch_case_list_t *cases = frame->v[0].ptr;
+                list_clear(cases);
+                free(cases);
+                drop(b);
+                place_label(b, frame->v[2].i);
+                RETURN();
+            }
+            break;
+        }
+        case NODE_CASE:
+        case NODE_DEFAULT: {
+            int label = -1;
+            for (size_t i = walk.stack.len - 1; i-- > 0 && label == -1;) {
+                if (walk.stack.data[i].node->type != NODE_SWITCH) continue;
+                switch_case_list_t *cases = walk.stack.data[i].v[0].ptr;
+                for_each (cases) {
+                    if (it->node == node) label = it->block;
+                }
+                break;
+            }
+            if (label != -1) place_label(b, label);
+            else print_error_node(tu, node, "case label not within a switch statement");
+            RETURN();
+            break;
+        }
+        case NODE_LABEL:
+            place_label(b, label_of(b, node->label.name, nullptr));
+            RETURN();
+            break;
+        case NODE_GOTO:
+            jump(b, X86_JMP, 0, label_of(b, node->goto_.label, node));
+            RETURN();
+            break;
+        case NODE_ERROR:
+            // already reported, and what the nodes around it expect of it is
+            // anyone's guess
+            abandoned = true;
+            break;
+        default:
+            print_internal_error(tu, "baseline: unrecognised ast node %s", node_type_strings[node->type]);
+            // something for the parent of an expression to consume
+            if (node->c_type) push(b, (struct item){ .kind = ITEM_CONST, .type = type });
+            RETURN();
+        }
+
+#undef VISIT
+#undef RETURN
+
+        if (abandoned) break;
+        if (done) {
+            walk_return(&walk, (union walk_value){});
+        } else if (child) {
+            frame = walk_push(&walk, child);
+            frame->mode = child_mode;
+        }
+    }
+
+    for_each (&b->labels) {
+        if (abandoned || it->defined) continue;
+        struct token *t = it->name->token;
+        print_error_node(tu, it->first_use, "use of undeclared label '%.*s'", t->len, &tu->source[t->index]);
+    }
+    walk_free(&walk);
+}
+
+// The frame holds every parameter and local, then the spill slots. Its size
+// is only known at the end, when the prologue's sub is patched.
+struct x86_function *baseline_function(struct tu *tu, struct node *definition) {
+    struct scope *name = TSCOPE(definition->fun.d->d.scope_id);
+    struct x86_function *out = calloc(1, sizeof(struct x86_function));
+    struct baseline b = { .tu = tu, .out = out, .return_type = TTYPE(name->c_type)->inner };
+    out->symbol = scope_symbol(tu, name, &out->is_global);
+
+    put1(&b, X86_PUSH, 8, reg_operand(RBP));
+    put(&b, X86_MOV, 8, reg_operand(RBP), reg_operand(RSP));
+    b.frame_instr = out->instrs.len;
+    put(&b, X86_SUB, 8, reg_operand(RSP), imm_operand(0));
+
+    // parameters passed in registers are stored to their slot; those on the
+    // stack already have one
+    struct node *d = function_declarator(definition->fun.d);
+    int n_int = 0, n_float = 0, n_stack = 0;
+    for_each (&d->d.fun.args) {
+        struct node *decl = *it;
+        if (decl->type != NODE_DECLARATION || !decl->decl.declarators.len) continue;
+        struct node *param = list_first(&decl->decl.declarators);
+        int param_type = param->c_type ? type_rvalue(tu, param->c_type) : 0;
+        struct scope *scope = param->d.scope_id ? TSCOPE(param->d.scope_id) : nullptr;
+        if (scope) param_type = type_rvalue(tu, scope->c_type);
+        if (!param_type || TTYPE(param_type)->layer == TYPE_VOID) continue;
+        bool param_float = is_float(&b, param_type);
+        signed char from = param_register(param_float, param_float ? n_float++ : n_int++);
+        if (from == -1) {
+            if (scope) scope->frame_offset = 16 + 8 * n_stack;
+            n_stack++;
+            continue;
+        }
+        if (!scope) continue;
+        allocate(&b, scope);
+        int w = width(&b, param_type);
+        put(&b, param_float ? X86_MOVS : X86_MOV, w, mem_operand(RBP, scope->frame_offset), reg_operand(from));
+    }
+
+    generate_body(&b, definition->fun.body);
+
+    // falling off the end returns, with 0 from main
+    struct token *t = name->token;
+    bool is_main = t->len == 4 && memcmp(&tu->source[t->index], "main", 4) == 0;
+    if (is_main && TTYPE(b.return_type)->layer != TYPE_VOID) put(&b, X86_MOV, 4, reg_operand(RAX), imm_operand(0));
+    ret(&b);
+
+    out->instrs.data[b.frame_instr].operands[1].imm = (b.frame_size + 15) & ~15;
+    list_clear(&b.items);
+    list_clear(&b.free_slots);
+    list_clear(&b.labels);
+    return out;
+}
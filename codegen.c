@@ -0,0 +1,952 @@
+#include "x86.h"
+#include "ir.h"
+#include "opt.h"
+#include "regalloc.h"
+#include "sched.h"
+#include "tu.h"
+#include "type.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Lowering the IR of a function to x86-64 after register allocation.
+//
+// Every register has one location, so each IR instruction turns into a short
+// fixed sequence: operands are read where they live, as a machine register, a
+// stack slot or an immediate, and results are computed in the destination's
+// register if it has one. Whatever x86 can't do in one instruction, like two
+// memory operands or an immediate too wide for one, goes through the
+// registers the allocators never hand out: RAX, RCX and RDX for division,
+// shift counts and results, R11 for addresses and wide constants, and XMM15
+// for floats. Nothing is kept in them between IR instructions.
+//
+// Instruction selection first picks how each IR instruction is covered:
+// most on their own as above, some folded into the instruction that uses
+// them, as an address or an immediate.
+// A peephole pass then cleans up the seams between the sequences.
+
+#define TTYPE(n) type_at(&tu->types, n)
+
+struct codegen {
+    struct tu *tu;
+    struct function *function;
+    struct x86_function *out;
+    // the frame pointer offset of each saved callee-saved register, 0 if it
+    // isn't saved
+    int save_offset[N_MACHINE_REGS];
+    struct selection selection;
+    // the block being generated, and the instruction whose operands are
+    // being read, with its cover
+    int block;
+    struct ir_instr *instr;
+    struct cover *cover;
+};
+
+static struct x86_operand reg_operand(enum machine_reg r) {
+    return (struct x86_operand){ .kind = X86_REG, .reg = r };
+}
+
+static struct x86_operand imm_operand(int64_t imm) {
+    return (struct x86_operand){ .kind = X86_IMM, .imm = imm };
+}
+
+static struct x86_operand mem_operand(enum machine_reg base, int64_t disp) {
+    return (struct x86_operand){ .kind = X86_MEM, .reg = base, .imm = disp };
+}
+
+static struct x86_operand label_operand(int label) {
+    return (struct x86_operand){ .kind = X86_TARGET, .label = label };
+}
+
+static struct x86_instr *put(struct codegen *g, enum x86_op op, int size, struct x86_operand a, struct x86_operand b) {
+    list_push(&g->out->instrs, ((struct x86_instr){ .op = op, .size = (unsigned char)size, .operands = { a, b } }));
+    return &list_last(&g->out->instrs);
+}
+
+static struct x86_instr *put1(struct codegen *g, enum x86_op op, int size, struct x86_operand a) {
+    return put(g, op, size, a, (struct x86_operand){});
+}
+
+static int new_label(struct codegen *g) {
+    return g->out->n_labels++;
+}
+
+static void place_label(struct codegen *g, int label) {
+    put1(g, X86_LABEL, 0, label_operand(label));
+}
+
+static void jump(struct codegen *g, enum x86_op op, enum x86_cond cond, int label) {
+    put1(g, op, 0, label_operand(label))->cond = cond;
+}
+
+static bool fits_imm32(int64_t imm) {
+    return imm >= INT32_MIN && imm <= INT32_MAX;
+}
+
+static int64_t sign_extend(uint64_t value, int size) {
+    if (size >= 8) return (int64_t)value;
+    int shift = 64 - 8 * size;
+    return (int64_t)(value << shift) >> shift;
+}
+
+// Integer operations narrower than 32 bits are done at 32 bits, which is
+// also what writing a register's low half clears the rest of.
+static int int_size(int width) {
+    return width <= 4 ? 4 : 8;
+}
+
+static uint64_t float_bits(double f, int size) {
+    uint64_t bits = 0;
+    if (size == 4) {
+        float narrow = (float)f;
+        memcpy(&bits, &narrow, sizeof(narrow));
+    } else {
+        memcpy(&bits, &f, sizeof(f));
+    }
+    return bits;
+}
+
+// A constant in read only data, shared with any the function already has of
+// the same bits.
+static struct x86_operand constant_operand(struct codegen *g, uint64_t bits, int size) {
+    for_each (&g->out->constants) {
+        if (it->bits == bits && it->size == size) return (struct x86_operand){ .kind = X86_RIP, .label = it->label };
+    }
+    int label = new_label(g);
+    list_push(&g->out->constants, ((struct x86_constant){ .label = label, .bits = bits, .size = (unsigned char)size }));
+    return (struct x86_operand){ .kind = X86_RIP, .label = label };
+}
+
+static struct location *location(struct codegen *g, reg r) {
+    return &g->function->allocation->locations.data[r];
+}
+
+// Whether the instruction being generated reads a register as the constant
+// it holds, instead of where it lives.
+static bool is_immediate(struct codegen *g, reg r) {
+    if (!g->cover || !g->cover->immediates) return false;
+    for (int slot = 0; slot < 3; slot++) {
+        if ((g->cover->immediates & (1 << slot)) && g->instr->r[slot] == r) return true;
+    }
+    return false;
+}
+
+static bool in_reg(struct codegen *g, reg r, enum machine_reg m) {
+    struct location *l = location(g, r);
+    return l->kind == LOC_REG && l->reg == m;
+}
+
+// Where a register is read from, for an access of size bytes.
+static struct x86_operand operand(struct codegen *g, reg r, int size) {
+    struct location *l = location(g, r);
+    if (is_immediate(g, r)) return imm_operand(sign_extend(g->function->constants.data[g->selection.constants[r]].i, size));
+    switch (l->kind) {
+    case LOC_REG:
+        return reg_operand(l->reg);
+    case LOC_STACK:
+        return mem_operand(RBP, l->offset);
+    case LOC_REMAT: {
+        struct ir_constant *c = &g->function->constants.data[l->constant];
+        if (l->is_float) return constant_operand(g, float_bits(c->f, l->width), l->width);
+        return imm_operand(sign_extend(c->i, size));
+    }
+    default:
+        // the undefined value of a variable read before it is assigned
+        return l->is_float ? constant_operand(g, 0, 8) : imm_operand(0);
+    }
+}
+
+static bool same_operand(struct x86_operand *x, struct x86_operand *y) {
+    if (x->kind != y->kind) return false;
+    switch (x->kind) {
+    case X86_REG:
+        return x->reg == y->reg;
+    case X86_MEM:
+        return x->reg == y->reg && x->imm == y->imm && x->scale == y->scale && (!x->scale || x->index == y->index);
+    case X86_IMM:
+        return x->imm == y->imm;
+    case X86_RIP:
+        return x->symbol == y->symbol && x->label == y->label && x->imm == y->imm && x->indirect == y->indirect;
+    default:
+        return false;
+    }
+}
+
+// Copy a value between two operands, through a scratch register where it
+// takes two instructions.
+static void move(struct codegen *g, struct x86_operand to, struct x86_operand from, int size, bool is_float) {
+    if (same_operand(&to, &from)) return;
+    if (is_float) {
+        if (to.kind == X86_REG && from.kind == X86_REG) {
+            put(g, X86_MOVAPS, size, to, from);
+        } else if (to.kind == X86_REG || from.kind == X86_REG) {
+            put(g, X86_MOVS, size, to, from);
+        } else {
+            put(g, X86_MOVS, size, reg_operand(SCRATCH_FLOAT_REG), from);
+            put(g, X86_MOVS, size, to, reg_operand(SCRATCH_FLOAT_REG));
+        }
+        return;
+    }
+
+    if (to.kind == X86_REG && from.kind == X86_IMM && from.imm == 0) {
+        put(g, X86_XOR, 4, to, to);
+    } else if (to.kind != X86_REG && (from.kind == X86_MEM || from.kind == X86_RIP ||
+                                      (from.kind == X86_IMM && !fits_imm32(from.imm)))) {
+        put(g, X86_MOV, size, reg_operand(SCRATCH_REG), from);
+        put(g, X86_MOV, size, to, reg_operand(SCRATCH_REG));
+    } else {
+        put(g, X86_MOV, size, to, from);
+    }
+}
+
+// The machine register to compute the value of d in: its own, or a scratch
+// register that store_result then copies it from.
+static enum machine_reg result_reg(struct codegen *g, reg d, enum machine_reg scratch) {
+    struct location *l = location(g, d);
+    return l->kind == LOC_REG ? l->reg : scratch;
+}
+
+static void store_result(struct codegen *g, reg d, enum machine_reg from, int size, bool is_float) {
+    move(g, operand(g, d, size), reg_operand(from), size, is_float);
+}
+
+// Read a register into a machine register: the one it is allocated to, or
+// scratch.
+static enum machine_reg load(struct codegen *g, reg r, int size, bool is_float, enum machine_reg scratch) {
+    struct location *l = location(g, r);
+    if (l->kind == LOC_REG && !is_immediate(g, r)) return l->reg;
+    move(g, reg_operand(scratch), operand(g, r, size), size, is_float);
+    return scratch;
+}
+
+// An operand that can be the source of an ALU instruction, which can't take
+// an immediate wider than 32 bits.
+static struct x86_operand source_operand(struct codegen *g, reg r, int size) {
+    struct x86_operand x = operand(g, r, size);
+    if (x.kind == X86_IMM && !fits_imm32(x.imm)) {
+        put(g, X86_MOV, size, reg_operand(SCRATCH_REG), x);
+        return reg_operand(SCRATCH_REG);
+    }
+    return x;
+}
+
+// The memory an address register points to.
+static struct x86_operand pointee(struct codegen *g, reg address) {
+    return mem_operand(load(g, address, 8, false, SCRATCH_REG), 0);
+}
+
+// The memory an addressing mode selects, with a base that isn't in a
+// register loaded into R11 and an index into RCX.
+static struct x86_operand mode_operand(struct codegen *g, struct address_mode *mode) {
+    struct x86_operand x = mem_operand(mode->frame ? RBP : load(g, mode->base, 8, false, SCRATCH_REG), mode->disp);
+    if (mode->scale) {
+        x.index = load(g, mode->index, 8, false, RCX);
+        x.scale = mode->scale;
+    }
+    return x;
+}
+
+static void generate_binop(struct codegen *g, struct ir_instr *i, enum x86_op op, bool commutative) {
+    bool is_float = i->is_float;
+    int size = is_float ? i->width : int_size(i->width);
+    reg d = i->r[0], a = i->r[1], b = i->r[2];
+    struct location *l = location(g, d);
+    // the destination can only double as the first operand if the second
+    // isn't in it
+    if (commutative && l->kind == LOC_REG && in_reg(g, b, l->reg)) {
+        reg t = a;
+        a = b;
+        b = t;
+    }
+    enum machine_reg w = is_float ? SCRATCH_FLOAT_REG : RAX;
+    if (l->kind == LOC_REG && !in_reg(g, b, l->reg)) w = l->reg;
+
+    move(g, reg_operand(w), operand(g, a, size), size, is_float);
+    put(g, op, size, reg_operand(w), is_float ? operand(g, b, size) : source_operand(g, b, size));
+    store_result(g, d, w, size, is_float);
+}
+
+static void generate_shift(struct codegen *g, struct ir_instr *i) {
+    int size = int_size(i->width);
+    reg d = i->r[0];
+    enum x86_op op = i->op == SHL ? X86_SHL : i->is_signed ? X86_SAR : X86_SHR;
+    struct x86_operand count = operand(g, i->r[2], 4);
+    if (count.kind == X86_IMM) {
+        count.imm &= size * 8 - 1;
+    } else {
+        // the count goes in cl before the destination is written, in case
+        // they are the same register
+        move(g, reg_operand(RCX), count, 4, false);
+        count = reg_operand(RCX);
+    }
+    enum machine_reg w = result_reg(g, d, RAX);
+    move(g, reg_operand(w), operand(g, i->r[1], size), size, false);
+    put(g, op, size, reg_operand(w), count);
+    store_result(g, d, w, size, false);
+}
+
+static void generate_division(struct codegen *g, struct ir_instr *i) {
+    if (i->is_float) {
+        generate_binop(g, i, X86_DIVS, false);
+        return;
+    }
+    int size = int_size(i->width);
+    move(g, reg_operand(RAX), operand(g, i->r[1], size), size, false);
+    if (i->is_signed) put(g, X86_CQO, size, (struct x86_operand){}, (struct x86_operand){});
+    else put(g, X86_XOR, 4, reg_operand(RDX), reg_operand(RDX));
+    struct x86_operand divisor = operand(g, i->r[2], size);
+    if (divisor.kind == X86_IMM) {
+        put(g, X86_MOV, size, reg_operand(SCRATCH_REG), divisor);
+        divisor = reg_operand(SCRATCH_REG);
+    }
+    put1(g, i->is_signed ? X86_IDIV : X86_DIV, size, divisor);
+    move(g, operand(g, i->r[0], size), reg_operand(i->op == DIV ? RAX : RDX), size, false);
+}
+
+// A float's sign is flipped by way of the integer registers, which avoids a
+// 16 byte mask constant.
+static void generate_negate(struct codegen *g, struct ir_instr *i) {
+    int size = i->is_float ? i->width : int_size(i->width);
+    reg d = i->r[0];
+    if (!i->is_float) {
+        enum machine_reg w = result_reg(g, d, RAX);
+        move(g, reg_operand(w), operand(g, i->r[1], size), size, false);
+        put1(g, i->op == NEG ? X86_NEG : X86_NOT, size, reg_operand(w));
+        store_result(g, d, w, size, false);
+        return;
+    }
+    enum machine_reg w = result_reg(g, d, SCRATCH_FLOAT_REG);
+    move(g, reg_operand(w), operand(g, i->r[1], size), size, true);
+    put(g, X86_MOVQ, size, reg_operand(RAX), reg_operand(w));
+    if (size == 8) {
+        put(g, X86_MOV, 8, reg_operand(SCRATCH_REG), imm_operand(INT64_MIN));
+        put(g, X86_XOR, 8, reg_operand(RAX), reg_operand(SCRATCH_REG));
+    } else {
+        put(g, X86_XOR, 4, reg_operand(RAX), imm_operand(INT32_MIN));
+    }
+    put(g, X86_MOVQ, size, reg_operand(w), reg_operand(RAX));
+    store_result(g, d, w, size, true);
+}
+
+// Set the int in d to a condition of the flags, two conditions that both
+// have to hold if also is given, or either if it is negative.
+static void set_condition(struct codegen *g, reg d, enum x86_cond cond, enum x86_cond also, int combine) {
+    enum machine_reg w = result_reg(g, d, RAX);
+    put1(g, X86_SETCC, 1, reg_operand(w))->cond = cond;
+    if (combine) {
+        put1(g, X86_SETCC, 1, reg_operand(RCX))->cond = also;
+        put(g, combine > 0 ? X86_AND : X86_OR, 1, reg_operand(w), reg_operand(RCX));
+    }
+    put(g, X86_MOVZX, 4, reg_operand(w), reg_operand(w))->from_size = 1;
+    store_result(g, d, w, 4, false);
+}
+
+static const enum x86_cond signed_conds[] = {
+    [COND_EQ] = X86_E, [COND_NE] = X86_NE,
+    [COND_LT] = X86_L, [COND_LE] = X86_LE, [COND_GT] = X86_G, [COND_GE] = X86_GE,
+};
+
+static const enum x86_cond unsigned_conds[] = {
+    [COND_EQ] = X86_E, [COND_NE] = X86_NE,
+    [COND_LT] = X86_B, [COND_LE] = X86_BE, [COND_GT] = X86_A, [COND_GE] = X86_AE,
+};
+
+// Floats compare with ucomis, which sets the flags like an unsigned compare,
+// and the parity flag when either side is NaN. Less than is greater than
+// with the operands swapped, so that every ordering is false for NaN.
+static void generate_float_test(struct codegen *g, struct ir_instr *i) {
+    int size = i->width;
+    reg x = i->r[1], y = i->r[2];
+    enum ir_cond cond = i->cond;
+    if (cond == COND_LT || cond == COND_LE) {
+        x = i->r[2];
+        y = i->r[1];
+    }
+    enum machine_reg left = load(g, x, size, true, SCRATCH_FLOAT_REG);
+    put(g, X86_UCOMIS, size, reg_operand(left), operand(g, y, size));
+    switch (cond) {
+    case COND_EQ: set_condition(g, i->r[0], X86_E, X86_NP, 1); break;
+    case COND_NE: set_condition(g, i->r[0], X86_NE, X86_P, -1); break;
+    case COND_LT: case COND_GT: set_condition(g, i->r[0], X86_A, 0, 0); break;
+    default: set_condition(g, i->r[0], X86_AE, 0, 0); break;
+    }
+}
+
+static void generate_test(struct codegen *g, struct ir_instr *i) {
+    if (i->is_float) {
+        generate_float_test(g, i);
+        return;
+    }
+    int size = i->width;
+    struct x86_operand x = operand(g, i->r[1], size);
+    if (x.kind != X86_REG) {
+        move(g, reg_operand(RAX), x, int_size(size), false);
+        x = reg_operand(RAX);
+    }
+    put(g, X86_CMP, size, x, source_operand(g, i->r[2], size));
+    set_condition(g, i->r[0], (i->is_signed ? signed_conds : unsigned_conds)[i->cond], 0, 0);
+}
+
+// Compare a register with zero. Returns false without emitting anything if
+// it is a constant, whose value is then in *value.
+static bool compare_zero(struct codegen *g, reg r, int size, bool is_float, int64_t *value) {
+    if (is_float) {
+        put(g, X86_XORPS, 16, reg_operand(SCRATCH_FLOAT_REG), reg_operand(SCRATCH_FLOAT_REG));
+        put(g, X86_UCOMIS, size, reg_operand(SCRATCH_FLOAT_REG), operand(g, r, size));
+        return true;
+    }
+    struct x86_operand x = operand(g, r, size);
+    if (x.kind == X86_IMM) {
+        *value = x.imm;
+        return false;
+    }
+    if (x.kind == X86_REG) put(g, X86_TEST, size, x, x);
+    else put(g, X86_CMP, size, x, imm_operand(0));
+    return true;
+}
+
+static void generate_not(struct codegen *g, struct ir_instr *i) {
+    int64_t value;
+    if (!compare_zero(g, i->r[1], i->width, i->is_float, &value)) {
+        move(g, operand(g, i->r[0], 4), imm_operand(value == 0), 4, false);
+    } else if (i->is_float) {
+        set_condition(g, i->r[0], X86_E, X86_NP, 1);
+    } else {
+        set_condition(g, i->r[0], X86_E, 0, 0);
+    }
+}
+
+// Jump to one block if a condition holds and another if it doesn't, leaving
+// out a jump to the next block.
+static void branch_on(struct codegen *g, enum x86_cond cond, enum x86_cond inverse, int target, int otherwise,
+                      int next) {
+    if (otherwise == next) {
+        jump(g, X86_JCC, cond, target);
+    } else {
+        jump(g, X86_JCC, inverse, otherwise);
+        if (target != next) jump(g, X86_JMP, 0, target);
+    }
+}
+
+static void generate_branch(struct codegen *g, struct ir_instr *i, int next) {
+    int if_zero = (int)i->r[1], otherwise = (int)i->r[2];
+    int64_t value;
+    if (if_zero == otherwise) {
+        if (if_zero != next) jump(g, X86_JMP, 0, if_zero);
+        return;
+    }
+    if (!compare_zero(g, i->r[0], i->width, i->is_float, &value)) {
+        int target = value == 0 ? if_zero : otherwise;
+        if (target != next) jump(g, X86_JMP, 0, target);
+        return;
+    }
+    // unordered, a NaN, isn't zero
+    if (i->is_float) jump(g, X86_JCC, X86_P, otherwise);
+    branch_on(g, X86_NE, X86_E, otherwise, if_zero, next);
+}
+
+static const enum x86_cond inverse_conds[] = {
+    [X86_E] = X86_NE, [X86_NE] = X86_E,
+    [X86_L] = X86_GE, [X86_LE] = X86_G, [X86_G] = X86_LE, [X86_GE] = X86_L,
+    [X86_B] = X86_AE, [X86_BE] = X86_A, [X86_A] = X86_BE, [X86_AE] = X86_B,
+    [X86_P] = X86_NP, [X86_NP] = X86_P,
+};
+
+// A jump on the flags of the integer comparison that is its condition,
+// which is then never materialized as a 0 or 1.
+static void generate_compare_branch(struct codegen *g, struct ir_instr *i, struct ir_instr *test, int next) {
+    int if_zero = (int)i->r[1], otherwise = (int)i->r[2];
+    if (if_zero == otherwise) {
+        if (if_zero != next) jump(g, X86_JMP, 0, if_zero);
+        return;
+    }
+    struct ir_block *block = &g->function->blocks.data[g->block];
+    g->instr = test;
+    g->cover = &g->selection.covers[g->selection.block_start[g->block] + (size_t)(test - block->instrs.data)];
+    int size = test->width;
+    struct x86_operand x = operand(g, test->r[1], size);
+    if (x.kind != X86_REG) {
+        move(g, reg_operand(RAX), x, int_size(size), false);
+        x = reg_operand(RAX);
+    }
+    put(g, X86_CMP, size, x, source_operand(g, test->r[2], size));
+    enum x86_cond cond = (test->is_signed ? signed_conds : unsigned_conds)[test->cond];
+    branch_on(g, cond, inverse_conds[cond], otherwise, if_zero, next);
+}
+
+// Extend the from byte integer in an operand to size bytes in w.
+static void extend(struct codegen *g, enum machine_reg w, struct x86_operand from, int from_size, int size, bool is_signed) {
+    if (from.kind == X86_IMM) {
+        uint64_t v = from_size >= 8 ? (uint64_t)from.imm : (uint64_t)from.imm & ((1ull << (8 * from_size)) - 1);
+        move(g, reg_operand(w), imm_operand(is_signed ? sign_extend(v, from_size) : (int64_t)v), size, false);
+    } else if (from_size < 4 || (from_size == 4 && size == 8 && is_signed)) {
+        put(g, is_signed ? X86_MOVSX : X86_MOVZX, size, reg_operand(w), from)->from_size = (unsigned char)from_size;
+    } else if (from_size == 4 && size == 8) {
+        // writing the low 32 bits clears the rest, so this is no copy to
+        // elide even from the register itself
+        put(g, X86_MOV, 4, reg_operand(w), from);
+    } else {
+        // the same size or narrower, which is only a copy
+        move(g, reg_operand(w), from, from_size < size ? from_size : size, false);
+    }
+}
+
+static void generate_extend(struct codegen *g, struct ir_instr *i) {
+    int size = int_size(i->width);
+    enum machine_reg w = result_reg(g, i->r[0], RAX);
+    extend(g, w, operand(g, i->r[1], i->from_width), i->from_width, size, i->is_signed);
+    store_result(g, i->r[0], w, size, false);
+}
+
+// There is no conversion from unsigned 64 bit integers: one with the top bit
+// set is halved, rounding to odd so the result rounds the same, converted and
+// doubled.
+static void generate_int_to_float(struct codegen *g, struct ir_instr *i) {
+    int size = i->width, from = i->from_width;
+    enum machine_reg w = result_reg(g, i->r[0], SCRATCH_FLOAT_REG);
+    // narrow integers convert as ints, and unsigned ints as longs
+    int from_size = from < 4 ? 4 : from == 4 && !i->is_signed ? 8 : from;
+    extend(g, RAX, operand(g, i->r[1], from), from, from_size, i->is_signed);
+
+    if (from == 8 && !i->is_signed) {
+        int big = new_label(g), done = new_label(g);
+        put(g, X86_TEST, 8, reg_operand(RAX), reg_operand(RAX));
+        jump(g, X86_JCC, X86_S, big);
+        put(g, X86_CVTSI2S, size, reg_operand(w), reg_operand(RAX))->from_size = 8;
+        jump(g, X86_JMP, 0, done);
+        place_label(g, big);
+        put(g, X86_MOV, 8, reg_operand(RCX), reg_operand(RAX));
+        put(g, X86_SHR, 8, reg_operand(RCX), imm_operand(1));
+        put(g, X86_AND, 4, reg_operand(RAX), imm_operand(1));
+        put(g, X86_OR, 8, reg_operand(RCX), reg_operand(RAX));
+        put(g, X86_CVTSI2S, size, reg_operand(w), reg_operand(RCX))->from_size = 8;
+        put(g, X86_ADDS, size, reg_operand(w), reg_operand(w));
+        place_label(g, done);
+    } else {
+        put(g, X86_CVTSI2S, size, reg_operand(w), reg_operand(RAX))->from_size = (unsigned char)from_size;
+    }
+    store_result(g, i->r[0], w, size, true);
+}
+
+// Unsigned integers that don't fit in the signed conversion of the next size
+// up are converted less 2^63, and get the top bit back afterwards.
+static void generate_float_to_int(struct codegen *g, struct ir_instr *i) {
+    int size = int_size(i->width), from = i->from_width;
+    reg d = i->r[0];
+    enum machine_reg w = result_reg(g, d, RAX);
+    if (!i->is_signed && size == 8) {
+        int big = new_label(g), done = new_label(g);
+        struct x86_operand limit = constant_operand(g, float_bits(0x1p63, from), from);
+        move(g, reg_operand(SCRATCH_FLOAT_REG), operand(g, i->r[1], from), from, true);
+        put(g, X86_UCOMIS, from, reg_operand(SCRATCH_FLOAT_REG), limit);
+        jump(g, X86_JCC, X86_AE, big);
+        put(g, X86_CVTTS2SI, 8, reg_operand(w), reg_operand(SCRATCH_FLOAT_REG))->from_size = (unsigned char)from;
+        jump(g, X86_JMP, 0, done);
+        place_label(g, big);
+        put(g, X86_SUBS, from, reg_operand(SCRATCH_FLOAT_REG), limit);
+        put(g, X86_CVTTS2SI, 8, reg_operand(w), reg_operand(SCRATCH_FLOAT_REG))->from_size = (unsigned char)from;
+        put(g, X86_MOV, 8, reg_operand(SCRATCH_REG), imm_operand(INT64_MIN));
+        put(g, X86_XOR, 8, reg_operand(w), reg_operand(SCRATCH_REG));
+        place_label(g, done);
+    } else {
+        // an unsigned int converts as a long and keeps the low half
+        int convert = !i->is_signed && size == 4 ? 8 : size;
+        put(g, X86_CVTTS2SI, convert, reg_operand(w), operand(g, i->r[1], from))->from_size = (unsigned char)from;
+    }
+    store_result(g, d, w, size, false);
+}
+
+static void generate_float_to_float(struct codegen *g, struct ir_instr *i) {
+    enum machine_reg w = result_reg(g, i->r[0], SCRATCH_FLOAT_REG);
+    put(g, X86_CVTS2S, i->width, reg_operand(w), operand(g, i->r[1], i->from_width))->from_size = i->from_width;
+    store_result(g, i->r[0], w, i->width, true);
+}
+
+static void generate_load(struct codegen *g, struct ir_instr *i, struct x86_operand from) {
+    reg d = i->r[0];
+    if (i->is_float) {
+        enum machine_reg w = result_reg(g, d, SCRATCH_FLOAT_REG);
+        put(g, X86_MOVS, i->width, reg_operand(w), from);
+        store_result(g, d, w, i->width, true);
+        return;
+    }
+    int size = int_size(i->width);
+    enum machine_reg w = result_reg(g, d, RAX);
+    extend(g, w, from, i->width, size, i->is_signed);
+    store_result(g, d, w, size, false);
+}
+
+static void generate_store(struct codegen *g, struct ir_instr *i, struct x86_operand to) {
+    if (i->is_float) {
+        put(g, X86_MOVS, i->width, to, reg_operand(load(g, i->r[1], i->width, true, SCRATCH_FLOAT_REG)));
+        return;
+    }
+    struct x86_operand value = operand(g, i->r[1], i->width);
+    if (value.kind == X86_MEM || (value.kind == X86_IMM && !fits_imm32(value.imm))) {
+        move(g, reg_operand(RAX), value, int_size(i->width), false);
+        value = reg_operand(RAX);
+    }
+    put(g, X86_MOV, i->width, to, value);
+}
+
+// Arithmetic that fits an addressing mode, done by the address unit in one
+// instruction that needn't overwrite an operand.
+static void generate_lea(struct codegen *g, struct ir_instr *i, struct address_mode *mode) {
+    reg d = i->r[0];
+    int size = int_size(i->width);
+    enum machine_reg w = result_reg(g, d, RAX);
+    put(g, X86_LEA, size, reg_operand(w), mode_operand(g, mode));
+    store_result(g, d, w, size, false);
+}
+
+static void generate_immediate(struct codegen *g, struct ir_instr *i) {
+    struct ir_constant *c = &g->function->constants.data[i->r[1]];
+    if (i->is_float) {
+        move(g, operand(g, i->r[0], i->width), constant_operand(g, float_bits(c->f, i->width), i->width), i->width, true);
+    } else {
+        int size = int_size(i->width);
+        move(g, operand(g, i->r[0], size), imm_operand(sign_extend(c->i, size)), size, false);
+    }
+}
+
+int scope_symbol(struct tu *tu, struct scope *scope, bool *is_global) {
+    struct token *t = scope->token;
+    bool is_function = TTYPE(scope->c_type)->layer == TYPE_FUNCTION;
+    *is_global = scope->sc != ST_STATIC && scope->sc != ST_CONSTEXPR &&
+                 (scope->is_global || scope->sc == ST_EXTERNAL || is_function);
+    if (scope->is_global || scope->sc != ST_STATIC)
+        return tu_intern(tu, &tu->source[t->index], t->len);
+    return tu_printf(tu, "%.*s.%i", t->len, &tu->source[t->index], (int)(scope - tu->scopes.data));
+}
+
+bool is_string_symbol(struct tu *tu, int symbol) {
+    return tu_string(tu, symbol)[0] == '"';
+}
+
+bool is_redefined(struct tu *tu, size_t g, int symbol) {
+    struct ir_global *global = &tu->module.globals.data[g];
+    for (size_t other = 0; other < tu->module.globals.len; other++) {
+        struct ir_global *o = &tu->module.globals.data[other];
+        bool preferred = o->initialized != global->initialized ? o->initialized : other > g;
+        if (other == g || !preferred) continue;
+        bool is_global;
+        if (scope_symbol(tu, o->scope, &is_global) == symbol) return true;
+    }
+    return false;
+}
+
+uint64_t global_bits(struct ir_global *global) {
+    uint64_t bits = global->is_float ? float_bits(global->init.f, global->width) : global->init.i;
+    if (global->width < 8) bits &= (1ull << (8 * global->width)) - 1;
+    return bits;
+}
+
+// The address of a symbol, which goes through the GOT if it may be defined
+// in another module.
+static struct x86_operand symbol_operand(struct codegen *g, struct scope *scope) {
+    bool is_global;
+    int symbol = scope_symbol(g->tu, scope, &is_global);
+    return (struct x86_operand){ .kind = X86_RIP, .symbol = symbol, .indirect = is_global };
+}
+
+bool names_symbol(struct tu *tu, struct scope *scope) {
+    return !is_stack_slot(scope) || TTYPE(scope->c_type)->layer == TYPE_FUNCTION;
+}
+
+static void generate_address(struct codegen *g, struct ir_instr *i) {
+    struct tu *tu = g->tu;
+    reg d = i->r[0];
+    enum machine_reg w = result_reg(g, d, RAX);
+    if (!i->r[1]) {
+        int name = g->function->constants.data[i->r[2]].name;
+        put(g, X86_LEA, 8, reg_operand(w), (struct x86_operand){ .kind = X86_RIP, .symbol = name });
+    } else {
+        struct scope *scope = g->function->regs.data[i->r[1]].scope;
+        if (!names_symbol(tu, scope)) {
+            put(g, X86_LEA, 8, reg_operand(w), mem_operand(RBP, scope->frame_offset));
+        } else {
+            struct x86_operand symbol = symbol_operand(g, scope);
+            put(g, symbol.indirect ? X86_MOV : X86_LEA, 8, reg_operand(w), symbol);
+        }
+    }
+    store_result(g, d, w, 8, false);
+}
+
+// A copy among several that happen at once, like the arguments of a call
+// going to their registers.
+struct parallel_move {
+    struct x86_operand to, from;
+    bool is_float;
+};
+
+typedef list(struct parallel_move) parallel_move_list_t;
+
+static bool reads(struct parallel_move *m, struct x86_operand *x) {
+    return same_operand(&m->from, x);
+}
+
+// Emit a set of copies whose destinations are registers or distinct stack
+// slots: each as soon as nothing else still reads its destination. A cycle
+// of integer registers is broken with xchg, which leaves R11 free for the
+// target of an indirect call, and one of floats through XMM15.
+static void parallel_move(struct codegen *g, parallel_move_list_t *moves) {
+    size_t n = 0;
+    for_each (moves) {
+        if (!same_operand(&it->to, &it->from)) moves->data[n++] = *it;
+    }
+    moves->len = n;
+
+    while (moves->len) {
+        bool progress = false;
+        for (size_t m = 0; m < moves->len;) {
+            struct parallel_move *move_m = &moves->data[m];
+            bool blocked = false;
+            for_each (moves) {
+                if (it != move_m && reads(it, &move_m->to)) blocked = true;
+            }
+            if (blocked) {
+                m++;
+                continue;
+            }
+            move(g, move_m->to, move_m->from, 8, move_m->is_float);
+            *move_m = moves->data[--moves->len];
+            progress = true;
+        }
+        if (progress) continue;
+
+        struct parallel_move *m = &moves->data[0];
+        struct x86_operand to = m->to, from = m->from;
+        if (!m->is_float) {
+            put(g, X86_XCHG, 8, to, from);
+            *m = moves->data[--moves->len];
+            for_each (moves) {
+                if (reads(it, &to)) it->from = from;
+                else if (reads(it, &from)) it->from = to;
+            }
+        } else {
+            struct x86_operand scratch = reg_operand(SCRATCH_FLOAT_REG);
+            put(g, X86_MOVAPS, 16, scratch, to);
+            for_each (moves) {
+                if (reads(it, &to)) it->from = scratch;
+            }
+        }
+    }
+}
+
+// Arguments go in the System V registers of their class in order, and the
+// rest on the stack, pushed last to first over padding that keeps the stack
+// 16 byte aligned at the call. al holds the number of vector registers used,
+// which variadic functions need.
+static void generate_call(struct codegen *g, struct ir_instr *i) {
+    struct tu *tu = g->tu;
+    struct function *function = g->function;
+    reg *args = &function->operands.data[i->r[2] + 1];
+    int n_args = (int)function->operands.data[i->r[2]];
+
+    parallel_move_list_t moves = {};
+    list(reg) stack = {};
+    int n_int = 0, n_float = 0;
+    for (int a = 0; a < n_args; a++) {
+        bool is_float = location(g, args[a])->is_float;
+        signed char r = param_register(is_float, is_float ? n_float++ : n_int++);
+        if (r == -1) {
+            list_push(&stack, args[a]);
+            continue;
+        }
+        list_push(&moves, ((struct parallel_move){ reg_operand(r), operand(g, args[a], 8), is_float }));
+    }
+
+    int stack_bytes = (int)stack.len * 8;
+    if (stack.len % 2) {
+        put(g, X86_SUB, 8, reg_operand(RSP), imm_operand(8));
+        stack_bytes += 8;
+    }
+    for (size_t s = stack.len; s-- > 0;) {
+        struct x86_operand x = operand(g, stack.data[s], 8);
+        if (location(g, stack.data[s])->is_float && x.kind == X86_REG) {
+            put(g, X86_SUB, 8, reg_operand(RSP), imm_operand(8));
+            put(g, X86_MOVS, 8, mem_operand(RSP, 0), x);
+            continue;
+        }
+        if (x.kind == X86_IMM && !fits_imm32(x.imm)) {
+            put(g, X86_MOV, 8, reg_operand(RAX), x);
+            x = reg_operand(RAX);
+        }
+        put1(g, X86_PUSH, 8, x);
+    }
+
+    struct scope *scope = function->regs.data[i->r[1]].scope;
+    struct x86_operand target;
+    if (scope && names_symbol(tu, scope)) {
+        target = symbol_operand(g, scope);
+        target.kind = X86_TARGET;
+    } else {
+        // the target is out of the way before the argument registers fill
+        move(g, reg_operand(SCRATCH_REG), operand(g, i->r[1], 8), 8, false);
+        target = reg_operand(SCRATCH_REG);
+    }
+    parallel_move(g, &moves);
+    move(g, reg_operand(RAX), imm_operand(n_float > 8 ? 8 : n_float), 4, false);
+    put1(g, X86_CALL, 8, target);
+    if (stack_bytes) put(g, X86_ADD, 8, reg_operand(RSP), imm_operand(stack_bytes));
+
+    reg d = i->r[0];
+    if (d && location(g, d)->kind != LOC_NONE) {
+        int size = i->is_float ? i->width : int_size(i->width);
+        move(g, operand(g, d, size), reg_operand(i->is_float ? XMM0 : RAX), size, i->is_float);
+    }
+    list_clear(&moves);
+    list_clear(&stack);
+}
+
+static void generate_return(struct codegen *g, struct ir_instr *i) {
+    reg r = i->r[0];
+    if (r && i->is_float) {
+        move(g, reg_operand(XMM0), operand(g, r, i->width), i->width, true);
+    } else if (r) {
+        // callers may rely on a narrow result being extended to 32 bits
+        extend(g, RAX, operand(g, r, i->width), i->width < 4 ? i->width : int_size(i->width),
+               int_size(i->width), i->is_signed);
+    }
+    for (int m = 0; m < N_MACHINE_REGS; m++) {
+        if (g->save_offset[m]) put(g, X86_MOV, 8, reg_operand(m), mem_operand(RBP, g->save_offset[m]));
+    }
+    put(g, X86_LEAVE, 0, (struct x86_operand){}, (struct x86_operand){});
+    put(g, X86_RET, 0, (struct x86_operand){}, (struct x86_operand){});
+}
+
+static void generate_op(struct codegen *g, struct ir_instr *i, int next) {
+    switch (i->op) {
+    case ADD: generate_binop(g, i, i->is_float ? X86_ADDS : X86_ADD, true); break;
+    case SUB: generate_binop(g, i, i->is_float ? X86_SUBS : X86_SUB, false); break;
+    case MUL: generate_binop(g, i, i->is_float ? X86_MULS : X86_IMUL, true); break;
+    case AND: generate_binop(g, i, X86_AND, true); break;
+    case OR: generate_binop(g, i, X86_OR, true); break;
+    case XOR: generate_binop(g, i, X86_XOR, true); break;
+    case DIV:
+    case MOD:
+        generate_division(g, i);
+        break;
+    case SHR:
+    case SHL:
+        generate_shift(g, i);
+        break;
+    case NEG:
+    case INV:
+        generate_negate(g, i);
+        break;
+    case NOT: generate_not(g, i); break;
+    case MOVE: {
+        int size = i->is_float ? i->width : int_size(i->width);
+        move(g, operand(g, i->r[0], size), operand(g, i->r[1], size), size, i->is_float);
+        break;
+    }
+    case IMM: generate_immediate(g, i); break;
+    case ST: generate_store(g, i, pointee(g, i->r[0])); break;
+    case LD: generate_load(g, i, pointee(g, i->r[1])); break;
+    case ADDR: generate_address(g, i); break;
+    case CALL: generate_call(g, i); break;
+    case RET: generate_return(g, i); break;
+    case TEST: generate_test(g, i); break;
+    case JZ: generate_branch(g, i, next); break;
+    case JMP:
+        if ((int)i->r[0] != next) jump(g, X86_JMP, 0, (int)i->r[0]);
+        break;
+    case EXT: generate_extend(g, i); break;
+    case ITOF: generate_int_to_float(g, i); break;
+    case FTOI: generate_float_to_int(g, i); break;
+    case FTOF: generate_float_to_float(g, i); break;
+    case PHI:
+        fprintf(stderr, "codegen: PHI left after register allocation\n");
+        break;
+    }
+}
+
+static void generate_instr(struct codegen *g, struct ir_instr *i, struct cover *cover, int next) {
+    // an instruction folded into the one that uses it is generated there
+    if (cover->emit == EMIT_NONE) return;
+    // a value nothing reads, or a constant that is materialized where it is
+    // used, needs no code unless a call produces it
+    reg d = ir_def(i);
+    if (d && is_allocated(g->function, d) && i->op != CALL) {
+        enum location_kind kind = location(g, d)->kind;
+        if (kind == LOC_NONE || kind == LOC_REMAT) return;
+    }
+
+    g->instr = i;
+    g->cover = cover;
+    switch (cover->emit) {
+    case EMIT_LEA: generate_lea(g, i, &cover->mode); break;
+    case EMIT_LOAD: generate_load(g, i, mode_operand(g, &cover->mode)); break;
+    case EMIT_STORE: generate_store(g, i, mode_operand(g, &cover->mode)); break;
+    case EMIT_BRANCH: generate_compare_branch(g, i, cover->compare, next); break;
+    default: generate_op(g, i, next); break;
+    }
+    g->cover = nullptr;
+}
+
+// The frame is the allocator's, below the saved frame pointer, with the
+// callee-saved registers it uses stored under it. The parameters then move
+// from where the caller passed them to where they were allocated, all at
+// once, since the two sets of registers can overlap.
+static void generate_prologue(struct codegen *g) {
+    struct tu *tu = g->tu;
+    struct function *function = g->function;
+    struct allocation *allocation = function->allocation;
+
+    int frame_size = allocation->frame_size;
+    for (int m = 0; m < N_MACHINE_REGS; m++) {
+        if (!(allocation->saved_regs & (1u << m))) continue;
+        frame_size += 8;
+        g->save_offset[m] = -frame_size;
+    }
+    frame_size = (frame_size + 15) & ~15;
+
+    put1(g, X86_PUSH, 8, reg_operand(RBP));
+    put(g, X86_MOV, 8, reg_operand(RBP), reg_operand(RSP));
+    if (frame_size) put(g, X86_SUB, 8, reg_operand(RSP), imm_operand(frame_size));
+    for (int m = 0; m < N_MACHINE_REGS; m++) {
+        if (g->save_offset[m]) put(g, X86_MOV, 8, mem_operand(RBP, g->save_offset[m]), reg_operand(m));
+    }
+
+    struct type *type = TTYPE(function->scope->c_type);
+    parallel_move_list_t moves = {};
+    int n_int = 0, n_float = 0, n_stack = 0;
+    for (size_t p = 0; p < function->params.len; p++) {
+        reg r = function->params.data[p];
+        struct location *l = location(g, r);
+        bool is_float = p < type->function.params.len ? type_is_floating(tu, type->function.params.data[p]) : l->is_float;
+        signed char from = param_register(is_float, is_float ? n_float++ : n_int++);
+        struct x86_operand source = from == -1 ? mem_operand(RBP, 16 + 8 * n_stack++) : reg_operand(from);
+        if (l->kind != LOC_REG && l->kind != LOC_STACK) continue;
+        list_push(&moves, ((struct parallel_move){ operand(g, r, 8), source, is_float }));
+    }
+    parallel_move(g, &moves);
+    list_clear(&moves);
+}
+
+void generate_function(struct tu *tu, struct function *function, struct x86_function *out) {
+    struct codegen g = { .tu = tu, .function = function, .out = out };
+    out->symbol = scope_symbol(tu, function->scope, &out->is_global);
+    out->n_labels = (int)function->blocks.len;
+
+    select_instructions(tu, function, &g.selection);
+    generate_prologue(&g);
+    size_t n_blocks = function->blocks.len;
+    for (size_t b = 0; b < n_blocks; b++) {
+        g.block = (int)b;
+        place_label(&g, (int)b);
+        struct cover *covers = &g.selection.covers[g.selection.block_start[b]];
+        for_each (&function->blocks.data[b].instrs) {
+            generate_instr(&g, it, &covers[it - function->blocks.data[b].instrs.data], (int)b + 1);
+        }
+    }
+    free_selection(&g.selection);
+    peephole(tu, function, out);
+    if (tu->opt_level >= 2) schedule_machine_code(tu, function, out);
+}
+
+void free_x86_function(struct x86_function *function) {
+    list_clear(&function->instrs);
+    list_clear(&function->constants);
+}
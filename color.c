@@ -0,0 +1,615 @@
+#include "regalloc.h"
+#include "ir.h"
+#include "ssa.h"
+#include "tu.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Iterated register coalescing, after George and Appel, "Iterated Register
+// Coalescing".
+//
+// Every register of the function is a node of the interference graph, and so
+// is every machine register the allocators hand out, precolored. Two nodes
+// interfere if one is defined where the other is live, except for the two
+// sides of a MOVE, and a value live across a call interferes with the
+// caller-saved registers. The two sides of a MOVE, and a parameter and the
+// register it arrives in, are candidates to be coalesced into one node.
+//
+// A node with fewer neighbors than there are registers of its class can
+// always be colored, so it is simplified: taken out of the graph and pushed
+// on a stack. Coalescing is conservative, done only where the merged node
+// has fewer neighbors of high degree than there are registers (Briggs), or,
+// with a precolored node, where every neighbor of the other already
+// interferes with it or has low degree (George). A node with a MOVE isn't
+// simplified until its moves are coalesced, or frozen: given up on. When
+// only nodes of high degree are left, the cheapest to spill, by uses weighted
+// by loop depth over degree, is pushed anyway, in the hope that its neighbors
+// share colors. Popping the stack gives each node a color none of its
+// neighbors has, one of its MOVEs' other sides' if it can, or a stack slot.
+//
+// Instructions can read and write stack slots, so a spilled node needs no
+// new registers and one round is enough.
+
+enum node_state : char {
+    PRECOLORED,
+    // not in the function, or not seen yet
+    ABSENT,
+    // seen, before the worklists are made
+    INITIAL,
+    SIMPLIFY,
+    FREEZE,
+    SPILL,
+    SELECTED,
+    COALESCED,
+    COLORED,
+    SPILLED,
+};
+
+enum copy_state : char {
+    COPY_WORKLIST,
+    COPY_ACTIVE,
+    COPY_COALESCED,
+    COPY_CONSTRAINED,
+    COPY_FROZEN,
+};
+
+struct graph_node {
+    enum node_state state;
+    bool is_float;
+    // neighbors left in the graph, or a lot for a precolored node
+    int degree;
+    // the node this one was coalesced into
+    int alias;
+    signed char color;
+    // uses and definitions, each 10 to its loop depth
+    float cost;
+    // the neighbors, except of a precolored node
+    block_list_t adjacent;
+    // the copies the node is on either side of
+    block_list_t copies;
+};
+
+struct copy {
+    int x;
+    int y;
+    enum copy_state state;
+};
+
+struct colorer {
+    struct function *function;
+    struct graph_node *nodes;
+    size_t n_nodes;
+    // a bit for every pair of nodes that interfere
+    uint64_t *matrix;
+    list(struct copy) copies;
+
+    // worklists of nodes, which may hold nodes that have since moved on to
+    // another state, and of copies
+    block_list_t simplify;
+    block_list_t freeze;
+    block_list_t spill;
+    block_list_t select;
+    block_list_t moves;
+
+    // for counting each node once
+    int *mark;
+    int generation;
+};
+
+#define NODE(r) (N_MACHINE_REGS + (int)(r))
+#define N(n) (&c->nodes[n])
+
+static int n_colors(struct graph_node *node) {
+    int n;
+    allocatable_regs(node->is_float, &n);
+    return n;
+}
+
+static size_t pair_bit(int u, int v) {
+    if (u < v) {
+        int t = u;
+        u = v;
+        v = t;
+    }
+    return (size_t)u * (size_t)(u - 1) / 2 + (size_t)v;
+}
+
+static bool interferes(struct colorer *c, int u, int v) {
+    size_t bit = pair_bit(u, v);
+    return c->matrix[bit / 64] >> (bit % 64) & 1;
+}
+
+static void add_edge(struct colorer *c, int u, int v) {
+    if (u == v || interferes(c, u, v)) return;
+    size_t bit = pair_bit(u, v);
+    c->matrix[bit / 64] |= (uint64_t)1 << (bit % 64);
+    if (N(u)->state != PRECOLORED) {
+        list_push(&N(u)->adjacent, v);
+        N(u)->degree += 1;
+    }
+    if (N(v)->state != PRECOLORED) {
+        list_push(&N(v)->adjacent, u);
+        N(v)->degree += 1;
+    }
+}
+
+static void add_copy(struct colorer *c, int x, int y) {
+    list_push(&c->copies, ((struct copy){ x, y, COPY_WORKLIST }));
+    int m = (int)c->copies.len - 1;
+    list_push(&N(x)->copies, m);
+    list_push(&N(y)->copies, m);
+    list_push(&c->moves, m);
+}
+
+static void see(struct colorer *c, reg r, bool *is_float) {
+    struct graph_node *node = N(NODE(r));
+    if (node->state != ABSENT) return;
+    node->state = INITIAL;
+    node->is_float = is_float[r];
+}
+
+// A set of registers that can be cleared in constant time.
+struct live_set {
+    reg *dense;
+    int *sparse;
+    size_t len;
+};
+
+static bool live_has(struct live_set *live, reg r) {
+    size_t i = (size_t)live->sparse[r];
+    return i < live->len && live->dense[i] == r;
+}
+
+static void live_add(struct live_set *live, reg r) {
+    if (live_has(live, r)) return;
+    live->sparse[r] = (int)live->len;
+    live->dense[live->len++] = r;
+}
+
+static void live_remove(struct live_set *live, reg r) {
+    if (!live_has(live, r)) return;
+    reg last = live->dense[--live->len];
+    live->dense[live->sparse[r]] = last;
+    live->sparse[last] = live->sparse[r];
+}
+
+// Walk each block backwards from what is live out of it, adding an edge from
+// every definition to everything live across it.
+static void build(struct colorer *c, bool *is_float, bool *can_remat, float *frequency) {
+    struct function *function = c->function;
+    size_t n_regs = function->regs.len;
+    size_t n_blocks = function->blocks.len;
+    reg_list_t *live_in = calloc(n_blocks, sizeof(reg_list_t));
+    reg_list_t *live_out = calloc(n_blocks, sizeof(reg_list_t));
+    compute_liveness(function, live_in, live_out);
+
+    struct live_set live = { .dense = malloc(n_regs * sizeof(reg)), .sparse = calloc(n_regs, sizeof(int)) };
+    for (size_t b = 0; b < n_blocks; b++) {
+        live.len = 0;
+        for_each (&live_out[b]) {
+            see(c, *it, is_float);
+            live_add(&live, *it);
+        }
+        ir_list_t *instrs = &function->blocks.data[b].instrs;
+        for (size_t n = instrs->len; n-- > 0;) {
+            struct ir_instr *instr = &instrs->data[n];
+            reg d = ir_def(instr);
+            if (!is_allocated(function, d)) d = 0;
+
+            if (instr->op == MOVE && d && is_allocated(function, instr->r[1]) && is_float[d] == is_float[instr->r[1]]) {
+                see(c, instr->r[1], is_float);
+                live_remove(&live, instr->r[1]);
+                if (d != instr->r[1]) add_copy(c, NODE(d), NODE(instr->r[1]));
+            }
+            if (instr->op == CALL) {
+                for (size_t l = 0; l < live.len; l++) {
+                    reg r = live.dense[l];
+                    if (r == d) continue;
+                    int n_class;
+                    const enum machine_reg *regs = allocatable_regs(is_float[r], &n_class);
+                    for (int i = 0; i < n_class; i++) {
+                        if (is_caller_saved(regs[i])) add_edge(c, NODE(r), regs[i]);
+                    }
+                }
+            }
+            if (d) {
+                see(c, d, is_float);
+                N(NODE(d))->cost += frequency[b];
+                for (size_t l = 0; l < live.len; l++) {
+                    if (is_float[live.dense[l]] == is_float[d]) add_edge(c, NODE(live.dense[l]), NODE(d));
+                }
+                live_remove(&live, d);
+            }
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                reg r = *ir_use(function, instr, u);
+                if (!is_allocated(function, r)) continue;
+                see(c, r, is_float);
+                N(NODE(r))->cost += frequency[b];
+                live_add(&live, r);
+            }
+        }
+
+        // the parameters are all defined on the way in
+        if (b != 0) continue;
+        for (size_t x = 0; x < live.len; x++) {
+            for (size_t y = 0; y < x; y++) {
+                if (is_float[live.dense[x]] == is_float[live.dense[y]]) add_edge(c, NODE(live.dense[x]), NODE(live.dense[y]));
+            }
+        }
+    }
+
+    // and arrive in the registers the ABI passes them in
+    int n_ints = 0, n_floats = 0;
+    for_each (&function->params) {
+        bool f = is_float[*it];
+        signed char arrives = param_register(f, f ? n_floats++ : n_ints++);
+        if (arrives == -1 || N(NODE(*it))->state == ABSENT || N(arrives)->state != PRECOLORED) continue;
+        add_copy(c, NODE(*it), arrives);
+    }
+
+    for (reg r = 1; r < n_regs; r++) {
+        if (can_remat[r]) N(NODE(r))->cost /= 2;
+    }
+
+    for (size_t b = 0; b < n_blocks; b++) {
+        list_clear(&live_in[b]);
+        list_clear(&live_out[b]);
+    }
+    free(live_in);
+    free(live_out);
+    free(live.dense);
+    free(live.sparse);
+}
+
+static bool is_move_related(struct colorer *c, int n) {
+    for_each (&N(n)->copies) {
+        enum copy_state state = c->copies.data[*it].state;
+        if (state == COPY_WORKLIST || state == COPY_ACTIVE) return true;
+    }
+    return false;
+}
+
+static void push_node(struct colorer *c, int n, enum node_state state) {
+    N(n)->state = state;
+    if (state == SIMPLIFY) list_push(&c->simplify, n);
+    else if (state == FREEZE) list_push(&c->freeze, n);
+    else if (state == SPILL) list_push(&c->spill, n);
+    else if (state == SELECTED) list_push(&c->select, n);
+}
+
+// Take the next node off a worklist that is still in its state, or -1.
+static int pop_node(struct colorer *c, block_list_t *list, enum node_state state) {
+    while (list->len) {
+        int n = list->data[--list->len];
+        if (N(n)->state == state) return n;
+    }
+    return -1;
+}
+
+static void make_worklists(struct colorer *c) {
+    for (int n = N_MACHINE_REGS; n < (int)c->n_nodes; n++) {
+        if (N(n)->state == ABSENT) continue;
+        if (N(n)->degree >= n_colors(N(n))) push_node(c, n, SPILL);
+        else if (is_move_related(c, n)) push_node(c, n, FREEZE);
+        else push_node(c, n, SIMPLIFY);
+    }
+}
+
+// Whether a neighbor is still in the graph.
+static bool in_graph(struct colorer *c, int n) {
+    return N(n)->state != SELECTED && N(n)->state != COALESCED;
+}
+
+static void enable_moves(struct colorer *c, int n) {
+    for_each (&N(n)->copies) {
+        struct copy *copy = &c->copies.data[*it];
+        if (copy->state != COPY_ACTIVE) continue;
+        copy->state = COPY_WORKLIST;
+        list_push(&c->moves, *it);
+    }
+}
+
+// A node that drops below as many neighbors as there are registers can be
+// colored, and so can its neighbors' moves be coalesced again.
+static void decrement_degree(struct colorer *c, int m) {
+    if (N(m)->state == PRECOLORED) return;
+    int degree = N(m)->degree--;
+    if (degree != n_colors(N(m))) return;
+    enable_moves(c, m);
+    for_each (&N(m)->adjacent) {
+        if (in_graph(c, *it)) enable_moves(c, *it);
+    }
+    if (N(m)->state != SPILL) return;
+    push_node(c, m, is_move_related(c, m) ? FREEZE : SIMPLIFY);
+}
+
+static bool simplify(struct colorer *c) {
+    int n = pop_node(c, &c->simplify, SIMPLIFY);
+    if (n == -1) return false;
+    push_node(c, n, SELECTED);
+    for_each (&N(n)->adjacent) {
+        if (in_graph(c, *it)) decrement_degree(c, *it);
+    }
+    return true;
+}
+
+static int get_alias(struct colorer *c, int n) {
+    while (N(n)->state == COALESCED) n = N(n)->alias;
+    return n;
+}
+
+static void add_work_list(struct colorer *c, int u) {
+    if (N(u)->state != FREEZE || is_move_related(c, u) || N(u)->degree >= n_colors(N(u))) return;
+    push_node(c, u, SIMPLIFY);
+}
+
+// George: merging v into the precolored u adds no neighbor of high degree
+// that u didn't already have.
+static bool george(struct colorer *c, int u, int v) {
+    for_each (&N(v)->adjacent) {
+        struct graph_node *t = N(*it);
+        if (!in_graph(c, *it)) continue;
+        if (t->degree >= n_colors(t) && t->state != PRECOLORED && !interferes(c, *it, u)) return false;
+    }
+    return true;
+}
+
+// Briggs: the merged node has fewer neighbors of high degree than there are
+// registers, so it can still be simplified once they are.
+static bool briggs(struct colorer *c, int u, int v) {
+    c->generation += 1;
+    int k = n_colors(N(u)), high = 0;
+    int both[] = { u, v };
+    for (int i = 0; i < 2; i++) {
+        for_each (&N(both[i])->adjacent) {
+            if (!in_graph(c, *it) || c->mark[*it] == c->generation) continue;
+            c->mark[*it] = c->generation;
+            if (N(*it)->degree >= n_colors(N(*it))) high += 1;
+        }
+    }
+    return high < k;
+}
+
+static void combine(struct colorer *c, int u, int v) {
+    N(v)->state = COALESCED;
+    N(v)->alias = u;
+    N(u)->cost += N(v)->cost;
+    for_each (&N(v)->copies) list_push(&N(u)->copies, *it);
+    enable_moves(c, v);
+    for_each (&N(v)->adjacent) {
+        if (!in_graph(c, *it)) continue;
+        add_edge(c, *it, u);
+        decrement_degree(c, *it);
+    }
+    if (N(u)->degree >= n_colors(N(u)) && N(u)->state == FREEZE) push_node(c, u, SPILL);
+}
+
+static bool coalesce(struct colorer *c) {
+    struct copy *copy = nullptr;
+    while (c->moves.len) {
+        copy = &c->copies.data[c->moves.data[--c->moves.len]];
+        if (copy->state == COPY_WORKLIST) break;
+        copy = nullptr;
+    }
+    if (!copy) return false;
+
+    int u = get_alias(c, copy->x), v = get_alias(c, copy->y);
+    if (N(v)->state == PRECOLORED) {
+        int t = u;
+        u = v;
+        v = t;
+    }
+    if (u == v) {
+        copy->state = COPY_COALESCED;
+        add_work_list(c, u);
+    } else if (N(v)->state == PRECOLORED || interferes(c, u, v)) {
+        copy->state = COPY_CONSTRAINED;
+        add_work_list(c, u);
+        add_work_list(c, v);
+    } else if (N(u)->state == PRECOLORED ? george(c, u, v) : briggs(c, u, v)) {
+        copy->state = COPY_COALESCED;
+        combine(c, u, v);
+        add_work_list(c, u);
+    } else {
+        copy->state = COPY_ACTIVE;
+    }
+    return true;
+}
+
+static void freeze_moves(struct colorer *c, int u) {
+    for_each (&N(u)->copies) {
+        struct copy *copy = &c->copies.data[*it];
+        if (copy->state != COPY_WORKLIST && copy->state != COPY_ACTIVE) continue;
+        int x = get_alias(c, copy->x), y = get_alias(c, copy->y);
+        int v = y == get_alias(c, u) ? x : y;
+        copy->state = COPY_FROZEN;
+        if (N(v)->state == FREEZE && !is_move_related(c, v) && N(v)->degree < n_colors(N(v))) {
+            push_node(c, v, SIMPLIFY);
+        }
+    }
+}
+
+static bool freeze(struct colorer *c) {
+    int u = pop_node(c, &c->freeze, FREEZE);
+    if (u == -1) return false;
+    push_node(c, u, SIMPLIFY);
+    freeze_moves(c, u);
+    return true;
+}
+
+static bool select_spill(struct colorer *c) {
+    int best = -1;
+    size_t kept = 0;
+    c->generation += 1;
+    for_each (&c->spill) {
+        if (N(*it)->state != SPILL || c->mark[*it] == c->generation) continue;
+        c->mark[*it] = c->generation;
+        c->spill.data[kept++] = *it;
+        if (best == -1 || N(*it)->cost * (float)N(best)->degree < N(best)->cost * (float)N(*it)->degree) best = *it;
+    }
+    c->spill.len = kept;
+    if (best == -1) return false;
+    push_node(c, best, SIMPLIFY);
+    freeze_moves(c, best);
+    return true;
+}
+
+static void assign_colors(struct colorer *c) {
+    while (c->select.len) {
+        int n = c->select.data[--c->select.len];
+        uint32_t taken = 0;
+        for_each (&N(n)->adjacent) {
+            struct graph_node *w = N(get_alias(c, *it));
+            if (w->state == COLORED || w->state == PRECOLORED) taken |= 1u << w->color;
+        }
+
+        int n_regs;
+        const enum machine_reg *regs = allocatable_regs(N(n)->is_float, &n_regs);
+        int color = -1;
+        // the other side of a MOVE that couldn't be coalesced, if it can
+        for_each (&N(n)->copies) {
+            struct copy *copy = &c->copies.data[*it];
+            struct graph_node *other = N(get_alias(c, get_alias(c, copy->x) == n ? copy->y : copy->x));
+            if ((other->state == COLORED || other->state == PRECOLORED) && !(taken >> other->color & 1)) {
+                color = other->color;
+                break;
+            }
+        }
+        for (int i = 0; i < n_regs && color == -1; i++) {
+            if (!(taken >> regs[i] & 1)) color = regs[i];
+        }
+
+        N(n)->state = color == -1 ? SPILLED : COLORED;
+        N(n)->color = (signed char)color;
+    }
+}
+
+// Give each register the location of the node it was coalesced into, and
+// rewrite the function without the MOVEs that coalescing made copies to the
+// same place.
+static void rewrite(struct colorer *c, struct tu *tu, bool *can_remat, struct ir_instr *remat) {
+    struct function *function = c->function;
+    struct allocation *result = function->allocation;
+    size_t n_regs = function->regs.len;
+
+    int *members = calloc(c->n_nodes, sizeof(int));
+    int *slot = calloc(c->n_nodes, sizeof(int));
+    for (reg r = 1; r < n_regs; r++) {
+        if (N(NODE(r))->state != ABSENT) members[get_alias(c, NODE(r))] += 1;
+    }
+    int frame_size = layout_frame(tu, function);
+    for (reg r = 0; r < n_regs; r++) {
+        struct location location = {};
+        int n = get_alias(c, NODE(r));
+        if (r && N(NODE(r))->state != ABSENT) {
+            location.is_float = N(NODE(r))->is_float;
+            if (N(n)->state != SPILLED) {
+                location.kind = LOC_REG;
+                location.reg = N(n)->color;
+                if (!is_caller_saved(location.reg)) result->saved_regs |= 1u << location.reg;
+            } else if (can_remat[r] && members[n] == 1) {
+                location.kind = LOC_REMAT;
+                location.constant = (int)remat[r].r[1];
+                location.width = remat[r].width;
+                result->rematerialized += 1;
+            } else {
+                if (!slot[n]) {
+                    frame_size += 8;
+                    slot[n] = -frame_size;
+                }
+                location.kind = LOC_STACK;
+                location.offset = slot[n];
+                result->spilled += 1;
+            }
+        }
+        list_push(&result->locations, location);
+    }
+    result->frame_size = (frame_size + 15) & ~15;
+    free(members);
+    free(slot);
+
+#define LOC(r) (&result->locations.data[r])
+    for_each_n (block, &function->blocks) {
+        size_t kept = 0;
+        for_each_n (instr, &block->instrs) {
+            reg d = ir_def(instr);
+            if (instr->op == IMM && is_allocated(function, d) && LOC(d)->kind == LOC_REMAT) continue;
+            if (instr->op == MOVE && is_allocated(function, d) && same_location(LOC(d), LOC(instr->r[1]))) {
+                result->coalesced += 1;
+                continue;
+            }
+            struct ir_instr copy = *instr;
+            if (copy.op == MOVE && LOC(copy.r[1])->kind == LOC_REMAT) {
+                copy = remat[instr->r[1]];
+                copy.r[0] = d;
+            }
+            block->instrs.data[kept++] = copy;
+        }
+        block->instrs.len = kept;
+    }
+#undef LOC
+}
+
+void color_registers(struct tu *tu, struct function *function) {
+    leave_ssa(function);
+    remove_unreachable_blocks(function);
+
+    size_t n_regs = function->regs.len;
+    bool *is_float = calloc(n_regs, sizeof(bool));
+    bool *can_remat = calloc(n_regs, sizeof(bool));
+    struct ir_instr *remat = calloc(n_regs, sizeof(struct ir_instr));
+    int *defs = calloc(n_regs, sizeof(int));
+    classify_registers(function, is_float, can_remat, remat, defs);
+    float *frequency = block_frequencies(function);
+
+    struct colorer c = { .function = function, .n_nodes = NODE(n_regs) };
+    c.nodes = calloc(c.n_nodes, sizeof(struct graph_node));
+    c.matrix = calloc(pair_bit((int)c.n_nodes, 0) / 64 + 1, sizeof(uint64_t));
+    c.mark = calloc(c.n_nodes, sizeof(int));
+    for (int n = 0; n < (int)c.n_nodes; n++) {
+        c.nodes[n] = (struct graph_node){ .state = ABSENT, .alias = n, .color = -1 };
+    }
+    for (int f = 0; f < 2; f++) {
+        int n;
+        const enum machine_reg *regs = allocatable_regs(f, &n);
+        for (int i = 0; i < n; i++) {
+            c.nodes[regs[i]] = (struct graph_node){
+                .state = PRECOLORED,
+                .is_float = f,
+                .degree = 1 << 30,
+                .alias = regs[i],
+                .color = (signed char)regs[i],
+            };
+        }
+    }
+
+    build(&c, is_float, can_remat, frequency);
+    make_worklists(&c);
+    while (simplify(&c) || coalesce(&c) || freeze(&c) || select_spill(&c)) {}
+    assign_colors(&c);
+
+    function->allocation = calloc(1, sizeof(struct allocation));
+    rewrite(&c, tu, can_remat, remat);
+    print_allocation(tu, function, "coloring");
+
+    for (size_t n = 0; n < c.n_nodes; n++) {
+        list_clear(&c.nodes[n].adjacent);
+        list_clear(&c.nodes[n].copies);
+    }
+    free(c.nodes);
+    free(c.matrix);
+    free(c.mark);
+    list_clear(&c.copies);
+    list_clear(&c.simplify);
+    list_clear(&c.freeze);
+    list_clear(&c.spill);
+    list_clear(&c.select);
+    list_clear(&c.moves);
+    free(is_float);
+    free(can_remat);
+    free(remat);
+    free(defs);
+    free(frequency);
+}
@@ -0,0 +1,270 @@
+#include "opt.h"
+#include "ir.h"
+#include "type.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Whether an instruction does something besides computing its result, so it
+// has to stay even if nothing reads the result.
+static bool has_side_effects(struct ir_instr *i) {
+    switch (i->op) {
+    case ST:
+    case CALL:
+    case RET:
+    case JZ:
+    case JMP:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Drop the instructions of a block that keep says to drop, counting them.
+static int sweep(struct ir_block *block, bool *keep) {
+    size_t kept = 0;
+    for (size_t n = 0; n < block->instrs.len; n++) {
+        if (keep[n]) block->instrs.data[kept++] = block->instrs.data[n];
+    }
+    int removed = (int)(block->instrs.len - kept);
+    block->instrs.len = kept;
+    return removed;
+}
+
+// Mark and sweep over values: everything with a side effect is live, as is
+// the definition of every register a live instruction reads. The rest only
+// computes values nobody reads. Registers can have more than one definition
+// outside of SSA, so a live register keeps all of them.
+struct pass_stats dce(struct tu *tu, struct function *function) {
+    struct pass_stats stats = {};
+    size_t n_regs = function->regs.len;
+    size_t n_blocks = function->blocks.len;
+
+    // the instructions defining each register, as block and index pairs
+    int *def_start = calloc(n_regs + 2, sizeof(int));
+    for_each_n (block, &function->blocks) {
+        for_each_n (instr, &block->instrs) def_start[ir_def(instr) + 2] += 1;
+    }
+    for (size_t r = 1; r <= n_regs + 1; r++) def_start[r] += def_start[r - 1];
+    struct { int block; int index; } *defs = malloc((def_start[n_regs + 1] + 1) * sizeof(*defs));
+
+    bool **live = malloc(n_blocks * sizeof(bool *));
+    bool *live_reg = calloc(n_regs, sizeof(bool));
+    reg_list_t work = {};
+
+    for (int b = 0; b < (int)n_blocks; b++) {
+        struct ir_block *block = &function->blocks.data[b];
+        live[b] = calloc(block->instrs.len + 1, sizeof(bool));
+        for (int n = 0; n < (int)block->instrs.len; n++) {
+            struct ir_instr *instr = &block->instrs.data[n];
+            int slot = def_start[ir_def(instr) + 1]++;
+            defs[slot].block = b;
+            defs[slot].index = n;
+
+            if (!has_side_effects(instr)) continue;
+            live[b][n] = true;
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                reg r = *ir_use(function, instr, u);
+                if (r && !live_reg[r]) {
+                    live_reg[r] = true;
+                    list_push(&work, r);
+                }
+            }
+        }
+    }
+
+    while (work.len) {
+        reg r = work.data[--work.len];
+        for (int d = def_start[r]; d < def_start[r + 1]; d++) {
+            struct ir_instr *instr = &function->blocks.data[defs[d].block].instrs.data[defs[d].index];
+            if (live[defs[d].block][defs[d].index]) continue;
+            live[defs[d].block][defs[d].index] = true;
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                reg used = *ir_use(function, instr, u);
+                if (used && !live_reg[used]) {
+                    live_reg[used] = true;
+                    list_push(&work, used);
+                }
+            }
+        }
+    }
+
+    for (size_t b = 0; b < n_blocks; b++) {
+        stats.instrs_removed += sweep(&function->blocks.data[b], live[b]);
+        free(live[b]);
+    }
+
+    list_clear(&work);
+    free(live);
+    free(live_reg);
+    free(def_start);
+    free(defs);
+    return stats;
+}
+
+bool is_stack_slot(struct scope *scope) {
+    return scope && !scope->is_global && scope->sc != ST_STATIC && scope->sc != ST_THREAD_LOCAL &&
+           scope->sc != ST_EXTERNAL && scope->sc != ST_CONSTEXPR;
+}
+
+struct slot {
+    // the width of every access, or -1 once accesses of different widths are
+    // seen, when a store might not overwrite the whole object
+    int width;
+    bool escapes;
+};
+
+// Remove stores to stack slots that nothing can read afterwards. Only slots
+// whose address is used for nothing but loading and storing are considered:
+// then no call can see them and no pointer arithmetic can reach them, so a
+// backward liveness analysis over the loads and stores of each slot is exact.
+// A store is dead where its slot isn't live.
+struct pass_stats dse(struct tu *tu, struct function *function) {
+    struct pass_stats stats = {};
+    size_t n_regs = function->regs.len;
+    size_t n_blocks = function->blocks.len;
+
+    // the slot each address register points to, plus one
+    int *slot_of = calloc(n_regs, sizeof(int));
+    list(struct slot) slots = {};
+    int *slot_of_scope = calloc(n_regs, sizeof(int));
+    for_each_n (block, &function->blocks) {
+        for_each_n (instr, &block->instrs) {
+            if (instr->op != ADDR || !instr->r[1]) continue;
+            reg name = instr->r[1];
+            if (!is_stack_slot(function->regs.data[name].scope)) continue;
+            if (!slot_of_scope[name]) {
+                list_push(&slots, (struct slot){});
+                slot_of_scope[name] = (int)slots.len;
+            }
+            slot_of[instr->r[0]] = slot_of_scope[name];
+        }
+    }
+    free(slot_of_scope);
+    if (!slots.len) {
+        free(slot_of);
+        return stats;
+    }
+
+    // copies of an address point to the same slot
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for_each_n (block, &function->blocks) {
+            for_each_n (instr, &block->instrs) {
+                if (instr->op != MOVE && instr->op != PHI) continue;
+                for (int u = 0; u < ir_use_count(function, instr); u++) {
+                    int s = slot_of[*ir_use(function, instr, u)];
+                    if (!s) continue;
+                    int *d = &slot_of[instr->r[0]];
+                    if (!*d) {
+                        *d = s;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    for_each_n (block, &function->blocks) {
+        for_each_n (instr, &block->instrs) {
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                reg *use = ir_use(function, instr, u);
+                int s = slot_of[*use];
+                if (!s) continue;
+                bool address = (instr->op == LD && u == 0) || (instr->op == ST && use == &instr->r[0]);
+                if (address) {
+                    struct slot *slot = &slots.data[s - 1];
+                    if (!slot->width) slot->width = instr->width;
+                    else if (slot->width != instr->width) slot->width = -1;
+                } else if (instr->op != MOVE && instr->op != PHI) {
+                    slots.data[s - 1].escapes = true;
+                }
+            }
+
+            // a copy that merges a slot's address with any other pointer
+            // could store somewhere else
+            if (instr->op != MOVE && instr->op != PHI) continue;
+            int d = slot_of[instr->r[0]];
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                int s = slot_of[*ir_use(function, instr, u)];
+                if (s == d) continue;
+                if (d) slots.data[d - 1].escapes = true;
+                if (s) slots.data[s - 1].escapes = true;
+            }
+        }
+    }
+
+    // live_in and live_out of every block, as bitsets over the slots
+    size_t words = (slots.len + 63) / 64;
+    uint64_t *live_in = calloc(n_blocks * words, sizeof(uint64_t));
+    uint64_t *live_out = calloc(n_blocks * words, sizeof(uint64_t));
+    uint64_t *live = malloc(words * sizeof(uint64_t));
+
+#define SLOT(i) (slot_of[(i)->op == LD ? (i)->r[1] : (i)->r[0]])
+#define TRACKED(s) ((s) && !slots.data[(s) - 1].escapes)
+#define KILLS(i, s) ((i)->op == ST && slots.data[(s) - 1].width > 0)
+#define SET(bits, s) ((bits)[((s) - 1) / 64] |= 1ull << (((s) - 1) % 64))
+#define CLEAR(bits, s) ((bits)[((s) - 1) / 64] &= ~(1ull << (((s) - 1) % 64)))
+#define TEST(bits, s) (((bits)[((s) - 1) / 64] >> (((s) - 1) % 64)) & 1)
+
+    changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t b = n_blocks; b-- > 0;) {
+            struct ir_block *block = &function->blocks.data[b];
+            memset(live, 0, words * sizeof(uint64_t));
+            for (int s = 0; s < block->n_succs; s++) {
+                for (size_t w = 0; w < words; w++) live[w] |= live_in[block->succs[s] * words + w];
+            }
+            memcpy(&live_out[b * words], live, words * sizeof(uint64_t));
+            for (size_t n = block->instrs.len; n-- > 0;) {
+                struct ir_instr *instr = &block->instrs.data[n];
+                if (instr->op != LD && instr->op != ST) continue;
+                int s = SLOT(instr);
+                if (!TRACKED(s)) continue;
+                if (instr->op == LD) SET(live, s);
+                else if (KILLS(instr, s)) CLEAR(live, s);
+            }
+            if (memcmp(&live_in[b * words], live, words * sizeof(uint64_t))) {
+                memcpy(&live_in[b * words], live, words * sizeof(uint64_t));
+                changed = true;
+            }
+        }
+    }
+
+    for (size_t b = 0; b < n_blocks; b++) {
+        struct ir_block *block = &function->blocks.data[b];
+        bool *keep = malloc((block->instrs.len + 1) * sizeof(bool));
+        memcpy(live, &live_out[b * words], words * sizeof(uint64_t));
+        for (size_t n = block->instrs.len; n-- > 0;) {
+            struct ir_instr *instr = &block->instrs.data[n];
+            keep[n] = true;
+            if (instr->op != LD && instr->op != ST) continue;
+            int s = SLOT(instr);
+            if (!TRACKED(s)) continue;
+            if (instr->op == LD) {
+                SET(live, s);
+            } else {
+                keep[n] = TEST(live, s);
+                if (KILLS(instr, s)) CLEAR(live, s);
+            }
+        }
+        stats.instrs_removed += sweep(block, keep);
+        free(keep);
+    }
+
+#undef SLOT
+#undef TRACKED
+#undef KILLS
+#undef SET
+#undef CLEAR
+#undef TEST
+
+    list_clear(&slots);
+    free(slot_of);
+    free(live_in);
+    free(live_out);
+    free(live);
+    return stats;
+}
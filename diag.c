@@ -73,9 +73,11 @@ void print_error(struct tu *tu, const char *format, ...) {
     va_list args;
     va_start(args, format);
 
+    flockfile(stderr);
     fprintf(stderr, RED "error" RESET ": ");
     vfprintf(stderr, format, args);
     fprintf(stderr, "\n");
+    funlockfile(stderr);
 
     va_end(args);
 
@@ -86,9 +88,11 @@ void print_internal_error(struct tu *tu, const char *format, ...) {
     va_list args;
     va_start(args, format);
 
+    flockfile(stderr);
     fprintf(stderr, RED "internal error" RESET ": ");
     vfprintf(stderr, format, args);
     fprintf(stderr, "\n");
+    funlockfile(stderr);
 
     va_end(args);
 
@@ -99,10 +103,12 @@ void print_error_node(struct tu *tu, struct node *node, const char *format, ...)
     va_list args;
     va_start(args, format);
 
+    flockfile(stderr);
     fprintf(stderr, RED "error" RESET ": ");
     vfprintf(stderr, format, args);
     fprintf(stderr, "\n");
     print_and_highlight_extent(tu, node_begin(node), node_end(node));
+    funlockfile(stderr);
 
     va_end(args);
 
@@ -113,10 +119,12 @@ void print_info_node(struct tu *tu, struct node *node, const char *format, ...)
     va_list args;
     va_start(args, format);
 
+    flockfile(stderr);
     fprintf(stderr, BLUE "info" RESET ": ");
     vfprintf(stderr, format, args);
     fprintf(stderr, "\n");
     print_and_highlight_extent(tu, node_begin(node), node_end(node));
+    funlockfile(stderr);
 
     va_end(args);
 }
@@ -125,10 +133,12 @@ void print_error_token(struct tu *tu, struct token *token, const char *format, .
     va_list args;
     va_start(args, format);
 
+    flockfile(stderr);
     fprintf(stderr, RED "error" RESET ": ");
     vfprintf(stderr, format, args);
     fprintf(stderr, "\n");
     print_and_highlight(tu->source, token);
+    funlockfile(stderr);
 
     va_end(args);
 
@@ -139,36 +149,44 @@ void print_info_token(struct tu *tu, struct token *token, const char *format, ..
     va_list args;
     va_start(args, format);
 
+    flockfile(stderr);
     fprintf(stderr, BLUE "info" RESET ": ");
     vfprintf(stderr, format, args);
     fprintf(stderr, "\n");
     print_and_highlight(tu->source, token);
+    funlockfile(stderr);
 
     va_end(args);
 }
 
 void vprint_error(struct tu *tu, const char *format, va_list args) {
+    flockfile(stderr);
     fprintf(stderr, RED "error" RESET ": ");
     vfprintf(stderr, format, args);
     fprintf(stderr, "\n");
+    funlockfile(stderr);
 
     handle_error(tu);
 }
 
 void vprint_error_node(struct tu *tu, struct node *node, const char *format, va_list args) {
+    flockfile(stderr);
     fprintf(stderr, RED "error" RESET ": ");
     vfprintf(stderr, format, args);
     fprintf(stderr, "\n");
     print_and_highlight_extent(tu, node_begin(node), node_end(node));
+    funlockfile(stderr);
 
     handle_error(tu);
 }
 
 void vprint_error_token(struct tu *tu, struct token *token, const char *format, va_list args) {
+    flockfile(stderr);
     fprintf(stderr, RED "error" RESET ": ");
     vfprintf(stderr, format, args);
     fprintf(stderr, "\n");
     print_and_highlight(tu->source, token);
+    funlockfile(stderr);
 
     handle_error(tu);
 }
@@ -187,6 +205,7 @@ void error_abort(struct tu *tu, const char *message, ...) {
 }
 
 static void handle_error(struct tu *tu) {
+    atomic_fetch_add_explicit(&tu->errors, 1, memory_order_relaxed);
     // fprintf(stderr, "Too many errors, aborting\n");
 
     // if (tu->abort) exit(1);
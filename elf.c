@@ -0,0 +1,247 @@
+#include "x86.h"
+#include "tu.h"
+
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Writing a module as an ELF64 relocatable object, the .o an assembler would
+// make of the module's assembly.
+//
+// A relocation to a symbol local to the module is made against its
+// section's symbol, with the symbol's offset added, so the local symbols
+// are only there for debuggers and string literals don't need any.
+
+struct elf_writer {
+    struct tu *tu;
+    struct x86_module *module;
+    byte_list_t file;
+    byte_list_t strtab;
+    byte_list_t shstrtab;
+    list(Elf64_Shdr) headers;
+    list(Elf64_Sym) symbols;
+    // the ELF symbol of each module symbol, 0 if it has none
+    int *symbol_index;
+    // the symbols the module uses but doesn't define, and their ELF symbols
+    list(int) undefined;
+    list(int) undefined_index;
+    // the ELF symbol of the first global, after all the locals
+    size_t first_global;
+};
+
+static const char *const section_names[] = {
+    [X86_TEXT] = ".text", [X86_RODATA] = ".rodata", [X86_DATA] = ".data", [X86_BSS] = ".bss",
+};
+
+static const int reloc_types[] = {
+    [X86_RELOC_PC32] = R_X86_64_PC32,
+    [X86_RELOC_PLT32] = R_X86_64_PLT32,
+    [X86_RELOC_GOTPCREL] = R_X86_64_GOTPCREL,
+    [X86_RELOC_64] = R_X86_64_64,
+};
+
+static void append(byte_list_t *bytes, const void *data, size_t len) {
+    const unsigned char *b = data;
+    for (size_t i = 0; i < len; i++) list_push(bytes, b[i]);
+}
+
+static void pad(byte_list_t *bytes, size_t align) {
+    while (bytes->len % align) list_push(bytes, 0);
+}
+
+static uint32_t add_name(byte_list_t *table, const char *name) {
+    uint32_t offset = (uint32_t)table->len;
+    append(table, name, strlen(name) + 1);
+    return offset;
+}
+
+// The ELF section a module section is in: they are numbered from 1 in order.
+static int elf_section(enum x86_section section) {
+    return section + 1;
+}
+
+static size_t add_header(struct elf_writer *w, const char *name, Elf64_Word type, Elf64_Xword flags, size_t offset,
+                         size_t size, size_t align) {
+    list_push(&w->headers, ((Elf64_Shdr){
+        .sh_name = add_name(&w->shstrtab, name),
+        .sh_type = type,
+        .sh_flags = flags,
+        .sh_offset = offset,
+        .sh_size = size,
+        .sh_addralign = align,
+    }));
+    return w->headers.len - 1;
+}
+
+// Write the bytes of a section into the file and return where they are.
+static size_t place(struct elf_writer *w, const void *data, size_t len, size_t align) {
+    pad(&w->file, align);
+    size_t offset = w->file.len;
+    append(&w->file, data, len);
+    return offset;
+}
+
+static void add_symbols(struct elf_writer *w) {
+    struct tu *tu = w->tu;
+    struct x86_module *module = w->module;
+    list_push(&w->symbols, (Elf64_Sym){});
+    for (int s = 0; s < N_X86_SECTIONS; s++) {
+        list_push(&w->symbols, ((Elf64_Sym){
+            .st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION),
+            .st_shndx = (Elf64_Section)elf_section(s),
+        }));
+    }
+
+    // the locals come first, then the globals
+    w->symbol_index = calloc(module->symbols.len, sizeof(int));
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) w->first_global = w->symbols.len;
+        for (size_t s = 0; s < module->symbols.len; s++) {
+            struct x86_symbol *symbol = &module->symbols.data[s];
+            if (symbol->is_global != (pass == 1) || is_string_symbol(tu, symbol->name)) continue;
+            w->symbol_index[s] = (int)w->symbols.len;
+            list_push(&w->symbols, ((Elf64_Sym){
+                .st_name = add_name(&w->strtab, tu_string(tu, symbol->name)),
+                .st_info = ELF64_ST_INFO(symbol->is_global ? STB_GLOBAL : STB_LOCAL,
+                                         symbol->is_function ? STT_FUNC : STT_OBJECT),
+                .st_shndx = (Elf64_Section)elf_section(symbol->section),
+                .st_value = symbol->offset,
+                .st_size = symbol->size,
+            }));
+        }
+    }
+
+    for (int s = 0; s < N_X86_SECTIONS; s++) {
+        for_each (&module->sections[s].relocs) {
+            if (find_symbol(module, it->symbol) != -1) continue;
+            bool seen = false;
+            for_each_n (u, &w->undefined) seen |= *u == it->symbol;
+            if (seen) continue;
+            list_push(&w->undefined, it->symbol);
+            list_push(&w->undefined_index, (int)w->symbols.len);
+            list_push(&w->symbols, ((Elf64_Sym){
+                .st_name = add_name(&w->strtab, tu_string(tu, it->symbol)),
+                .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE),
+                .st_shndx = SHN_UNDEF,
+            }));
+        }
+    }
+}
+
+static Elf64_Rela elf_reloc(struct elf_writer *w, struct x86_reloc *r) {
+    int64_t addend = r->addend;
+    int index = 0;
+    int s = find_symbol(w->module, r->symbol);
+    if (s != -1 && !w->module->symbols.data[s].is_global) {
+        struct x86_symbol *symbol = &w->module->symbols.data[s];
+        index = elf_section(symbol->section);
+        addend += symbol->offset;
+    } else if (s != -1) {
+        index = w->symbol_index[s];
+    } else {
+        for (size_t u = 0; u < w->undefined.len; u++) {
+            if (w->undefined.data[u] == r->symbol) index = w->undefined_index.data[u];
+        }
+    }
+    return (Elf64_Rela){
+        .r_offset = r->offset,
+        .r_info = ELF64_R_INFO(index, reloc_types[r->kind]),
+        .r_addend = addend,
+    };
+}
+
+void elf_image(struct tu *tu, struct x86_module *module, char *const *addresses, byte_list_t *out) {
+    struct elf_writer w = { .tu = tu, .module = module };
+    list_push(&w.strtab, 0);
+    list_push(&w.shstrtab, 0);
+    list_push(&w.headers, (Elf64_Shdr){});
+    append(&w.file, &(Elf64_Ehdr){}, sizeof(Elf64_Ehdr));
+
+    static const Elf64_Xword flags[] = {
+        [X86_TEXT] = SHF_ALLOC | SHF_EXECINSTR,
+        [X86_RODATA] = SHF_ALLOC,
+        [X86_DATA] = SHF_ALLOC | SHF_WRITE,
+        [X86_BSS] = SHF_ALLOC | SHF_WRITE,
+    };
+    for (int s = 0; s < N_X86_SECTIONS; s++) {
+        struct x86_section_data *section = &module->sections[s];
+        size_t h;
+        if (s == X86_BSS) {
+            h = add_header(&w, section_names[s], SHT_NOBITS, flags[s], w.file.len, section->size, section->align);
+        } else {
+            size_t offset = place(&w, section->bytes.data, section->bytes.len, section->align);
+            h = add_header(&w, section_names[s], SHT_PROGBITS, flags[s], offset, section->bytes.len, section->align);
+        }
+        if (addresses) w.headers.data[h].sh_addr = (Elf64_Addr)addresses[s];
+    }
+
+    add_symbols(&w);
+    // the symbol table comes right after the relocation sections, which a
+    // module that has been loaded doesn't have
+    size_t symtab = w.headers.len;
+    for (int s = 0; s < N_X86_SECTIONS && !addresses; s++) symtab += module->sections[s].relocs.len != 0;
+    for (int s = 0; s < N_X86_SECTIONS && !addresses; s++) {
+        struct x86_section_data *section = &module->sections[s];
+        if (!section->relocs.len) continue;
+        pad(&w.file, 8);
+        size_t offset = w.file.len;
+        for_each (&section->relocs) {
+            Elf64_Rela rela = elf_reloc(&w, it);
+            append(&w.file, &rela, sizeof(rela));
+        }
+        char name[32];
+        snprintf(name, sizeof(name), ".rela%s", section_names[s]);
+        size_t h = add_header(&w, name, SHT_RELA, SHF_INFO_LINK, offset, w.file.len - offset, 8);
+        w.headers.data[h].sh_entsize = sizeof(Elf64_Rela);
+        w.headers.data[h].sh_info = (Elf64_Word)elf_section(s);
+        w.headers.data[h].sh_link = (Elf64_Word)symtab;
+    }
+
+    size_t offset = place(&w, w.symbols.data, w.symbols.len * sizeof(Elf64_Sym), 8);
+    size_t h = add_header(&w, ".symtab", SHT_SYMTAB, 0, offset, w.symbols.len * sizeof(Elf64_Sym), 8);
+    w.headers.data[h].sh_entsize = sizeof(Elf64_Sym);
+    w.headers.data[h].sh_info = (Elf64_Word)w.first_global;
+    w.headers.data[h].sh_link = (Elf64_Word)(h + 1);
+
+    offset = place(&w, w.strtab.data, w.strtab.len, 1);
+    add_header(&w, ".strtab", SHT_STRTAB, 0, offset, w.strtab.len, 1);
+    // a stack that isn't executable
+    add_header(&w, ".note.GNU-stack", SHT_PROGBITS, 0, w.file.len, 0, 1);
+    size_t shstrtab = add_header(&w, ".shstrtab", SHT_STRTAB, 0, 0, 0, 1);
+    offset = place(&w, w.shstrtab.data, w.shstrtab.len, 1);
+    w.headers.data[shstrtab].sh_offset = offset;
+    w.headers.data[shstrtab].sh_size = w.shstrtab.len;
+
+    size_t headers = place(&w, w.headers.data, w.headers.len * sizeof(Elf64_Shdr), 8);
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)w.file.data;
+    *ehdr = (Elf64_Ehdr){
+        .e_ident = { ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV },
+        .e_type = ET_REL,
+        .e_machine = EM_X86_64,
+        .e_version = EV_CURRENT,
+        .e_shoff = headers,
+        .e_ehsize = sizeof(Elf64_Ehdr),
+        .e_shentsize = sizeof(Elf64_Shdr),
+        .e_shnum = (Elf64_Half)w.headers.len,
+        .e_shstrndx = (Elf64_Half)shstrtab,
+    };
+    *out = w.file;
+
+    free(w.symbol_index);
+    list_clear(&w.strtab);
+    list_clear(&w.shstrtab);
+    list_clear(&w.headers);
+    list_clear(&w.symbols);
+    list_clear(&w.undefined);
+    list_clear(&w.undefined_index);
+}
+
+void write_object(struct tu *tu, FILE *out) {
+    struct x86_module module = {};
+    build_module(tu, &module);
+    byte_list_t image = {};
+    elf_image(tu, &module, nullptr, &image);
+    fwrite(image.data, 1, image.len, out);
+    list_clear(&image);
+    free_module(&module);
+}
@@ -0,0 +1,580 @@
+#include "x86.h"
+#include "ir.h"
+#include "token.h"
+#include "tu.h"
+#include "type.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Encoding machine code as bytes, the way an assembler would.
+//
+// Every instruction but a jump has one encoding, so a function is encoded
+// once into a buffer, and the jumps, which can be 2 bytes if their target is
+// near or 5 or 6 if it isn't, are sized after: all short to begin with, then
+// growing the ones that don't reach until none change. Displacements to the
+// function's own labels are filled in at the end, and ones to symbols are
+// left as relocations.
+
+// A displacement in an instruction, to a label of the function or, if label
+// is -1, to a symbol.
+struct field {
+    // the instruction and where the field is in the encoder's bytes
+    uint32_t instr;
+    uint32_t at;
+    int label;
+    // bytes of the instruction after the field, an immediate
+    unsigned char trailing;
+    enum x86_reloc_kind kind;
+    int symbol;
+    int64_t addend;
+};
+
+struct encoder {
+    struct x86_function *function;
+    // the bytes of every instruction but the jumps, back to back
+    byte_list_t bytes;
+    // where each instruction's bytes start in bytes
+    list(uint32_t) starts;
+    list(struct field) fields;
+    uint32_t instr;
+};
+
+static const unsigned char cond_codes[] = {
+    [X86_E] = 0x4, [X86_NE] = 0x5,
+    [X86_L] = 0xc, [X86_LE] = 0xe, [X86_G] = 0xf, [X86_GE] = 0xd,
+    [X86_B] = 0x2, [X86_BE] = 0x6, [X86_A] = 0x7, [X86_AE] = 0x3,
+    [X86_P] = 0xa, [X86_NP] = 0xb,
+    [X86_S] = 0x8,
+};
+
+// The /digit of the group 1 instructions, whose other opcodes follow from it.
+static const unsigned char alu_digits[] = {
+    [X86_ADD] = 0, [X86_OR] = 1, [X86_AND] = 4, [X86_SUB] = 5, [X86_XOR] = 6, [X86_CMP] = 7,
+};
+
+static const unsigned char shift_digits[] = { [X86_SHL] = 4, [X86_SHR] = 5, [X86_SAR] = 7 };
+
+static const unsigned char sse_opcodes[] = {
+    [X86_ADDS] = 0x58, [X86_MULS] = 0x59, [X86_SUBS] = 0x5c, [X86_DIVS] = 0x5e,
+};
+
+static bool fits_imm8(int64_t imm) {
+    return imm >= INT8_MIN && imm <= INT8_MAX;
+}
+
+static bool fits_imm32(int64_t imm) {
+    return imm >= INT32_MIN && imm <= INT32_MAX;
+}
+
+static void put_byte(byte_list_t *bytes, unsigned char b) {
+    list_push(bytes, b);
+}
+
+static void put_bytes(byte_list_t *bytes, uint64_t value, int n) {
+    for (int b = 0; b < n; b++) list_push(bytes, (unsigned char)(value >> (8 * b)));
+}
+
+static void patch32(unsigned char *at, int64_t value) {
+    for (int b = 0; b < 4; b++) at[b] = (unsigned char)(value >> (8 * b));
+}
+
+// The three bit number of a register, and the bit that goes in the REX prefix.
+static int low_bits(enum machine_reg r) {
+    return r & 7;
+}
+
+static int high_bit(enum machine_reg r) {
+    return (r >> 3) & 1;
+}
+
+// spl, bpl, sil and dil are only reachable with a REX prefix, without which
+// their numbers mean ah, ch, dh and bh.
+static bool needs_rex(enum machine_reg r) {
+    return r >= RSP && r <= RDI;
+}
+
+static int sse_prefix(int size) {
+    return size == 4 ? 0xf3 : 0xf2;
+}
+
+// Where a field is to be filled in once its target is known.
+static void add_field(struct encoder *e, struct x86_operand *x, int trailing, enum x86_reloc_kind kind) {
+    list_push(&e->fields, ((struct field){
+        .instr = e->instr,
+        .at = (uint32_t)e->bytes.len,
+        .label = x->symbol ? -1 : x->label,
+        .trailing = (unsigned char)trailing,
+        .kind = kind,
+        .symbol = x->symbol,
+        .addend = x->imm,
+    }));
+    put_bytes(&e->bytes, 0, 4);
+}
+
+enum {
+    BYTE_REG = 1,   // the reg field names a byte register
+    BYTE_RM = 2,    // and the r/m operand
+};
+
+// An instruction with a ModRM byte: the mandatory prefix if there is one,
+// REX, the opcode of up to 3 bytes, then reg and the r/m operand, and an
+// immediate of imm_size bytes.
+static void encode_modrm(struct encoder *e, int prefix, bool w, uint32_t opcode, int reg, struct x86_operand *rm,
+                         int flags, int imm_size, int64_t imm) {
+    byte_list_t *b = &e->bytes;
+    if (prefix) put_byte(b, (unsigned char)prefix);
+
+    int rex = (w ? 8 : 0) | (high_bit(reg) << 2);
+    if (rm->kind == X86_REG || rm->kind == X86_MEM) rex |= high_bit(rm->reg);
+    if (rm->kind == X86_MEM && rm->scale) rex |= high_bit(rm->index) << 1;
+    bool force = ((flags & BYTE_REG) && needs_rex(reg)) ||
+                 ((flags & BYTE_RM) && rm->kind == X86_REG && needs_rex(rm->reg));
+    if (rex || force) put_byte(b, (unsigned char)(0x40 | rex));
+
+    if (opcode > 0xffff) put_byte(b, (unsigned char)(opcode >> 16));
+    if (opcode > 0xff) put_byte(b, (unsigned char)(opcode >> 8));
+    put_byte(b, (unsigned char)opcode);
+
+    int r = low_bits(reg) << 3;
+    switch (rm->kind) {
+    case X86_REG:
+        put_byte(b, (unsigned char)(0xc0 | r | low_bits(rm->reg)));
+        break;
+    case X86_MEM: {
+        int base = low_bits(rm->reg);
+        int64_t disp = rm->imm;
+        // rbp and r13 as a base always have a displacement, and rsp and r12
+        // need a SIB byte
+        int mod = disp == 0 && base != RBP ? 0 : fits_imm8(disp) ? 1 : 2;
+        if (rm->scale) {
+            // a SIB byte with the index, scaled by 1 << its top two bits
+            int scale = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+            put_byte(b, (unsigned char)(mod << 6 | r | 4));
+            put_byte(b, (unsigned char)(scale << 6 | low_bits(rm->index) << 3 | base));
+        } else {
+            put_byte(b, (unsigned char)(mod << 6 | r | base));
+            if (base == RSP) put_byte(b, 0x24);
+        }
+        if (mod == 1) put_byte(b, (unsigned char)disp);
+        else if (mod == 2) put_bytes(b, (uint64_t)disp, 4);
+        break;
+    }
+    case X86_RIP:
+        put_byte(b, (unsigned char)(r | 5));
+        add_field(e, rm, imm_size, rm->indirect ? X86_RELOC_GOTPCREL : X86_RELOC_PC32);
+        break;
+    default:
+        fprintf(stderr, "encode: bad r/m operand kind %i\n", rm->kind);
+        break;
+    }
+    put_bytes(b, (uint64_t)imm, imm_size);
+}
+
+// An instruction whose opcode holds its register, like push or mov of an
+// immediate.
+static void encode_opreg(struct encoder *e, int prefix, bool w, int opcode, enum machine_reg reg, bool is_byte,
+                         int imm_size, int64_t imm) {
+    byte_list_t *b = &e->bytes;
+    if (prefix) put_byte(b, (unsigned char)prefix);
+    int rex = (w ? 8 : 0) | high_bit(reg);
+    if (rex || (is_byte && needs_rex(reg))) put_byte(b, (unsigned char)(0x40 | rex));
+    put_byte(b, (unsigned char)(opcode + low_bits(reg)));
+    put_bytes(b, (uint64_t)imm, imm_size);
+}
+
+static int size_prefix(int size) {
+    return size == 2 ? 0x66 : 0;
+}
+
+// The immediate of an instruction that takes one of at most 32 bits: a byte,
+// or as many as the operand up to 4.
+static int imm_size(int size) {
+    return size == 8 ? 4 : size;
+}
+
+static void encode_alu(struct encoder *e, struct x86_instr *i) {
+    struct x86_operand *dst = &i->operands[0], *src = &i->operands[1];
+    int size = i->size, digit = alu_digits[i->op];
+    int prefix = size_prefix(size), flags = size == 1 ? BYTE_REG | BYTE_RM : 0;
+    bool w = size == 8;
+    if (src->kind == X86_IMM) {
+        // the reg field is the digit
+        flags &= BYTE_RM;
+        if (size == 1) encode_modrm(e, prefix, w, 0x80, digit, dst, flags, 1, src->imm);
+        else if (fits_imm8(src->imm)) encode_modrm(e, prefix, w, 0x83, digit, dst, flags, 1, src->imm);
+        else encode_modrm(e, prefix, w, 0x81, digit, dst, flags, imm_size(size), src->imm);
+    } else if (src->kind == X86_REG) {
+        encode_modrm(e, prefix, w, (uint32_t)(digit * 8 + (size == 1 ? 0 : 1)), src->reg, dst, flags, 0, 0);
+    } else {
+        encode_modrm(e, prefix, w, (uint32_t)(digit * 8 + (size == 1 ? 2 : 3)), dst->reg, src, flags, 0, 0);
+    }
+}
+
+static void encode_mov(struct encoder *e, struct x86_instr *i) {
+    struct x86_operand *dst = &i->operands[0], *src = &i->operands[1];
+    int size = i->size, prefix = size_prefix(size), flags = size == 1 ? BYTE_REG | BYTE_RM : 0;
+    bool w = size == 8;
+    if (src->kind == X86_IMM && dst->kind == X86_REG) {
+        int64_t imm = src->imm;
+        if (size == 1) {
+            encode_opreg(e, 0, false, 0xb0, dst->reg, true, 1, imm);
+        } else if (size < 8 || (imm >= 0 && imm <= UINT32_MAX)) {
+            // writing 32 bits clears the top half
+            encode_opreg(e, prefix, false, 0xb8, dst->reg, false, size == 2 ? 2 : 4, imm);
+        } else if (fits_imm32(imm)) {
+            encode_modrm(e, 0, true, 0xc7, 0, dst, 0, 4, imm);
+        } else {
+            encode_opreg(e, 0, true, 0xb8, dst->reg, false, 8, imm);
+        }
+    } else if (src->kind == X86_IMM) {
+        encode_modrm(e, prefix, w, size == 1 ? 0xc6 : 0xc7, 0, dst, flags, imm_size(size), src->imm);
+    } else if (src->kind == X86_REG) {
+        encode_modrm(e, prefix, w, size == 1 ? 0x88 : 0x89, src->reg, dst, flags, 0, 0);
+    } else {
+        encode_modrm(e, prefix, w, size == 1 ? 0x8a : 0x8b, dst->reg, src, flags, 0, 0);
+    }
+}
+
+static void encode_instr(struct encoder *e, struct x86_instr *i) {
+    struct x86_operand *dst = &i->operands[0], *src = &i->operands[1];
+    int size = i->size;
+    bool w = size == 8;
+    int prefix = size_prefix(size);
+
+    switch (i->op) {
+    case X86_LABEL:
+    case X86_JMP:
+    case X86_JCC:
+        // laid out once the jumps are sized
+        break;
+    case X86_MOV:
+        encode_mov(e, i);
+        break;
+    case X86_MOVSX:
+    case X86_MOVZX: {
+        uint32_t opcode;
+        if (i->from_size == 4) opcode = 0x63;
+        else if (i->op == X86_MOVSX) opcode = i->from_size == 1 ? 0x0fbe : 0x0fbf;
+        else opcode = i->from_size == 1 ? 0x0fb6 : 0x0fb7;
+        encode_modrm(e, prefix, w, opcode, dst->reg, src, i->from_size == 1 ? BYTE_RM : 0, 0, 0);
+        break;
+    }
+    case X86_LEA:
+        encode_modrm(e, 0, w, 0x8d, dst->reg, src, 0, 0, 0);
+        break;
+    case X86_ADD:
+    case X86_SUB:
+    case X86_AND:
+    case X86_OR:
+    case X86_XOR:
+    case X86_CMP:
+        encode_alu(e, i);
+        break;
+    case X86_IMUL:
+        if (src->kind == X86_IMM && fits_imm8(src->imm)) encode_modrm(e, prefix, w, 0x6b, dst->reg, dst, 0, 1, src->imm);
+        else if (src->kind == X86_IMM) encode_modrm(e, prefix, w, 0x69, dst->reg, dst, 0, imm_size(size), src->imm);
+        else encode_modrm(e, prefix, w, 0x0faf, dst->reg, src, 0, 0, 0);
+        break;
+    case X86_SHL:
+    case X86_SHR:
+    case X86_SAR: {
+        int flags = size == 1 ? BYTE_RM : 0;
+        if (src->kind == X86_IMM && src->imm == 1) encode_modrm(e, prefix, w, size == 1 ? 0xd0 : 0xd1, shift_digits[i->op], dst, flags, 0, 0);
+        else if (src->kind == X86_IMM) encode_modrm(e, prefix, w, size == 1 ? 0xc0 : 0xc1, shift_digits[i->op], dst, flags, 1, src->imm);
+        else encode_modrm(e, prefix, w, size == 1 ? 0xd2 : 0xd3, shift_digits[i->op], dst, flags, 0, 0);
+        break;
+    }
+    case X86_NEG:
+    case X86_NOT:
+    case X86_DIV:
+    case X86_IDIV: {
+        int digit = i->op == X86_NEG ? 3 : i->op == X86_NOT ? 2 : i->op == X86_DIV ? 6 : 7;
+        encode_modrm(e, prefix, w, size == 1 ? 0xf6 : 0xf7, digit, dst, size == 1 ? BYTE_RM : 0, 0, 0);
+        break;
+    }
+    case X86_TEST: {
+        int flags = size == 1 ? BYTE_REG | BYTE_RM : 0;
+        if (src->kind == X86_IMM) encode_modrm(e, prefix, w, size == 1 ? 0xf6 : 0xf7, 0, dst, flags & BYTE_RM, imm_size(size), src->imm);
+        else encode_modrm(e, prefix, w, size == 1 ? 0x84 : 0x85, src->reg, dst, flags, 0, 0);
+        break;
+    }
+    case X86_XCHG:
+        if (src->kind == X86_REG) encode_modrm(e, prefix, w, 0x87, src->reg, dst, 0, 0, 0);
+        else encode_modrm(e, prefix, w, 0x87, dst->reg, src, 0, 0, 0);
+        break;
+    case X86_CQO:
+        if (w) put_byte(&e->bytes, 0x48);
+        put_byte(&e->bytes, 0x99);
+        break;
+    case X86_SETCC:
+        encode_modrm(e, 0, false, 0x0f90u + cond_codes[i->cond], 0, dst, BYTE_RM, 0, 0);
+        break;
+    case X86_CALL:
+        if (dst->kind == X86_REG) {
+            encode_modrm(e, 0, false, 0xff, 2, dst, 0, 0, 0);
+        } else {
+            put_byte(&e->bytes, 0xe8);
+            add_field(e, dst, 0, dst->indirect ? X86_RELOC_PLT32 : X86_RELOC_PC32);
+        }
+        break;
+    case X86_RET:
+        put_byte(&e->bytes, 0xc3);
+        break;
+    case X86_PUSH:
+        if (dst->kind == X86_REG) encode_opreg(e, 0, false, 0x50, dst->reg, false, 0, 0);
+        else if (dst->kind == X86_IMM && fits_imm8(dst->imm)) put_bytes(&e->bytes, 0x6a | (uint64_t)(uint8_t)dst->imm << 8, 2);
+        else if (dst->kind == X86_IMM) encode_opreg(e, 0, false, 0x68, RAX, false, 4, dst->imm);
+        else encode_modrm(e, 0, false, 0xff, 6, dst, 0, 0, 0);
+        break;
+    case X86_LEAVE:
+        put_byte(&e->bytes, 0xc9);
+        break;
+
+    case X86_MOVS:
+        if (dst->kind == X86_REG) encode_modrm(e, sse_prefix(size), false, 0x0f10, dst->reg, src, 0, 0, 0);
+        else encode_modrm(e, sse_prefix(size), false, 0x0f11, src->reg, dst, 0, 0, 0);
+        break;
+    case X86_MOVAPS:
+        encode_modrm(e, 0, false, 0x0f28, dst->reg, src, 0, 0, 0);
+        break;
+    case X86_MOVQ:
+        if (dst->reg >= XMM0) encode_modrm(e, 0x66, w, 0x0f6e, dst->reg, src, 0, 0, 0);
+        else encode_modrm(e, 0x66, w, 0x0f7e, src->reg, dst, 0, 0, 0);
+        break;
+    case X86_ADDS:
+    case X86_SUBS:
+    case X86_MULS:
+    case X86_DIVS:
+        encode_modrm(e, sse_prefix(size), false, 0x0f00u + sse_opcodes[i->op], dst->reg, src, 0, 0, 0);
+        break;
+    case X86_UCOMIS:
+        encode_modrm(e, size == 8 ? 0x66 : 0, false, 0x0f2e, dst->reg, src, 0, 0, 0);
+        break;
+    case X86_XORPS:
+        encode_modrm(e, 0, false, 0x0f57, dst->reg, src, 0, 0, 0);
+        break;
+    case X86_CVTSI2S:
+        encode_modrm(e, sse_prefix(size), i->from_size == 8, 0x0f2a, dst->reg, src, 0, 0, 0);
+        break;
+    case X86_CVTTS2SI:
+        encode_modrm(e, sse_prefix(i->from_size), w, 0x0f2c, dst->reg, src, 0, 0, 0);
+        break;
+    case X86_CVTS2S:
+        encode_modrm(e, sse_prefix(i->from_size), false, 0x0f5a, dst->reg, src, 0, 0, 0);
+        break;
+    }
+}
+
+static bool is_jump(struct x86_instr *i) {
+    return i->op == X86_JMP || i->op == X86_JCC;
+}
+
+static uint32_t jump_size(struct x86_instr *i, bool is_long) {
+    if (!is_long) return 2;
+    return i->op == X86_JMP ? 5 : 6;
+}
+
+uint32_t encode_function(struct x86_function *function, struct x86_section_data *text) {
+    struct encoder e = { .function = function };
+    size_t n = function->instrs.len;
+    for (size_t i = 0; i < n; i++) {
+        e.instr = (uint32_t)i;
+        list_push(&e.starts, (uint32_t)e.bytes.len);
+        encode_instr(&e, &function->instrs.data[i]);
+    }
+    list_push(&e.starts, (uint32_t)e.bytes.len);
+
+    // where each instruction and label is from the start of the function
+    uint32_t *offsets = calloc(n + 1, sizeof(uint32_t));
+    uint32_t *labels = calloc(function->n_labels, sizeof(uint32_t));
+    bool *is_long = calloc(n, sizeof(bool));
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        uint32_t at = 0;
+        for (size_t i = 0; i < n; i++) {
+            struct x86_instr *instr = &function->instrs.data[i];
+            offsets[i] = at;
+            if (instr->op == X86_LABEL) labels[instr->operands[0].label] = at;
+            at += is_jump(instr) ? jump_size(instr, is_long[i]) : e.starts.data[i + 1] - e.starts.data[i];
+        }
+        offsets[n] = at;
+        for (size_t i = 0; i < n; i++) {
+            struct x86_instr *instr = &function->instrs.data[i];
+            if (!is_jump(instr) || is_long[i]) continue;
+            int64_t disp = (int64_t)labels[instr->operands[0].label] - (offsets[i] + 2);
+            if (!fits_imm8(disp)) {
+                is_long[i] = true;
+                changed = true;
+            }
+        }
+    }
+
+    // functions start 16 byte aligned, like a compiler's would
+    while (text->bytes.len % 16) put_byte(&text->bytes, 0xcc);
+    uint32_t base = (uint32_t)text->bytes.len;
+    for (size_t i = 0; i < n; i++) {
+        struct x86_instr *instr = &function->instrs.data[i];
+        if (!is_jump(instr)) {
+            for (uint32_t b = e.starts.data[i]; b < e.starts.data[i + 1]; b++) put_byte(&text->bytes, e.bytes.data[b]);
+            continue;
+        }
+        int64_t target = labels[instr->operands[0].label];
+        int64_t disp = target - (offsets[i] + jump_size(instr, is_long[i]));
+        if (!is_long[i]) {
+            put_byte(&text->bytes, instr->op == X86_JMP ? 0xeb : 0x70 + cond_codes[instr->cond]);
+            put_byte(&text->bytes, (unsigned char)disp);
+        } else {
+            if (instr->op == X86_JMP) {
+                put_byte(&text->bytes, 0xe9);
+            } else {
+                put_byte(&text->bytes, 0x0f);
+                put_byte(&text->bytes, 0x80 + cond_codes[instr->cond]);
+            }
+            put_bytes(&text->bytes, (uint64_t)disp, 4);
+        }
+    }
+
+    // the constants follow the code, 8 bytes each
+    while (text->bytes.len % 8) put_byte(&text->bytes, 0xcc);
+    for_each (&function->constants) {
+        labels[it->label] = (uint32_t)text->bytes.len - base;
+        put_bytes(&text->bytes, it->bits, 8);
+    }
+
+    for_each (&e.fields) {
+        uint32_t at = offsets[it->instr] + (it->at - e.starts.data[it->instr]);
+        // from the end of the instruction
+        int64_t end = at + 4 + it->trailing;
+        if (it->label != -1) {
+            patch32(&text->bytes.data[base + at], labels[it->label] - end + it->addend);
+        } else {
+            list_push(&text->relocs, ((struct x86_reloc){
+                .offset = base + at,
+                .kind = it->kind,
+                .symbol = it->symbol,
+                .addend = it->addend - (end - at),
+            }));
+        }
+    }
+
+    free(offsets);
+    free(labels);
+    free(is_long);
+    list_clear(&e.bytes);
+    list_clear(&e.starts);
+    list_clear(&e.fields);
+    return base;
+}
+
+static void add_symbol(struct x86_module *module, int name, enum x86_section section, size_t offset, size_t size,
+                       bool is_global, bool is_function) {
+    list_push(&module->symbols, ((struct x86_symbol){
+        .name = name,
+        .section = section,
+        .offset = (uint32_t)offset,
+        .size = (uint32_t)size,
+        .is_global = is_global,
+        .is_function = is_function,
+    }));
+}
+
+int find_symbol(struct x86_module *module, int name) {
+    for (size_t s = 0; s < module->symbols.len; s++) {
+        if (module->symbols.data[s].name == name) return (int)s;
+    }
+    return -1;
+}
+
+static void align_section(struct x86_section_data *section, size_t align) {
+    if (align > section->align) section->align = align;
+    if (section->size % align) section->size += align - section->size % align;
+    while (section->bytes.len % align) put_byte(&section->bytes, 0);
+}
+
+void add_string_literal(struct tu *tu, struct x86_module *module, int symbol) {
+    if (!is_string_symbol(tu, symbol) || find_symbol(module, symbol) != -1) return;
+    const char *text = tu_string(tu, symbol);
+    struct token token = { .index = 0, .len = (int)strlen(text) };
+    struct x86_section_data *rodata = &module->sections[X86_RODATA];
+    size_t len = string_literal_decode(text, &token, nullptr);
+    size_t offset = rodata->bytes.len;
+    for (size_t b = 0; b <= len; b++) put_byte(&rodata->bytes, 0);
+    string_literal_decode(text, &token, (char *)&rodata->bytes.data[offset]);
+    add_symbol(module, symbol, X86_RODATA, offset, len + 1, false, false);
+}
+
+static void add_global(struct tu *tu, struct x86_module *module, size_t g) {
+    struct ir_global *global = &tu->module.globals.data[g];
+    bool is_global;
+    int symbol = scope_symbol(tu, global->scope, &is_global);
+    if (is_redefined(tu, g, symbol)) return;
+
+    size_t align = type_align(tu, global->scope->c_type);
+    size_t size = global->size ? global->size : 1;
+    if (!global->initialized) {
+        struct x86_section_data *bss = &module->sections[X86_BSS];
+        align_section(bss, align ? align : 1);
+        add_symbol(module, symbol, X86_BSS, bss->size, global->size, is_global, false);
+        bss->size += size;
+        return;
+    }
+
+    struct x86_section_data *data = &module->sections[X86_DATA];
+    align_section(data, align ? align : 1);
+    size_t offset = data->bytes.len;
+    add_symbol(module, symbol, X86_DATA, offset, global->size, is_global, false);
+    struct ir_constant *init = &global->init;
+    if (!global->width) {
+        for (size_t b = 0; b < size; b++) put_byte(&data->bytes, 0);
+    } else if (init->name) {
+        list_push(&data->relocs, ((struct x86_reloc){
+            .offset = (uint32_t)offset,
+            .kind = X86_RELOC_64,
+            .symbol = init->name,
+            .addend = (int64_t)init->i,
+        }));
+        put_bytes(&data->bytes, 0, 8);
+    } else {
+        put_bytes(&data->bytes, global_bits(global), global->width);
+    }
+}
+
+void build_module(struct tu *tu, struct x86_module *module) {
+    struct x86_section_data *text = &module->sections[X86_TEXT];
+    for (int s = 0; s < N_X86_SECTIONS; s++) module->sections[s].align = 1;
+    text->align = 16;
+
+    for_each (&tu->module.functions) {
+        struct x86_function code = {};
+        generate_function(tu, *it, &code);
+        free_function(*it);
+        uint32_t start = encode_function(&code, text);
+        add_symbol(module, code.symbol, X86_TEXT, start, text->bytes.len - start, code.is_global, true);
+        free_x86_function(&code);
+    }
+    // the IR is only needed to generate the code
+    list_clear(&tu->module.functions);
+    for_each (&tu->module.code) {
+        uint32_t start = encode_function(*it, text);
+        add_symbol(module, (*it)->symbol, X86_TEXT, start, text->bytes.len - start, (*it)->is_global, true);
+    }
+    build_data(tu, module);
+}
+
+void build_data(struct tu *tu, struct x86_module *module) {
+    for (size_t g = 0; g < tu->module.globals.len; g++) add_global(tu, module, g);
+
+    for (int s = 0; s < N_X86_SECTIONS; s++) {
+        for_each (&module->sections[s].relocs) add_string_literal(tu, module, it->symbol);
+    }
+}
+
+void free_module(struct x86_module *module) {
+    for (int s = 0; s < N_X86_SECTIONS; s++) {
+        list_clear(&module->sections[s].bytes);
+        list_clear(&module->sections[s].relocs);
+    }
+    list_clear(&module->symbols);
+}
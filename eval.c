@@ -0,0 +1,427 @@
+#include "eval.h"
+#include "parse.h"
+#include "token.h"
+#include "type.h"
+#include "tu.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#define SCOPE(n) list_ptr(&tu->scopes, n)
+#define TYPE(n) type_at(&tu->types, n)
+
+static void eval_node(struct tu *tu, struct node *node, struct value *out);
+
+struct value *eval(struct tu *tu, struct node *node) {
+    if (node->value) return node->value;
+
+    // The cache entry is installed before evaluating so that a constexpr
+    // declaration that refers to itself evaluates to VALUE_NONE instead of
+    // recursing forever.
+    struct value *result = calloc(1, sizeof(struct value));
+    node->value = result;
+
+    struct value v = {};
+    eval_node(tu, node, &v);
+    *result = v;
+
+    return result;
+}
+
+bool eval_int(struct tu *tu, struct node *node, int64_t *out) {
+    struct value *v = eval(tu, node);
+    if (v->kind != VALUE_INT) return false;
+    *out = (int64_t)v->i;
+    return true;
+}
+
+static int int_type(struct tu *tu) {
+    return find_or_create_type(tu, 0, TYPE_SIGNED_INT, 0);
+}
+
+// Wrap an integer to the width of type_id, sign-extending signed types so
+// that (int64_t)i is always the value of the constant.
+static uint64_t wrap_int(struct tu *tu, uint64_t i, int type_id) {
+    if (TYPE(type_id)->layer == TYPE_BOOL) return i != 0;
+
+    size_t size = type_size(tu, type_id);
+    if (size >= 8 || size == 0) return i;
+
+    int bits = (int)size * 8;
+    uint64_t mask = (1ull << bits) - 1;
+    i &= mask;
+    if (type_is_signed(tu, type_id) && (i >> (bits - 1)) & 1) {
+        i |= ~mask;
+    }
+    return i;
+}
+
+static void convert(struct tu *tu, struct value *v, int type_id) {
+    if (v->kind == VALUE_NONE || v->kind == VALUE_ADDRESS) {
+        return;
+    }
+
+    if (type_is_floating(tu, type_id)) {
+        if (v->kind == VALUE_INT) {
+            v->f = type_is_signed(tu, v->c_type) ? (double)(int64_t)v->i : (double)v->i;
+            v->kind = VALUE_FLOAT;
+        }
+        if (TYPE(type_id)->layer == TYPE_FLOAT) {
+            v->f = (float)v->f;
+        }
+    } else if (type_is_integer(tu, type_id)) {
+        if (v->kind == VALUE_FLOAT) {
+            if (TYPE(type_id)->layer == TYPE_BOOL)
+                v->i = v->f != 0;
+            else if (type_is_signed(tu, type_id))
+                v->i = (uint64_t)(int64_t)v->f;
+            else
+                v->i = (uint64_t)v->f;
+            v->kind = VALUE_INT;
+        }
+        v->i = wrap_int(tu, v->i, type_id);
+    } else {
+        v->kind = VALUE_NONE;
+        return;
+    }
+
+    v->c_type = type_id;
+}
+
+static bool is_true(struct value *v) {
+    switch (v->kind) {
+    case VALUE_INT:
+        return v->i != 0;
+    case VALUE_FLOAT:
+        return v->f != 0;
+    case VALUE_ADDRESS:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool has_static_storage(struct scope *scope) {
+    return scope->is_global || scope->sc == ST_STATIC || scope->sc == ST_EXTERNAL ||
+        scope->sc == ST_THREAD_LOCAL;
+}
+
+// The type of an arbitrary (not necessarily constant) expression, for sizeof
+// and alignof.
+static int expr_type(struct tu *tu, struct node *node) {
+    if (node->c_type) return node->c_type;
+    if (node->type == NODE_IDENT && node->ident.scope_id)
+        return SCOPE(node->ident.scope_id)->c_type;
+    if (node->type == NODE_SUBSCRIPT) {
+        int inner = expr_type(tu, node->subscript.inner);
+        return inner ? TYPE(inner)->inner : 0;
+    }
+    if (node->type == NODE_UNARY_OP && node->token->type == '*') {
+        int inner = expr_type(tu, node->unary_op.inner);
+        return inner ? TYPE(inner)->inner : 0;
+    }
+    return eval(tu, node)->c_type;
+}
+
+// The address of an lvalue with static storage duration, C23(N3096) 6.6.10
+static void eval_address_of(struct tu *tu, struct node *node, struct value *out) {
+    switch (node->type) {
+    case NODE_IDENT: {
+        struct scope *scope = SCOPE(node->ident.scope_id);
+        if (!node->ident.scope_id || !has_static_storage(scope)) return;
+        out->kind = VALUE_ADDRESS;
+        out->address.scope_id = node->ident.scope_id;
+        out->c_type = find_or_create_type(tu, scope->c_type, TYPE_POINTER, 0);
+        return;
+    }
+    case NODE_STRING_LITERAL:
+        out->kind = VALUE_ADDRESS;
+        out->address.string = node;
+        out->c_type = find_or_create_type(tu, find_or_create_type(tu, 0, TYPE_CHAR, 0), TYPE_POINTER, 0);
+        return;
+    case NODE_SUBSCRIPT: {
+        struct value *base = eval(tu, node->subscript.inner);
+        struct value *index = eval(tu, node->subscript.subscript);
+        if (base->kind == VALUE_INT && index->kind == VALUE_ADDRESS) {
+            struct value *t = base;
+            base = index;
+            index = t;
+        }
+        if (base->kind != VALUE_ADDRESS || index->kind != VALUE_INT) return;
+        int element = TYPE(base->c_type)->inner;
+        *out = *base;
+        out->address.offset += (int64_t)index->i * (int64_t)type_size(tu, element);
+        return;
+    }
+    case NODE_UNARY_OP:
+        if (node->token->type == '*') {
+            struct value *inner = eval(tu, node->unary_op.inner);
+            if (inner->kind == VALUE_ADDRESS) *out = *inner;
+        }
+        return;
+    default:
+        return;
+    }
+}
+
+static void eval_unary(struct tu *tu, struct node *node, struct value *out) {
+    int op = node->token->type;
+
+    switch (op) {
+    case TOKEN_SIZEOF:
+    case TOKEN_ALIGNOF: {
+        int type_id = expr_type(tu, node->unary_op.inner);
+        if (!type_id) return;
+        out->kind = VALUE_INT;
+        out->c_type = find_or_create_type(tu, 0, TYPE_UNSIGNED_LONG, 0);
+        out->i = op == TOKEN_SIZEOF ? type_size(tu, type_id) : type_align(tu, type_id);
+        return;
+    }
+    case '&':
+        eval_address_of(tu, node->unary_op.inner, out);
+        return;
+    }
+
+    struct value v = *eval(tu, node->unary_op.inner);
+
+    if (op == '!') {
+        if (v.kind == VALUE_NONE) return;
+        out->kind = VALUE_INT;
+        out->c_type = int_type(tu);
+        out->i = !is_true(&v);
+        return;
+    }
+
+    if (v.kind != VALUE_INT && v.kind != VALUE_FLOAT) return;
+    if (op == '~' && v.kind != VALUE_INT) return;
+
+    convert(tu, &v, type_promote(tu, v.c_type));
+
+    switch (op) {
+    case '+':
+        break;
+    case '-':
+        if (v.kind == VALUE_FLOAT) v.f = -v.f;
+        else v.i = -v.i;
+        break;
+    case '~':
+        v.i = ~v.i;
+        break;
+    default:
+        return;
+    }
+
+    convert(tu, &v, v.c_type);
+    *out = v;
+}
+
+static bool eval_compare(int op, struct value *a, struct value *b, bool is_signed) {
+    if (a->kind == VALUE_FLOAT) {
+        switch (op) {
+        case '<': return a->f < b->f;
+        case '>': return a->f > b->f;
+        case TOKEN_LESS_EQUAL: return a->f <= b->f;
+        case TOKEN_GREATER_EQUAL: return a->f >= b->f;
+        case TOKEN_EQUAL_EQUAL: return a->f == b->f;
+        case TOKEN_NOT_EQUAL: return a->f != b->f;
+        }
+    } else if (is_signed) {
+        int64_t x = (int64_t)a->i, y = (int64_t)b->i;
+        switch (op) {
+        case '<': return x < y;
+        case '>': return x > y;
+        case TOKEN_LESS_EQUAL: return x <= y;
+        case TOKEN_GREATER_EQUAL: return x >= y;
+        case TOKEN_EQUAL_EQUAL: return x == y;
+        case TOKEN_NOT_EQUAL: return x != y;
+        }
+    } else {
+        uint64_t x = a->i, y = b->i;
+        switch (op) {
+        case '<': return x < y;
+        case '>': return x > y;
+        case TOKEN_LESS_EQUAL: return x <= y;
+        case TOKEN_GREATER_EQUAL: return x >= y;
+        case TOKEN_EQUAL_EQUAL: return x == y;
+        case TOKEN_NOT_EQUAL: return x != y;
+        }
+    }
+    return false;
+}
+
+static bool is_comparison(int op) {
+    return op == '<' || op == '>' || op == TOKEN_LESS_EQUAL || op == TOKEN_GREATER_EQUAL ||
+        op == TOKEN_EQUAL_EQUAL || op == TOKEN_NOT_EQUAL;
+}
+
+static void eval_address_arithmetic(struct tu *tu, int op, struct value *a, struct value *b, struct value *out) {
+    if (op == '+' && a->kind == VALUE_INT && b->kind == VALUE_ADDRESS) {
+        struct value *t = a;
+        a = b;
+        b = t;
+    }
+    if (a->kind != VALUE_ADDRESS || b->kind != VALUE_INT) return;
+    if (op != '+' && op != '-') return;
+
+    int64_t scale = (int64_t)type_size(tu, TYPE(a->c_type)->inner);
+    *out = *a;
+    if (op == '+') out->address.offset += (int64_t)b->i * scale;
+    else out->address.offset -= (int64_t)b->i * scale;
+}
+
+static void eval_binary(struct tu *tu, struct node *node, struct value *out) {
+    int op = node->token->type;
+
+    if (op == TOKEN_AND_AND || op == TOKEN_OR_OR) {
+        struct value *lhs = eval(tu, node->binop.lhs);
+        if (lhs->kind == VALUE_NONE) return;
+        bool result = is_true(lhs);
+        // the right operand is not evaluated if the left determines the result
+        if ((op == TOKEN_AND_AND) == result) {
+            struct value *rhs = eval(tu, node->binop.rhs);
+            if (rhs->kind == VALUE_NONE) return;
+            result = is_true(rhs);
+        }
+        out->kind = VALUE_INT;
+        out->c_type = int_type(tu);
+        out->i = result;
+        return;
+    }
+
+    struct value a = *eval(tu, node->binop.lhs);
+    if (a.kind == VALUE_NONE) return;
+    struct value b = *eval(tu, node->binop.rhs);
+    if (b.kind == VALUE_NONE) return;
+
+    if (a.kind == VALUE_ADDRESS || b.kind == VALUE_ADDRESS) {
+        eval_address_arithmetic(tu, op, &a, &b, out);
+        return;
+    }
+
+    if (op == TOKEN_SHIFT_LEFT || op == TOKEN_SHIFT_RIGHT) {
+        if (a.kind != VALUE_INT || b.kind != VALUE_INT) return;
+        convert(tu, &a, type_promote(tu, a.c_type));
+        size_t bits = type_size(tu, a.c_type) * 8;
+        if ((int64_t)b.i < 0 || b.i >= bits) return;
+        if (op == TOKEN_SHIFT_LEFT) a.i <<= b.i;
+        else if (type_is_signed(tu, a.c_type)) a.i = (uint64_t)((int64_t)a.i >> b.i);
+        else a.i >>= b.i;
+        convert(tu, &a, a.c_type);
+        *out = a;
+        return;
+    }
+
+    int common = type_common(tu, a.c_type, b.c_type);
+    convert(tu, &a, common);
+    convert(tu, &b, common);
+    bool is_signed = type_is_signed(tu, common);
+
+    if (is_comparison(op)) {
+        out->kind = VALUE_INT;
+        out->c_type = int_type(tu);
+        out->i = eval_compare(op, &a, &b, is_signed);
+        return;
+    }
+
+    if (a.kind == VALUE_FLOAT) {
+        switch (op) {
+        case '+': a.f += b.f; break;
+        case '-': a.f -= b.f; break;
+        case '*': a.f *= b.f; break;
+        case '/': a.f /= b.f; break;
+        default: return;
+        }
+        convert(tu, &a, common);
+        *out = a;
+        return;
+    }
+
+    // division by zero, and the one signed quotient that doesn't fit, which
+    // traps if computed, are undefined and so not constant; where a constant
+    // is required the caller says so
+    if ((op == '/' || op == '%') && b.i == 0) return;
+    if ((op == '/' || op == '%') && is_signed && (int64_t)b.i == -1 &&
+        (int64_t)a.i == (int64_t)(~0ull << (type_size(tu, common) * 8 - 1))) {
+        return;
+    }
+
+    switch (op) {
+    case '+': a.i += b.i; break;
+    case '-': a.i -= b.i; break;
+    case '*': a.i *= b.i; break;
+    case '/':
+        if (is_signed) a.i = (uint64_t)((int64_t)a.i / (int64_t)b.i);
+        else a.i /= b.i;
+        break;
+    case '%':
+        if (is_signed) a.i = (uint64_t)((int64_t)a.i % (int64_t)b.i);
+        else a.i %= b.i;
+        break;
+    case '&': a.i &= b.i; break;
+    case '|': a.i |= b.i; break;
+    case '^': a.i ^= b.i; break;
+    default:
+        // assignment and comma are never constant expressions
+        return;
+    }
+
+    convert(tu, &a, common);
+    *out = a;
+}
+
+static void eval_node(struct tu *tu, struct node *node, struct value *out) {
+    switch (node->type) {
+    case NODE_INT_LITERAL:
+        out->kind = VALUE_INT;
+        out->c_type = int_literal_type(tu, node->token);
+        out->i = wrap_int(tu, node->token->int_.value, out->c_type);
+        break;
+    case NODE_FLOAT_LITERAL:
+        out->kind = VALUE_FLOAT;
+        out->c_type = float_literal_type(tu, node->token);
+        out->f = node->token->float_.value;
+        convert(tu, out, out->c_type);
+        break;
+    case NODE_STRING_LITERAL:
+        eval_address_of(tu, node, out);
+        break;
+    case NODE_IDENT: {
+        if (!node->ident.scope_id) break;
+        struct scope *scope = SCOPE(node->ident.scope_id);
+        int c_type = scope->c_type;
+        enum layer_type layer = TYPE(c_type)->layer;
+        if (scope->sc == ST_CONSTEXPR && scope->decl->d.initializer) {
+            *out = *eval(tu, scope->decl->d.initializer);
+            convert(tu, out, c_type);
+        } else if (layer == TYPE_ARRAY || layer == TYPE_FUNCTION) {
+            // array and function designators decay to address constants
+            eval_address_of(tu, node, out);
+            if (out->kind == VALUE_ADDRESS && layer == TYPE_ARRAY)
+                out->c_type = find_or_create_type(tu, TYPE(c_type)->inner, TYPE_POINTER, 0);
+        }
+        break;
+    }
+    case NODE_UNARY_OP:
+        eval_unary(tu, node, out);
+        break;
+    case NODE_BINARY_OP:
+        eval_binary(tu, node, out);
+        break;
+    case NODE_TERNARY: {
+        struct value *cond = eval(tu, node->ternary.condition);
+        if (cond->kind == VALUE_NONE) break;
+        struct value *t = eval(tu, node->ternary.branch_true);
+        struct value *f = eval(tu, node->ternary.branch_false);
+        struct value *chosen = is_true(cond) ? t : f;
+        if (chosen->kind == VALUE_NONE) break;
+        *out = *chosen;
+        if (t->kind != VALUE_NONE && f->kind != VALUE_NONE &&
+            type_is_arithmetic(tu, t->c_type) && type_is_arithmetic(tu, f->c_type)) {
+            convert(tu, out, type_common(tu, t->c_type, f->c_type));
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+#ifndef COMPILER_EVAL_H
+#define COMPILER_EVAL_H
+
+#include <stdint.h>
+
+enum value_kind {
+    // evaluated, but not a constant expression
+    VALUE_NONE,
+    VALUE_INT,
+    VALUE_FLOAT,
+    // address constant, C23(N3096) 6.6.10
+    VALUE_ADDRESS,
+};
+
+struct value {
+    enum value_kind kind;
+    int c_type;
+    union {
+        uint64_t i;
+        double f;
+        struct {
+            // the object or function the address points into, 0 for string literals
+            int scope_id;
+            struct node *string;
+            int64_t offset;
+        } address;
+    };
+};
+
+struct tu;
+struct node;
+
+// Evaluate node as a constant expression. The result is cached on the node,
+// so repeated calls on the same subtree are O(1). Never returns nullptr; if
+// the node is not a constant expression the result has kind VALUE_NONE, and
+// nothing is reported: the callers that require a constant do that.
+struct value *eval(struct tu *, struct node *);
+bool eval_int(struct tu *, struct node *, int64_t *out);
+
+#endif //COMPILER_EVAL_H
@@ -0,0 +1,303 @@
+#include "opt.h"
+#include "ir.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Dominator-based value numbering, after Briggs, Cooper and Simpson. The
+// dominator tree is walked in preorder with a scoped hash table of the
+// computations seen on the way down from the entry. An instruction that
+// computes the same operation on the same values as one already in the table
+// is dominated by it, so it is removed and its result replaced by the earlier
+// one. Since the function is in SSA form, every register has one definition
+// and its value never changes, so the table never has to forget a pure
+// computation until the walk leaves the block that made it.
+//
+// Loads are numbered too, but memory does change: an entry for a load is
+// killed by any store or call in between that might write what it read, and
+// by entering a block with more than one predecessor, since the walk has not
+// seen the stores along the other paths.
+
+// What a value is computed from. Operands are value numbers, or the constant
+// and its name for IMM.
+struct key {
+    enum ir_op op;
+    enum ir_cond cond;
+    unsigned char width;
+    bool is_signed;
+    bool is_float;
+    unsigned char from_width;
+    uint64_t a;
+    uint64_t b;
+};
+
+struct entry {
+    struct key key;
+    // the register holding the value, or 0 if the entry is empty
+    reg value;
+    bool killed;
+};
+
+struct gvn {
+    struct function *function;
+    // the value number of each register: the register holding the same
+    // value that every use should read instead
+    reg *vn;
+    struct alias_info alias;
+
+    struct entry *table;
+    size_t mask;
+    // the table entries of the loads that are available, in insertion order
+    block_list_t loads;
+    // undo log: an index into the table is an entry to clear when the walk
+    // leaves the block, a negative one an entry killed in the block
+    block_list_t log;
+};
+
+static bool is_commutative(struct ir_instr *i) {
+    switch (i->op) {
+    case ADD:
+    case MUL:
+    case AND:
+    case OR:
+    case XOR:
+        return true;
+    case TEST:
+        return i->cond == COND_EQ || i->cond == COND_NE;
+    default:
+        return false;
+    }
+}
+
+// Whether an instruction can be numbered: it computes its result from its
+// operands and nothing else, or it is a load.
+static bool is_numbered(struct ir_instr *i) {
+    switch (i->op) {
+    case ADD: case SUB: case MUL: case DIV: case MOD:
+    case AND: case OR: case XOR: case SHR: case SHL:
+    case NEG: case NOT: case INV:
+    case MOVE: case IMM: case ADDR: case TEST:
+    case EXT: case ITOF: case FTOI: case FTOF:
+    case LD:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static reg value_number(struct gvn *g, reg r) {
+    while (g->vn[r] != r) r = g->vn[r];
+    return r;
+}
+
+static struct key make_key(struct gvn *g, struct ir_instr *i) {
+    struct key k = {
+        .op = i->op,
+        .cond = i->cond,
+        .width = i->width,
+        .is_signed = i->is_signed,
+        .is_float = i->is_float,
+        .from_width = i->from_width,
+    };
+    if (i->op == IMM) {
+        struct ir_constant *c = &g->function->constants.data[i->r[1]];
+        k.a = c->i;
+        k.b = (uint64_t)c->name;
+    } else if (i->op == ADDR) {
+        k.a = i->r[1];
+        k.b = i->r[2];
+    } else {
+        int n = ir_use_count(g->function, i);
+        if (n >= 1) k.a = value_number(g, *ir_use(g->function, i, 0));
+        if (n >= 2) k.b = value_number(g, *ir_use(g->function, i, 1));
+        if (is_commutative(i) && k.a > k.b) {
+            uint64_t t = k.a;
+            k.a = k.b;
+            k.b = t;
+        }
+    }
+    return k;
+}
+
+static bool same_key(struct key *x, struct key *y) {
+    return x->op == y->op && x->cond == y->cond && x->width == y->width && x->is_signed == y->is_signed &&
+           x->is_float == y->is_float && x->from_width == y->from_width && x->a == y->a && x->b == y->b;
+}
+
+static size_t hash_key(struct key *k) {
+    uint64_t h = (uint64_t)k->op | (uint64_t)k->cond << 8 | (uint64_t)k->width << 16 |
+                 (uint64_t)k->is_signed << 24 | (uint64_t)k->is_float << 25 | (uint64_t)k->from_width << 32;
+    h = (h ^ k->a) * 0x9e3779b97f4a7c15ull;
+    h = (h ^ k->b) * 0x9e3779b97f4a7c15ull;
+    return (size_t)(h ^ h >> 32);
+}
+
+// The register holding a value with this key, or 0. Leaves *slot at the
+// empty entry where the key would go.
+static reg lookup(struct gvn *g, struct key *k, size_t *slot) {
+    size_t s = hash_key(k) & g->mask;
+    for (; g->table[s].value; s = (s + 1) & g->mask) {
+        struct entry *e = &g->table[s];
+        if (!e->killed && same_key(&e->key, k)) return e->value;
+    }
+    *slot = s;
+    return 0;
+}
+
+// Entries are removed in the reverse of the order they were inserted, so
+// clearing them is enough to leave the probe sequences of the rest intact.
+static void insert(struct gvn *g, size_t slot, struct key *k, reg value) {
+    g->table[slot] = (struct entry){ .key = *k, .value = value };
+    list_push(&g->log, (int)slot);
+    if (k->op == LD) list_push(&g->loads, (int)slot);
+}
+
+static void kill(struct gvn *g, int slot) {
+    g->table[slot].killed = true;
+    list_push(&g->log, -slot - 1);
+}
+
+// Kill the available loads that a store of width bytes to address, or a
+// call if address is 0, might overwrite.
+static void clobber(struct gvn *g, reg address, int width) {
+    for_each (&g->loads) {
+        struct entry *e = &g->table[*it];
+        if (e->killed) continue;
+        reg loaded = (reg)e->key.a;
+        bool hit = address ? may_alias(&g->alias, address, width, loaded, e->key.width)
+                           : call_may_clobber(&g->alias, loaded);
+        if (hit) kill(g, *it);
+    }
+}
+
+struct pass_stats gvn(struct tu *tu, struct function *function) {
+    struct pass_stats stats = {};
+    size_t n_regs = function->regs.len;
+    size_t n_blocks = function->blocks.len;
+    struct ir_block *blocks = function->blocks.data;
+
+    struct gvn g = { .function = function };
+    g.vn = malloc(n_regs * sizeof(reg));
+    for (size_t r = 0; r < n_regs; r++) g.vn[r] = (reg)r;
+    analyze_aliases(function, &g.alias);
+
+    size_t n_instrs = 0;
+    for_each (&function->blocks) n_instrs += it->instrs.len;
+    size_t capacity = 16;
+    while (capacity < n_instrs * 2) capacity *= 2;
+    g.table = calloc(capacity, sizeof(struct entry));
+    g.mask = capacity - 1;
+
+    // the dominator tree, as each block's children
+    int *child_start = calloc(n_blocks + 2, sizeof(int));
+    int *children = malloc(n_blocks * sizeof(int));
+    for (size_t b = 1; b < n_blocks; b++) child_start[blocks[b].idom + 2] += 1;
+    for (size_t b = 1; b <= n_blocks; b++) child_start[b] += child_start[b - 1];
+    for (size_t b = 1; b < n_blocks; b++) children[child_start[blocks[b].idom + 1]++] = (int)b;
+
+    bool **keep = malloc(n_blocks * sizeof(bool *));
+    int *log_start = malloc(n_blocks * sizeof(int));
+    int *loads_start = malloc(n_blocks * sizeof(int));
+    block_list_t stack = {};
+
+    // a negative entry on the stack leaves a block
+    list_push(&stack, 0);
+    while (stack.len) {
+        int b = stack.data[--stack.len];
+        if (b < 0) {
+            b = -b - 1;
+            for (size_t n = g.log.len; n-- > (size_t)log_start[b];) {
+                int slot = g.log.data[n];
+                if (slot >= 0) g.table[slot] = (struct entry){};
+                else g.table[-slot - 1].killed = false;
+            }
+            g.log.len = log_start[b];
+            g.loads.len = loads_start[b];
+            continue;
+        }
+        log_start[b] = (int)g.log.len;
+        loads_start[b] = (int)g.loads.len;
+        list_push(&stack, -b - 1);
+
+        struct ir_block *block = &blocks[b];
+        if (block->preds.len > 1) {
+            for_each (&g.loads) {
+                if (!g.table[*it].killed) kill(&g, *it);
+            }
+        }
+
+        keep[b] = malloc((block->instrs.len + 1) * sizeof(bool));
+        for (size_t n = 0; n < block->instrs.len; n++) {
+            struct ir_instr *instr = &block->instrs.data[n];
+            keep[b][n] = true;
+
+            if (instr->op == PHI) {
+                // a PHI that merges the same value from everywhere, or
+                // itself around a loop, is that value
+                reg same = 0;
+                bool meaningless = true;
+                for (int u = 0; u < ir_use_count(function, instr); u++) {
+                    reg v = value_number(&g, *ir_use(function, instr, u));
+                    if (v == instr->r[0] || v == same) continue;
+                    if (same) meaningless = false;
+                    same = v;
+                }
+                if (meaningless && same) {
+                    g.vn[instr->r[0]] = same;
+                    keep[b][n] = false;
+                    stats.instrs_removed += 1;
+                }
+                continue;
+            }
+            if (instr->op == ST) {
+                reg address = value_number(&g, instr->r[0]);
+                clobber(&g, address, instr->width);
+                continue;
+            }
+            if (instr->op == CALL) clobber(&g, 0, 0);
+            if (!is_numbered(instr)) continue;
+
+            struct key k = make_key(&g, instr);
+            size_t slot;
+            reg found = lookup(&g, &k, &slot);
+            if (found) {
+                g.vn[instr->r[0]] = found;
+                keep[b][n] = false;
+                stats.instrs_removed += 1;
+            } else {
+                insert(&g, slot, &k, instr->r[0]);
+            }
+        }
+
+        for (int c = child_start[b]; c < child_start[b + 1]; c++) list_push(&stack, children[c]);
+    }
+
+    for (size_t b = 0; b < n_blocks; b++) {
+        ir_list_t *instrs = &blocks[b].instrs;
+        size_t kept = 0;
+        for (size_t n = 0; n < instrs->len; n++) {
+            if (!keep[b][n]) continue;
+            struct ir_instr *instr = &instrs->data[n];
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                reg *use = ir_use(function, instr, u);
+                *use = value_number(&g, *use);
+            }
+            instrs->data[kept++] = *instr;
+        }
+        instrs->len = kept;
+        free(keep[b]);
+    }
+
+    list_clear(&stack);
+    list_clear(&g.loads);
+    list_clear(&g.log);
+    free(keep);
+    free(log_start);
+    free(loads_start);
+    free(child_start);
+    free(children);
+    free(g.table);
+    free(g.vn);
+    free_aliases(&g.alias);
+    return stats;
+}
@@ -0,0 +1,757 @@
+#include "tier.h"
+#include "ir.h"
+#include "regalloc.h"
+#include "tu.h"
+#include "type.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The interpreter of tiered execution. A function's IR becomes bytecode
+// whose instructions are each specialized for the width, signedness and
+// kind of value they work on, so every one does a single thing, and they
+// are dispatched by jumping through a table of computed goto labels at the
+// end of each, rather than from one switch.
+//
+// A value lives in a 64 bit slot, in the bits machine code would keep in a
+// register: an integer narrower than 8 bytes is computed at 32 bits with the
+// upper half clear, and a float is in the low 4 bytes. Code that reads only
+// the low bits, as it would the low half of a register, ignores the rest.
+
+#define TTYPE(n) type_at(&tu->types, n)
+
+// a <- b op c for the arithmetic, a <- op b for the rest, as for the IR
+#define BC_OPS(OP) \
+    OP(ADD32) OP(ADD64) OP(SUB32) OP(SUB64) OP(MUL32) OP(MUL64) \
+    OP(AND32) OP(AND64) OP(OR32) OP(OR64) OP(XOR32) OP(XOR64) \
+    OP(SHL32) OP(SHL64) OP(SHR32) OP(SHR64) OP(SAR32) OP(SAR64) \
+    OP(SDIV32) OP(SDIV64) OP(UDIV32) OP(UDIV64) OP(SMOD32) OP(SMOD64) OP(UMOD32) OP(UMOD64) \
+    OP(FADD32) OP(FADD64) OP(FSUB32) OP(FSUB64) OP(FMUL32) OP(FMUL64) OP(FDIV32) OP(FDIV64) \
+    OP(NEG32) OP(NEG64) OP(INV32) OP(INV64) OP(FNEG32) OP(FNEG64) \
+    OP(NOT8) OP(NOT16) OP(NOT32) OP(NOT64) OP(FNOT32) OP(FNOT64) \
+    /* a <- b, a <- constant b, a <- the frame's address plus b */ \
+    OP(MOV) OP(LOADK) OP(FRAME) \
+    /* a <- [b], extended to 32 bits or not at all */ \
+    OP(LD8S) OP(LD8U) OP(LD16S) OP(LD16U) OP(LD32) OP(LD64) \
+    /* [a] <- b */ \
+    OP(ST8) OP(ST16) OP(ST32) OP(ST64) \
+    OP(SX8_32) OP(SX8_64) OP(SX16_32) OP(SX16_64) OP(SX32_64) OP(ZX8) OP(ZX16) OP(ZX32) \
+    /* a <- b cond c, with greater than as less than the other way round */ \
+    OP(EQ32) OP(NE32) OP(LTS32) OP(LES32) OP(LTU32) OP(LEU32) \
+    OP(EQ64) OP(NE64) OP(LTS64) OP(LES64) OP(LTU64) OP(LEU64) \
+    OP(FEQ32) OP(FNE32) OP(FLT32) OP(FLE32) OP(FEQ64) OP(FNE64) OP(FLT64) OP(FLE64) \
+    /* pc <- a; pc <- b if a is zero, else c */ \
+    OP(JMP) OP(JZ8) OP(JZ16) OP(JZ32) OP(JZ64) OP(JZF32) OP(JZF64) \
+    /* a compare and the JZ on its result: pc <- d if a cond b, else c */ \
+    OP(BEQ32) OP(BNE32) OP(BLTS32) OP(BLES32) OP(BLTU32) OP(BLEU32) \
+    OP(BEQ64) OP(BNE64) OP(BLTS64) OP(BLES64) OP(BLTU64) OP(BLEU64) \
+    /* a <- call of function b, of the address in constant b or in slot b, with call c */ \
+    OP(CALL) OP(CALLX) OP(CALLR) \
+    /* return a, extended to 32 bits if it is narrower */ \
+    OP(RET) OP(RET8S) OP(RET8U) OP(RET16S) OP(RET16U) OP(RET32) OP(RETV) \
+    /* conversions, named for the kinds they convert between */ \
+    OP(S32F32) OP(S32F64) OP(U32F32) OP(U32F64) OP(S64F32) OP(S64F64) OP(U64F32) OP(U64F64) \
+    OP(F32S32) OP(F64S32) OP(F32U32) OP(F64U32) OP(F32S64) OP(F64S64) OP(F32U64) OP(F64U64) \
+    OP(F32F64) OP(F64F32)
+
+#define ENUM(name) BC_##name,
+enum bc_op : unsigned char { BC_OPS(ENUM) };
+#undef ENUM
+
+struct bc_instr {
+    enum bc_op op;
+    uint32_t a, b, c, d;
+};
+
+struct bc_call {
+    // the first of its arguments in args
+    uint32_t args;
+    uint32_t n_args;
+    // the result, which decides the register it comes back in
+    unsigned char width;
+    bool is_float;
+};
+
+// the most arguments a call to machine code passes on the stack
+#define MAX_STACK_ARGS 16
+
+// The two slots narrow comparisons are extended into.
+#define N_SCRATCH 2
+
+struct builder {
+    struct tier *tier;
+    struct tu *tu;
+    struct function *function;
+    struct bytecode *code;
+    bool *is_float;
+    // how many instructions read each register
+    int *uses;
+    uint32_t scratch;
+};
+
+static void put(struct builder *b, enum bc_op op, uint32_t x, uint32_t y, uint32_t z, uint32_t w) {
+    list_push(&b->code->instrs, ((struct bc_instr){ .op = op, .a = x, .b = y, .c = z, .d = w }));
+}
+
+static uint32_t constant(struct builder *b, uint64_t value) {
+    list_push(&b->code->constants, value);
+    return (uint32_t)b->code->constants.len - 1;
+}
+
+static bool is_wide(struct ir_instr *i) {
+    return i->width > 4;
+}
+
+static uint64_t float_bits(double f, int width) {
+    uint64_t bits = 0;
+    if (width == 4) {
+        float narrow = (float)f;
+        memcpy(&bits, &narrow, sizeof(narrow));
+    } else {
+        memcpy(&bits, &f, sizeof(f));
+    }
+    return bits;
+}
+
+static enum bc_op arithmetic(struct ir_instr *i) {
+    int w = i->is_float ? i->width == 8 : is_wide(i);
+    if (i->is_float) {
+        switch (i->op) {
+        case ADD: return BC_FADD32 + w;
+        case SUB: return BC_FSUB32 + w;
+        case MUL: return BC_FMUL32 + w;
+        default: return BC_FDIV32 + w;
+        }
+    }
+    switch (i->op) {
+    case ADD: return BC_ADD32 + w;
+    case SUB: return BC_SUB32 + w;
+    case MUL: return BC_MUL32 + w;
+    case AND: return BC_AND32 + w;
+    case OR: return BC_OR32 + w;
+    case XOR: return BC_XOR32 + w;
+    case SHL: return BC_SHL32 + w;
+    case SHR: return (i->is_signed ? BC_SAR32 : BC_SHR32) + w;
+    case DIV: return (i->is_signed ? BC_SDIV32 : BC_UDIV32) + w;
+    default: return (i->is_signed ? BC_SMOD32 : BC_UMOD32) + w;
+    }
+}
+
+// The extension of a from byte integer to 32 or 64 bits.
+static enum bc_op extension(int from, bool wide, bool is_signed) {
+    switch (from) {
+    case 1: return is_signed ? (wide ? BC_SX8_64 : BC_SX8_32) : BC_ZX8;
+    case 2: return is_signed ? (wide ? BC_SX16_64 : BC_SX16_32) : BC_ZX16;
+    case 4: return is_signed && wide ? BC_SX32_64 : BC_ZX32;
+    default: return wide ? BC_MOV : BC_ZX32;
+    }
+}
+
+static const enum bc_op int_tests[2][3] = {
+    { BC_EQ32, BC_LTS32, BC_LES32 },
+    { BC_EQ64, BC_LTS64, BC_LES64 },
+};
+
+// The test of a comparison, with its operands swapped if it is greater than
+// or greater or equal.
+static enum bc_op test_op(struct ir_instr *i, bool *swap) {
+    *swap = i->cond == COND_GT || i->cond == COND_GE;
+    bool strict = i->cond == COND_LT || i->cond == COND_GT;
+    if (i->is_float) {
+        enum bc_op base = i->width == 8 ? BC_FEQ64 : BC_FEQ32;
+        if (i->cond == COND_EQ || i->cond == COND_NE) return base + (i->cond == COND_NE);
+        return base + (strict ? 2 : 3);
+    }
+    const enum bc_op *tests = int_tests[is_wide(i)];
+    if (i->cond == COND_EQ || i->cond == COND_NE) return tests[0] + (i->cond == COND_NE);
+    enum bc_op op = strict ? tests[1] : tests[2];
+    // the unsigned tests follow the signed ones
+    return i->is_signed ? op : op + 2;
+}
+
+// The operands of an integer test narrower than 32 bits, extended into the
+// scratch slots.
+static void extend_operands(struct builder *b, struct ir_instr *i, uint32_t *x, uint32_t *y) {
+    if (i->is_float || i->width >= 4) return;
+    enum bc_op op = extension(i->width, false, i->is_signed);
+    put(b, op, b->scratch, *x, 0, 0);
+    put(b, op, b->scratch + 1, *y, 0, 0);
+    *x = b->scratch;
+    *y = b->scratch + 1;
+}
+
+static bool build_test(struct builder *b, struct ir_instr *i, struct ir_instr *next) {
+    uint32_t x = i->r[1], y = i->r[2];
+    bool swap;
+    enum bc_op op = test_op(i, &swap);
+    extend_operands(b, i, &x, &y);
+    if (swap) {
+        uint32_t t = x;
+        x = y;
+        y = t;
+    }
+    // a test that only decides the branch after it becomes part of it
+    if (next && next->op == JZ && next->r[0] == i->r[0] && b->uses[i->r[0]] == 1 && !i->is_float) {
+        // the branches are in the same order as the tests
+        put(b, op - BC_EQ32 + BC_BEQ32, x, y, next->r[1], next->r[2]);
+        return true;
+    }
+    put(b, op, i->r[0], x, y, 0);
+    return false;
+}
+
+static enum bc_op load_op(struct ir_instr *i) {
+    switch (i->width) {
+    case 1: return i->is_signed && !i->is_float ? BC_LD8S : BC_LD8U;
+    case 2: return i->is_signed && !i->is_float ? BC_LD16S : BC_LD16U;
+    case 4: return BC_LD32;
+    default: return BC_LD64;
+    }
+}
+
+static enum bc_op store_op(int width) {
+    switch (width) {
+    case 1: return BC_ST8;
+    case 2: return BC_ST16;
+    case 4: return BC_ST32;
+    default: return BC_ST64;
+    }
+}
+
+static enum bc_op return_op(struct ir_instr *i) {
+    if (!i->r[0]) return BC_RETV;
+    if (i->is_float) return BC_RET;
+    switch (i->width) {
+    case 1: return i->is_signed ? BC_RET8S : BC_RET8U;
+    case 2: return i->is_signed ? BC_RET16S : BC_RET16U;
+    case 4: return BC_RET32;
+    default: return BC_RET;
+    }
+}
+
+static enum bc_op int_to_float(struct builder *b, struct ir_instr *i, uint32_t *from) {
+    int w = i->width == 8;
+    switch (i->from_width) {
+    case 1:
+    case 2:
+        // narrow integers convert as ints
+        put(b, extension(i->from_width, false, i->is_signed), b->scratch, *from, 0, 0);
+        *from = b->scratch;
+        return BC_S32F32 + w;
+    case 4: return (i->is_signed ? BC_S32F32 : BC_U32F32) + w;
+    default: return (i->is_signed ? BC_S64F32 : BC_U64F32) + w;
+    }
+}
+
+static enum bc_op float_to_int(struct ir_instr *i) {
+    int w = i->from_width == 8;
+    if (is_wide(i)) return (i->is_signed ? BC_F32S64 : BC_F32U64) + w;
+    return (i->is_signed ? BC_F32S32 : BC_F32U32) + w;
+}
+
+// The address a symbol has in the engine, for an ADDR or a call.
+static bool symbol_address(struct builder *b, int name, uint64_t *address) {
+    int s = tier_symbol_index(b->tier, name);
+    if (s == -1) {
+        fprintf(stderr, "interp: undefined symbol %s\n", tu_string(b->tu, name));
+        return false;
+    }
+    *address = (uint64_t)b->tier->symbols.data[s].address;
+    return true;
+}
+
+static bool build_call(struct builder *b, struct ir_instr *i) {
+    struct tu *tu = b->tu;
+    struct function *function = b->function;
+    struct bytecode *code = b->code;
+    reg *args = &function->operands.data[i->r[2] + 1];
+    int n_args = (int)function->operands.data[i->r[2]];
+    int n_int = 0, n_float = 0;
+    list_push(&code->calls, ((struct bc_call){
+        .args = (uint32_t)code->args.len,
+        .n_args = (uint32_t)n_args,
+        .width = i->width,
+        .is_float = i->is_float,
+    }));
+    for (int a = 0; a < n_args; a++) {
+        bool is_float = b->is_float[args[a]];
+        n_int += !is_float;
+        n_float += is_float;
+        list_push(&code->args, args[a] | (is_float ? FLOAT_SLOT : 0));
+    }
+    int n_stack = (n_int > 6 ? n_int - 6 : 0) + (n_float > 8 ? n_float - 8 : 0);
+    if (n_stack > MAX_STACK_ARGS) {
+        fprintf(stderr, "interp: a call with %i arguments on the stack\n", n_stack);
+        return false;
+    }
+
+    uint32_t call = (uint32_t)code->calls.len - 1;
+    struct scope *scope = function->regs.data[i->r[1]].scope;
+    if (!scope || !names_symbol(tu, scope)) {
+        put(b, BC_CALLR, i->r[0], i->r[1], call, 0);
+        return true;
+    }
+    bool is_global;
+    int name = scope_symbol(tu, scope, &is_global);
+    int callee = tier_function_index(b->tier, name);
+    if (callee != -1) {
+        put(b, BC_CALL, i->r[0], (uint32_t)callee, call, 0);
+        return true;
+    }
+    uint64_t address;
+    if (!symbol_address(b, name, &address)) return false;
+    put(b, BC_CALLX, i->r[0], constant(b, address), call, 0);
+    return true;
+}
+
+static bool build_instr(struct builder *b, struct ir_instr *i, struct ir_instr *next, bool *fused) {
+    struct tu *tu = b->tu;
+    struct function *function = b->function;
+    *fused = false;
+    switch (i->op) {
+    case ADD: case SUB: case MUL: case DIV: case MOD:
+    case AND: case OR: case XOR: case SHR: case SHL:
+        put(b, arithmetic(i), i->r[0], i->r[1], i->r[2], 0);
+        break;
+    case NEG:
+        if (i->is_float) put(b, i->width == 8 ? BC_FNEG64 : BC_FNEG32, i->r[0], i->r[1], 0, 0);
+        else put(b, BC_NEG32 + is_wide(i), i->r[0], i->r[1], 0, 0);
+        break;
+    case INV:
+        put(b, BC_INV32 + is_wide(i), i->r[0], i->r[1], 0, 0);
+        break;
+    case NOT:
+        if (i->is_float) put(b, i->width == 8 ? BC_FNOT64 : BC_FNOT32, i->r[0], i->r[1], 0, 0);
+        else put(b, i->width == 1 ? BC_NOT8 : i->width == 2 ? BC_NOT16 : BC_NOT32 + is_wide(i), i->r[0], i->r[1], 0, 0);
+        break;
+    case MOVE:
+        put(b, BC_MOV, i->r[0], i->r[1], 0, 0);
+        break;
+    case IMM: {
+        struct ir_constant *c = &function->constants.data[i->r[1]];
+        uint64_t bits = i->is_float ? float_bits(c->f, i->width) : is_wide(i) ? c->i : (uint32_t)c->i;
+        put(b, BC_LOADK, i->r[0], constant(b, bits), 0, 0);
+        break;
+    }
+    case ST:
+        put(b, store_op(i->width), i->r[0], i->r[1], 0, 0);
+        break;
+    case LD:
+        put(b, load_op(i), i->r[0], i->r[1], 0, 0);
+        break;
+    case ADDR: {
+        uint64_t address;
+        if (!i->r[1]) {
+            if (!symbol_address(b, function->constants.data[i->r[2]].name, &address)) return false;
+            put(b, BC_LOADK, i->r[0], constant(b, address), 0, 0);
+            break;
+        }
+        struct scope *scope = function->regs.data[i->r[1]].scope;
+        if (!names_symbol(tu, scope)) {
+            put(b, BC_FRAME, i->r[0], b->code->frame_size + scope->frame_offset, 0, 0);
+            break;
+        }
+        bool is_global;
+        if (!symbol_address(b, scope_symbol(tu, scope, &is_global), &address)) return false;
+        put(b, BC_LOADK, i->r[0], constant(b, address), 0, 0);
+        break;
+    }
+    case CALL:
+        return build_call(b, i);
+    case RET:
+        put(b, return_op(i), i->r[0], 0, 0, 0);
+        break;
+    case TEST:
+        *fused = build_test(b, i, next);
+        break;
+    case JZ:
+        if (i->r[1] == i->r[2]) put(b, BC_JMP, i->r[1], 0, 0, 0);
+        else if (i->is_float) put(b, i->width == 8 ? BC_JZF64 : BC_JZF32, i->r[0], i->r[1], i->r[2], 0);
+        else put(b, i->width == 1 ? BC_JZ8 : i->width == 2 ? BC_JZ16 : BC_JZ32 + is_wide(i), i->r[0], i->r[1], i->r[2], 0);
+        break;
+    case JMP:
+        put(b, BC_JMP, i->r[0], 0, 0, 0);
+        break;
+    case EXT:
+        put(b, extension(i->from_width, is_wide(i), i->is_signed), i->r[0], i->r[1], 0, 0);
+        break;
+    case ITOF: {
+        uint32_t from = i->r[1];
+        enum bc_op op = int_to_float(b, i, &from);
+        put(b, op, i->r[0], from, 0, 0);
+        break;
+    }
+    case FTOI:
+        put(b, float_to_int(i), i->r[0], i->r[1], 0, 0);
+        break;
+    case FTOF:
+        put(b, i->width == 8 ? BC_F32F64 : BC_F64F32, i->r[0], i->r[1], 0, 0);
+        break;
+    case PHI:
+        fprintf(stderr, "interp: PHI in a function that should not be in SSA form\n");
+        return false;
+    }
+    return true;
+}
+
+// Branches are built to blocks, and pointed at their first instructions once
+// every block has been built.
+static void resolve_branches(struct bytecode *code, uint32_t *block_start) {
+    for_each (&code->instrs) {
+        if (it->op == BC_JMP) {
+            it->a = block_start[it->a];
+        } else if (it->op >= BC_JZ8 && it->op <= BC_JZF64) {
+            it->b = block_start[it->b];
+            it->c = block_start[it->c];
+        } else if (it->op >= BC_BEQ32 && it->op <= BC_BLEU64) {
+            it->c = block_start[it->c];
+            it->d = block_start[it->d];
+        }
+    }
+}
+
+bool build_bytecode(struct tier *tier, struct tier_function *f) {
+    struct tu *tu = tier->tu;
+    struct function *function = f->ir;
+    struct bytecode *code = &f->code;
+    size_t n_regs = function->regs.len;
+
+    bool *is_float = calloc(n_regs, sizeof(bool));
+    bool *can_remat = calloc(n_regs, sizeof(bool));
+    struct ir_instr *remat = calloc(n_regs, sizeof(struct ir_instr));
+    int *defs = calloc(n_regs, sizeof(int));
+    int *uses = calloc(n_regs, sizeof(int));
+    classify_registers(function, is_float, can_remat, remat, defs);
+    for_each_n (block, &function->blocks) {
+        for_each_n (instr, &block->instrs) {
+            for (int u = 0; u < ir_use_count(function, instr); u++) uses[*ir_use(function, instr, u)] += 1;
+        }
+    }
+
+    // the variables in memory are laid out like the machine code's, below a
+    // base that is 8 byte aligned
+    int frame_size = layout_frame(tu, function);
+    code->frame_size = (uint32_t)(frame_size + 7) / 8 * 8;
+    code->n_slots = (uint32_t)n_regs + N_SCRATCH;
+
+    struct type *type = TTYPE(function->scope->c_type);
+    for (size_t p = 0; p < function->params.len; p++) {
+        reg r = function->params.data[p];
+        bool param_float = p < type->function.params.len ? type_is_floating(tu, type->function.params.data[p]) : is_float[r];
+        list_push(&code->params, r | (param_float ? FLOAT_SLOT : 0));
+    }
+
+    struct builder b = {
+        .tier = tier,
+        .tu = tu,
+        .function = function,
+        .code = code,
+        .is_float = is_float,
+        .uses = uses,
+        .scratch = (uint32_t)n_regs,
+    };
+    uint32_t *block_start = calloc(function->blocks.len, sizeof(uint32_t));
+    bool ok = true;
+    for (size_t bl = 0; bl < function->blocks.len && ok; bl++) {
+        struct ir_block *block = &function->blocks.data[bl];
+        block_start[bl] = (uint32_t)code->instrs.len;
+        for (size_t n = 0; n < block->instrs.len && ok; n++) {
+            struct ir_instr *next = n + 1 < block->instrs.len ? &block->instrs.data[n + 1] : nullptr;
+            bool fused;
+            ok = build_instr(&b, &block->instrs.data[n], next, &fused);
+            if (fused) n++;
+        }
+    }
+    resolve_branches(code, block_start);
+
+    free(block_start);
+    free(is_float);
+    free(can_remat);
+    free(remat);
+    free(defs);
+    free(uses);
+    return ok;
+}
+
+void free_bytecode(struct bytecode *code) {
+    list_clear(&code->instrs);
+    list_clear(&code->constants);
+    list_clear(&code->calls);
+    list_clear(&code->args);
+    list_clear(&code->params);
+}
+
+static float get_f32(uint64_t v) {
+    float f;
+    uint32_t bits = (uint32_t)v;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static double get_f64(uint64_t v) {
+    double f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+static uint64_t put_f32(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(f));
+    return bits;
+}
+
+static uint64_t put_f64(double f) {
+    uint64_t bits;
+    memcpy(&bits, &f, sizeof(f));
+    return bits;
+}
+
+// A value as it is kept in a slot, from the register it came back in.
+static uint64_t call_result(struct bc_call *call, uint64_t value) {
+    int size = call->is_float ? call->width : call->width <= 4 ? 4 : 8;
+    return size == 4 ? (uint32_t)value : value;
+}
+
+typedef struct words (*native_function)(uint64_t, ...);
+
+// Call machine code with the System V ABI. Its signature isn't known here,
+// so it is called as a variadic function taking every argument register,
+// doubles in the xmm registers, and the stack arguments: each argument goes
+// where it would if it had been declared, al says all 8 xmm registers might
+// be used, and both registers a value comes back in are returned.
+static uint64_t call_native(char *address, struct bc_call *call, const uint32_t *args, const uint64_t *slots) {
+    uint64_t ints[6] = {}, stack[MAX_STACK_ARGS] = {};
+    double floats[8] = {};
+    int n_int = 0, n_float = 0, n_stack = 0;
+    for (uint32_t a = 0; a < call->n_args; a++) {
+        uint32_t arg = args[call->args + a];
+        uint64_t value = slots[arg & ~FLOAT_SLOT];
+        if (arg & FLOAT_SLOT && n_float < 8) memcpy(&floats[n_float++], &value, sizeof(double));
+        else if (!(arg & FLOAT_SLOT) && n_int < 6) ints[n_int++] = value;
+        else stack[n_stack++] = value;
+    }
+    native_function function;
+    memcpy(&function, &address, sizeof(function));
+    struct words result;
+#define REGISTERS ints[0], ints[1], ints[2], ints[3], ints[4], ints[5], \
+    floats[0], floats[1], floats[2], floats[3], floats[4], floats[5], floats[6], floats[7]
+    if (!n_stack) {
+        result = function(REGISTERS);
+    } else {
+        result = function(REGISTERS, stack[0], stack[1], stack[2], stack[3], stack[4], stack[5], stack[6], stack[7],
+                          stack[8], stack[9], stack[10], stack[11], stack[12], stack[13], stack[14], stack[15]);
+    }
+#undef REGISTERS
+    return call_result(call, call->is_float ? put_f64(result.f) : result.i);
+}
+
+// A call to a function of the module: interpreted, unless it has been
+// compiled since.
+static uint64_t call_function(struct tier *tier, struct tier_function *callee, struct bc_call *call,
+                              const uint32_t *args, const uint64_t *slots) {
+    char *entry = atomic_load_explicit(callee->slot, memory_order_acquire);
+    if (entry != callee->thunk) return call_native(entry, call, args, slots);
+    uint64_t values[call->n_args + 1];
+    for (uint32_t a = 0; a < call->n_args; a++) values[a] = slots[args[call->args + a] & ~FLOAT_SLOT];
+    return call_result(call, interpret(tier, callee, values, call->n_args));
+}
+
+uint64_t interpret(struct tier *tier, struct tier_function *f, const uint64_t *args, size_t n_args) {
+#define LABEL(name) [BC_##name] = &&do_##name,
+    static const void *const labels[] = { BC_OPS(LABEL) };
+#undef LABEL
+    struct bytecode *code = &f->code;
+    if (f->calls < TIER_CALLS && ++f->calls == TIER_CALLS) request_compile(tier, f);
+
+    uint64_t slots[code->n_slots];
+    memset(slots, 0, sizeof(slots));
+    uint64_t frame[code->frame_size / 8 + 1];
+    char *base = (char *)frame;
+    for (size_t p = 0; p < code->params.len && p < n_args; p++) slots[code->params.data[p] & ~FLOAT_SLOT] = args[p];
+
+    struct bc_instr *start = code->instrs.data, *ip = start;
+    const uint32_t *call_args = code->args.data;
+
+#define A slots[ip->a]
+#define B slots[ip->b]
+#define C slots[ip->c]
+#define NEXT() goto *labels[(++ip)->op]
+    // a jump back is a loop going round again
+#define JUMP(target) \
+    do { \
+        struct bc_instr *to = start + (target); \
+        if (to <= ip && f->back_edges < TIER_BACK_EDGES && ++f->back_edges == TIER_BACK_EDGES) \
+            request_compile(tier, f); \
+        ip = to; \
+        goto *labels[ip->op]; \
+    } while (0)
+#define OP32(name, expr) do_##name: { uint32_t x = (uint32_t)B, y = (uint32_t)C; A = (uint32_t)(expr); NEXT(); }
+#define OP64(name, expr) do_##name: { uint64_t x = B, y = C; A = (expr); NEXT(); }
+#define FOP(name, op) \
+    do_##name##32: A = put_f32(get_f32(B) op get_f32(C)); NEXT(); \
+    do_##name##64: A = put_f64(get_f64(B) op get_f64(C)); NEXT();
+#define TEST32(name, type, op) do_##name: A = (type)B op (type)C; NEXT();
+#define BRANCH(name, type, op) do_##name: JUMP((type)B op (type)C ? ip->d : ip->c);
+#define UNARY(name, expr) do_##name: { uint64_t x = B; A = (expr); NEXT(); }
+
+    goto *labels[ip->op];
+
+    OP32(ADD32, x + y) OP64(ADD64, x + y)
+    OP32(SUB32, x - y) OP64(SUB64, x - y)
+    OP32(MUL32, x * y) OP64(MUL64, x * y)
+    OP32(AND32, x & y) OP64(AND64, x & y)
+    OP32(OR32, x | y) OP64(OR64, x | y)
+    OP32(XOR32, x ^ y) OP64(XOR64, x ^ y)
+    // the machine masks shift counts to the width
+    OP32(SHL32, x << (y & 31)) OP64(SHL64, x << (y & 63))
+    OP32(SHR32, x >> (y & 31)) OP64(SHR64, x >> (y & 63))
+    OP32(SAR32, (int32_t)x >> (y & 31)) OP64(SAR64, (uint64_t)((int64_t)x >> (y & 63)))
+    OP32(SDIV32, (int32_t)x / (int32_t)y) OP64(SDIV64, (uint64_t)((int64_t)x / (int64_t)y))
+    OP32(UDIV32, x / y) OP64(UDIV64, x / y)
+    OP32(SMOD32, (int32_t)x % (int32_t)y) OP64(SMOD64, (uint64_t)((int64_t)x % (int64_t)y))
+    OP32(UMOD32, x % y) OP64(UMOD64, x % y)
+    FOP(FADD, +)
+    FOP(FSUB, -)
+    FOP(FMUL, *)
+    FOP(FDIV, /)
+
+    UNARY(NEG32, (uint32_t)-(uint32_t)x) UNARY(NEG64, -x)
+    UNARY(INV32, (uint32_t)~x) UNARY(INV64, ~x)
+    // a float's sign is flipped in its bits
+    UNARY(FNEG32, x ^ 0x80000000u) UNARY(FNEG64, x ^ 0x8000000000000000u)
+    UNARY(NOT8, (uint8_t)x == 0) UNARY(NOT16, (uint16_t)x == 0) UNARY(NOT32, (uint32_t)x == 0) UNARY(NOT64, x == 0)
+    UNARY(FNOT32, get_f32(x) == 0) UNARY(FNOT64, get_f64(x) == 0)
+
+do_MOV:
+    A = B;
+    NEXT();
+do_LOADK:
+    A = code->constants.data[ip->b];
+    NEXT();
+do_FRAME:
+    A = (uint64_t)(base + ip->b);
+    NEXT();
+
+#define LOAD(name, type, cast) do_##name: { type v; memcpy(&v, (void *)B, sizeof(v)); A = cast v; NEXT(); }
+    LOAD(LD8S, int8_t, (uint32_t)(int32_t)) LOAD(LD8U, uint8_t, )
+    LOAD(LD16S, int16_t, (uint32_t)(int32_t)) LOAD(LD16U, uint16_t, )
+    LOAD(LD32, uint32_t, ) LOAD(LD64, uint64_t, )
+#undef LOAD
+#define STORE(name, type) do_##name: { type v = (type)B; memcpy((void *)A, &v, sizeof(v)); NEXT(); }
+    STORE(ST8, uint8_t) STORE(ST16, uint16_t) STORE(ST32, uint32_t) STORE(ST64, uint64_t)
+#undef STORE
+
+    UNARY(SX8_32, (uint32_t)(int32_t)(int8_t)x) UNARY(SX8_64, (uint64_t)(int64_t)(int8_t)x)
+    UNARY(SX16_32, (uint32_t)(int32_t)(int16_t)x) UNARY(SX16_64, (uint64_t)(int64_t)(int16_t)x)
+    UNARY(SX32_64, (uint64_t)(int64_t)(int32_t)x)
+    UNARY(ZX8, (uint8_t)x) UNARY(ZX16, (uint16_t)x) UNARY(ZX32, (uint32_t)x)
+
+    TEST32(EQ32, uint32_t, ==) TEST32(NE32, uint32_t, !=)
+    TEST32(LTS32, int32_t, <) TEST32(LES32, int32_t, <=)
+    TEST32(LTU32, uint32_t, <) TEST32(LEU32, uint32_t, <=)
+    TEST32(EQ64, uint64_t, ==) TEST32(NE64, uint64_t, !=)
+    TEST32(LTS64, int64_t, <) TEST32(LES64, int64_t, <=)
+    TEST32(LTU64, uint64_t, <) TEST32(LEU64, uint64_t, <=)
+do_FEQ32: A = get_f32(B) == get_f32(C); NEXT();
+do_FNE32: A = get_f32(B) != get_f32(C); NEXT();
+do_FLT32: A = get_f32(B) < get_f32(C); NEXT();
+do_FLE32: A = get_f32(B) <= get_f32(C); NEXT();
+do_FEQ64: A = get_f64(B) == get_f64(C); NEXT();
+do_FNE64: A = get_f64(B) != get_f64(C); NEXT();
+do_FLT64: A = get_f64(B) < get_f64(C); NEXT();
+do_FLE64: A = get_f64(B) <= get_f64(C); NEXT();
+
+do_JMP: JUMP(ip->a);
+do_JZ8: JUMP((uint8_t)A ? ip->c : ip->b);
+do_JZ16: JUMP((uint16_t)A ? ip->c : ip->b);
+do_JZ32: JUMP((uint32_t)A ? ip->c : ip->b);
+do_JZ64: JUMP(A ? ip->c : ip->b);
+    // a NaN isn't zero
+do_JZF32: JUMP(get_f32(A) != 0 ? ip->c : ip->b);
+do_JZF64: JUMP(get_f64(A) != 0 ? ip->c : ip->b);
+#undef B
+#undef C
+#define B slots[ip->a]
+#define C slots[ip->b]
+    BRANCH(BEQ32, uint32_t, ==) BRANCH(BNE32, uint32_t, !=)
+    BRANCH(BLTS32, int32_t, <) BRANCH(BLES32, int32_t, <=)
+    BRANCH(BLTU32, uint32_t, <) BRANCH(BLEU32, uint32_t, <=)
+    BRANCH(BEQ64, uint64_t, ==) BRANCH(BNE64, uint64_t, !=)
+    BRANCH(BLTS64, int64_t, <) BRANCH(BLES64, int64_t, <=)
+    BRANCH(BLTU64, uint64_t, <) BRANCH(BLEU64, uint64_t, <=)
+#undef B
+#undef C
+#define B slots[ip->b]
+#define C slots[ip->c]
+
+do_CALL:
+    A = call_function(tier, &tier->functions.data[ip->b], &code->calls.data[ip->c], call_args, slots);
+    NEXT();
+do_CALLX:
+    A = call_native((char *)code->constants.data[ip->b], &code->calls.data[ip->c], call_args, slots);
+    NEXT();
+do_CALLR: {
+    // a pointer to a function of the module is its entry stub
+    char *address = (char *)B;
+    struct tier_function *functions = tier->functions.data;
+    size_t n = tier->functions.len;
+    if (n && address >= functions[0].stub && address < functions[0].stub + n * 8 && (address - functions[0].stub) % 8 == 0) {
+        A = call_function(tier, &functions[(address - functions[0].stub) / 8], &code->calls.data[ip->c], call_args, slots);
+    } else {
+        A = call_native(address, &code->calls.data[ip->c], call_args, slots);
+    }
+    NEXT();
+}
+
+do_RET: return A;
+do_RET8S: return (uint32_t)(int32_t)(int8_t)A;
+do_RET8U: return (uint8_t)A;
+do_RET16S: return (uint32_t)(int32_t)(int16_t)A;
+do_RET16U: return (uint16_t)A;
+do_RET32: return (uint32_t)A;
+do_RETV: return 0;
+
+    UNARY(S32F32, put_f32((float)(int32_t)x)) UNARY(S32F64, put_f64((double)(int32_t)x))
+    UNARY(U32F32, put_f32((float)(uint32_t)x)) UNARY(U32F64, put_f64((double)(uint32_t)x))
+    UNARY(S64F32, put_f32((float)(int64_t)x)) UNARY(S64F64, put_f64((double)(int64_t)x))
+    UNARY(U64F32, put_f32((float)x)) UNARY(U64F64, put_f64((double)x))
+    // truncated like cvttss2si, and an unsigned int by way of a long
+    UNARY(F32S32, (uint32_t)(int32_t)get_f32(x)) UNARY(F64S32, (uint32_t)(int32_t)get_f64(x))
+    UNARY(F32U32, (uint32_t)(int64_t)get_f32(x)) UNARY(F64U32, (uint32_t)(int64_t)get_f64(x))
+    UNARY(F32S64, (uint64_t)(int64_t)get_f32(x)) UNARY(F64S64, (uint64_t)(int64_t)get_f64(x))
+    // an unsigned long past the longs is converted less 2^63
+    UNARY(F32U64, get_f32(x) >= 0x1p63f ? (uint64_t)(int64_t)(get_f32(x) - 0x1p63f) ^ 0x8000000000000000u
+                                        : (uint64_t)(int64_t)get_f32(x))
+    UNARY(F64U64, get_f64(x) >= 0x1p63 ? (uint64_t)(int64_t)(get_f64(x) - 0x1p63) ^ 0x8000000000000000u
+                                       : (uint64_t)(int64_t)get_f64(x))
+    UNARY(F32F64, put_f64((double)get_f32(x))) UNARY(F64F32, put_f32((float)get_f64(x)))
+
+#undef A
+#undef B
+#undef C
+#undef NEXT
+#undef JUMP
+#undef OP32
+#undef OP64
+#undef FOP
+#undef TEST32
+#undef BRANCH
+#undef UNARY
+}
+
+struct words enter_interpreter(struct tier_function *f, const uint64_t *registers, const uint64_t *stack) {
+    size_t n = f->code.params.len;
+    uint64_t args[n + 1];
+    int n_int = 0, n_float = 0, n_stack = 0;
+    for (size_t p = 0; p < n; p++) {
+        bool is_float = f->code.params.data[p] & FLOAT_SLOT;
+        if (is_float && n_float < 8) args[p] = registers[6 + n_float++];
+        else if (!is_float && n_int < 6) args[p] = registers[n_int++];
+        else args[p] = stack[n_stack++];
+    }
+    uint64_t value = interpret(f->tier, f, args, n);
+    struct words result = { .i = value };
+    memcpy(&result.f, &value, sizeof(value));
+    return result;
+}
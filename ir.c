@@ -3,41 +3,80 @@
 #include "parse.h"
 #include "type.h"
 #include "tu.h"
+#include "eval.h"
+#include "walk.h"
+#include "diag.h"
+#include "opt.h"
+#include "regalloc.h"
+#include "sched.h"
+#include "x86.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 
 #define SCOPE(n) list_ptr(&context->tu->scopes, n)
 #define TSCOPE(n) list_ptr(&tu->scopes, n)
+#define TTYPE(n) type_at(&tu->types, n)
 
-void print_ir_reg(struct tu *tu, struct ir_reg *reg) {
-    if (reg->scope) {
-        print_token(tu, reg->scope->token);
+void print_ir_reg(struct tu *tu, struct function *function, reg r) {
+    struct ir_reg *info = &function->regs.data[r];
+    if (!r) {
+        fputc('_', stderr);
+    } else if (info->scope) {
+        print_token(tu, info->scope->token);
+        if (info->index) fprintf(stderr, ".%i", info->index);
     } else {
-        fprintf(stderr, "r%i", reg->index);
+        fprintf(stderr, "r%i", info->index);
     }
+    if (function->allocation && r < function->allocation->locations.len) {
+        struct location *location = &function->allocation->locations.data[r];
+        if (location->kind == LOC_NONE) return;
+        fputc('@', stderr);
+        print_location(location);
+    }
+}
+
+static void print_reg(struct tu *tu, struct function *function, struct ir_instr *i, int r) {
+    print_ir_reg(tu, function, i->r[r]);
 }
 
-void print_reg(struct tu *tu, struct ir_instr *i, int r) {
-    print_ir_reg(tu, i->r[r]);
+static void print_width(struct ir_instr *i) {
+    if (!i->width) return;
+    fprintf(stderr, ".%c%i", i->is_float ? 'f' : i->is_signed ? 's' : 'u', i->width * 8);
 }
 
-void print_ir_instr(struct tu *tu, struct ir_instr *i) {
+static const char *cond_names[] = {
+    [COND_EQ] = "eq",
+    [COND_NE] = "ne",
+    [COND_LT] = "lt",
+    [COND_LE] = "le",
+    [COND_GT] = "gt",
+    [COND_GE] = "ge",
+};
+
+void print_ir_instr(struct tu *tu, struct function *function, struct ir_instr *i) {
+    struct ir_constant *constant = &function->constants.data[i->r[1]];
+
     switch (i->op) {
 #define CASE3(instr, name) case (instr): \
-    print_reg(tu, i, 0); \
-    fprintf(stderr, " := " name " "); \
-    print_reg(tu, i, 1); \
+    print_reg(tu, function, i, 0); \
+    fprintf(stderr, " := " name); \
+    print_width(i); \
+    fputc(' ', stderr); \
+    print_reg(tu, function, i, 1); \
     fputs(", ", stderr); \
-    print_reg(tu, i, 2); \
+    print_reg(tu, function, i, 2); \
     fputc('\n', stderr); \
     break
 
 #define CASE2(instr, name) case (instr): \
-    print_reg(tu, i, 0); \
-    fprintf(stderr, " := " name " "); \
-    print_reg(tu, i, 1); \
+    print_reg(tu, function, i, 0); \
+    fprintf(stderr, " := " name); \
+    print_width(i); \
+    fputc(' ', stderr); \
+    print_reg(tu, function, i, 1); \
     fputc('\n', stderr); \
     break
 
@@ -51,112 +90,235 @@ void print_ir_instr(struct tu *tu, struct ir_instr *i) {
     CASE3(XOR, "xor");
     CASE3(SHR, "shr");
     CASE3(SHL, "shl");
-    CASE3(TEST, "test");
 
     CASE2(NEG, "neg");
     CASE2(INV, "inv");
     CASE2(NOT, "not");
-    CASE2(ADDR, "addr");
+
+#undef CASE3
+#undef CASE2
+
+#define CONVERT(instr, name) case (instr): \
+    print_reg(tu, function, i, 0); \
+    fprintf(stderr, " := " name); \
+    print_width(i); \
+    fputc(' ', stderr); \
+    print_reg(tu, function, i, 1); \
+    fprintf(stderr, " (%i bytes)\n", i->from_width); \
+    break
+
+    CONVERT(EXT, "ext");
+    CONVERT(ITOF, "itof");
+    CONVERT(FTOI, "ftoi");
+    CONVERT(FTOF, "ftof");
+
+#undef CONVERT
+
+    case TEST:
+        print_reg(tu, function, i, 0);
+        fprintf(stderr, " := test.%s", cond_names[i->cond]);
+        print_width(i);
+        fputc(' ', stderr);
+        print_reg(tu, function, i, 1);
+        fputs(", ", stderr);
+        print_reg(tu, function, i, 2);
+        fputc('\n', stderr);
+        break;
+
+    case ADDR:
+        print_reg(tu, function, i, 0);
+        fprintf(stderr, " := addr ");
+        if (i->r[1]) print_reg(tu, function, i, 1);
+        else fputs(tu_string(tu, function->constants.data[i->r[2]].name), stderr);
+        fputc('\n', stderr);
+        break;
 
     case MOVE:
-        print_reg(tu, i, 0);
-        fprintf(stderr, " := ");
-        print_reg(tu, i, 1);
+        print_reg(tu, function, i, 0);
+        fprintf(stderr, " := mov");
+        print_width(i);
+        fputc(' ', stderr);
+        print_reg(tu, function, i, 1);
         fputc('\n', stderr);
         break;
 
     case LD:
-        print_reg(tu, i, 0);
-        fprintf(stderr, " := [");
-        print_reg(tu, i, 1);
+        print_reg(tu, function, i, 0);
+        fprintf(stderr, " := ld");
+        print_width(i);
+        fprintf(stderr, " [");
+        print_reg(tu, function, i, 1);
         fprintf(stderr, "]\n");
+        break;
 
     case ST:
         fprintf(stderr, "[");
-        print_reg(tu, i, 0);
-        fprintf(stderr, "] := ");
-        print_reg(tu, i, 1);
+        print_reg(tu, function, i, 0);
+        fprintf(stderr, "] := st");
+        print_width(i);
+        fputc(' ', stderr);
+        print_reg(tu, function, i, 1);
         fprintf(stderr, "\n");
+        break;
 
     case IMM:
-        print_reg(tu, i, 0);
-        fprintf(stderr, " := %llu\n", i->immediate_i);
+        print_reg(tu, function, i, 0);
+        fprintf(stderr, " := imm");
+        print_width(i);
+        if (i->is_float) fprintf(stderr, " %g\n", constant->f);
+        else if (i->is_signed) fprintf(stderr, " %lli\n", (long long)constant->i);
+        else fprintf(stderr, " %llu\n", (unsigned long long)constant->i);
         break;
 
     case RET:
-        fprintf(stderr, "ret ");
-        print_reg(tu, i, 0);
+        fprintf(stderr, "ret");
+        print_width(i);
+        fputc(' ', stderr);
+        print_reg(tu, function, i, 0);
         fputc('\n', stderr);
         break;
 
-    case LABEL:
-        fprintf(stderr, "label: %s:\n", i->name);
-        break;
-
     case JMP:
-        fprintf(stderr, "jmp %s\n", i->name);
+        fprintf(stderr, "jmp %s\n", tu_string(tu, function->blocks.data[i->r[0]].label));
         break;
 
     case JZ:
-        fprintf(stderr, "jz %s, ", i->name);
-        print_reg(tu, i, 0);
-        fprintf(stderr, "\n");
+        fprintf(stderr, "jz");
+        print_width(i);
+        fputc(' ', stderr);
+        print_reg(tu, function, i, 0);
+        fprintf(stderr, ", %s, %s\n", tu_string(tu, function->blocks.data[i->r[1]].label),
+                tu_string(tu, function->blocks.data[i->r[2]].label));
         break;
 
     case CALL:
-        print_reg(tu, i, 0);
-        fprintf(stderr, " := call ");
-        print_reg(tu, i, 1);
-        fprintf(stderr, ", ");
-        bool first = true;
-        for_each (&i->args) {
-            if (!first) fprintf(stderr, ", ");
-            print_ir_reg(tu, *it);
-            first = false;
+        print_reg(tu, function, i, 0);
+        fprintf(stderr, " := call");
+        print_width(i);
+        fputc(' ', stderr);
+        print_reg(tu, function, i, 1);
+        reg *args = &function->operands.data[i->r[2]];
+        fputs(" (", stderr);
+        for (reg n = 0; n < args[0]; n += 1) {
+            if (n) fputs(", ", stderr);
+            print_ir_reg(tu, function, args[n + 1]);
         }
+        fputs(")\n", stderr);
         break;
 
-    case PHI:
-        fprintf(stderr, "PHI instruction shouldn't be a thing");
+    case PHI: {
+        print_reg(tu, function, i, 0);
+        fprintf(stderr, " := phi");
+        print_width(i);
+        reg *args = &function->operands.data[i->r[1]];
+        struct ir_block *block = &function->blocks.data[function->current];
+        for (reg n = 0; n < args[0]; n += 1) {
+            fputs(n ? ", [" : " [", stderr);
+            print_ir_reg(tu, function, args[n + 1]);
+            if (n < block->preds.len) fprintf(stderr, ", %s", tu_string(tu, function->blocks.data[block->preds.data[n]].label));
+            fputc(']', stderr);
+        }
+        fputc('\n', stderr);
         break;
+    }
 
     default:
         fprintf(stderr, "no print for ir %i\n", i->op);
-
-#undef CASE3
     }
 }
 
-// TODO: this should use the tu argument to print to tu->strtab instead of allocating
-// for itself.
-const char *tprintf(struct tu *tu, const char *format, ...) {
-    char *out;
-    va_list args;
-    va_start(args, format);
-    vasprintf(&out, format, args);
-    va_end(args);
-    return out;
+// How an expression is wanted by its parent.
+enum emit_mode : char {
+    // the value of the expression, after lvalue conversion
+    EMIT_VALUE,
+    // the register of a register variable that the parent assigns to
+    EMIT_WRITE,
+    // the address of an lvalue that lives in memory
+    EMIT_ADDRESS,
+};
+
+void print_function(struct tu *tu, struct function *function) {
+    print_token(tu, function->scope->token);
+    fputc('(', stderr);
+    for_each (&function->params) {
+        if (it != function->params.data) fputs(", ", stderr);
+        print_ir_reg(tu, function, *it);
+    }
+    fputs("):\n", stderr);
+
+    for_each_n (block, &function->blocks) {
+        // PHI operands are printed with the predecessor they come from
+        function->current = (int)(block - function->blocks.data);
+        fprintf(stderr, "%s:", tu_string(tu, block->label));
+        if (block->preds.len) {
+            fputs(" ; preds", stderr);
+            for_each (&block->preds) fprintf(stderr, " %s", tu_string(tu, function->blocks.data[*it].label));
+        }
+        fputc('\n', stderr);
+        for_each_n (instr, &block->instrs) {
+            fputs("    ", stderr);
+            print_ir_instr(tu, function, instr);
+        }
+    }
 }
 
-struct ir_reg *emit_node_recur(struct tu *tu, struct function *function, struct node *node, bool write);
-struct function *new_function();
+static void print_global(struct tu *tu, struct ir_global *global) {
+    fprintf(stderr, "data");
+    if (global->width) fprintf(stderr, ".%c%i", global->is_float ? 'f' : global->is_signed ? 's' : 'u', global->width * 8);
+    fputc(' ', stderr);
+    print_token(tu, global->scope->token);
+    if (!global->width) fprintf(stderr, " (%zu bytes)", global->size);
 
-int emit(struct tu *tu) {
-    struct function *function = new_function();
+    if (!global->initialized) fputc('\n', stderr);
+    else if (global->init.name) fprintf(stderr, " := &%s + %lli\n", tu_string(tu, global->init.name), (long long)global->init.i);
+    else if (global->is_float) fprintf(stderr, " := %g\n", global->init.f);
+    else fprintf(stderr, " := %llu\n", (unsigned long long)global->init.i);
+}
 
-    emit_node_recur(tu, function, tu->ast_root, false);
+void print_module(struct tu *tu, struct module *module) {
+    for_each (&module->globals) {
+        print_global(tu, it);
+    }
+    for_each (&module->functions) {
+        print_function(tu, *it);
+    }
+}
 
-    for_each_n (instr, &function->ir_list) {
-        print_ir_instr(tu, instr);
+reg emit_node(struct tu *tu, struct function *function, struct node *root);
+static struct function *emit_function(struct tu *tu, struct node *node);
+
+// Build the module: one function for each definition, and the static data of
+// the file scope declarations and any static locals. At -O0 a definition goes
+// straight to machine code instead, unless it is to be tiered.
+int emit(struct tu *tu) {
+    for_each (&tu->ast_root->root.children) {
+        struct node *node = *it;
+        if (node->type == NODE_FUNCTION_DEFINITION && tu->opt_level == 0 && !tu->tiered) {
+            list_push(&tu->module.code, baseline_function(tu, node));
+        } else if (node->type == NODE_FUNCTION_DEFINITION) {
+            struct function *function = emit_function(tu, node);
+            if (!tu->tiered) prepare_function(tu, function);
+            list_push(&tu->module.functions, function);
+        } else if (node->type == NODE_DECLARATION) {
+            for_each_n (d, &node->decl.declarators) {
+                emit_global(tu, *d);
+            }
+        }
     }
 
-    // fprintf(stderr, "\n");
-    // print_control_flow(tu, function);
+    print_module(tu, &tu->module);
 
     return 0;
 }
 
-struct ir_instr ir_move(struct ir_reg *out, struct ir_reg *in) {
+void prepare_function(struct tu *tu, struct function *function) {
+    optimize(tu, function);
+    if (tu->opt_level >= 2) schedule_function(tu, function);
+    if (tu->opt_level >= 3) color_registers(tu, function);
+    else allocate_registers(tu, function);
+}
+
+struct ir_instr ir_move(reg out, reg in) {
     ir i = {
         .op = MOVE,
         .r = { out, in },
@@ -164,7 +326,7 @@ struct ir_instr ir_move(struct ir_reg *out, struct ir_reg *in) {
     return i;
 }
 
-struct ir_instr ir_binop(enum ir_op op, struct ir_reg *out, struct ir_reg *in1, struct ir_reg *in2) {
+struct ir_instr ir_binop(enum ir_op op, reg out, reg in1, reg in2) {
     ir i = {
         .op = op,
         .r = { out, in1, in2 },
@@ -172,23 +334,49 @@ struct ir_instr ir_binop(enum ir_op op, struct ir_reg *out, struct ir_reg *in1,
     return i;
 }
 
-struct ir_instr ir_label(const char *name) {
+struct ir_instr ir_test(enum ir_cond cond, reg out, reg in1, reg in2) {
     ir i = {
-        .op = LABEL,
-        .name = name,
+        .op = TEST,
+        .cond = cond,
+        .r = { out, in1, in2 },
+    };
+    return i;
+}
+
+struct ir_instr ir_unop(enum ir_op op, reg out, reg in) {
+    ir i = {
+        .op = op,
+        .r = { out, in },
     };
     return i;
 }
 
-struct ir_instr ir_unop(enum ir_op op, struct ir_reg *out, struct ir_reg *in) {
+struct ir_instr ir_convert(enum ir_op op, reg out, reg in, size_t from_width) {
     ir i = {
         .op = op,
+        .from_width = (unsigned char)from_width,
         .r = { out, in },
     };
     return i;
 }
 
-struct ir_instr ir_ret(struct ir_reg *v) {
+struct ir_instr ir_load(reg out, reg address) {
+    ir i = {
+        .op = LD,
+        .r = { out, address },
+    };
+    return i;
+}
+
+struct ir_instr ir_store(reg address, reg value) {
+    ir i = {
+        .op = ST,
+        .r = { address, value },
+    };
+    return i;
+}
+
+struct ir_instr ir_ret(reg v) {
     ir i = {
         .op = RET,
         .r = { v },
@@ -196,260 +384,1472 @@ struct ir_instr ir_ret(struct ir_reg *v) {
     return i;
 }
 
-struct ir_instr ir_jz(const char *label, struct ir_reg *cond) {
+struct ir_instr ir_jz(reg cond, int if_zero, int otherwise) {
     ir i = {
         .op = JZ,
-        .name = label,
-        .r = { cond },
+        .r = { cond, if_zero, otherwise },
     };
     return i;
 }
 
-struct ir_instr ir_jmp(const char *label) {
+struct ir_instr ir_jmp(int block) {
     ir i = {
         .op = JMP,
-        .name = label,
+        .r = { block },
     };
     return i;
 }
 
-struct ir_instr ir_imm(uint64_t immediate, struct ir_reg *out) {
+static reg new_constant(struct function *function, struct ir_constant constant) {
+    list_push(&function->constants, constant);
+    return (reg)function->constants.len - 1;
+}
+
+struct ir_instr ir_imm(struct function *function, uint64_t immediate, reg out) {
     ir i = {
         .op = IMM,
-        .immediate_i = immediate,
-        .r = { out },
+        .r = { out, new_constant(function, (struct ir_constant){ .i = immediate }) },
     };
     return i;
 }
 
-struct ir_instr ir_call(struct ir_reg *out, struct ir_reg *func, reg_list_t args) {
+struct ir_instr ir_fimm(struct function *function, double immediate, reg out) {
+    ir i = {
+        .op = IMM,
+        .r = { out, new_constant(function, (struct ir_constant){ .f = immediate }) },
+    };
+    return i;
+}
+
+struct ir_instr ir_string(struct function *function, reg out, int name) {
+    ir i = {
+        .op = ADDR,
+        .r = { out, 0, new_constant(function, (struct ir_constant){ .name = name }) },
+    };
+    return i;
+}
+
+static size_t value_width(struct tu *tu, int type_id);
+
+// Static data is emitted from the folded value of its initializer rather than
+// computed at runtime.
+static struct ir_global ir_global(struct tu *tu, struct scope *scope, struct value *v) {
+    int type = scope->c_type;
+    struct ir_global global = {
+        .scope = scope,
+        .size = type_size(tu, type),
+    };
+    enum layer_type layer = TTYPE(type)->layer;
+    if (layer != TYPE_ARRAY && layer != TYPE_STRUCT && layer != TYPE_UNION) {
+        global.width = (unsigned char)value_width(tu, type);
+        global.is_signed = type_is_signed(tu, type);
+        global.is_float = type_is_floating(tu, type);
+    }
+    if (!v) return global;
+
+    global.initialized = true;
+    switch (v->kind) {
+    case VALUE_INT:
+        global.init.i = v->i;
+        break;
+    case VALUE_FLOAT:
+        global.init.f = v->f;
+        break;
+    case VALUE_ADDRESS: {
+        struct token *t = v->address.scope_id ? TSCOPE(v->address.scope_id)->token : v->address.string->token;
+        global.init.name = tu_intern(tu, &tu->source[t->index], t->len);
+        global.init.i = v->address.offset;
+        break;
+    }
+    case VALUE_NONE:
+        break;
+    }
+    return global;
+}
+
+// The arguments are copied to the function's operand array.
+struct ir_instr ir_call(struct function *function, reg out, reg func, reg_list_t *args) {
+    reg first = (reg)function->operands.len;
+    list_push(&function->operands, (reg)args->len);
+    for_each (args) list_push(&function->operands, *it);
     ir i = {
         .op = CALL,
-        .r = { out, func },
-        .args = args,
+        .r = { out, func, first },
     };
     return i;
 }
 
-struct function *new_function() {
+// The width an rvalue of this type occupies in a register. Arrays and
+// functions only appear as their address.
+static size_t value_width(struct tu *tu, int type_id) {
+    switch (TTYPE(type_id)->layer) {
+    case TYPE_ARRAY:
+    case TYPE_FUNCTION:
+    case TYPE_POINTER:
+        return 8;
+    case TYPE_VOID:
+        return 0;
+    default:
+        return type_size(tu, type_id);
+    }
+}
+
+// Attach the width and signedness of a C type to an instruction.
+static struct ir_instr typed(struct tu *tu, struct ir_instr i, int type_id) {
+    if (!type_id) return i;
+    i.width = (unsigned char)value_width(tu, type_id);
+    i.is_float = type_is_floating(tu, type_id);
+    i.is_signed = type_is_signed(tu, type_id);
+    return i;
+}
+
+struct function *new_function(struct scope *scope) {
     struct function *function = calloc(1, sizeof(struct function));
+    function->scope = scope;
+    list_push(&function->regs, (struct ir_reg){});
+    list_push(&function->constants, (struct ir_constant){});
     return function;
 }
 
-struct ir_reg *new_reg(struct function *function) {
-    reg *r = calloc(1, sizeof(struct ir_reg));
-    r->function = function;
-    return r;
+reg new_reg(struct function *function, struct scope *scope, int index) {
+    list_push(&function->regs, ((struct ir_reg){ .scope = scope, .index = index }));
+    return (reg)function->regs.len - 1;
 }
 
-struct ir_reg *new_temporary(struct function *function) {
-    reg *r = new_reg(function);
-    r->index = function->temporary_id++;
-    return r;
+reg new_temporary(struct function *function) {
+    return new_reg(function, nullptr, function->temporary_id++);
 }
 
-static struct ir_reg *new_scope_reg(struct function *function, struct scope *scope, bool write) {
-    if (write) scope->ir_index += 1;
-    reg *r = new_reg(function);
-    r->scope = scope;
-    r->index = (short)scope->ir_index;
+// A register variable is one register for the whole function, assigned as
+// often as the source does; build_ssa splits it into versions. The scope
+// remembers the register, which is checked before reuse because a scope can
+// be referenced from more than one function.
+static reg new_scope_reg(struct function *function, struct scope *scope) {
+    reg r = scope->ir_reg;
+    if (r && r < function->regs.len && function->regs.data[r].scope == scope)
+        return r;
+    r = new_reg(function, scope, 0);
+    scope->ir_reg = r;
     return r;
 }
 
-struct ir_reg *emit_node_recur(struct tu *tu, struct function *function, struct node *node, bool write) {
-#define EMIT(i) list_push(&function->ir_list, (i))
-
-    switch (node->type) {
-    case NODE_ROOT:
-        for_each (&node->root.children) {
-            emit_node_recur(tu, function, *it, false);
-        }
-        return nullptr;
-    case NODE_BINARY_OP: {
-        enum ir_op op;
-        switch (node->token->type) {
-#define CASE(token, p) case (token): op = (p); break
-        CASE('+', ADD);
-        CASE('-', SUB);
-        CASE('*', MUL);
-        CASE('/', DIV);
-        CASE('&', AND);
-        CASE('|', OR);
-        CASE('^', XOR);
-        CASE(TOKEN_EQUAL_EQUAL, TEST);
-        CASE(TOKEN_SHIFT_RIGHT, SHR);
-        CASE(TOKEN_SHIFT_LEFT, SHL);
-        CASE('=', MOVE);
-#undef CASE
-        default:
-            fprintf(stderr, "unhandled binary operation: %i\n", node->token->type);
-            return nullptr;
-        }
-        if (op == MOVE) {
-            reg *lhs = emit_node_recur(tu, function, node->binop.lhs, true);
-            reg *rhs = emit_node_recur(tu, function, node->binop.rhs, false);
-            EMIT(ir_move(lhs, rhs));
-            return lhs;
-        } else {
-            reg *lhs = emit_node_recur(tu, function, node->binop.lhs, true);
-            reg *rhs = emit_node_recur(tu, function, node->binop.rhs, false);
-            reg *res = new_temporary(function);
-            EMIT(ir_binop(op, res, lhs, rhs));
-            return res;
-        }
-    }
-    case NODE_UNARY_OP: {
-        enum ir_op op;
-        switch (node->token->type) {
-#define CASE(token, p) case (token): op = (p); break
-        CASE('-', NEG);
-        CASE('!', NOT);
-        CASE('~', INV);
-        CASE('*', ST);
-        CASE('&', ADDR);
-#undef CASE
-        default:
-            fprintf(stderr, "unhandled binary operation: %i\n", node->token->type);
-            return nullptr;
+void free_function(struct function *function) {
+    for_each (&function->blocks) {
+        list_clear(&it->instrs);
+        list_clear(&it->preds);
+    }
+    list_clear(&function->blocks);
+    list_clear(&function->layout);
+    list_clear(&function->regs);
+    list_clear(&function->constants);
+    list_clear(&function->operands);
+    list_clear(&function->params);
+    if (function->allocation) free_allocation(function->allocation);
+    free(function->allocation);
+    free(function);
+}
+
+bool ir_is_terminator(enum ir_op op) {
+    return op == JZ || op == JMP || op == RET;
+}
+
+reg ir_def(struct ir_instr *i) {
+    switch (i->op) {
+    case ST:
+    case RET:
+    case JZ:
+    case JMP:
+        return 0;
+    default:
+        return i->r[0];
+    }
+}
+
+int ir_use_count(struct function *function, struct ir_instr *i) {
+    switch (i->op) {
+    case IMM:
+    case ADDR:
+    case JMP:
+        return 0;
+    case RET:
+        return i->r[0] ? 1 : 0;
+    case JZ:
+        return 1;
+    case ST:
+    case TEST:
+    case ADD: case SUB: case MUL: case DIV: case MOD:
+    case AND: case OR: case XOR: case SHR: case SHL:
+        return 2;
+    case CALL:
+        return 1 + (int)function->operands.data[i->r[2]];
+    case PHI:
+        return (int)function->operands.data[i->r[1]];
+    default:
+        return 1;
+    }
+}
+
+reg *ir_use(struct function *function, struct ir_instr *i, int n) {
+    switch (i->op) {
+    case RET:
+    case JZ:
+        return &i->r[0];
+    case ST:
+        return &i->r[n];
+    case CALL:
+        return n ? &function->operands.data[i->r[2] + n] : &i->r[1];
+    case PHI:
+        return &function->operands.data[i->r[1] + 1 + n];
+    default:
+        return &i->r[1 + n];
+    }
+}
+
+static bool block_terminated(struct ir_block *block) {
+    return block->instrs.len && ir_is_terminator(list_last(&block->instrs).op);
+}
+
+static int new_block(struct function *function, int label) {
+    list_push(&function->blocks, ((struct ir_block){ .label = label, .idom = -1 }));
+    return (int)function->blocks.len - 1;
+}
+
+// Make block the one being emitted into. Falling into it from the previous
+// block becomes an explicit jump, so every block ends in a terminator.
+static void start_block(struct function *function, int block) {
+    struct ir_block *current = &function->blocks.data[function->current];
+    if (function->layout.len && !block_terminated(current)) {
+        list_push(&current->instrs, ir_jmp(block));
+    }
+    function->current = block;
+    list_push(&function->layout, block);
+}
+
+static void emit_instr(struct tu *tu, struct function *function, struct ir_instr i) {
+    if (block_terminated(&function->blocks.data[function->current])) {
+        // code after a jump or return can't be reached, but it still needs a block
+        start_block(function, new_block(function, tu_printf(tu, "dead%i", ++function->cond_id)));
+    }
+    list_push(&function->blocks.data[function->current].instrs, i);
+}
+
+#define EMIT(i) emit_instr(tu, function, (i))
+
+// Fill in the successors and predecessors of every block from the
+// terminators. Predecessors are counted first so each list is allocated once
+// at its exact size.
+void compute_cfg(struct function *function) {
+    for_each_n (block, &function->blocks) {
+        block->n_succs = 0;
+        block->preds.len = 0;
+        if (!block->instrs.len) continue;
+        struct ir_instr *last = &list_last(&block->instrs);
+        if (last->op == JMP) {
+            block->succs[block->n_succs++] = (int)last->r[0];
+        } else if (last->op == JZ) {
+            block->succs[block->n_succs++] = (int)last->r[1];
+            if (last->r[2] != last->r[1]) block->succs[block->n_succs++] = (int)last->r[2];
+        }
+    }
+    for_each_n (block, &function->blocks) {
+        for (int s = 0; s < block->n_succs; s++) function->blocks.data[block->succs[s]].preds.len++;
+    }
+    for_each_n (block, &function->blocks) {
+        if (block->preds.cap < block->preds.len) {
+            block->preds.data = realloc(block->preds.data, block->preds.len * sizeof(int));
+            block->preds.cap = block->preds.len;
+        }
+        block->preds.len = 0;
+    }
+    for (int b = 0; b < (int)function->blocks.len; b++) {
+        struct ir_block *block = &function->blocks.data[b];
+        for (int s = 0; s < block->n_succs; s++) {
+            struct ir_block *succ = &function->blocks.data[block->succs[s]];
+            succ->preds.data[succ->preds.len++] = b;
+        }
+    }
+}
+
+// Drop the CFG edge from one block to another, along with its operands in the
+// PHIs of the block it leads to. The terminator of from is left alone, so the
+// caller is expected to have already retargeted it.
+void remove_edge(struct function *function, int from, int to) {
+    struct ir_block *block = &function->blocks.data[from];
+    for (int s = 0; s < block->n_succs; s++) {
+        if (block->succs[s] != to) continue;
+        block->succs[s] = block->succs[--block->n_succs];
+        break;
+    }
+
+    struct ir_block *succ = &function->blocks.data[to];
+    size_t p = 0;
+    while (p < succ->preds.len && succ->preds.data[p] != from) p++;
+    if (p == succ->preds.len) return;
+
+    for_each_n (instr, &succ->instrs) {
+        if (instr->op != PHI) break;
+        reg *args = &function->operands.data[instr->r[1]];
+        for (reg n = (reg)p; n + 1 < args[0]; n++) args[1 + n] = args[2 + n];
+        args[0] -= 1;
+    }
+    for (size_t n = p; n + 1 < succ->preds.len; n++) succ->preds.data[n] = succ->preds.data[n + 1];
+    succ->preds.len -= 1;
+}
+
+void retarget_edge(struct function *function, int from, int old, int new) {
+    struct ir_block *block = &function->blocks.data[from];
+    for (int s = 0; s < block->n_succs; s++) {
+        if (block->succs[s] == old) block->succs[s] = new;
+    }
+    struct ir_instr *term = &list_last(&block->instrs);
+    if (term->op == JMP && term->r[0] == (reg)old) term->r[0] = (reg) new;
+    if (term->op == JZ && term->r[1] == (reg)old) term->r[1] = (reg) new;
+    if (term->op == JZ && term->r[2] == (reg)old) term->r[2] = (reg) new;
+}
+
+// The new block has the highest index, so it moves to the end of the preds
+// of to, and its PHI operand with it.
+int split_edge(struct tu *tu, struct function *function, int from, int to) {
+    int label = tu_printf(tu, "%s.%s", tu_string(tu, function->blocks.data[from].label),
+                          tu_string(tu, function->blocks.data[to].label));
+    int edge = new_block(function, label);
+    struct ir_block *block = &function->blocks.data[edge];
+    block->succs[block->n_succs++] = to;
+    list_push(&block->preds, from);
+    list_push(&block->instrs, ir_jmp(to));
+    retarget_edge(function, from, to, edge);
+
+    struct ir_block *succ = &function->blocks.data[to];
+    size_t p = 0;
+    while (succ->preds.data[p] != from) p++;
+    for_each_n (instr, &succ->instrs) {
+        if (instr->op != PHI) break;
+        reg *args = &function->operands.data[instr->r[1]];
+        reg value = args[1 + p];
+        for (reg n = (reg)p; n + 1 < args[0]; n++) args[1 + n] = args[2 + n];
+        args[args[0]] = value;
+    }
+    for (size_t n = p; n + 1 < succ->preds.len; n++) succ->preds.data[n] = succ->preds.data[n + 1];
+    list_last(&succ->preds) = edge;
+    return edge;
+}
+
+// Delete the blocks that can't be reached from the entry, along with their
+// operands in the PHIs of the blocks they jump to. Dominators are left for
+// the caller to recompute. Returns the number of blocks removed.
+int remove_unreachable_blocks(struct function *function) {
+    size_t n = function->blocks.len;
+    int *renumber = malloc(n * sizeof(int));
+    for (size_t b = 0; b < n; b++) renumber[b] = -1;
+
+    block_list_t work = {};
+    list_push(&work, 0);
+    renumber[0] = 0;
+    while (work.len) {
+        struct ir_block *block = &function->blocks.data[work.data[--work.len]];
+        for (int s = 0; s < block->n_succs; s++) {
+            if (renumber[block->succs[s]] != -1) continue;
+            renumber[block->succs[s]] = 0;
+            list_push(&work, block->succs[s]);
+        }
+    }
+    list_clear(&work);
+
+    int removed = 0;
+    for (size_t b = 0; b < n; b++) {
+        if (renumber[b] == -1) removed += 1;
+        else renumber[b] = (int)b - removed;
+    }
+    if (!removed) {
+        free(renumber);
+        return 0;
+    }
+
+    for (size_t b = 0; b < n; b++) {
+        struct ir_block *block = &function->blocks.data[b];
+        if (renumber[b] == -1) {
+            list_clear(&block->instrs);
+            list_clear(&block->preds);
+            continue;
+        }
+
+        for_each_n (instr, &block->instrs) {
+            if (instr->op != PHI) break;
+            reg *args = &function->operands.data[instr->r[1]];
+            reg kept = 0;
+            for (size_t p = 0; p < block->preds.len; p++) {
+                if (renumber[block->preds.data[p]] != -1) args[1 + kept++] = args[1 + p];
+            }
+            args[0] = kept;
         }
-        if (op == ST && !write) op = LD;
 
-        reg *inner = emit_node_recur(tu, function, node->unary_op.inner, write);
-        reg *res = new_temporary(function);
-        EMIT(ir_unop(op, res, inner));
+        size_t kept = 0;
+        for_each (&block->preds) {
+            if (renumber[*it] != -1) block->preds.data[kept++] = renumber[*it];
+        }
+        block->preds.len = kept;
+
+        for (int s = 0; s < block->n_succs; s++) block->succs[s] = renumber[block->succs[s]];
+        struct ir_instr *last = &list_last(&block->instrs);
+        if (last->op == JMP) {
+            last->r[0] = renumber[last->r[0]];
+        } else if (last->op == JZ) {
+            last->r[1] = renumber[last->r[1]];
+            last->r[2] = renumber[last->r[2]];
+        }
+        block->idom = -1;
+        function->blocks.data[renumber[b]] = *block;
+    }
+
+    function->blocks.len -= removed;
+    free(renumber);
+    return removed;
+}
+
+// Objects that can't live in a virtual register: anything with static storage,
+// arrays, and anything whose address is taken.
+static bool in_memory(struct tu *tu, struct scope *scope) {
+    if (scope->is_global || scope->sc == ST_STATIC || scope->sc == ST_THREAD_LOCAL ||
+        scope->sc == ST_EXTERNAL || scope->sc == ST_CONSTEXPR)
+        return true;
+    enum layer_type layer = TTYPE(scope->c_type)->layer;
+    return layer == TYPE_ARRAY || layer == TYPE_FUNCTION || scope->address_taken;
+}
+
+static bool is_register_variable(struct tu *tu, struct node *node) {
+    return node->type == NODE_IDENT && !in_memory(tu, TSCOPE(node->ident.scope_id));
+}
+
+// Convert an rvalue between two types, C23(N3096) 6.3.
+static reg emit_convert(struct tu *tu, struct function *function, reg in, int from, int to) {
+    if (!from || !to || from == to || !in) return in;
+    if (TTYPE(to)->layer == TYPE_VOID) return in;
+
+    // C23(N3096) 6.3.1.2
+    if (TTYPE(to)->layer == TYPE_BOOL && TTYPE(from)->layer != TYPE_BOOL) {
+        reg zero = new_temporary(function);
+        reg res = new_temporary(function);
+        EMIT(typed(tu, ir_imm(function, 0, zero), from));
+        EMIT(typed(tu, ir_test(COND_NE, res, in, zero), from));
         return res;
     }
-    case NODE_POSTFIX_OP:
-        break;
-    case NODE_IDENT: {
-        struct scope *scope = TSCOPE(node->ident.scope_id);
-        return new_scope_reg(function, scope, false);
+
+    size_t from_width = value_width(tu, from);
+    size_t to_width = value_width(tu, to);
+    bool from_float = type_is_floating(tu, from);
+    bool to_float = type_is_floating(tu, to);
+    enum ir_op op;
+
+    if (from_float && to_float) {
+        if (from_width == to_width) return in;
+        op = FTOF;
+    } else if (from_float) {
+        op = FTOI;
+    } else if (to_float) {
+        reg res = new_temporary(function);
+        ir i = typed(tu, ir_convert(ITOF, res, in, from_width), to);
+        i.is_signed = type_is_signed(tu, from);
+        EMIT(i);
+        return res;
+    } else if (to_width > from_width) {
+        reg res = new_temporary(function);
+        ir i = typed(tu, ir_convert(EXT, res, in, from_width), to);
+        i.is_signed = type_is_signed(tu, from);
+        EMIT(i);
+        return res;
+    } else if (to_width < from_width) {
+        // truncation just uses the low bytes
+        reg res = new_temporary(function);
+        EMIT(typed(tu, ir_move(res, in), to));
+        return res;
+    } else {
+        return in;
+    }
+
+    reg res = new_temporary(function);
+    EMIT(typed(tu, ir_convert(op, res, in, from_width), to));
+    return res;
+}
+
+enum ir_op arith_op(int token_type) {
+    switch (token_type) {
+    case '+': case TOKEN_PLUS_EQUAL: case TOKEN_PLUS_PLUS: return ADD;
+    case '-': case TOKEN_MINUS_EQUAL: case TOKEN_MINUS_MINUS: return SUB;
+    case '*': case TOKEN_STAR_EQUAL: return MUL;
+    case '/': case TOKEN_DIVIDE_EQUAL: return DIV;
+    case '%': case TOKEN_MOD_EQUAL: return MOD;
+    case '&': case TOKEN_BITAND_EQUAL: return AND;
+    case '|': case TOKEN_BITOR_EQUAL: return OR;
+    case '^': case TOKEN_BITXOR_EQUAL: return XOR;
+    case TOKEN_SHIFT_LEFT: case TOKEN_SHIFT_LEFT_EQUAL: return SHL;
+    case TOKEN_SHIFT_RIGHT: case TOKEN_SHIFT_RIGHT_EQUAL: return SHR;
+    default: return TEST;
+    }
+}
+
+enum ir_cond test_cond(int token_type) {
+    switch (token_type) {
+    case TOKEN_EQUAL_EQUAL: return COND_EQ;
+    case TOKEN_NOT_EQUAL: return COND_NE;
+    case '<': return COND_LT;
+    case TOKEN_LESS_EQUAL: return COND_LE;
+    case '>': return COND_GT;
+    default: return COND_GE;
+    }
+}
+
+// Emit a binary arithmetic or comparison operator on two rvalues, applying the
+// usual arithmetic conversions and scaling pointer arithmetic. The type of the
+// result is stored in result_type.
+static reg emit_arith(struct tu *tu, struct function *function, int token_type,
+                                 reg a, int a_type, reg b, int b_type, int *result_type) {
+    enum ir_op op = arith_op(token_type);
+    int long_type = find_or_create_type(tu, 0, TYPE_SIGNED_LONG, 0);
+    reg res = new_temporary(function);
+
+    if (op == ADD && type_is_integer(tu, a_type) && type_is_pointer(tu, b_type)) {
+        reg r = a; a = b; b = r;
+        int t = a_type; a_type = b_type; b_type = t;
+    }
+
+    if ((op == ADD || op == SUB) && type_is_pointer(tu, a_type) && type_is_integer(tu, b_type)) {
+        size_t size = type_size(tu, TTYPE(a_type)->inner);
+        b = emit_convert(tu, function, b, b_type, long_type);
+        if (size != 1) {
+            reg scale = new_temporary(function);
+            reg scaled = new_temporary(function);
+            EMIT(typed(tu, ir_imm(function, size, scale), long_type));
+            EMIT(typed(tu, ir_binop(MUL, scaled, b, scale), long_type));
+            b = scaled;
+        }
+        EMIT(typed(tu, ir_binop(op, res, a, b), a_type));
+        *result_type = a_type;
+        return res;
     }
-    case NODE_INT_LITERAL: {
-        reg *res = new_temporary(function);
-        EMIT(ir_imm(node->token->int_.value, res));
+
+    if (op == SUB && type_is_pointer(tu, a_type) && type_is_pointer(tu, b_type)) {
+        size_t size = type_size(tu, TTYPE(a_type)->inner);
+        EMIT(typed(tu, ir_binop(SUB, res, a, b), long_type));
+        if (size != 1) {
+            reg scale = new_temporary(function);
+            reg quotient = new_temporary(function);
+            EMIT(typed(tu, ir_imm(function, size, scale), long_type));
+            EMIT(typed(tu, ir_binop(DIV, quotient, res, scale), long_type));
+            res = quotient;
+        }
+        *result_type = long_type;
         return res;
     }
-    case NODE_FLOAT_LITERAL:
-        break;
-    case NODE_STRING_LITERAL:
-        break;
-    case NODE_ERROR:
-        break;
-    case NODE_MEMBER:
-        break;
-    case NODE_SUBSCRIPT:
-        break;
-    case NODE_TERNARY:
-        break;
-    case NODE_FUNCTION_CALL: {
-        struct ir_instr ins = {};
-        for_each (&node->funcall.args) {
-            list_push(&ins.args, emit_node_recur(tu, function, *it, false));
-        }
-        reg *f = emit_node_recur(tu, function, node->funcall.inner, false);
-        reg *out = new_temporary(function);
-        EMIT(ir_call(out, f, ins.args));
-        return out;
-    }
-    case NODE_DECLARATION:
-        for_each (&node->decl.declarators) {
-            emit_node_recur(tu, function, *it, false);
-        }
-        return nullptr;
-    case NODE_TYPE_SPECIFIER:
-        break;
-    case NODE_DECLARATOR:
-        if (node->d.initializer) {
+
+    int operand_type;
+    if (type_is_pointer(tu, a_type)) operand_type = a_type;
+    else if (type_is_pointer(tu, b_type)) operand_type = b_type;
+    else if (op == SHL || op == SHR) operand_type = type_promote(tu, a_type);
+    else operand_type = type_common(tu, a_type, b_type);
+
+    a = emit_convert(tu, function, a, a_type, operand_type);
+    b = emit_convert(tu, function, b, b_type, operand_type);
+
+    if (op == TEST) {
+        EMIT(typed(tu, ir_test(test_cond(token_type), res, a, b), operand_type));
+        *result_type = find_or_create_type(tu, 0, TYPE_SIGNED_INT, 0);
+    } else {
+        EMIT(typed(tu, ir_binop(op, res, a, b), operand_type));
+        *result_type = operand_type;
+    }
+    return res;
+}
+
+static reg emit_constant(struct tu *tu, struct function *function, struct value *v, int type_id) {
+    reg res = new_temporary(function);
+    if (v->kind == VALUE_FLOAT) EMIT(typed(tu, ir_fimm(function, v->f, res), type_id));
+    else EMIT(typed(tu, ir_imm(function, v->i, res), type_id));
+    return res;
+}
+
+// The function's name in CALL and ADDR: the scope register of its declaration.
+static reg emit_function_name(struct tu *tu, struct function *function, struct node *node) {
+    return new_scope_reg(function, TSCOPE(node->ident.scope_id));
+}
+
+void find_cases(struct tu *tu, struct node *body, switch_case_list_t *cases) {
+    struct walk walk = {};
+    walk_push(&walk, body);
+
+    struct walk_frame *frame;
+    enum walk_event event;
+    while ((frame = walk_next(&walk, &event))) {
+        if (event != WALK_ENTER) continue;
+        struct node *node = frame->node;
+        switch (node->type) {
+        case NODE_CASE:
+        case NODE_DEFAULT:
+            // C23(N3096) 6.8.5.3.3: no two case values the same, and at most
+            // one default
+            for_each_n (c, cases) {
+                int64_t value, other;
+                if (node->type == NODE_DEFAULT && c->node->type == NODE_DEFAULT) {
+                    print_error_node(tu, node, "multiple default labels in one switch");
+                    break;
+                }
+                if (node->type == NODE_CASE && c->node->type == NODE_CASE &&
+                    eval_int(tu, node->case_.value, &value) && eval_int(tu, c->node->case_.value, &other) &&
+                    value == other) {
+                    print_error_node(tu, node->case_.value, "duplicate case value");
+                    break;
+                }
+            }
+            list_push(cases, ((struct switch_case){ .node = node }));
+            frame->index = SIZE_MAX;
+            break;
+        case NODE_BLOCK:
+        case NODE_IF:
+        case NODE_WHILE:
+        case NODE_DO:
+        case NODE_FOR:
+            break;
+        default:
+            if (node != body) frame->index = SIZE_MAX;
+        }
+    }
+
+    walk_free(&walk);
+}
+
+struct label {
+    struct node *name;
+    int block;
+    // the first goto, kept for the error if the label is never defined
+    struct node *first_use;
+    bool defined;
+};
+
+typedef list(struct label) label_list_t;
+
+// The block a label names, created the first time it is defined or jumped to.
+// use is the goto node, or nullptr for the label's definition.
+static int label_block(struct tu *tu, struct function *function, label_list_t *labels, struct node *name,
+                       struct node *use) {
+    struct token *t = name->token;
+    struct label *label = nullptr;
+    for_each (labels) {
+        struct token *o = it->name->token;
+        if (o->len == t->len && memcmp(&tu->source[o->index], &tu->source[t->index], t->len) == 0) {
+            label = it;
+            break;
+        }
+    }
+    if (!label) {
+        int block = new_block(function, tu_intern(tu, &tu->source[t->index], t->len));
+        list_push(labels, ((struct label){ .name = name, .block = block, .first_use = use }));
+        label = &list_last(labels);
+    }
+    if (!use && label->defined) {
+        print_error_node(tu, name, "redefinition of label '%.*s'", t->len, &tu->source[t->index]);
+        return new_block(function, label->block ? function->blocks.data[label->block].label : 0);
+    }
+    if (!use) label->defined = true;
+    return label->block;
+}
+
+// Emit IR for a tree of nodes. The tree is walked with an explicit stack, so
+// deeply nested code doesn't use native stack: each frame is a small state
+// machine, where `phase` says which child it is waiting on, v[] holds the
+// registers and labels it needs between children, and walk.ret holds the
+// result of the child that just finished.
+reg emit_node(struct tu *tu, struct function *function, struct node *root) {
+    struct walk walk = {};
+    label_list_t labels = {};
+    struct walk_frame *frame = walk_push(&walk, root);
+    frame->mode = EMIT_VALUE;
+
+    while ((frame = walk_top(&walk))) {
+        struct node *node = frame->node;
+        enum emit_mode mode = frame->mode;
+        reg ret = walk.ret.reg;
+
+        struct node *child = nullptr;
+        enum emit_mode child_mode = EMIT_VALUE;
+        bool done = false;
+        reg result = 0;
+
+#define VISIT(next_phase, n, m) do { frame->phase = (next_phase); child = (n); child_mode = (m); } while (0)
+#define RETURN(r) do { result = (r); done = true; } while (0)
+
+        if (!node) {
+            walk_return(&walk, (union walk_value){ .reg = 0 });
+            continue;
+        }
+
+        if (frame->phase == 0 && mode == EMIT_VALUE && node->c_type &&
+            (node->type == NODE_BINARY_OP || node->type == NODE_UNARY_OP ||
+             node->type == NODE_TERNARY || node->type == NODE_IDENT)) {
+            struct value *v = eval(tu, node);
+            if (v->kind == VALUE_INT || v->kind == VALUE_FLOAT) {
+                walk_return(&walk, (union walk_value){ .reg = emit_constant(tu, function, v, type_rvalue(tu, node->c_type)) });
+                continue;
+            }
+        }
+
+        int type = node->c_type ? type_rvalue(tu, node->c_type) : 0;
+
+        switch (node->type) {
+        case NODE_BINARY_OP: {
+            int op = node->token->type;
+            struct node *lhs = node->binop.lhs;
+            struct node *rhs = node->binop.rhs;
+            int lhs_type = type_rvalue(tu, lhs->c_type);
+            int rhs_type = type_rvalue(tu, rhs->c_type);
+            int result_type;
+
+            switch (op) {
+            case ',':
+                if (frame->phase == 0) VISIT(1, lhs, EMIT_VALUE);
+                else if (frame->phase == 1) VISIT(2, rhs, EMIT_VALUE);
+                else RETURN(ret);
+                break;
+            case '=':
+                if (is_register_variable(tu, lhs)) {
+                    if (frame->phase == 0) {
+                        VISIT(1, rhs, EMIT_VALUE);
+                    } else if (frame->phase == 1) {
+                        frame->v[0].reg = emit_convert(tu, function, ret, rhs_type, type);
+                        VISIT(2, lhs, EMIT_WRITE);
+                    } else {
+                        EMIT(typed(tu, ir_move(ret, frame->v[0].reg), type));
+                        RETURN(ret);
+                    }
+                } else {
+                    if (frame->phase == 0) {
+                        VISIT(1, lhs, EMIT_ADDRESS);
+                    } else if (frame->phase == 1) {
+                        frame->v[0].reg = ret;
+                        VISIT(2, rhs, EMIT_VALUE);
+                    } else {
+                        reg value = emit_convert(tu, function, ret, rhs_type, type);
+                        EMIT(typed(tu, ir_store(frame->v[0].reg, value), type));
+                        RETURN(value);
+                    }
+                }
+                break;
+            case TOKEN_AND_AND:
+            case TOKEN_OR_OR: {
+                // a && b is `res = 0; if (a) res = b != 0;`, a || b is `res = 1; if (!a) res = b != 0;`
+                bool is_and = op == TOKEN_AND_AND;
+                if (frame->phase == 0) {
+                    const char *name = is_and ? "and" : "or";
+                    int id = ++function->cond_id;
+                    reg res = new_temporary(function);
+                    frame->v[0].reg = res;
+                    frame->v[1].i = new_block(function, tu_printf(tu, "%s%i.rhs", name, id));
+                    frame->v[2].i = new_block(function, tu_printf(tu, "%s%i.end", name, id));
+                    EMIT(typed(tu, ir_imm(function, is_and ? 0 : 1, res), type));
+                    VISIT(1, lhs, EMIT_VALUE);
+                } else if (frame->phase == 1) {
+                    if (is_and) EMIT(typed(tu, ir_jz(ret, frame->v[2].i, frame->v[1].i), lhs_type));
+                    else EMIT(typed(tu, ir_jz(ret, frame->v[1].i, frame->v[2].i), lhs_type));
+                    start_block(function, frame->v[1].i);
+                    VISIT(2, rhs, EMIT_VALUE);
+                } else {
+                    reg zero = new_temporary(function);
+                    reg test = new_temporary(function);
+                    EMIT(typed(tu, ir_imm(function, 0, zero), rhs_type));
+                    EMIT(typed(tu, ir_test(COND_NE, test, ret, zero), rhs_type));
+                    EMIT(typed(tu, ir_move(frame->v[0].reg, test), type));
+                    start_block(function, frame->v[2].i);
+                    RETURN(frame->v[0].reg);
+                }
+                break;
+            }
+            case TOKEN_PLUS_EQUAL:
+            case TOKEN_MINUS_EQUAL:
+            case TOKEN_STAR_EQUAL:
+            case TOKEN_DIVIDE_EQUAL:
+            case TOKEN_MOD_EQUAL:
+            case TOKEN_SHIFT_LEFT_EQUAL:
+            case TOKEN_SHIFT_RIGHT_EQUAL:
+            case TOKEN_BITAND_EQUAL:
+            case TOKEN_BITOR_EQUAL:
+            case TOKEN_BITXOR_EQUAL:
+                if (is_register_variable(tu, lhs)) {
+                    if (frame->phase == 0) {
+                        VISIT(1, lhs, EMIT_VALUE);
+                    } else if (frame->phase == 1) {
+                        frame->v[0].reg = ret;
+                        VISIT(2, rhs, EMIT_VALUE);
+                    } else if (frame->phase == 2) {
+                        reg res = emit_arith(tu, function, op, frame->v[0].reg, lhs_type, ret, rhs_type, &result_type);
+                        frame->v[1].reg = emit_convert(tu, function, res, result_type, type);
+                        VISIT(3, lhs, EMIT_WRITE);
+                    } else {
+                        EMIT(typed(tu, ir_move(ret, frame->v[1].reg), type));
+                        RETURN(ret);
+                    }
+                } else {
+                    if (frame->phase == 0) {
+                        VISIT(1, lhs, EMIT_ADDRESS);
+                    } else if (frame->phase == 1) {
+                        reg current = new_temporary(function);
+                        EMIT(typed(tu, ir_load(current, ret), type));
+                        frame->v[0].reg = ret;
+                        frame->v[1].reg = current;
+                        VISIT(2, rhs, EMIT_VALUE);
+                    } else {
+                        reg res = emit_arith(tu, function, op, frame->v[1].reg, lhs_type, ret, rhs_type, &result_type);
+                        res = emit_convert(tu, function, res, result_type, type);
+                        EMIT(typed(tu, ir_store(frame->v[0].reg, res), type));
+                        RETURN(res);
+                    }
+                }
+                break;
+            default:
+                if (frame->phase == 0) {
+                    VISIT(1, lhs, EMIT_VALUE);
+                } else if (frame->phase == 1) {
+                    frame->v[0].reg = ret;
+                    VISIT(2, rhs, EMIT_VALUE);
+                } else {
+                    RETURN(emit_arith(tu, function, op, frame->v[0].reg, lhs_type, ret, rhs_type, &result_type));
+                }
+            }
+            break;
+        }
+        case NODE_UNARY_OP:
+        case NODE_POSTFIX_OP: {
+            int op = node->token->type;
+            struct node *inner = node->unary_op.inner;
+            int inner_type = inner->c_type ? type_rvalue(tu, inner->c_type) : 0;
+
+            switch (op) {
+            case '&':
+                if (inner->type == NODE_IDENT && TTYPE(inner->c_type)->layer == TYPE_FUNCTION) {
+                    reg res = new_temporary(function);
+                    EMIT(typed(tu, ir_unop(ADDR, res, emit_function_name(tu, function, inner)), type));
+                    RETURN(res);
+                } else if (frame->phase == 0) {
+                    VISIT(1, inner, EMIT_ADDRESS);
+                } else {
+                    RETURN(ret);
+                }
+                break;
+            case '*':
+                if (frame->phase == 0) {
+                    VISIT(1, inner, EMIT_VALUE);
+                } else {
+                    enum layer_type layer = TTYPE(node->c_type)->layer;
+                    if (mode == EMIT_ADDRESS || layer == TYPE_ARRAY || layer == TYPE_FUNCTION) {
+                        RETURN(ret);
+                    } else {
+                        reg res = new_temporary(function);
+                        EMIT(typed(tu, ir_load(res, ret), type));
+                        RETURN(res);
+                    }
+                }
+                break;
+            case TOKEN_SIZEOF:
+            case TOKEN_ALIGNOF:
+                RETURN(emit_constant(tu, function, eval(tu, node), type));
+                break;
+            case TOKEN_PLUS_PLUS:
+            case TOKEN_MINUS_MINUS: {
+                // ++x is x += 1, x++ is the same but results in the old value
+                int one_type = type_is_floating(tu, inner_type) ? inner_type : find_or_create_type(tu, 0, TYPE_SIGNED_INT, 0);
+                bool postfix = node->type == NODE_POSTFIX_OP;
+                int result_type;
+
+                if (frame->phase == 0) {
+                    reg one = new_temporary(function);
+                    if (type_is_floating(tu, inner_type)) EMIT(typed(tu, ir_fimm(function, 1.0, one), one_type));
+                    else EMIT(typed(tu, ir_imm(function, 1, one), one_type));
+                    frame->v[2].reg = one;
+                }
+
+                if (is_register_variable(tu, inner)) {
+                    if (frame->phase == 0) {
+                        VISIT(1, inner, EMIT_VALUE);
+                    } else if (frame->phase == 1) {
+                        frame->v[0].reg = ret;
+                        if (postfix) {
+                            // the old value outlives the write to the variable's register
+                            frame->v[0].reg = new_temporary(function);
+                            EMIT(typed(tu, ir_move(frame->v[0].reg, ret), inner_type));
+                        }
+                        reg res = emit_arith(tu, function, op, ret, inner_type, frame->v[2].reg, one_type, &result_type);
+                        frame->v[1].reg = emit_convert(tu, function, res, result_type, inner_type);
+                        VISIT(2, inner, EMIT_WRITE);
+                    } else {
+                        EMIT(typed(tu, ir_move(ret, frame->v[1].reg), inner_type));
+                        RETURN(postfix ? frame->v[0].reg : ret);
+                    }
+                } else {
+                    if (frame->phase == 0) {
+                        VISIT(1, inner, EMIT_ADDRESS);
+                    } else {
+                        reg current = new_temporary(function);
+                        EMIT(typed(tu, ir_load(current, ret), inner_type));
+                        reg res = emit_arith(tu, function, op, current, inner_type, frame->v[2].reg, one_type, &result_type);
+                        res = emit_convert(tu, function, res, result_type, inner_type);
+                        EMIT(typed(tu, ir_store(ret, res), inner_type));
+                        RETURN(postfix ? current : res);
+                    }
+                }
+                break;
+            }
+            default:
+                if (frame->phase == 0) {
+                    VISIT(1, inner, EMIT_VALUE);
+                    break;
+                }
+
+                switch (op) {
+                case '+':
+                    RETURN(emit_convert(tu, function, ret, inner_type, type));
+                    break;
+                case '-':
+                case '~': {
+                    reg value = emit_convert(tu, function, ret, inner_type, type);
+                    reg res = new_temporary(function);
+                    EMIT(typed(tu, ir_unop(op == '-' ? NEG : INV, res, value), type));
+                    RETURN(res);
+                    break;
+                }
+                case '!': {
+                    // NOT tests its operand, so it is typed by the operand rather than the int result
+                    reg res = new_temporary(function);
+                    EMIT(typed(tu, ir_unop(NOT, res, ret), inner_type));
+                    RETURN(res);
+                    break;
+                }
+                default:
+                    print_internal_error(tu, "unhandled unary operation: %i", op);
+                    RETURN(0);
+                }
+            }
+            break;
+        }
+        case NODE_IDENT: {
+            struct scope *scope = TSCOPE(node->ident.scope_id);
+            if (!in_memory(tu, scope)) {
+                RETURN(new_scope_reg(function, scope));
+                break;
+            }
+
+            reg address = new_temporary(function);
+            EMIT(typed(tu, ir_unop(ADDR, address, new_scope_reg(function, scope)),
+                       find_or_create_type(tu, node->c_type, TYPE_POINTER, 0)));
+
+            enum layer_type layer = TTYPE(scope->c_type)->layer;
+            if (mode == EMIT_ADDRESS || layer == TYPE_ARRAY || layer == TYPE_FUNCTION) {
+                RETURN(address);
+            } else {
+                reg res = new_temporary(function);
+                EMIT(typed(tu, ir_load(res, address), type));
+                RETURN(res);
+            }
+            break;
+        }
+        case NODE_INT_LITERAL: {
+            reg res = new_temporary(function);
+            EMIT(typed(tu, ir_imm(function, node->token->int_.value, res), type));
+            RETURN(res);
+            break;
+        }
+        case NODE_FLOAT_LITERAL: {
+            reg res = new_temporary(function);
+            EMIT(typed(tu, ir_fimm(function, node->token->float_.value, res), type));
+            RETURN(res);
+            break;
+        }
+        case NODE_STRING_LITERAL: {
+            reg res = new_temporary(function);
+            int name = tu_intern(tu, &tu->source[node->token->index], node->token->len);
+            EMIT(typed(tu, ir_string(function, res, name), type));
+            RETURN(res);
+            break;
+        }
+        case NODE_SUBSCRIPT: {
+            struct node *inner = node->subscript.inner;
+            struct node *subscript = node->subscript.subscript;
+            if (frame->phase == 0) {
+                VISIT(1, inner, EMIT_VALUE);
+            } else if (frame->phase == 1) {
+                frame->v[0].reg = ret;
+                VISIT(2, subscript, EMIT_VALUE);
+            } else {
+                int result_type;
+                reg address = emit_arith(tu, function, '+', frame->v[0].reg, type_rvalue(tu, inner->c_type),
+                                          ret, type_rvalue(tu, subscript->c_type), &result_type);
+
+                if (mode == EMIT_ADDRESS || TTYPE(node->c_type)->layer == TYPE_ARRAY) {
+                    RETURN(address);
+                } else {
+                    reg res = new_temporary(function);
+                    EMIT(typed(tu, ir_load(res, address), type));
+                    RETURN(res);
+                }
+            }
+            break;
+        }
+        case NODE_TERNARY: {
+            struct node *t = node->ternary.branch_true;
+            struct node *f = node->ternary.branch_false;
+            bool is_void = TTYPE(type)->layer == TYPE_VOID;
+
+            if (frame->phase == 0) {
+                int id = ++function->cond_id;
+                frame->v[0].reg = is_void ? 0 : new_temporary(function);
+                frame->v[1].i = new_block(function, tu_printf(tu, "ternary%i.true", id));
+                frame->v[2].i = new_block(function, tu_printf(tu, "ternary%i.false", id));
+                frame->v[3].i = new_block(function, tu_printf(tu, "ternary%i.end", id));
+                VISIT(1, node->ternary.condition, EMIT_VALUE);
+            } else if (frame->phase == 1) {
+                EMIT(typed(tu, ir_jz(ret, frame->v[2].i, frame->v[1].i), type_rvalue(tu, node->ternary.condition->c_type)));
+                start_block(function, frame->v[1].i);
+                VISIT(2, t, EMIT_VALUE);
+            } else if (frame->phase == 2) {
+                reg value = emit_convert(tu, function, ret, type_rvalue(tu, t->c_type), type);
+                if (!is_void) EMIT(typed(tu, ir_move(frame->v[0].reg, value), type));
+                EMIT(ir_jmp(frame->v[3].i));
+                start_block(function, frame->v[2].i);
+                VISIT(3, f, EMIT_VALUE);
+            } else {
+                reg value = emit_convert(tu, function, ret, type_rvalue(tu, f->c_type), type);
+                if (!is_void) EMIT(typed(tu, ir_move(frame->v[0].reg, value), type));
+                start_block(function, frame->v[3].i);
+                RETURN(frame->v[0].reg);
+            }
+            break;
+        }
+        case NODE_FUNCTION_CALL: {
+            struct node *inner = node->funcall.inner;
+            int callee_type = type_rvalue(tu, inner->c_type);
+            int function_type = TTYPE(callee_type)->inner;
+            bool direct = inner->type == NODE_IDENT && TTYPE(inner->c_type)->layer == TYPE_FUNCTION;
+
+            if (frame->phase == 0) {
+                frame->v[0].args = calloc(1, sizeof(reg_list_t));
+                frame->phase = 1;
+            }
+
+            if (frame->phase == 2) {
+                struct node *arg = node->funcall.args.data[frame->index];
+                int arg_type = type_rvalue(tu, arg->c_type);
+
+                // arguments convert as if by assignment to the parameter; arguments past the
+                // prototype get the default argument promotions, C23(N3096) 6.5.2.2
+                int param_type;
+                if (frame->index < TTYPE(function_type)->function.params.len) {
+                    param_type = TTYPE(function_type)->function.params.data[frame->index];
+                } else if (TTYPE(arg_type)->layer == TYPE_FLOAT) {
+                    param_type = find_or_create_type(tu, 0, TYPE_DOUBLE, 0);
+                } else if (type_is_integer(tu, arg_type)) {
+                    param_type = type_promote(tu, arg_type);
+                } else {
+                    param_type = arg_type;
+                }
+                list_push(frame->v[0].args, emit_convert(tu, function, ret, arg_type, param_type));
+                frame->index += 1;
+                frame->phase = 1;
+            }
+
+            if (frame->phase == 1) {
+                if (frame->index < node->funcall.args.len) {
+                    VISIT(2, node->funcall.args.data[frame->index], EMIT_VALUE);
+                    break;
+                }
+                if (!direct) {
+                    VISIT(3, inner, EMIT_VALUE);
+                    break;
+                }
+            }
+
+            reg f = direct ? emit_function_name(tu, function, inner) : ret;
+            reg out = TTYPE(type)->layer == TYPE_VOID ? 0 : new_temporary(function);
+            EMIT(typed(tu, ir_call(function, out, f, frame->v[0].args), type));
+            list_clear(frame->v[0].args);
+            free(frame->v[0].args);
+            RETURN(out);
+            break;
+        }
+        case NODE_DECLARATION:
+            if (frame->index < node->decl.declarators.len)
+                VISIT(0, node->decl.declarators.data[frame->index++], EMIT_VALUE);
+            else
+                RETURN(0);
+            break;
+        case NODE_DECLARATOR:
+        case NODE_ARRAY_DECLARATOR:
+        case NODE_FUNCTION_DECLARATOR: {
             struct scope *scope = TSCOPE(node->d.scope_id);
-            reg *init = emit_node_recur(tu, function, node->d.initializer, false);
-            reg *out = new_scope_reg(function, scope, true);
-            EMIT(ir_move(out, init));
+            if (scope->is_global || scope->sc == ST_STATIC || scope->sc == ST_CONSTEXPR || scope->sc == ST_EXTERNAL) {
+                emit_global(tu, node);
+                RETURN(0);
+                break;
+            }
+            if (!node->d.initializer) {
+                RETURN(0);
+                break;
+            }
+            int var_type = type_rvalue(tu, scope->c_type);
+            int init_type = type_rvalue(tu, node->d.initializer->c_type);
+            if (TTYPE(scope->c_type)->layer == TYPE_ARRAY) {
+                print_error_node(tu, node->d.initializer, "array initializers are not implemented");
+                RETURN(0);
+            } else if (frame->phase == 0) {
+                VISIT(1, node->d.initializer, EMIT_VALUE);
+            } else {
+                reg init = emit_convert(tu, function, ret, init_type, var_type);
+                if (in_memory(tu, scope)) {
+                    reg address = new_temporary(function);
+                    EMIT(typed(tu, ir_unop(ADDR, address, new_scope_reg(function, scope)),
+                               find_or_create_type(tu, scope->c_type, TYPE_POINTER, 0)));
+                    EMIT(typed(tu, ir_store(address, init), var_type));
+                } else {
+                    reg out = new_scope_reg(function, scope);
+                    EMIT(typed(tu, ir_move(out, init), var_type));
+                }
+                RETURN(0);
+            }
+            break;
         }
-        return nullptr;
-    case NODE_ARRAY_DECLARATOR:
-        break;
-    case NODE_FUNCTION_DECLARATOR:
-        break;
-    case NODE_FUNCTION_DEFINITION:emit_node_recur(tu, function, node->fun.decl, false);
-        emit_node_recur(tu, function, node->fun.body, false);
-        return nullptr;
-    case NODE_STATIC_ASSERT:
-        break;
-    case NODE_BLOCK:
-        for_each (&node->block.children) {
-            emit_node_recur(tu, function, *it, false);
+        case NODE_STATIC_ASSERT:
+        case NODE_NULL:
+            RETURN(0);
+            break;
+        case NODE_BLOCK:
+            if (frame->index < node->block.children.len)
+                VISIT(0, node->block.children.data[frame->index++], EMIT_VALUE);
+            else
+                RETURN(0);
+            break;
+        case NODE_RETURN:
+            if (!node->ret.expr) {
+                EMIT(ir_ret(0));
+                RETURN(0);
+            } else if (frame->phase == 0) {
+                VISIT(1, node->ret.expr, EMIT_VALUE);
+            } else {
+                reg value = emit_convert(tu, function, ret, type_rvalue(tu, node->ret.expr->c_type), function->return_type);
+                EMIT(typed(tu, ir_ret(value), function->return_type));
+                RETURN(0);
+            }
+            break;
+        case NODE_IF:
+            if (frame->phase == 0) {
+                VISIT(1, node->if_.cond, EMIT_VALUE);
+            } else if (frame->phase == 1) {
+                int id = ++function->cond_id;
+                frame->v[1].i = new_block(function, tu_printf(tu, "if%i.then", id));
+                frame->v[2].i = node->if_.block_false ? new_block(function, tu_printf(tu, "if%i.else", id)) : 0;
+                frame->v[3].i = new_block(function, tu_printf(tu, "if%i.end", id));
+                int if_zero = node->if_.block_false ? frame->v[2].i : frame->v[3].i;
+
+                EMIT(typed(tu, ir_jz(ret, if_zero, frame->v[1].i), type_rvalue(tu, node->if_.cond->c_type)));
+                start_block(function, frame->v[1].i);
+                VISIT(2, node->if_.block_true, EMIT_VALUE);
+            } else if (frame->phase == 2 && node->if_.block_false) {
+                EMIT(ir_jmp(frame->v[3].i));
+                start_block(function, frame->v[2].i);
+                VISIT(3, node->if_.block_false, EMIT_VALUE);
+            } else {
+                start_block(function, frame->v[3].i);
+                RETURN(0);
+            }
+            break;
+
+        // Loops keep the block `continue` goes to in v[1] and the one `break`
+        // goes to in v[2].
+        case NODE_WHILE:
+            if (frame->phase == 0) {
+                int id = ++function->cond_id;
+                frame->v[1].i = new_block(function, tu_printf(tu, "while%i.cond", id));
+                frame->v[2].i = new_block(function, tu_printf(tu, "while%i.end", id));
+                frame->v[3].i = new_block(function, tu_printf(tu, "while%i.body", id));
+
+                start_block(function, frame->v[1].i);
+                VISIT(1, node->while_.cond, EMIT_VALUE);
+            } else if (frame->phase == 1) {
+                EMIT(typed(tu, ir_jz(ret, frame->v[2].i, frame->v[3].i), type_rvalue(tu, node->while_.cond->c_type)));
+                start_block(function, frame->v[3].i);
+                VISIT(2, node->while_.block, EMIT_VALUE);
+            } else {
+                EMIT(ir_jmp(frame->v[1].i));
+                start_block(function, frame->v[2].i);
+                RETURN(0);
+            }
+            break;
+        case NODE_DO:
+            if (frame->phase == 0) {
+                int id = ++function->cond_id;
+                frame->v[1].i = new_block(function, tu_printf(tu, "do%i.cond", id));
+                frame->v[2].i = new_block(function, tu_printf(tu, "do%i.end", id));
+                frame->v[3].i = new_block(function, tu_printf(tu, "do%i.body", id));
+
+                start_block(function, frame->v[3].i);
+                VISIT(1, node->do_.block, EMIT_VALUE);
+            } else if (frame->phase == 1) {
+                start_block(function, frame->v[1].i);
+                VISIT(2, node->do_.cond, EMIT_VALUE);
+            } else {
+                EMIT(typed(tu, ir_jz(ret, frame->v[2].i, frame->v[3].i), type_rvalue(tu, node->do_.cond->c_type)));
+                start_block(function, frame->v[2].i);
+                RETURN(0);
+            }
+            break;
+        case NODE_FOR:
+            // v[3] is the condition and v[0] the body
+            if (frame->phase == 0) {
+                int id = ++function->cond_id;
+                frame->v[0].i = new_block(function, tu_printf(tu, "for%i.body", id));
+                frame->v[1].i = new_block(function, tu_printf(tu, "for%i.next", id));
+                frame->v[2].i = new_block(function, tu_printf(tu, "for%i.end", id));
+                frame->v[3].i = new_block(function, tu_printf(tu, "for%i.cond", id));
+                VISIT(1, node->for_.init, EMIT_VALUE);
+            } else if (frame->phase == 1) {
+                start_block(function, frame->v[3].i);
+                if (node->for_.cond) {
+                    VISIT(2, node->for_.cond, EMIT_VALUE);
+                } else {
+                    start_block(function, frame->v[0].i);
+                    VISIT(3, node->for_.block, EMIT_VALUE);
+                }
+            } else if (frame->phase == 2) {
+                EMIT(typed(tu, ir_jz(ret, frame->v[2].i, frame->v[0].i), type_rvalue(tu, node->for_.cond->c_type)));
+                start_block(function, frame->v[0].i);
+                VISIT(3, node->for_.block, EMIT_VALUE);
+            } else if (frame->phase == 3) {
+                start_block(function, frame->v[1].i);
+                VISIT(4, node->for_.next, EMIT_VALUE);
+            } else {
+                EMIT(ir_jmp(frame->v[3].i));
+                start_block(function, frame->v[2].i);
+                RETURN(0);
+            }
+            break;
+        case NODE_BREAK:
+        case NODE_CONTINUE: {
+            bool is_break = node->type == NODE_BREAK;
+            struct walk_frame *target = nullptr;
+            for (size_t i = walk.stack.len - 1; i-- > 0;) {
+                enum node_type t = walk.stack.data[i].node->type;
+                if (t == NODE_WHILE || t == NODE_DO || t == NODE_FOR || (is_break && t == NODE_SWITCH)) {
+                    target = &walk.stack.data[i];
+                    break;
+                }
+            }
+            if (!target) {
+                print_error_node(tu, node, is_break ? "break statement not within a loop or switch"
+                                                    : "continue statement not within a loop");
+            } else {
+                EMIT(ir_jmp(is_break ? target->v[2].i : target->v[1].i));
+            }
+            RETURN(0);
+            break;
         }
-        return nullptr;
-    case NODE_LABEL:
-        break;
-    case NODE_RETURN: {
-        reg *ret = emit_node_recur(tu, function, node->ret.expr, false);
-        EMIT(ir_ret(ret));
-        return nullptr;
-    }
-    case NODE_IF: {
-        reg *test = emit_node_recur(tu, function, node->if_.cond, false);
-        const char *label_false = tprintf(tu, "if%i.false", ++function->cond_id);
-        const char *label_end = tprintf(tu, "if%i.end", function->cond_id);
-
-        EMIT(ir_jz(label_false, test));
-        emit_node_recur(tu, function, node->if_.block_true, false);
-
-        if (node->if_.block_false) {
-            EMIT(ir_jmp(label_end));
-            EMIT(ir_label(label_false));
-            emit_node_recur(tu, function, node->if_.block_false, false);
-            EMIT(ir_label(label_end));
-        } else {
-            EMIT(ir_label(label_false));
+        case NODE_SWITCH: {
+            // v[0] holds the case blocks, v[2] the block `break` goes to
+            int control_type = type_promote(tu, type_rvalue(tu, node->switch_.expr->c_type));
+            if (frame->phase == 0) {
+                VISIT(1, node->switch_.expr, EMIT_VALUE);
+            } else if (frame->phase == 1) {
+                int id = ++function->cond_id;
+                switch_case_list_t *cases = calloc(1, sizeof(switch_case_list_t));
+                find_cases(tu, node->switch_.block, cases);
+                frame->v[0].ptr = cases;
+                frame->v[2].i = new_block(function, tu_printf(tu, "switch%i.end", id));
+
+                reg value = emit_convert(tu, function, ret, type_rvalue(tu, node->switch_.expr->c_type), control_type);
+                int otherwise = frame->v[2].i;
+                int n = 0, tests = 0;
+                for_each (cases) {
+                    if (it->node->type == NODE_DEFAULT) {
+                        it->block = otherwise = new_block(function, tu_printf(tu, "switch%i.default", id));
+                    } else {
+                        it->block = new_block(function, tu_printf(tu, "switch%i.case%i", id, tests++));
+                    }
+                }
+
+                // compare against each case in turn; the last miss goes
+                // straight to default, or out of the switch
+                for_each (cases) {
+                    if (it->node->type == NODE_DEFAULT) continue;
+                    int next = ++n == tests ? otherwise : new_block(function, tu_printf(tu, "switch%i.test%i", id, n));
+                    reg constant = new_temporary(function);
+                    reg test = new_temporary(function);
+                    EMIT(typed(tu, ir_imm(function, eval(tu, it->node->case_.value)->i, constant), control_type));
+                    EMIT(typed(tu, ir_test(COND_EQ, test, value, constant), control_type));
+                    EMIT(typed(tu, ir_jz(test, next, it->block), find_or_create_type(tu, 0, TYPE_SIGNED_INT, 0)));
+                    if (n < tests) start_block(function, next);
+                }
+                if (!tests) EMIT(ir_jmp(otherwise));
+                VISIT(2, node->switch_.block, EMIT_VALUE);
+            } else {
+                switch_case_list_t *cases = frame->v[0].ptr;
+                list_clear(cases);
+                free(cases);
+                start_block(function, frame->v[2].i);
+                RETURN(0);
+            }
+            break;
+        }
+        case NODE_CASE:
+        case NODE_DEFAULT: {
+            int block = 0;
+            for (size_t i = walk.stack.len - 1; i-- > 0 && !block;) {
+                if (walk.stack.data[i].node->type != NODE_SWITCH) continue;
+                switch_case_list_t *cases = walk.stack.data[i].v[0].ptr;
+                for_each (cases) {
+                    if (it->node == node) block = it->block;
+                }
+                break;
+            }
+            if (block) start_block(function, block);
+            else print_error_node(tu, node, "case label not within a switch statement");
+            RETURN(0);
+            break;
+        }
+        case NODE_LABEL:
+            start_block(function, label_block(tu, function, &labels, node->label.name, nullptr));
+            RETURN(0);
+            break;
+        case NODE_GOTO:
+            EMIT(ir_jmp(label_block(tu, function, &labels, node->goto_.label, node)));
+            RETURN(0);
+            break;
+        default:
+            print_internal_error(tu, "ir: unrecognised ast node %s", node_type_strings[node->type]);
+            RETURN(0);
         }
 
-        return nullptr;
+#undef VISIT
+#undef RETURN
+
+        if (done) {
+            walk_return(&walk, (union walk_value){ .reg = result });
+        } else if (child) {
+            frame = walk_push(&walk, child);
+            frame->mode = child_mode;
+        }
+    }
+
+    for_each (&labels) {
+        if (it->defined) continue;
+        struct token *t = it->name->token;
+        print_error_node(tu, it->first_use, "use of undeclared label '%.*s'", t->len, &tu->source[t->index]);
     }
-    case NODE_WHILE: {
-        const char *label_top = tprintf(tu, "while%i.top", ++function->cond_id);
-        const char *label_end = tprintf(tu, "while%i.end", function->cond_id);
+    list_clear(&labels);
+
+    walk_free(&walk);
+    return walk.ret.reg;
+}
 
-        EMIT(ir_label(label_top));
-        reg *test = emit_node_recur(tu, function, node->while_.cond, false);
-        EMIT(ir_jz(label_end, test));
+void emit_global(struct tu *tu, struct node *declarator) {
+    if (!declarator->d.scope_id) return;
+    struct scope *scope = TSCOPE(declarator->d.scope_id);
+    struct node *init = declarator->d.initializer;
 
-        emit_node_recur(tu, function, node->while_.block, false);
-        EMIT(ir_jmp(label_top));
-        EMIT(ir_label(label_end));
+    if (scope->sc == ST_TYPEDEF || TTYPE(scope->c_type)->layer == TYPE_FUNCTION) return;
+    if (scope->sc == ST_EXTERNAL && !init) return;
 
-        return nullptr;
+    list_push(&tu->module.globals, ir_global(tu, scope, init ? eval(tu, init) : nullptr));
+}
+
+// Renumber the blocks into the order they were started, so reading the blocks
+// in order reads the function top to bottom, and retarget the jumps. Blocks
+// that were only ever jumped to, like an undefined label, go at the end.
+static void layout_blocks(struct function *function) {
+    size_t n = function->blocks.len;
+    int *renumber = malloc(n * sizeof(int));
+    for (size_t b = 0; b < n; b++) renumber[b] = -1;
+
+    list(struct ir_block) blocks = {};
+    for_each (&function->layout) {
+        if (renumber[*it] != -1) continue;
+        renumber[*it] = (int)blocks.len;
+        list_push(&blocks, function->blocks.data[*it]);
     }
-    case NODE_DO:
-        break;
-    case NODE_FOR:
-        break;
-    case NODE_GOTO:
-        break;
-    case NODE_SWITCH:
-        break;
-    case NODE_CASE:
-        break;
-    case NODE_NULL:
-        break;
-    case NODE_BREAK:
-        break;
-    case NODE_CONTINUE:
-        break;
-    case NODE_DEFAULT:
-        break;
-    case NODE_STRUCT:
-        break;
-    case NODE_ENUM:
-        break;
-    case NODE_UNION:
-        break;
+    for (size_t b = 0; b < n; b++) {
+        if (renumber[b] != -1) continue;
+        renumber[b] = (int)blocks.len;
+        struct ir_block block = function->blocks.data[b];
+        if (!block_terminated(&block)) list_push(&block.instrs, ir_ret(0));
+        list_push(&blocks, block);
     }
 
-    fprintf(stderr, "ir: unrecognised ast node %s\n", node_type_strings[node->type]);
+    for_each_n (block, &blocks) {
+        // most blocks are a few instructions, far below the list's initial
+        // capacity, and they don't grow once the function is built
+        block->instrs.data = realloc(block->instrs.data, block->instrs.len * sizeof(struct ir_instr));
+        block->instrs.cap = block->instrs.len;
 
-    return nullptr;
+        struct ir_instr *last = &list_last(&block->instrs);
+        if (last->op == JMP) {
+            last->r[0] = renumber[last->r[0]];
+        } else if (last->op == JZ) {
+            last->r[1] = renumber[last->r[1]];
+            last->r[2] = renumber[last->r[2]];
+        }
+    }
 
-#undef EMIT
+    free(function->blocks.data);
+    function->blocks.data = blocks.data;
+    function->blocks.len = blocks.len;
+    function->blocks.cap = blocks.cap;
+    function->current = renumber[function->current];
+    list_clear(&function->layout);
+    free(renumber);
 }
+
+// Build the IR of one function definition. Parameters arrive in fresh
+// registers; the ones that live in memory are stored to their slot on entry.
+static struct function *emit_function(struct tu *tu, struct node *node) {
+    struct scope *name = TSCOPE(node->fun.d->d.scope_id);
+    struct function *function = new_function(name);
+    function->return_type = TTYPE(name->c_type)->inner;
+    start_block(function, new_block(function, tu_intern(tu, "entry", 5)));
+
+    struct node *d = function_declarator(node->fun.d);
+    for_each (&d->d.fun.args) {
+        struct node *decl = *it;
+        if (decl->type != NODE_DECLARATION || !decl->decl.declarators.len) continue;
+
+        struct node *param = list_first(&decl->decl.declarators);
+        if (!param->d.scope_id) {
+            list_push(&function->params, new_temporary(function));
+            continue;
+        }
+
+        struct scope *scope = TSCOPE(param->d.scope_id);
+        if (in_memory(tu, scope)) {
+            reg in = new_temporary(function);
+            reg address = new_temporary(function);
+            list_push(&function->params, in);
+            EMIT(typed(tu, ir_unop(ADDR, address, new_scope_reg(function, scope)),
+                       find_or_create_type(tu, scope->c_type, TYPE_POINTER, 0)));
+            EMIT(typed(tu, ir_store(address, in), scope->c_type));
+        } else {
+            list_push(&function->params, new_scope_reg(function, scope));
+        }
+    }
+
+    emit_node(tu, function, node->fun.body);
+
+    // falling off the end returns, with 0 from main
+    if (!block_terminated(&function->blocks.data[function->current])) {
+        struct token *t = name->token;
+        bool is_main = t->len == 4 && memcmp(&tu->source[t->index], "main", 4) == 0;
+        if (is_main && TTYPE(function->return_type)->layer != TYPE_VOID) {
+            reg zero = new_temporary(function);
+            EMIT(typed(tu, ir_imm(function, 0, zero), function->return_type));
+            EMIT(typed(tu, ir_ret(zero), function->return_type));
+        } else {
+            EMIT(ir_ret(0));
+        }
+    }
+
+    layout_blocks(function);
+    compute_cfg(function);
+    return function;
+}
+
+#undef EMIT
@@ -7,65 +7,210 @@
 
 #include "list.h"
 
+// Operands are register ids in r[]. Instructions that need something other
+// than a register keep an index into one of the function's side tables in a
+// slot instead, as noted here.
 enum ir_op : char {
-    LABEL,  // name
-    DATA,   // ?
-    ADD,    // r1 <- r2 + r3
-    SUB,    // r1 <- r2 - r3
-    MUL,    // r1 <- r2 * r3
-    DIV,    // r1 <- r2 / r3
-    MOD,    // r1 <- r2 % r3
-    AND,    // r1 <- r2 & r3
-    OR,     // r1 <- r2 | r3
-    XOR,    // r1 <- r2 ^ r3
-    SHR,    // r1 <- r2 >> r3
-    SHL,    // r1 <- r2 << r3
-    NEG,    // r1 <- -r2
-    NOT,    // r1 <- !r2
-    INV,    // r1 <- ~r2
-    MOVE,   // r1 <- r2
-    IMM,    // r1 <- imm
-    ST,     // [r1 + r3] <- r2
-    LD,     // r1 <- [r2 + r3]
-    ADDR,   // r1 <- addr r2
-    CALL,   // name + args unknown
-    RET,    // r1
-    TEST,   // r1 <- r2 < r3
-    JZ,     // pc <- ? if ?
-    JMP,    // pc <- ?
-
-    PHI,    // r0 <- phi [ r1, r2 ]
+    ADD,    // r0 <- r1 + r2
+    SUB,    // r0 <- r1 - r2
+    MUL,    // r0 <- r1 * r2
+    DIV,    // r0 <- r1 / r2
+    MOD,    // r0 <- r1 % r2
+    AND,    // r0 <- r1 & r2
+    OR,     // r0 <- r1 | r2
+    XOR,    // r0 <- r1 ^ r2
+    SHR,    // r0 <- r1 >> r2
+    SHL,    // r0 <- r1 << r2
+    NEG,    // r0 <- -r1
+    NOT,    // r0 <- !r1
+    INV,    // r0 <- ~r1
+    MOVE,   // r0 <- r1
+    IMM,    // r0 <- constant r1
+    ST,     // [r0] <- r1
+    LD,     // r0 <- [r1]
+    ADDR,   // r0 <- addr r1, or of the string literal named by constant r2 if r1 is 0
+    CALL,   // r0 <- r1(args), r2 indexes the argument count in operands, followed by the args
+    RET,    // r0
+    TEST,   // r0 <- r1 cond r2
+    JZ,     // pc <- block r1 if r0 is zero, else block r2
+    JMP,    // pc <- block r0
+    EXT,    // r0 <- r1 extended from from_width bytes, sign extended if is_signed
+    ITOF,   // r0 <- (float)r1, r1 is a from_width byte integer, signed if is_signed
+    FTOI,   // r0 <- (int)r1, r1 is a from_width byte float
+    FTOF,   // r0 <- (float)r1, r1 is a from_width byte float
+
+    PHI,    // r0 <- phi, r1 indexes the operand count in operands, followed by one register per predecessor in preds order
+};
+
+enum ir_cond : char {
+    COND_EQ,
+    COND_NE,
+    COND_LT,
+    COND_LE,
+    COND_GT,
+    COND_GE,
 };
 
+// A virtual register: an index into function->regs. 0 is no register.
+typedef uint32_t reg;
+
 typedef list(struct ir_instr) ir_list_t;
-typedef list(struct ir_reg *) reg_list_t;
+typedef list(reg) reg_list_t;
 
 struct ir_reg {
+    // the variable this is a version of, or nullptr for a temporary
     struct scope *scope;
-    struct function *function;
-    short index;
+    // the temporary number, or the SSA version of the variable. Version 0 is
+    // the variable itself, before SSA construction, and stands for its
+    // undefined value after.
+    int index;
+};
+
+// An entry in the constant pool. Address constants name the object that the
+// integer is an offset from, as an offset into tu->strtab.
+struct ir_constant {
+    union {
+        uint64_t i;
+        double f;
+    };
+    int name;
 };
 
 struct ir_instr {
-    const char *name;
-    uint64_t immediate_i;
-    double immediate_f;
-    reg_list_t args;
-    struct ir_reg *r[3];
+    reg r[3];
     enum ir_op op;
+    enum ir_cond cond;
+    // The size in bytes and kind of value the instruction produces. For TEST
+    // and JZ it describes the operands being compared; TEST always produces
+    // an int.
+    unsigned char width;
+    bool is_signed;
+    bool is_float;
+    // the width of the operand of a conversion
+    unsigned char from_width;
 };
 
+typedef list(int) block_list_t;
+
+// A straight line of instructions ending in exactly one JZ, JMP or RET.
+struct ir_block {
+    // the block's name in tu->strtab, only used for printing
+    int label;
+    ir_list_t instrs;
+    // a terminator has at most two targets
+    int succs[2];
+    int n_succs;
+    // sorted by block index, which is the order of PHI operands
+    block_list_t preds;
+    // the immediate dominator, -1 for the entry and unreachable blocks
+    int idom;
+};
+
+// The IR of a function definition. Each block's instructions are a flat
+// array and everything they refer to is an index, so a function is a few
+// allocations per block no matter how many registers it uses. Index 0 of regs and constants is
+// reserved so that 0 can mean none. Block 0 is the entry, and blocks are
+// stored in layout order.
 struct function {
-    short temporary_id;
-    short cond_id;
-    ir_list_t ir_list;
+    // the function's name
+    struct scope *scope;
+    int temporary_id;
+    int cond_id;
+    int return_type;
+    // the incoming value of each parameter, in order
+    reg_list_t params;
+    list(struct ir_block) blocks;
+    // while the function is built: the block being emitted into, and the
+    // blocks in the order they were started
+    int current;
+    block_list_t layout;
+    list(struct ir_reg) regs;
+    list(struct ir_constant) constants;
+    // call arguments and PHI operands, each instruction's count followed by
+    // its registers
+    reg_list_t operands;
+    // whether variables have been renamed to SSA versions and PHIs placed
+    bool ssa;
+    // where each register lives, once registers are allocated
+    struct allocation *allocation;
+};
+
+// An object with static storage duration and its folded initializer.
+struct ir_global {
+    struct scope *scope;
+    struct ir_constant init;
+    size_t size;
+    // the kind of scalar the object holds, 0 for aggregates
+    unsigned char width;
+    bool is_signed;
+    bool is_float;
+    bool initialized;
+};
+
+// The IR of a translation unit. The functions share nothing but the module's
+// globals, so each can be optimized, code generated and freed on its own.
+struct module {
+    list(struct function *) functions;
+    list(struct ir_global) globals;
+    // at -O0, the machine code of each function, generated from its AST
+    list(struct x86_function *) code;
 };
 
 typedef struct ir_instr ir;
-typedef struct ir_reg reg;
 struct tu;
+struct node;
+struct x86_function;
 
 int emit(struct tu *tu);
-void print_ir_instr(struct tu *tu, struct ir_instr *i);
+// Optimize a function and allocate its registers, ready for code generation.
+// emit does this to every function, unless tu->tiered leaves it for later.
+void prepare_function(struct tu *tu, struct function *function);
+// Record an object with static storage duration in the module's data. A
+// declaration that doesn't define an object has nothing to record.
+void emit_global(struct tu *tu, struct node *declarator);
+
+// The IR operation of a binary or compound assignment operator, TEST for a
+// comparison, and the condition of a comparison operator.
+enum ir_op arith_op(int token_type);
+enum ir_cond test_cond(int token_type);
+
+// The case and default labels that belong to one switch statement, and the
+// blocks, or labels, they start.
+struct switch_case {
+    struct node *node;
+    int block;
+};
+
+typedef list(struct switch_case) switch_case_list_t;
+
+// Collect the case labels of a switch body, without descending into
+// expressions or nested switches, which own their own labels.
+void find_cases(struct tu *tu, struct node *body, switch_case_list_t *cases);
+void print_ir_instr(struct tu *tu, struct function *function, struct ir_instr *i);
+void print_function(struct tu *tu, struct function *function);
+void print_module(struct tu *tu, struct module *module);
+void free_function(struct function *function);
+bool ir_is_terminator(enum ir_op op);
+void compute_cfg(struct function *function);
+int remove_unreachable_blocks(struct function *function);
+void remove_edge(struct function *function, int from, int to);
+// Redirect the edge from a block to old so it goes to new instead, leaving
+// the preds of both for the caller.
+void retarget_edge(struct function *function, int from, int old, int new);
+// Put a new block holding just a jump on the edge between two blocks, and
+// return it. Dominators are left for the caller to recompute.
+int split_edge(struct tu *tu, struct function *function, int from, int to);
+
+struct ir_instr ir_imm(struct function *function, uint64_t immediate, reg out);
+struct ir_instr ir_fimm(struct function *function, double immediate, reg out);
+struct ir_instr ir_jmp(int block);
+
+reg new_reg(struct function *function, struct scope *scope, int index);
+reg new_temporary(struct function *function);
+// The register an instruction writes, or 0.
+reg ir_def(struct ir_instr *i);
+// The registers an instruction reads, as slots that can be rewritten.
+int ir_use_count(struct function *function, struct ir_instr *i);
+reg *ir_use(struct function *function, struct ir_instr *i, int n);
 
 #endif //COMPILER_IR_H
@@ -0,0 +1,836 @@
+#include "x86.h"
+#include "ir.h"
+#include "regalloc.h"
+#include "tu.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Instruction selection by bottom-up rewriting, after Pelegrí-Llopart and
+// Graham, with the dynamic programming labeller of iburg run over a table of
+// rules instead of generated from one.
+//
+// The IR is a forest of trees within each block: a value that is defined once
+// and read once, later in the same block, by an instruction whose leaves
+// nothing overwrites in between, is an edge, and its computation can move to
+// where it is used. Every other operand is a leaf, read in the location it was
+// allocated. Each instruction is labelled, bottom up, with the cheapest rule
+// that reduces it to each nonterminal; then every instruction whose value is
+// read as a register, by its user or because it is not part of a tree, is
+// covered top down from there with the rule that reduces it to a register or a
+// statement. The nodes its pattern matches are folded into it, and so are
+// those its pattern reduces to anything other than a register, like the scaled
+// index of an address. Any instruction can be lowered on its own, as code
+// generation always did, and the rules are the ways to do better.
+
+#define INFINITE_COST (1 << 24)
+// How far apart an edge of a tree can be, and how many leaves a subtree that
+// is folded can read, which keep checking what lies between them cheap.
+#define MAX_DISTANCE 16
+#define MAX_REACH 8
+
+enum atom_kind : char {
+    ATOM_END,
+    ATOM_OP,
+    ATOM_NT,
+    ATOM_CONST,
+};
+
+// The constants an operand can match.
+enum constant_kind : char {
+    // any integer
+    K_ANY,
+    // one that fits in the 32 bit immediate of an instruction of its user's
+    // size
+    K_IMM,
+    // 1, 2, 4 or 8, the scale of an index
+    K_SCALE,
+    // 0 to 3, the shift of a scaled index
+    K_SHIFT,
+    // 3, 5 or 9, a register plus itself scaled
+    K_LEA,
+};
+
+// An element of a pattern, in prefix order: an operation followed by the
+// patterns of its operands, a nonterminal an operand is reduced to, or a
+// constant operand.
+struct atom {
+    enum atom_kind kind;
+    char value;
+};
+
+// How the address_mode of a rule is made from the modes of its leaves.
+enum action : char {
+    // the mode of the first leaf
+    ACT_FIRST,
+    // the sum of the leaves, one a base and one an index, with the constants
+    // as the displacement
+    ACT_SUM,
+    // a register as an index
+    ACT_INDEX,
+    // the sum of the other leaves, scaled by the last, a constant
+    ACT_SCALE,
+    // a register plus itself scaled by one less than a constant
+    ACT_TIMES,
+    // the address of a variable in the stack frame
+    ACT_FRAME,
+};
+
+struct rule {
+    enum nonterminal lhs;
+    unsigned char cost;
+    enum action action;
+    enum emitter emit;
+    // whether the root can be a float operation; the rest of a pattern is
+    // integer arithmetic
+    bool floats;
+    struct atom pattern[6];
+};
+
+#define OP(op) { ATOM_OP, op }
+#define NT(nt) { ATOM_NT, NT_##nt }
+#define K(k) { ATOM_CONST, K_##k }
+
+// A rule whose pattern is a nonterminal is a chain rule, and its cost is
+// added to that of the nonterminal at the same node. The costs are roughly
+// instructions. When two rules cost the same the first wins, and the rules
+// win over lowering an instruction on its own.
+static const struct rule rules[] = {
+    // addresses
+    { NT_BASE, 0, ACT_FIRST, EMIT_NONE, false, { NT(REG) } },
+    { NT_BASE, 0, ACT_FRAME, EMIT_NONE, false, { OP(ADDR) } },
+    { NT_INDEX, 0, ACT_INDEX, EMIT_NONE, false, { NT(REG) } },
+    { NT_INDEX, 0, ACT_SCALE, EMIT_NONE, false, { OP(MUL), NT(REG), K(SCALE) } },
+    { NT_INDEX, 0, ACT_SCALE, EMIT_NONE, false, { OP(SHL), NT(REG), K(SHIFT) } },
+    { NT_INDEX, 0, ACT_SCALE, EMIT_NONE, false, { OP(MUL), OP(ADD), NT(REG), K(IMM), K(SCALE) } },
+    { NT_INDEX, 0, ACT_SCALE, EMIT_NONE, false, { OP(SHL), OP(ADD), NT(REG), K(IMM), K(SHIFT) } },
+    { NT_MODE, 0, ACT_SUM, EMIT_NONE, false, { OP(ADD), NT(BASE), NT(INDEX) } },
+    { NT_MODE, 0, ACT_SUM, EMIT_NONE, false, { OP(ADD), NT(INDEX), NT(BASE) } },
+    { NT_MODE, 0, ACT_SUM, EMIT_NONE, false, { OP(ADD), NT(BASE), K(IMM) } },
+    { NT_MODE, 0, ACT_SUM, EMIT_NONE, false, { OP(SUB), NT(BASE), K(IMM) } },
+    { NT_MODE, 0, ACT_SUM, EMIT_NONE, false, { OP(ADD), OP(ADD), NT(BASE), NT(INDEX), K(IMM) } },
+    { NT_MODE, 0, ACT_SUM, EMIT_NONE, false, { OP(ADD), OP(ADD), NT(INDEX), NT(BASE), K(IMM) } },
+    { NT_MODE, 0, ACT_SUM, EMIT_NONE, false, { OP(ADD), OP(ADD), NT(BASE), K(IMM), NT(INDEX) } },
+    { NT_MODE, 0, ACT_TIMES, EMIT_NONE, false, { OP(MUL), NT(REG), K(LEA) } },
+    { NT_ADDR, 0, ACT_FIRST, EMIT_NONE, false, { NT(BASE) } },
+    { NT_ADDR, 0, ACT_FIRST, EMIT_NONE, false, { NT(MODE) } },
+
+    // arithmetic in the address unit
+    { NT_REG, 1, ACT_FIRST, EMIT_LEA, false, { NT(MODE) } },
+
+    // memory
+    { NT_REG, 1, ACT_FIRST, EMIT_LOAD, true, { OP(LD), NT(ADDR) } },
+    { NT_STMT, 1, ACT_FIRST, EMIT_STORE, true, { OP(ST), NT(ADDR), NT(REG) } },
+    { NT_STMT, 1, ACT_FIRST, EMIT_STORE, false, { OP(ST), NT(ADDR), K(IMM) } },
+
+    // comparisons straight into the flags of a jump
+    { NT_STMT, 2, ACT_FIRST, EMIT_BRANCH, false, { OP(JZ), OP(TEST), NT(REG), NT(REG) } },
+    { NT_STMT, 2, ACT_FIRST, EMIT_BRANCH, false, { OP(JZ), OP(TEST), NT(REG), K(IMM) } },
+
+    // immediate operands
+    { NT_REG, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(ADD), NT(REG), K(IMM) } },
+    { NT_REG, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(ADD), K(IMM), NT(REG) } },
+    { NT_REG, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(SUB), NT(REG), K(IMM) } },
+    { NT_REG, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(MUL), NT(REG), K(IMM) } },
+    { NT_REG, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(MUL), K(IMM), NT(REG) } },
+    { NT_REG, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(AND), NT(REG), K(IMM) } },
+    { NT_REG, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(AND), K(IMM), NT(REG) } },
+    { NT_REG, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(OR), NT(REG), K(IMM) } },
+    { NT_REG, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(OR), K(IMM), NT(REG) } },
+    { NT_REG, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(XOR), NT(REG), K(IMM) } },
+    { NT_REG, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(XOR), K(IMM), NT(REG) } },
+    { NT_REG, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(SHL), NT(REG), K(ANY) } },
+    { NT_REG, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(SHR), NT(REG), K(ANY) } },
+    { NT_REG, 3, ACT_FIRST, EMIT_DEFAULT, false, { OP(TEST), NT(REG), K(IMM) } },
+    { NT_REG, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(MOVE), K(ANY) } },
+    { NT_STMT, 1, ACT_FIRST, EMIT_DEFAULT, false, { OP(RET), K(ANY) } },
+};
+
+#undef OP
+#undef NT
+#undef K
+
+#define N_RULES (sizeof(rules) / sizeof(rules[0]))
+// an instruction lowered on its own, with its operands in registers
+#define RULE_DEFAULT ((short)N_RULES)
+#define NO_RULE ((short)-1)
+
+// The cheapest rule that reduces a node to each nonterminal, and what it
+// makes of it.
+struct label {
+    int cost[N_NONTERMINALS];
+    short rule[N_NONTERMINALS];
+    struct address_mode mode[N_NONTERMINALS];
+};
+
+struct selector {
+    struct tu *tu;
+    struct function *function;
+    struct selection *out;
+    // every instruction of the function, and the block it is in
+    struct ir_instr **instrs;
+    int *block_of;
+    size_t n_instrs;
+    // for each register: its definitions and uses, and the instruction of
+    // its last definition and use
+    int *defs;
+    int *uses;
+    int *def_at;
+    int *use_at;
+    // for each register, where it lives as an index among the machine
+    // registers and then the stack slots that hold registers, or -1. The
+    // allocators coalesce registers that are copies into the same place, so
+    // a value can be read through any register that lives where it does.
+    int *place;
+    size_t n_places;
+    // for each place, how many instructions and parameters write it
+    int *place_defs;
+    // for each instruction: the one instruction that reads the value it
+    // writes before anything overwrites it, or -1 if none or several do
+    int *sole_reader;
+    // the one it is an edge of a tree into, or -1, and the registers its
+    // subtree reads
+    int *folds_into;
+    reg (*reach)[MAX_REACH];
+    int *n_reach;
+    bool *folded;
+    struct label *labels;
+};
+
+struct leaf {
+    enum atom_kind kind;
+    // the operation the leaf is an operand of, and which operand
+    enum ir_op user;
+    int operand;
+    int64_t constant;
+    struct address_mode mode;
+};
+
+struct match {
+    const struct rule *rule;
+    const struct atom *at;
+    struct leaf leaves[6];
+    int n_leaves;
+    int cost;
+};
+
+static bool fits_imm32(int64_t imm) {
+    return imm >= INT32_MIN && imm <= INT32_MAX;
+}
+
+static int64_t sign_extend(uint64_t value, int size) {
+    if (size >= 8) return (int64_t)value;
+    int shift = 64 - 8 * size;
+    return (int64_t)(value << shift) >> shift;
+}
+
+static int int_size(int width) {
+    return width <= 4 ? 4 : 8;
+}
+
+// The operands of the operations that patterns match.
+static int arity(enum ir_op op) {
+    switch (op) {
+    case ADD: case SUB: case MUL: case SHL: case SHR:
+    case AND: case OR: case XOR:
+    case TEST: case ST:
+        return 2;
+    case LD: case JZ: case RET: case MOVE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static struct location *location(struct selector *s, reg r) {
+    return &s->function->allocation->locations.data[r];
+}
+
+// The address of a variable in the stack frame, rather than one reached
+// through its symbol.
+static bool is_frame_address(struct selector *s, struct ir_instr *i) {
+    return i->op == ADDR && i->r[1] && !names_symbol(s->tu, s->function->regs.data[i->r[1]].scope);
+}
+
+// Whether an instruction can move to where its value is used: it only
+// computes, from registers that are still there.
+static bool can_fold(struct selector *s, struct ir_instr *i) {
+    switch (i->op) {
+    case ADD: case SUB: case MUL: case SHL: case TEST:
+        return !i->is_float;
+    case ADDR:
+        return is_frame_address(s, i);
+    default:
+        return false;
+    }
+}
+
+static int compare_offsets(const void *x, const void *y) {
+    int a = *(const int *)x, b = *(const int *)y;
+    return (a > b) - (a < b);
+}
+
+static void find_places(struct selector *s) {
+    struct function *function = s->function;
+    size_t n_regs = function->regs.len;
+    int *offsets = malloc((n_regs ? n_regs : 1) * sizeof(int));
+    size_t n_offsets = 0;
+    for (reg r = 1; r < n_regs; r++) {
+        if (is_allocated(function, r) && location(s, r)->kind == LOC_STACK) offsets[n_offsets++] = location(s, r)->offset;
+    }
+    qsort(offsets, n_offsets, sizeof(int), compare_offsets);
+    size_t n_slots = 0;
+    for (size_t o = 0; o < n_offsets; o++) {
+        if (!n_slots || offsets[n_slots - 1] != offsets[o]) offsets[n_slots++] = offsets[o];
+    }
+    s->n_places = N_MACHINE_REGS + n_slots;
+    for (reg r = 0; r < n_regs; r++) {
+        struct location *l = location(s, r);
+        s->place[r] = -1;
+        if (!is_allocated(function, r)) continue;
+        if (l->kind == LOC_REG) {
+            s->place[r] = l->reg;
+        } else if (l->kind == LOC_STACK) {
+            int *slot = bsearch(&l->offset, offsets, n_slots, sizeof(int), compare_offsets);
+            s->place[r] = N_MACHINE_REGS + (int)(slot - offsets);
+        }
+    }
+    free(offsets);
+}
+
+#define SET(bits, p) ((bits)[(p) / 64] |= 1ull << ((p) % 64))
+#define CLEAR(bits, p) ((bits)[(p) / 64] &= ~(1ull << ((p) % 64)))
+#define TEST(bits, p) (((bits)[(p) / 64] >> ((p) % 64)) & 1)
+
+enum {
+    NO_READER = -1,
+    LIVE_OUT = -2,
+};
+
+// Find the sole reader of every instruction's value, from which places are
+// live out of each block.
+static void find_readers(struct selector *s) {
+    struct function *function = s->function;
+    size_t n_blocks = function->blocks.len, words = (s->n_places + 63) / 64;
+    uint64_t *live_in = calloc(n_blocks * words, sizeof(uint64_t));
+    uint64_t *live_out = calloc(n_blocks * words, sizeof(uint64_t));
+    uint64_t *live = malloc(words * sizeof(uint64_t));
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t b = n_blocks; b-- > 0;) {
+            struct ir_block *block = &function->blocks.data[b];
+            memset(live, 0, words * sizeof(uint64_t));
+            for (int succ = 0; succ < block->n_succs; succ++) {
+                for (size_t w = 0; w < words; w++) live[w] |= live_in[block->succs[succ] * words + w];
+            }
+            memcpy(&live_out[b * words], live, words * sizeof(uint64_t));
+            for (size_t n = block->instrs.len; n-- > 0;) {
+                struct ir_instr *instr = &block->instrs.data[n];
+                reg d = ir_def(instr);
+                if (d && s->place[d] >= 0) CLEAR(live, s->place[d]);
+                for (int u = 0; u < ir_use_count(function, instr); u++) {
+                    int p = s->place[*ir_use(function, instr, u)];
+                    if (p >= 0) SET(live, p);
+                }
+            }
+            if (memcmp(&live_in[b * words], live, words * sizeof(uint64_t))) {
+                memcpy(&live_in[b * words], live, words * sizeof(uint64_t));
+                changed = true;
+            }
+        }
+    }
+
+    // going back through each block: the next instruction that reads each
+    // place, and whether anything reads it after that one
+    int *next = malloc(s->n_places * sizeof(int));
+    bool *more = malloc(s->n_places * sizeof(bool));
+    for (size_t b = 0; b < n_blocks; b++) {
+        for (size_t p = 0; p < s->n_places; p++) {
+            next[p] = TEST(&live_out[b * words], p) ? LIVE_OUT : NO_READER;
+            more[p] = false;
+        }
+        for (size_t k = s->out->block_start[b + 1]; k-- > s->out->block_start[b];) {
+            struct ir_instr *instr = s->instrs[k];
+            reg d = ir_def(instr);
+            int p = d ? s->place[d] : -1;
+            s->sole_reader[k] = p >= 0 && next[p] >= 0 && !more[p] ? next[p] : -1;
+            if (p >= 0) {
+                next[p] = NO_READER;
+                more[p] = false;
+            }
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                p = s->place[*ir_use(function, instr, u)];
+                if (p < 0 || next[p] == (int)k) continue;
+                more[p] = next[p] != NO_READER;
+                next[p] = (int)k;
+            }
+        }
+    }
+
+    free(next);
+    free(more);
+    free(live_in);
+    free(live_out);
+    free(live);
+}
+
+// Whether instruction j can be an edge of a tree into the one that uses its
+// value: that is the only instruction to read the value, and nothing between
+// them calls or writes where a register its subtree reads lives.
+static bool is_edge(struct selector *s, int j) {
+    struct ir_instr *i = s->instrs[j];
+    reg d = ir_def(i);
+    if (!d || !is_allocated(s->function, d) || s->defs[d] != 1 || s->uses[d] != 1) return false;
+    int k = s->use_at[d];
+    if (k <= j || k - j > MAX_DISTANCE || s->sole_reader[j] != k || !can_fold(s, i)) return false;
+    if (s->n_reach[j] > MAX_REACH) return false;
+    for (int m = j + 1; m < k; m++) {
+        struct ir_instr *between = s->instrs[m];
+        if (between->op == CALL) return false;
+        reg w = ir_def(between);
+        if (!w || s->place[w] < 0) continue;
+        for (int r = 0; r < s->n_reach[j]; r++) {
+            if (s->place[s->reach[j][r]] == s->place[w]) return false;
+        }
+    }
+    return true;
+}
+
+static void add_reach(struct selector *s, int j, reg r) {
+    if (!is_allocated(s->function, r)) return;
+    for (int n = 0; n < s->n_reach[j] && n < MAX_REACH; n++) {
+        if (s->reach[j][n] == r) return;
+    }
+    if (s->n_reach[j] < MAX_REACH) s->reach[j][s->n_reach[j]] = r;
+    s->n_reach[j] += 1;
+}
+
+// Find the edges of the trees, each instruction's after those of its
+// operands, which are earlier in the block.
+static void find_edges(struct selector *s) {
+    for (size_t j = 0; j < s->n_instrs; j++) {
+        struct ir_instr *i = s->instrs[j];
+        s->folds_into[j] = -1;
+        for (int u = 0; u < ir_use_count(s->function, i); u++) {
+            reg r = *ir_use(s->function, i, u);
+            add_reach(s, (int)j, r);
+            int c = r ? s->def_at[r] : -1;
+            if (c < 0 || s->folds_into[c] != (int)j) continue;
+            for (int n = 0; n < s->n_reach[c] && n < MAX_REACH; n++) add_reach(s, (int)j, s->reach[c][n]);
+            if (s->n_reach[c] > MAX_REACH) s->n_reach[j] = MAX_REACH + 1;
+        }
+        if (is_edge(s, (int)j)) s->folds_into[j] = s->use_at[ir_def(i)];
+    }
+}
+
+// The instruction an operand of instruction k is the subtree of, or -1 if it
+// is a leaf.
+static int subtree(struct selector *s, int k, reg r) {
+    int c = r ? s->def_at[r] : -1;
+    return c >= 0 && s->folds_into[c] == k ? c : -1;
+}
+
+// Whether instruction k can read register r as the constant its IMM writes.
+// A register coalesced with others shares where it lives with them, so that
+// is only so if nothing else ever writes there, or nothing does between the
+// IMM and k in the same block.
+static bool is_constant(struct selector *s, int k, reg r, int64_t *value) {
+    int c = r ? s->out->constants[r] : 0;
+    if (!c) return false;
+    int p = s->place[r];
+    if (p >= 0 && s->place_defs[p] > 1) {
+        int j = s->def_at[r];
+        if (j >= k || k - j > MAX_DISTANCE || s->block_of[j] != s->block_of[k]) return false;
+        for (int m = j + 1; m < k; m++) {
+            reg w = ir_def(s->instrs[m]);
+            if (s->instrs[m]->op == CALL || (w && s->place[w] == p)) return false;
+        }
+    }
+    *value = (int64_t)s->function->constants.data[c].i;
+    return true;
+}
+
+static bool constant_matches(enum constant_kind kind, int64_t c, int size) {
+    switch (kind) {
+    case K_ANY: return true;
+    case K_IMM: return fits_imm32(sign_extend((uint64_t)c, size));
+    case K_SCALE: return c == 1 || c == 2 || c == 4 || c == 8;
+    case K_SHIFT: return c >= 0 && c <= 3;
+    case K_LEA: return c == 3 || c == 5 || c == 9;
+    }
+    return false;
+}
+
+// Add a mode to a sum, as its base, or as its index if it has a base
+// already and the mode is a register.
+static bool add_mode(struct address_mode *sum, struct address_mode *m) {
+    sum->disp += m->disp;
+    if (m->frame || m->base) {
+        if (!sum->frame && !sum->base) {
+            sum->frame = m->frame;
+            sum->base = m->base;
+        } else if (!sum->scale && !m->frame) {
+            sum->index = m->base;
+            sum->scale = 1;
+        } else {
+            return false;
+        }
+    }
+    if (m->scale) {
+        if (sum->scale) return false;
+        sum->index = m->index;
+        sum->scale = m->scale;
+    }
+    return true;
+}
+
+static bool sum_leaves(struct leaf *leaves, int n, struct address_mode *sum) {
+    *sum = (struct address_mode){};
+    for (int l = 0; l < n; l++) {
+        if (leaves[l].kind == ATOM_CONST) {
+            bool negate = leaves[l].user == SUB && leaves[l].operand == 1;
+            sum->disp += negate ? -leaves[l].constant : leaves[l].constant;
+        } else if (!add_mode(sum, &leaves[l].mode)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool apply_action(struct selector *s, int k, struct match *m, struct address_mode *mode) {
+    struct leaf *leaves = m->leaves;
+    *mode = (struct address_mode){};
+    switch (m->rule->action) {
+    case ACT_FIRST:
+        if (m->n_leaves) *mode = leaves[0].mode;
+        return true;
+    case ACT_SUM:
+        if (!sum_leaves(leaves, m->n_leaves, mode)) return false;
+        break;
+    case ACT_INDEX:
+        if (leaves[0].mode.frame || leaves[0].mode.scale || leaves[0].mode.disp) return false;
+        *mode = (struct address_mode){ .index = leaves[0].mode.base, .scale = 1 };
+        return true;
+    case ACT_SCALE: {
+        struct leaf *by = &leaves[m->n_leaves - 1];
+        int64_t scale = by->user == SHL ? (int64_t)1 << by->constant : by->constant;
+        struct address_mode sum;
+        if (!sum_leaves(leaves, m->n_leaves - 1, &sum) || sum.frame || sum.scale || !sum.base) return false;
+        *mode = (struct address_mode){ .index = sum.base, .scale = (unsigned char)scale, .disp = sum.disp * scale };
+        break;
+    }
+    case ACT_TIMES: {
+        if (leaves[0].mode.frame || leaves[0].mode.scale || leaves[0].mode.disp) return false;
+        reg r = leaves[0].mode.base;
+        *mode = (struct address_mode){ .base = r, .index = r, .scale = (unsigned char)(leaves[1].constant - 1) };
+        return true;
+    }
+    case ACT_FRAME:
+        *mode = (struct address_mode){ .frame = true, .disp = s->function->regs.data[s->instrs[k]->r[1]].scope->frame_offset };
+        break;
+    }
+    return fits_imm32(mode->disp);
+}
+
+static void close_label(struct label *l, reg self);
+
+// The label of an operand that is a leaf: a register, which every chain
+// rule from NT_REG applies to.
+static void leaf_label(struct label *l, reg r) {
+    for (int nt = 0; nt < N_NONTERMINALS; nt++) {
+        l->cost[nt] = INFINITE_COST;
+        l->rule[nt] = NO_RULE;
+    }
+    l->cost[NT_REG] = 0;
+    l->rule[NT_REG] = RULE_DEFAULT;
+    close_label(l, r);
+}
+
+// Match the pattern at m->at, an operation, against instruction k, adding up
+// the costs of its leaves.
+static bool match(struct selector *s, struct match *m, int k, bool is_root) {
+    struct ir_instr *i = s->instrs[k];
+    enum ir_op op = (enum ir_op)(m->at++)->value;
+    if (i->op != op || arity(op) != ir_use_count(s->function, i)) return false;
+    if (i->is_float && !(is_root && m->rule->floats)) return false;
+    if (op == ADDR && !is_frame_address(s, i)) return false;
+
+    for (int u = 0; u < arity(op); u++) {
+        reg r = *ir_use(s->function, i, u);
+        struct atom a = *m->at;
+        if (a.kind == ATOM_OP) {
+            int c = subtree(s, k, r);
+            if (c < 0 || !match(s, m, c, false)) return false;
+            continue;
+        }
+        m->at++;
+        struct leaf *leaf = &m->leaves[m->n_leaves++];
+        *leaf = (struct leaf){ .kind = a.kind, .user = op, .operand = u };
+        if (a.kind == ATOM_CONST) {
+            if (!is_constant(s, k, r, &leaf->constant) ||
+                !constant_matches((enum constant_kind)a.value, leaf->constant, int_size(i->width)))
+                return false;
+            continue;
+        }
+        int c = subtree(s, k, r);
+        struct label operand;
+        if (c < 0) leaf_label(&operand, r);
+        struct label *l = c < 0 ? &operand : &s->labels[c];
+        if (l->cost[(int)a.value] >= INFINITE_COST) return false;
+        m->cost += l->cost[(int)a.value];
+        leaf->mode = a.value == NT_REG ? (struct address_mode){ .base = r } : l->mode[(int)a.value];
+    }
+    return true;
+}
+
+// Apply the chain rules to a label until none makes anything cheaper. The
+// mode of NT_REG is what its rule computes, which its users see as the
+// register it is in.
+static void close_label(struct label *l, reg self) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t n = 0; n < N_RULES; n++) {
+            const struct rule *rule = &rules[n];
+            if (rule->pattern[0].kind != ATOM_NT) continue;
+            int from = rule->pattern[0].value;
+            int cost = l->cost[from] + rule->cost;
+            if (cost >= l->cost[rule->lhs]) continue;
+            struct address_mode mode = from == NT_REG ? (struct address_mode){ .base = self } : l->mode[from];
+            if (rule->action == ACT_INDEX) {
+                if (mode.frame || mode.scale || mode.disp) continue;
+                mode = (struct address_mode){ .index = mode.base, .scale = 1 };
+            }
+            l->cost[rule->lhs] = cost;
+            l->rule[rule->lhs] = (short)n;
+            l->mode[rule->lhs] = mode;
+            changed = true;
+        }
+    }
+}
+
+static int default_cost(enum ir_op op) {
+    switch (op) {
+    case TEST: return 3;
+    case JZ: return 2;
+    default: return 1;
+    }
+}
+
+static void label(struct selector *s, int k) {
+    struct ir_instr *i = s->instrs[k];
+    struct label *l = &s->labels[k];
+    for (int nt = 0; nt < N_NONTERMINALS; nt++) {
+        l->cost[nt] = INFINITE_COST;
+        l->rule[nt] = NO_RULE;
+    }
+
+    for (size_t n = 0; n < N_RULES; n++) {
+        const struct rule *rule = &rules[n];
+        if (rule->pattern[0].kind != ATOM_OP || rule->pattern[0].value != i->op) continue;
+        struct match m = { .rule = rule, .at = rule->pattern };
+        struct address_mode mode;
+        if (!match(s, &m, k, true) || !apply_action(s, k, &m, &mode)) continue;
+        int cost = m.cost + rule->cost;
+        if (cost >= l->cost[rule->lhs]) continue;
+        l->cost[rule->lhs] = cost;
+        l->rule[rule->lhs] = (short)n;
+        l->mode[rule->lhs] = mode;
+    }
+
+    enum nonterminal lhs = ir_def(i) ? NT_REG : NT_STMT;
+    int cost = default_cost(i->op);
+    for (int u = 0; u < ir_use_count(s->function, i); u++) {
+        int c = subtree(s, k, *ir_use(s->function, i, u));
+        if (c >= 0) cost += s->labels[c].cost[NT_REG];
+    }
+    if (cost < l->cost[lhs]) {
+        l->cost[lhs] = cost;
+        l->rule[lhs] = RULE_DEFAULT;
+    }
+    close_label(l, ir_def(i));
+}
+
+static void reduce(struct selector *s, int k, enum nonterminal nt);
+
+// Whether a node reduces to a nonterminal by chain rules from NT_REG, which
+// leaves it computed where it stands.
+static bool is_register_chain(struct label *l, enum nonterminal nt) {
+    while (nt != NT_REG) {
+        short n = l->rule[nt];
+        if (n == RULE_DEFAULT || n == NO_RULE || rules[n].pattern[0].kind != ATOM_NT) return false;
+        nt = (enum nonterminal)rules[n].pattern[0].value;
+    }
+    return true;
+}
+
+// Cover the nodes that the pattern at *at, an operation, matches from
+// instruction k.
+static void cover_pattern(struct selector *s, int k, const struct atom **at) {
+    struct ir_instr *i = s->instrs[k];
+    (*at)++;
+    for (int u = 0; u < arity(i->op); u++) {
+        reg *slot = ir_use(s->function, i, u);
+        struct atom a = **at;
+        int c = subtree(s, k, *slot);
+        if (a.kind == ATOM_OP) {
+            s->folded[c] = true;
+            cover_pattern(s, c, at);
+            continue;
+        }
+        (*at)++;
+        if (a.kind == ATOM_CONST) {
+            s->out->covers[k].immediates |= (unsigned char)(1 << (slot - i->r));
+        } else if (c >= 0 && !is_register_chain(&s->labels[c], (enum nonterminal)a.value)) {
+            s->folded[c] = true;
+            reduce(s, c, (enum nonterminal)a.value);
+        }
+    }
+}
+
+static void reduce(struct selector *s, int k, enum nonterminal nt) {
+    short n = s->labels[k].rule[nt];
+    if (n == RULE_DEFAULT || n == NO_RULE) return;
+    const struct rule *rule = &rules[n];
+    const struct atom *at = rule->pattern;
+    if (at->kind == ATOM_NT) reduce(s, k, (enum nonterminal)at->value);
+    else cover_pattern(s, k, &at);
+}
+
+// Cover an instruction that is computed where it stands.
+static void cover_root(struct selector *s, int k) {
+    struct ir_instr *i = s->instrs[k];
+    struct cover *cover = &s->out->covers[k];
+    enum nonterminal goal = ir_def(i) ? NT_REG : NT_STMT;
+    struct label *l = &s->labels[k];
+    short n = l->rule[goal];
+    cover->emit = EMIT_DEFAULT;
+    if (n != RULE_DEFAULT && n != NO_RULE) {
+        cover->emit = rules[n].emit;
+        cover->mode = l->mode[goal];
+        if (rules[n].emit == EMIT_BRANCH) cover->compare = s->instrs[s->def_at[i->r[0]]];
+    }
+    reduce(s, k, goal);
+}
+
+// Drop the constants that nothing reads where they live, because every use
+// of them, and of any register coalesced with them, is an immediate.
+static void drop_unread_constants(struct selector *s) {
+    struct function *function = s->function;
+    bool *read = calloc(s->n_places, sizeof(bool));
+    for (size_t k = 0; k < s->n_instrs; k++) {
+        struct ir_instr *i = s->instrs[k];
+        for (int u = 0; u < ir_use_count(function, i); u++) {
+            reg *slot = ir_use(function, i, u);
+            int p = s->place[*slot];
+            if (p < 0) continue;
+            bool immediate = slot >= i->r && slot < i->r + 3 && (s->out->covers[k].immediates & (1 << (slot - i->r)));
+            if (!immediate || !s->out->constants[*slot]) read[p] = true;
+        }
+    }
+    for (size_t k = 0; k < s->n_instrs; k++) {
+        reg d = ir_def(s->instrs[k]);
+        if (s->instrs[k]->op == IMM && s->out->constants[d] && s->place[d] >= 0 && !read[s->place[d]])
+            s->out->covers[k].emit = EMIT_NONE;
+    }
+    free(read);
+}
+
+void select_instructions(struct tu *tu, struct function *function, struct selection *out) {
+    size_t n_blocks = function->blocks.len, n_regs = function->regs.len;
+    struct selector s = { .tu = tu, .function = function, .out = out };
+    out->block_start = malloc((n_blocks + 1) * sizeof(size_t));
+    for (size_t b = 0; b < n_blocks; b++) {
+        out->block_start[b] = s.n_instrs;
+        s.n_instrs += function->blocks.data[b].instrs.len;
+    }
+    out->block_start[n_blocks] = s.n_instrs;
+    size_t n = s.n_instrs;
+    out->covers = calloc(n ? n : 1, sizeof(struct cover));
+    out->constants = calloc(n_regs, sizeof(int));
+    s.instrs = malloc((n ? n : 1) * sizeof(struct ir_instr *));
+    s.block_of = malloc((n ? n : 1) * sizeof(int));
+    s.defs = calloc(n_regs, sizeof(int));
+    s.uses = calloc(n_regs, sizeof(int));
+    s.def_at = malloc(n_regs * sizeof(int));
+    s.use_at = malloc(n_regs * sizeof(int));
+    s.place = malloc(n_regs * sizeof(int));
+    s.sole_reader = malloc((n ? n : 1) * sizeof(int));
+    s.folds_into = malloc((n ? n : 1) * sizeof(int));
+    s.reach = malloc((n ? n : 1) * sizeof(*s.reach));
+    s.n_reach = calloc(n ? n : 1, sizeof(int));
+    s.folded = calloc(n ? n : 1, sizeof(bool));
+    s.labels = malloc((n ? n : 1) * sizeof(struct label));
+    for (size_t r = 0; r < n_regs; r++) s.def_at[r] = s.use_at[r] = -1;
+
+    size_t k = 0;
+    for (size_t b = 0; b < n_blocks; b++) {
+        for_each (&function->blocks.data[b].instrs) {
+            s.instrs[k] = it;
+            s.block_of[k] = (int)b;
+            reg d = ir_def(it);
+            if (d) {
+                s.defs[d] += 1;
+                s.def_at[d] = (int)k;
+            }
+            for (int u = 0; u < ir_use_count(function, it); u++) {
+                reg r = *ir_use(function, it, u);
+                s.uses[r] += 1;
+                s.use_at[r] = (int)k;
+            }
+            k++;
+        }
+    }
+    for (size_t r = 1; r < n_regs; r++) {
+        if (s.defs[r] != 1) {
+            s.def_at[r] = -1;
+            continue;
+        }
+        struct ir_instr *def = s.instrs[s.def_at[r]];
+        if (def->op == IMM && !def->is_float) out->constants[r] = (int)def->r[1];
+    }
+
+    find_places(&s);
+    s.place_defs = calloc(s.n_places, sizeof(int));
+    for (k = 0; k < n; k++) {
+        reg d = ir_def(s.instrs[k]);
+        if (d && s.place[d] >= 0) s.place_defs[s.place[d]] += 1;
+    }
+    for_each (&function->params) {
+        if (s.place[*it] >= 0) s.place_defs[s.place[*it]] += 1;
+    }
+    find_readers(&s);
+    find_edges(&s);
+    for (k = 0; k < n; k++) label(&s, (int)k);
+    // the users of a tree's nodes come after them
+    for (k = n; k-- > 0;) {
+        if (!s.folded[k]) cover_root(&s, (int)k);
+    }
+    for (k = 0; k < n; k++) {
+        if (s.folded[k]) out->covers[k].emit = EMIT_NONE;
+    }
+    drop_unread_constants(&s);
+
+    free(s.instrs);
+    free(s.block_of);
+    free(s.defs);
+    free(s.uses);
+    free(s.def_at);
+    free(s.use_at);
+    free(s.place);
+    free(s.place_defs);
+    free(s.sole_reader);
+    free(s.folds_into);
+    free(s.reach);
+    free(s.n_reach);
+    free(s.folded);
+    free(s.labels);
+}
+
+void free_selection(struct selection *selection) {
+    free(selection->covers);
+    free(selection->block_start);
+    free(selection->constants);
+}
@@ -0,0 +1,495 @@
+#include "opt.h"
+#include "ir.h"
+#include "loop.h"
+#include "ssa.h"
+
+#include <stdckdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Induction variables are found the way scalar evolution describes them, as
+// add recurrences: a basic induction variable is a header PHI that enters
+// with some value and has an invariant step added around the back edge, and
+// anything computed from one by adding, multiplying or shifting by invariants
+// is an affine function of it. Only the forms the emitter produces for
+// counted loops and array indexing are recognized, which are the ones worth
+// reducing.
+
+struct iv_context {
+    struct function *function;
+    struct loop_forest *forest;
+    struct induction *ivs;
+    // the block and instruction defining each register, -1 and nullptr for
+    // parameters and undefined values
+    int *def_block;
+    struct ir_instr **def;
+};
+
+static bool is_invariant(struct iv_context *c, int l, reg r) {
+    return c->def_block[r] == -1 || !loop_contains(c->forest, l, c->def_block[r]);
+}
+
+static bool is_iv(struct iv_context *c, int l, reg r) {
+    return c->ivs[r].loop == l;
+}
+
+// The value of an integer IMM as its width and signedness see it.
+static bool constant(struct iv_context *c, reg r, int64_t *value) {
+    struct ir_instr *d = c->def[r];
+    if (!d || d->op != IMM || d->is_float) return false;
+    struct ir_constant *k = &c->function->constants.data[d->r[1]];
+    if (k->name) return false;
+    uint64_t v = k->i;
+    if (d->width < 8) {
+        int bits = d->width * 8;
+        v &= (1ull << bits) - 1;
+        if (d->is_signed && (v >> (bits - 1)) & 1) v |= ~((1ull << bits) - 1);
+    }
+    *value = (int64_t)v;
+    return true;
+}
+
+static void find_basic(struct iv_context *c, int l) {
+    struct loop *loop = &c->forest->loops.data[l];
+    if (loop->preheader == -1) return;
+    struct ir_block *header = &c->function->blocks.data[loop->header];
+
+    for_each_n (phi, &header->instrs) {
+        if (phi->op != PHI) break;
+        if (phi->is_float) continue;
+
+        // one value from the preheader, and the same one from every back edge
+        reg start = 0, next = 0;
+        bool ok = true;
+        for (size_t p = 0; p < header->preds.len; p++) {
+            reg v = *ir_use(c->function, phi, (int)p);
+            if (header->preds.data[p] == loop->preheader) start = v;
+            else if (!next) next = v;
+            else if (next != v) ok = false;
+        }
+        if (!ok || !start || !next) continue;
+
+        struct ir_instr *d = c->def[next];
+        while (d && d->op == MOVE && d->width == phi->width) d = c->def[d->r[1]];
+        if (!d || (d->op != ADD && d->op != SUB) || d->width != phi->width) continue;
+        reg x = d->r[1], k = d->r[2];
+        if (d->op == ADD && k == phi->r[0]) {
+            k = x;
+            x = phi->r[0];
+        }
+        if (x != phi->r[0] || !is_invariant(c, l, k)) continue;
+
+        struct induction *iv = &c->ivs[phi->r[0]];
+        *iv = (struct induction){
+            .loop = l,
+            .basic = phi->r[0],
+            .scale = 1,
+            .start = start,
+            .step = d->op == SUB ? -1 : 1,
+            .width = phi->width,
+        };
+        int64_t v;
+        if (constant(c, k, &v) && (d->op == ADD || v != INT64_MIN)) iv->step = d->op == SUB ? -v : v;
+        else iv->step_reg = k;
+    }
+}
+
+// An instruction whose operands are an induction variable and invariants is
+// another induction variable of the same basic one.
+static void find_derived(struct iv_context *c, int l, struct ir_instr *i) {
+    if (i->is_float) return;
+    reg x = i->r[1], y = i->r[2];
+    if ((i->op == ADD || i->op == MUL) && is_iv(c, l, y) && !is_iv(c, l, x)) {
+        reg t = x;
+        x = y;
+        y = t;
+    }
+    if (!is_iv(c, l, x)) return;
+    struct induction iv = c->ivs[x];
+    if (i->op == EXT) {
+        // sign extension commutes with the arithmetic as long as the narrow
+        // value doesn't overflow, which is undefined anyway
+        if (!i->is_signed || i->from_width != iv.width) return;
+        iv.width = i->width;
+        c->ivs[i->r[0]] = iv;
+        return;
+    }
+    if (i->width != iv.width) return;
+
+    int64_t v;
+    bool is_constant = constant(c, y, &v);
+    switch (i->op) {
+    case MOVE:
+        break;
+    case ADD:
+        if (!is_invariant(c, l, y)) return;
+        if (is_constant) {
+            if (ckd_add(&iv.offset, iv.offset, v)) return;
+        } else if (!iv.offset_reg) {
+            iv.offset_reg = y;
+            iv.offset_width = i->width;
+        } else {
+            return;
+        }
+        break;
+    case SUB:
+        if (!is_constant || ckd_sub(&iv.offset, iv.offset, v)) return;
+        break;
+    case SHL:
+        if (!is_constant || v < 0 || v > 62) return;
+        v = (int64_t)1 << v;
+        is_constant = true;
+        [[fallthrough]];
+    case MUL:
+        if (!is_invariant(c, l, y)) return;
+        if (is_constant) {
+            if (iv.offset_reg || ckd_mul(&iv.scale, iv.scale, v) || ckd_mul(&iv.offset, iv.offset, v)) return;
+        } else if (!iv.scale_reg && !iv.offset_reg && !iv.offset) {
+            iv.scale_reg = y;
+            iv.scale_width = i->width;
+        } else {
+            return;
+        }
+        break;
+    default:
+        return;
+    }
+    c->ivs[i->r[0]] = iv;
+}
+
+static enum ir_cond negate(enum ir_cond cond) {
+    switch (cond) {
+    case COND_EQ: return COND_NE;
+    case COND_NE: return COND_EQ;
+    case COND_LT: return COND_GE;
+    case COND_LE: return COND_GT;
+    case COND_GT: return COND_LE;
+    case COND_GE: return COND_LT;
+    }
+    return cond;
+}
+
+static enum ir_cond swap(enum ir_cond cond) {
+    switch (cond) {
+    case COND_LT: return COND_GT;
+    case COND_LE: return COND_GE;
+    case COND_GT: return COND_LT;
+    case COND_GE: return COND_LE;
+    default: return cond;
+    }
+}
+
+// How many times a value that starts at start and goes up by step can be
+// tested against bound with cond before the test fails, if it stays within
+// min and max until then, or -1.
+static int64_t count_iterations(enum ir_cond cond, int64_t start, int64_t step, int64_t bound, int64_t min,
+                                int64_t max) {
+    if (cond == COND_EQ) return start != bound ? 0 : step ? 1 : -1;
+    if (cond == COND_NE) {
+        int64_t distance;
+        if (!step || ckd_sub(&distance, bound, start)) return -1;
+        if (distance % step || distance / step < 0) return -1;
+        return distance / step;
+    }
+
+    // count downwards as upwards on the negated values
+    if (cond == COND_GT || cond == COND_GE) {
+        if (ckd_sub(&start, 0, start) || ckd_sub(&step, 0, step) || ckd_sub(&bound, 0, bound)) return -1;
+        if (ckd_sub(&max, 0, min)) return -1;
+        cond = cond == COND_GT ? COND_LT : COND_LE;
+    }
+    if (cond == COND_LE && ckd_add(&bound, bound, 1)) return -1;
+
+    if (start >= bound) return 0;
+    if (step <= 0) return -1;
+    int64_t last, distance, count;
+    if (ckd_add(&last, bound - 1, step) || last > max) return -1;
+    if (ckd_sub(&distance, bound, start) || ckd_add(&count, distance, step - 1)) return -1;
+    return count / step;
+}
+
+// The trip count of a loop that exits from its header when a basic induction
+// variable with a constant start and step fails a test against a constant.
+static void find_trip_count(struct iv_context *c, int l) {
+    struct loop *loop = &c->forest->loops.data[l];
+    struct ir_instr *jz = &list_last(&c->function->blocks.data[loop->header].instrs);
+    if (jz->op != JZ) return;
+    struct ir_instr *test = c->def[jz->r[0]];
+    if (!test || test->op != TEST || test->is_float) return;
+
+    enum ir_cond cond = test->cond;
+    reg x = test->r[1], y = test->r[2];
+    if (is_iv(c, l, y)) {
+        x = test->r[2];
+        y = test->r[1];
+        cond = swap(cond);
+    }
+    bool stays_if_zero = loop_contains(c->forest, l, (int)jz->r[1]);
+    bool stays_if_not = loop_contains(c->forest, l, (int)jz->r[2]);
+    if (stays_if_zero == stays_if_not) return;
+    if (stays_if_zero) cond = negate(cond);
+
+    struct induction *iv = &c->ivs[x];
+    int64_t start, bound;
+    if (!is_iv(c, l, x) || iv->scale != 1 || iv->scale_reg || iv->offset_reg || iv->step_reg) return;
+    if (iv->width != test->width || !constant(c, iv->start, &start) || !constant(c, y, &bound)) return;
+    if (ckd_add(&start, start, iv->offset)) return;
+
+    int bits = test->width * 8;
+    int64_t min, max;
+    if (test->is_signed) {
+        max = bits == 64 ? INT64_MAX : ((int64_t)1 << (bits - 1)) - 1;
+        min = -max - 1;
+    } else {
+        // 64 bit unsigned values above INT64_MAX aren't counted
+        max = bits == 64 ? INT64_MAX : ((int64_t)1 << bits) - 1;
+        min = 0;
+        if (start < 0 || bound < 0) return;
+    }
+    loop->trip_count = count_iterations(cond, start, iv->step, bound, min, max);
+}
+
+void find_induction_variables(struct function *function, struct loop_forest *forest, struct induction *ivs) {
+    size_t n_regs = function->regs.len;
+    struct iv_context c = {
+        .function = function,
+        .forest = forest,
+        .ivs = ivs,
+        .def_block = malloc(n_regs * sizeof(int)),
+        .def = calloc(n_regs, sizeof(struct ir_instr *)),
+    };
+    for (size_t r = 0; r < n_regs; r++) {
+        c.def_block[r] = -1;
+        ivs[r] = (struct induction){ .loop = -1 };
+    }
+    for (size_t b = 0; b < function->blocks.len; b++) {
+        for_each_n (instr, &function->blocks.data[b].instrs) {
+            reg d = ir_def(instr);
+            if (!d) continue;
+            c.def_block[d] = (int)b;
+            c.def[d] = instr;
+        }
+    }
+
+    for (size_t l = 0; l < forest->loops.len; l++) find_basic(&c, (int)l);
+
+    // in reverse postorder, operands are classified before their uses
+    block_list_t order = {};
+    reverse_postorder(function, &order);
+    for_each (&order) {
+        int l = forest->loop_of[*it];
+        if (l == -1) continue;
+        for_each_n (instr, &function->blocks.data[*it].instrs) {
+            if (instr->op != PHI) find_derived(&c, l, instr);
+        }
+    }
+
+    for (size_t l = 0; l < forest->loops.len; l++) find_trip_count(&c, (int)l);
+
+    list_clear(&order);
+    free(c.def_block);
+    free(c.def);
+}
+
+static void insert_instr(ir_list_t *instrs, size_t at, struct ir_instr instr) {
+    list_push(instrs, instr);
+    memmove(&instrs->data[at + 1], &instrs->data[at], (instrs->len - 1 - at) * sizeof(struct ir_instr));
+    instrs->data[at] = instr;
+}
+
+// Emits instructions in front of a block's terminator, in the width and
+// signedness of an induction variable.
+struct emitter {
+    struct function *function;
+    int block;
+    unsigned char width;
+    bool is_signed;
+};
+
+static reg emit_op(struct emitter *e, enum ir_op op, reg x, reg y) {
+    ir_list_t *instrs = &e->function->blocks.data[e->block].instrs;
+    struct ir_instr i = { .op = op, .r = { new_temporary(e->function), x, y }, .width = e->width,
+                          .is_signed = e->is_signed };
+    insert_instr(instrs, instrs->len - 1, i);
+    return i.r[0];
+}
+
+static reg emit_constant(struct emitter *e, int64_t v) {
+    ir_list_t *instrs = &e->function->blocks.data[e->block].instrs;
+    struct ir_instr i = ir_imm(e->function, (uint64_t)v, new_temporary(e->function));
+    i.width = e->width;
+    i.is_signed = e->is_signed;
+    insert_instr(instrs, instrs->len - 1, i);
+    return i.r[0];
+}
+
+// A value of the basic induction variable's width, sign extended to the
+// induction variable's if it is wider.
+static reg emit_widened(struct emitter *e, reg r, unsigned char from_width) {
+    if (from_width == e->width) return r;
+    ir_list_t *instrs = &e->function->blocks.data[e->block].instrs;
+    struct ir_instr i = { .op = EXT, .r = { new_temporary(e->function), r }, .width = e->width,
+                          .is_signed = true, .from_width = from_width };
+    insert_instr(instrs, instrs->len - 1, i);
+    return i.r[0];
+}
+
+// Replace an induction variable computed with a multiplication by a new basic
+// induction variable that starts at its first value and goes up by its step
+// scaled the same way. Returns the new PHI, or 0.
+static reg reduce(struct function *function, struct loop_forest *forest, struct induction *iv, bool is_signed) {
+    struct loop *loop = &forest->loops.data[iv->loop];
+    int64_t step;
+    if (ckd_mul(&step, iv->step, iv->scale)) return 0;
+
+    // the basic induction variable's PHI, and where its next value is made
+    struct ir_block *header = &function->blocks.data[loop->header];
+    struct ir_instr *basic = nullptr;
+    reg next = 0;
+    for_each_n (phi, &header->instrs) {
+        if (phi->r[0] != iv->basic) continue;
+        basic = phi;
+        for (size_t p = 0; p < header->preds.len; p++) {
+            if (header->preds.data[p] != loop->preheader) next = *ir_use(function, phi, (int)p);
+        }
+        break;
+    }
+    unsigned char basic_width = basic->width;
+
+    // the registers applied before the value was sign extended are sign
+    // extended too, which gives the same value since the narrow arithmetic
+    // can't overflow
+    struct emitter e = { function, loop->preheader, iv->width, is_signed };
+    reg scale = iv->scale_reg ? emit_widened(&e, iv->scale_reg, iv->scale_width) : 0;
+    reg offset = iv->offset_reg ? emit_widened(&e, iv->offset_reg, iv->offset_width) : 0;
+    reg init = emit_widened(&e, iv->start, basic_width);
+    if (scale) init = emit_op(&e, MUL, init, scale);
+    if (iv->scale != 1) init = emit_op(&e, MUL, init, emit_constant(&e, iv->scale));
+    if (offset) init = emit_op(&e, ADD, init, offset);
+    if (iv->offset) init = emit_op(&e, ADD, init, emit_constant(&e, iv->offset));
+
+    reg increment = 0;
+    if (iv->step_reg) increment = emit_widened(&e, iv->step_reg, basic_width);
+    if (scale) increment = increment ? emit_op(&e, MUL, increment, scale) : scale;
+    if (!increment) increment = emit_constant(&e, step);
+    else if (step != 1) increment = emit_op(&e, MUL, increment, emit_constant(&e, step));
+
+    // the new PHI goes after the header's others, and its next value right
+    // after the basic induction variable's, which dominates every back edge
+    reg phi = new_temporary(function);
+    reg phi_next = new_temporary(function);
+    header = &function->blocks.data[loop->header];
+    struct ir_instr new_phi = { .op = PHI, .r = { phi, (reg)function->operands.len }, .width = iv->width,
+                                .is_signed = is_signed };
+    list_push(&function->operands, (reg)header->preds.len);
+    for_each (&header->preds) list_push(&function->operands, *it == loop->preheader ? init : phi_next);
+    size_t at = 0;
+    while (header->instrs.data[at].op == PHI) at++;
+    insert_instr(&header->instrs, at, new_phi);
+
+    for_each_n (block, &function->blocks) {
+        for (size_t n = 0; n < block->instrs.len; n++) {
+            if (ir_def(&block->instrs.data[n]) != next) continue;
+            struct ir_instr add = { .op = ADD, .r = { phi_next, phi, increment }, .width = iv->width,
+                                    .is_signed = is_signed };
+            insert_instr(&block->instrs, n + 1, add);
+            return phi;
+        }
+    }
+    return phi;
+}
+
+struct pass_stats strength_reduce(struct tu *tu, struct function *function) {
+    struct pass_stats stats = {};
+    struct loop_forest forest;
+    find_loops(function, &forest);
+    if (!forest.loops.len) {
+        free_loops(&forest);
+        return stats;
+    }
+
+    size_t n_regs = function->regs.len;
+    struct induction *ivs = malloc(n_regs * sizeof(struct induction));
+    find_induction_variables(function, &forest, ivs);
+
+    // Which induction variables are used by something other than the
+    // computation of another one in the same loop: those are the ones worth
+    // replacing, and the rest become dead along with them.
+    bool *used = calloc(n_regs, sizeof(bool));
+    bool *is_signed = calloc(n_regs, sizeof(bool));
+    for_each_n (block, &function->blocks) {
+        for_each_n (instr, &block->instrs) {
+            reg d = ir_def(instr);
+            if (d) is_signed[d] = instr->is_signed;
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                reg r = *ir_use(function, instr, u);
+                if (ivs[r].loop != -1 && (!d || ivs[d].loop != ivs[r].loop)) used[r] = true;
+            }
+        }
+    }
+
+    reg *replace = calloc(n_regs, sizeof(reg));
+    list(struct { struct induction iv; reg phi; }) reduced = {};
+    for (size_t r = 1; r < n_regs; r++) {
+        struct induction *iv = &ivs[r];
+        if (iv->loop == -1 || forest.loops.data[iv->loop].preheader == -1) continue;
+
+        if (iv->basic == (reg)r) {
+            // a basic induction variable that goes in step with an earlier
+            // one is the same value
+            for (size_t s = 1; s < r; s++) {
+                struct induction *other = &ivs[s];
+                if (other->basic != (reg)s || other->loop != iv->loop || replace[s]) continue;
+                if (other->start != iv->start || other->step_reg != iv->step_reg || other->step != iv->step ||
+                    other->width != iv->width)
+                    continue;
+                replace[r] = (reg)s;
+                stats.folded += 1;
+                break;
+            }
+            continue;
+        }
+
+        if (!used[r] || (iv->scale == 1 && !iv->scale_reg)) continue;
+        reg phi = 0;
+        for_each (&reduced) {
+            struct induction *x = &it->iv;
+            if (x->basic == iv->basic && x->scale_reg == iv->scale_reg && x->scale == iv->scale &&
+                x->offset_reg == iv->offset_reg && x->offset == iv->offset && x->width == iv->width) {
+                phi = it->phi;
+                break;
+            }
+        }
+        if (!phi) {
+            phi = reduce(function, &forest, iv, is_signed[r]);
+            if (!phi) continue;
+            list_push(&reduced, ((typeof(*reduced.data)){ *iv, phi }));
+        }
+        replace[r] = phi;
+        stats.folded += 1;
+    }
+
+    // A reduced value is only the same as the new PHI inside its loop; a
+    // basic induction variable is the same as its twin everywhere.
+    if (stats.folded) {
+        for (size_t b = 0; b < function->blocks.len; b++) {
+            for_each_n (instr, &function->blocks.data[b].instrs) {
+                for (int u = 0; u < ir_use_count(function, instr); u++) {
+                    reg *use = ir_use(function, instr, u);
+                    // the registers reduce added are past the end of replace
+                    if (*use >= n_regs || !replace[*use]) continue;
+                    struct induction *iv = &ivs[*use];
+                    if (iv->basic == *use || loop_contains(&forest, iv->loop, (int)b)) *use = replace[*use];
+                }
+            }
+        }
+    }
+
+    list_clear(&reduced);
+    free(replace);
+    free(used);
+    free(is_signed);
+    free(ivs);
+    free_loops(&forest);
+    return stats;
+}
@@ -0,0 +1,279 @@
+#include "jit.h"
+#include "x86.h"
+#include "tu.h"
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Running a module in this process: what the linker and loader would do to
+// its object, done on the module in memory.
+//
+// The sections are mapped one after the other, each from the start of a page
+// so it can be protected on its own: the text, followed by a stub for every
+// function of another module, the read only data, then the data, the bss and
+// a GOT. A call to another module goes to its stub, which jumps through the
+// GOT, since libc is rarely within the 2GB a call can reach.
+
+// The GDB JIT interface: a debugger that finds these symbols in the process
+// breaks in __jit_debug_register_code, and reads the symbol file of the
+// entry that changed.
+struct jit_code_entry {
+    struct jit_code_entry *next_entry;
+    struct jit_code_entry *prev_entry;
+    const char *symfile_addr;
+    uint64_t symfile_size;
+};
+
+enum jit_actions { JIT_NOACTION, JIT_REGISTER_FN, JIT_UNREGISTER_FN };
+
+struct jit_descriptor {
+    uint32_t version;
+    uint32_t action_flag;
+    struct jit_code_entry *relevant_entry;
+    struct jit_code_entry *first_entry;
+};
+
+[[gnu::noinline]] void __jit_debug_register_code(void) {
+    // something for the call to keep
+    __asm__ volatile("");
+}
+
+struct jit_descriptor __jit_debug_descriptor = { .version = 1 };
+
+// A symbol the code refers to, and where it ended up.
+struct target {
+    int symbol;
+    char *address;
+    // its GOT entry and stub, or -1
+    int got;
+    int stub;
+};
+
+struct jit {
+    struct tu *tu;
+    struct x86_module module;
+    char *memory;
+    size_t size;
+    char *sections[N_X86_SECTIONS];
+    list(struct target) targets;
+    // the symbol file registered with a debugger
+    byte_list_t image;
+    struct jit_code_entry debug_entry;
+};
+
+// A stub is jmp *got(%rip), padded to 8 bytes.
+enum { STUB_SIZE = 8 };
+
+static size_t round_up(size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+static struct target *find_target(struct jit *jit, int symbol) {
+    for_each (&jit->targets) {
+        if (it->symbol == symbol) return it;
+    }
+    list_push(&jit->targets, ((struct target){ .symbol = symbol, .got = -1, .stub = -1 }));
+    return &list_last(&jit->targets);
+}
+
+// Find every symbol the code refers to in the module or the process, and
+// count the GOT entries and stubs that need.
+static bool resolve(struct jit *jit, int *n_got, int *n_stubs) {
+    struct x86_module *module = &jit->module;
+    for (int s = 0; s < N_X86_SECTIONS; s++) {
+        for_each (&module->sections[s].relocs) {
+            struct target *t = find_target(jit, it->symbol);
+            bool is_defined = find_symbol(module, it->symbol) != -1;
+            if (!is_defined && !t->address) {
+                const char *name = tu_string(jit->tu, it->symbol);
+                t->address = dlsym(RTLD_DEFAULT, name);
+                if (!t->address) {
+                    fprintf(stderr, "jit: undefined symbol %s\n", name);
+                    return false;
+                }
+            }
+            bool through_got = it->kind == X86_RELOC_GOTPCREL || (it->kind == X86_RELOC_PLT32 && !is_defined);
+            if (through_got && t->got == -1) t->got = (*n_got)++;
+            if (it->kind == X86_RELOC_PLT32 && !is_defined && t->stub == -1) t->stub = (*n_stubs)++;
+        }
+    }
+    return true;
+}
+
+static bool fits_rel32(int64_t value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static bool relocate(struct jit *jit, char *section, struct x86_reloc *r, char **got, char *stubs) {
+    struct target *t = find_target(jit, r->symbol);
+    char *at = section + r->offset;
+    int64_t value;
+    switch (r->kind) {
+    case X86_RELOC_64:
+        value = (int64_t)(t->address + r->addend);
+        memcpy(at, &value, 8);
+        return true;
+    case X86_RELOC_GOTPCREL:
+        value = (char *)&got[t->got] + r->addend - at;
+        break;
+    case X86_RELOC_PLT32:
+        if (t->stub != -1) {
+            value = stubs + t->stub * STUB_SIZE + r->addend - at;
+            break;
+        }
+        [[fallthrough]];
+    case X86_RELOC_PC32:
+        value = t->address + r->addend - at;
+        break;
+    }
+    if (!fits_rel32(value)) {
+        fprintf(stderr, "jit: %s is out of reach of a 32 bit displacement\n", tu_string(jit->tu, r->symbol));
+        return false;
+    }
+    int32_t narrow = (int32_t)value;
+    memcpy(at, &narrow, 4);
+    return true;
+}
+
+static void write_perf_map(struct jit *jit, size_t stubs_at, int n_stubs) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%i.map", (int)getpid());
+    FILE *map = fopen(path, "a");
+    if (!map) {
+        perror("jit: perf map");
+        return;
+    }
+    for_each (&jit->module.symbols) {
+        if (!it->is_function) continue;
+        fprintf(map, "%lx %x %s\n", (unsigned long)(jit->sections[X86_TEXT] + it->offset), it->size,
+                tu_string(jit->tu, it->name));
+    }
+    if (n_stubs) fprintf(map, "%lx %x [jit stubs]\n", (unsigned long)(jit->memory + stubs_at), n_stubs * STUB_SIZE);
+    fclose(map);
+}
+
+static void register_debug(struct jit *jit) {
+    elf_image(jit->tu, &jit->module, jit->sections, &jit->image);
+    struct jit_code_entry *entry = &jit->debug_entry;
+    entry->symfile_addr = (const char *)jit->image.data;
+    entry->symfile_size = jit->image.len;
+    entry->next_entry = __jit_debug_descriptor.first_entry;
+    if (entry->next_entry) entry->next_entry->prev_entry = entry;
+    __jit_debug_descriptor.first_entry = entry;
+    __jit_debug_descriptor.relevant_entry = entry;
+    __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+    __jit_debug_register_code();
+}
+
+static void unregister_debug(struct jit *jit) {
+    struct jit_code_entry *entry = &jit->debug_entry;
+    if (entry->prev_entry) entry->prev_entry->next_entry = entry->next_entry;
+    else __jit_debug_descriptor.first_entry = entry->next_entry;
+    if (entry->next_entry) entry->next_entry->prev_entry = entry->prev_entry;
+    __jit_debug_descriptor.relevant_entry = entry;
+    __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+    __jit_debug_register_code();
+    list_clear(&jit->image);
+}
+
+struct jit *jit_load(struct tu *tu, int flags) {
+    struct jit *jit = calloc(1, sizeof(struct jit));
+    jit->tu = tu;
+    struct x86_module *module = &jit->module;
+    build_module(tu, module);
+
+    int n_got = 0, n_stubs = 0;
+    if (!resolve(jit, &n_got, &n_stubs)) {
+        jit_free(jit);
+        return nullptr;
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    struct x86_section_data *text = &module->sections[X86_TEXT], *rodata = &module->sections[X86_RODATA],
+                            *data = &module->sections[X86_DATA], *bss = &module->sections[X86_BSS];
+    size_t stubs_at = round_up(text->bytes.len, STUB_SIZE);
+    size_t rodata_at = round_up(stubs_at + n_stubs * STUB_SIZE, page);
+    size_t data_at = rodata_at + round_up(rodata->bytes.len, page);
+    size_t bss_at = data_at + round_up(data->bytes.len, bss->align);
+    size_t got_at = round_up(bss_at + bss->size, 8);
+    jit->size = round_up(got_at + n_got * sizeof(char *), page);
+    jit->memory = mmap(nullptr, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->memory == MAP_FAILED) {
+        perror("jit: mmap");
+        jit->memory = nullptr;
+        jit_free(jit);
+        return nullptr;
+    }
+
+    char *m = jit->memory;
+    jit->sections[X86_TEXT] = m;
+    jit->sections[X86_RODATA] = m + rodata_at;
+    jit->sections[X86_DATA] = m + data_at;
+    jit->sections[X86_BSS] = m + bss_at;
+    memcpy(m, text->bytes.data, text->bytes.len);
+    memcpy(m + rodata_at, rodata->bytes.data, rodata->bytes.len);
+    memcpy(m + data_at, data->bytes.data, data->bytes.len);
+
+    char **got = (char **)(m + got_at);
+    char *stubs = m + stubs_at;
+    for_each (&jit->targets) {
+        int s = find_symbol(module, it->symbol);
+        if (s != -1) {
+            struct x86_symbol *symbol = &module->symbols.data[s];
+            it->address = jit->sections[symbol->section] + symbol->offset;
+        }
+        if (it->got != -1) got[it->got] = it->address;
+        if (it->stub == -1) continue;
+        unsigned char *stub = (unsigned char *)stubs + it->stub * STUB_SIZE;
+        int32_t disp = (int32_t)((char *)&got[it->got] - (char *)(stub + 6));
+        memcpy(stub, (unsigned char[]){ 0xff, 0x25 }, 2);
+        memcpy(stub + 2, &disp, 4);
+        memcpy(stub + 6, (unsigned char[]){ 0xcc, 0xcc }, 2);
+    }
+    for (int s = 0; s < N_X86_SECTIONS; s++) {
+        for_each (&module->sections[s].relocs) {
+            if (!relocate(jit, jit->sections[s], it, got, stubs)) {
+                jit_free(jit);
+                return nullptr;
+            }
+        }
+    }
+
+    if (mprotect(m, rodata_at, PROT_READ | PROT_EXEC) || mprotect(m + rodata_at, data_at - rodata_at, PROT_READ)) {
+        perror("jit: mprotect");
+        jit_free(jit);
+        return nullptr;
+    }
+    if (flags & JIT_PERF_MAP) write_perf_map(jit, stubs_at, n_stubs);
+    if (flags & JIT_DEBUG) register_debug(jit);
+    return jit;
+}
+
+void *jit_symbol(struct jit *jit, const char *name) {
+    int s = find_symbol(&jit->module, tu_intern(jit->tu, name, strlen(name)));
+    if (s == -1) return nullptr;
+    struct x86_symbol *symbol = &jit->module.symbols.data[s];
+    return jit->sections[symbol->section] + symbol->offset;
+}
+
+bool jit_call(struct jit *jit, const char *name, int argc, char **argv, int *result) {
+    int s = find_symbol(&jit->module, tu_intern(jit->tu, name, strlen(name)));
+    if (s == -1 || !jit->module.symbols.data[s].is_function) return false;
+    int (*function)(int, char **);
+    void *address = jit_symbol(jit, name);
+    memcpy(&function, &address, sizeof(function));
+    *result = function(argc, argv);
+    return true;
+}
+
+void jit_free(struct jit *jit) {
+    if (jit->image.data) unregister_debug(jit);
+    if (jit->memory) munmap(jit->memory, jit->size);
+    free_module(&jit->module);
+    list_clear(&jit->targets);
+    free(jit);
+}
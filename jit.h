@@ -0,0 +1,28 @@
+#pragma once
+#ifndef COMPILER_JIT_H
+#define COMPILER_JIT_H
+
+struct tu;
+struct jit;
+
+enum jit_flags {
+    // list the functions in /tmp/perf-<pid>.map, where perf looks up the
+    // names of addresses that aren't in any file
+    JIT_PERF_MAP = 1,
+    // register the module with a debugger through the GDB JIT interface
+    JIT_DEBUG = 2,
+};
+
+// Encode a translation unit whose IR has been emitted into executable
+// memory in this process, resolving the symbols it doesn't define, like
+// libc's, with dlsym. Returns nullptr if one can't be found.
+struct jit *jit_load(struct tu *tu, int flags);
+// The address of a function or object the module defines, or nullptr.
+void *jit_symbol(struct jit *jit, const char *name);
+// Call a function of the module as int name(int argc, char **argv), which is
+// also how one taking fewer parameters is called. Returns false if the
+// module has no such function.
+bool jit_call(struct jit *jit, const char *name, int argc, char **argv, int *result);
+void jit_free(struct jit *jit);
+
+#endif //COMPILER_JIT_H
@@ -0,0 +1,167 @@
+#include "opt.h"
+#include "ir.h"
+#include "loop.h"
+#include "ssa.h"
+
+#include <stdlib.h>
+
+// Loop-invariant code motion. An instruction in a loop is invariant if it
+// computes its result from values defined outside the loop, or by other
+// invariant instructions, and it can move to the preheader if running it
+// there, once, even when the loop body wouldn't have, does the same thing.
+// In SSA form every value has one definition that dominates its uses, so
+// the preheader, which dominates the whole loop, is always a valid place for
+// an invariant definition.
+//
+// Loops are visited from the innermost out, so an instruction hoisted into
+// the preheader of an inner loop, which is part of the outer loop, can keep
+// going.
+
+struct licm {
+    struct function *function;
+    struct loop_forest forest;
+    struct alias_info alias;
+    // the block defining each register, -1 for parameters and undefined
+    // values, which are defined before everything
+    int *def_block;
+    // the value of each register defined by an integer IMM
+    bool *is_imm;
+    uint64_t *imm;
+    // the stores in the loop being visited, and whether it calls anything
+    ir_list_t stores;
+    bool calls;
+};
+
+// Whether a division by r can't trap: r is a constant other than 0, or -1,
+// which traps for the most negative dividend.
+static bool safe_divisor(struct licm *m, struct ir_instr *i, reg r) {
+    if (!m->is_imm[r]) return false;
+    uint64_t v = m->imm[r];
+    uint64_t mask = i->width >= 8 ? ~0ull : (1ull << (i->width * 8)) - 1;
+    return (v & mask) != 0 && (!i->is_signed || (v & mask) != mask);
+}
+
+static bool can_hoist(struct licm *m, int l, int b, struct ir_instr *i) {
+    switch (i->op) {
+    case ADD: case SUB: case MUL:
+    case AND: case OR: case XOR: case SHR: case SHL:
+    case NEG: case NOT: case INV:
+    case MOVE: case IMM: case ADDR: case TEST:
+    case EXT: case ITOF: case FTOI: case FTOF:
+    case LD:
+        break;
+    case DIV:
+    case MOD:
+        if (i->is_float || safe_divisor(m, i, i->r[2])) break;
+        return false;
+    default:
+        return false;
+    }
+
+    for (int u = 0; u < ir_use_count(m->function, i); u++) {
+        int d = m->def_block[*ir_use(m->function, i, u)];
+        if (d != -1 && loop_contains(&m->forest, l, d)) return false;
+    }
+    if (i->op != LD) return true;
+
+    // A load runs in the preheader even when the loop body wouldn't, so it
+    // has to be from somewhere that can always be read: a known offset into
+    // a variable, or anything read by the header, which runs whenever the
+    // preheader does. Nothing in the loop may write there either.
+    reg address = i->r[1];
+    struct address *a = &m->alias.addresses[address];
+    if (b != m->forest.loops.data[l].header && !(a->base && a->known_offset)) return false;
+    if (m->calls && call_may_clobber(&m->alias, address)) return false;
+    for_each (&m->stores) {
+        if (may_alias(&m->alias, it->r[0], it->width, address, i->width)) return false;
+    }
+    return true;
+}
+
+static int hoist(struct licm *m, int l, block_list_t *order) {
+    struct function *function = m->function;
+    struct loop *loop = &m->forest.loops.data[l];
+    if (loop->preheader == -1) return 0;
+
+    m->stores.len = 0;
+    m->calls = false;
+    for_each (&loop->blocks) {
+        for_each_n (instr, &function->blocks.data[*it].instrs) {
+            if (instr->op == ST) list_push(&m->stores, *instr);
+            if (instr->op == CALL) m->calls = true;
+        }
+    }
+
+    // in reverse postorder, an invariant operand's definition has already
+    // been hoisted by the time its uses are looked at
+    ir_list_t hoisted = {};
+    for_each (order) {
+        int b = *it;
+        if (!loop_contains(&m->forest, l, b)) continue;
+        ir_list_t *instrs = &function->blocks.data[b].instrs;
+        size_t kept = 0;
+        for (size_t n = 0; n < instrs->len; n++) {
+            struct ir_instr *instr = &instrs->data[n];
+            if (can_hoist(m, l, b, instr)) {
+                m->def_block[instr->r[0]] = loop->preheader;
+                list_push(&hoisted, *instr);
+            } else {
+                instrs->data[kept++] = *instr;
+            }
+        }
+        instrs->len = kept;
+    }
+    if (!hoisted.len) return 0;
+
+    // into the preheader, in front of its jump to the header
+    ir_list_t *instrs = &function->blocks.data[loop->preheader].instrs;
+    struct ir_instr jmp = list_last(instrs);
+    instrs->len -= 1;
+    for_each (&hoisted) list_push(instrs, *it);
+    list_push(instrs, jmp);
+
+    int moved = (int)hoisted.len;
+    list_clear(&hoisted);
+    return moved;
+}
+
+struct pass_stats licm(struct tu *tu, struct function *function) {
+    struct pass_stats stats = {};
+    struct licm m = { .function = function };
+    find_loops(function, &m.forest);
+    if (!m.forest.loops.len) {
+        free_loops(&m.forest);
+        return stats;
+    }
+    stats.blocks_added = insert_preheaders(tu, function, &m.forest);
+
+    size_t n_regs = function->regs.len;
+    m.def_block = malloc(n_regs * sizeof(int));
+    m.is_imm = calloc(n_regs, sizeof(bool));
+    m.imm = calloc(n_regs, sizeof(uint64_t));
+    for (size_t r = 0; r < n_regs; r++) m.def_block[r] = -1;
+    for (size_t b = 0; b < function->blocks.len; b++) {
+        for_each_n (instr, &function->blocks.data[b].instrs) {
+            reg d = ir_def(instr);
+            if (d) m.def_block[d] = (int)b;
+            if (instr->op == IMM && !instr->is_float && !function->constants.data[instr->r[1]].name) {
+                m.is_imm[d] = true;
+                m.imm[d] = function->constants.data[instr->r[1]].i;
+            }
+        }
+    }
+    analyze_aliases(function, &m.alias);
+
+    block_list_t order = {};
+    reverse_postorder(function, &order);
+    for (size_t l = m.forest.loops.len; l-- > 0;) stats.moved += hoist(&m, (int)l, &order);
+
+    list_clear(&order);
+    list_clear(&m.stores);
+    free_aliases(&m.alias);
+    free_loops(&m.forest);
+    free(m.def_block);
+    free(m.is_imm);
+    free(m.imm);
+    return stats;
+}
@@ -24,7 +24,7 @@ do {                        \
 
 #define list_push(list, value) \
 do {                           \
-    if ((list)->len <= (list)->cap) {                                            \
+    if ((list)->len >= (list)->cap) {                                            \
         size_t new_len = (list)->cap ? (list)->cap * 2 : 16;                     \
         (list)->data = realloc((list)->data, new_len * sizeof((list)->data[0])); \
         (list)->cap = new_len;                                                   \
@@ -48,6 +48,7 @@ do {                           \
 
 #define list_clear(list) do { \
     free((list)->data);       \
+    (list)->data = nullptr;   \
     (list)->len = 0;          \
     (list)->cap = 0;          \
 } while(0)
@@ -0,0 +1,175 @@
+#include "loop.h"
+#include "ir.h"
+#include "ssa.h"
+#include "tu.h"
+
+#include <stdlib.h>
+
+static int by_size(const void *a, const void *b) {
+    const struct loop *x = a, *y = b;
+    if (x->blocks.len != y->blocks.len) return x->blocks.len < y->blocks.len ? 1 : -1;
+    return x->header - y->header;
+}
+
+static int by_index(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Each loop's blocks are found by walking backwards from the sources of its
+// back edges until the header. Sorting the loops from largest to smallest
+// puts every loop after the ones it is nested in, so the innermost loop of a
+// block is the last one to claim it, and the parent of a loop is whichever
+// loop had claimed its header before it.
+void find_loops(struct function *function, struct loop_forest *forest) {
+    size_t n_blocks = function->blocks.len;
+    struct ir_block *blocks = function->blocks.data;
+    *forest = (struct loop_forest){};
+    forest->loop_of = malloc(n_blocks * sizeof(int));
+
+    // the loop each block was last added to, as the header plus one
+    int *mark = calloc(n_blocks, sizeof(int));
+    block_list_t work = {};
+    for (size_t h = 0; h < n_blocks; h++) {
+        struct loop loop = { .header = (int)h, .preheader = -1, .parent = -1, .trip_count = -1 };
+        for_each (&blocks[h].preds) {
+            if (!dominates(function, (int)h, *it)) continue;
+            if (!loop.blocks.len) {
+                mark[h] = (int)h + 1;
+                list_push(&loop.blocks, (int)h);
+            }
+            if (mark[*it] == (int)h + 1) continue;
+            mark[*it] = (int)h + 1;
+            list_push(&loop.blocks, *it);
+            list_push(&work, *it);
+        }
+        while (work.len) {
+            int b = work.data[--work.len];
+            for_each (&blocks[b].preds) {
+                if (mark[*it] == (int)h + 1) continue;
+                mark[*it] = (int)h + 1;
+                list_push(&loop.blocks, *it);
+                list_push(&work, *it);
+            }
+        }
+        if (!loop.blocks.len) continue;
+
+        int outside = -1, n_outside = 0;
+        for_each (&blocks[h].preds) {
+            if (mark[*it] == (int)h + 1) continue;
+            outside = *it;
+            n_outside += 1;
+        }
+        if (n_outside == 1 && blocks[outside].n_succs == 1) loop.preheader = outside;
+
+        qsort(loop.blocks.data, loop.blocks.len, sizeof(int), by_index);
+        list_push(&forest->loops, loop);
+    }
+
+    struct loop *loops = forest->loops.data;
+    qsort(loops, forest->loops.len, sizeof(struct loop), by_size);
+    for (size_t b = 0; b < n_blocks; b++) forest->loop_of[b] = -1;
+    for (size_t l = 0; l < forest->loops.len; l++) {
+        loops[l].parent = forest->loop_of[loops[l].header];
+        loops[l].depth = loops[l].parent == -1 ? 1 : loops[loops[l].parent].depth + 1;
+        for_each (&loops[l].blocks) forest->loop_of[*it] = (int)l;
+    }
+
+    list_clear(&work);
+    free(mark);
+}
+
+void free_loops(struct loop_forest *forest) {
+    for_each (&forest->loops) list_clear(&it->blocks);
+    list_clear(&forest->loops);
+    free(forest->loop_of);
+    *forest = (struct loop_forest){};
+}
+
+int loop_depth(struct loop_forest *forest, int block) {
+    int l = forest->loop_of[block];
+    return l == -1 ? 0 : forest->loops.data[l].depth;
+}
+
+bool loop_contains(struct loop_forest *forest, int loop, int block) {
+    for (int l = forest->loop_of[block]; l != -1; l = forest->loops.data[l].parent) {
+        if (l == loop) return true;
+    }
+    return false;
+}
+
+static void insert_preheader(struct tu *tu, struct function *function, struct loop_forest *forest, int l) {
+    int h = forest->loops.data[l].header;
+    int pre = (int)function->blocks.len;
+    struct ir_block block = {
+        .label = tu_printf(tu, "%s.preheader", tu_string(tu, function->blocks.data[h].label)),
+        .idom = -1,
+        .succs = { h },
+        .n_succs = 1,
+    };
+
+    // the header's preds split into those inside the loop, which stay, and
+    // those outside, which move to the preheader. The preheader has the
+    // highest index, so it goes last in the header's preds.
+    block_list_t *preds = &function->blocks.data[h].preds;
+    size_t inside = 0;
+    for (size_t p = 0; p < preds->len; p++) {
+        int pred = preds->data[p];
+        if (loop_contains(forest, l, pred)) continue;
+        list_push(&block.preds, pred);
+        retarget_edge(function, pred, h, pre);
+    }
+
+    ir_list_t *instrs = &function->blocks.data[h].instrs;
+    for_each_n (instr, instrs) {
+        if (instr->op != PHI) break;
+        // with one pred outside, its operand goes to the header as is;
+        // otherwise a PHI in the preheader merges them
+        reg value = 0;
+        if (block.preds.len > 1) {
+            struct ir_instr phi = *instr;
+            phi.r[0] = value = new_temporary(function);
+            phi.r[1] = (reg)function->operands.len;
+            list_push(&function->operands, (reg)block.preds.len);
+            for (size_t p = 0; p < preds->len; p++) {
+                if (loop_contains(forest, l, preds->data[p])) continue;
+                list_push(&function->operands, function->operands.data[instr->r[1] + 1 + p]);
+            }
+            list_push(&block.instrs, phi);
+        }
+
+        reg *args = &function->operands.data[instr->r[1]];
+        reg kept = 0;
+        for (size_t p = 0; p < preds->len; p++) {
+            if (loop_contains(forest, l, preds->data[p])) args[1 + kept++] = args[1 + p];
+            else if (!value) value = args[1 + p];
+        }
+        args[1 + kept++] = value;
+        args[0] = kept;
+    }
+
+    for (size_t p = 0; p < preds->len; p++) {
+        if (loop_contains(forest, l, preds->data[p])) preds->data[inside++] = preds->data[p];
+    }
+    preds->len = inside;
+    list_push(preds, pre);
+
+    list_push(&block.instrs, ir_jmp(h));
+    list_push(&function->blocks, block);
+}
+
+int insert_preheaders(struct tu *tu, struct function *function, struct loop_forest *forest) {
+    int added = 0;
+    for (size_t l = 0; l < forest->loops.len; l++) {
+        struct loop *loop = &forest->loops.data[l];
+        // a loop at the entry can't have anything in front of it
+        if (loop->preheader != -1 || loop->header == 0) continue;
+        insert_preheader(tu, function, forest, (int)l);
+        added += 1;
+    }
+    if (!added) return 0;
+
+    compute_dominators(function);
+    free_loops(forest);
+    find_loops(function, forest);
+    return added;
+}
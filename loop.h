@@ -0,0 +1,81 @@
+#pragma once
+#ifndef COMPILER_LOOP_H
+#define COMPILER_LOOP_H
+
+#include "ir.h"
+
+struct tu;
+
+// A natural loop: a header that dominates the whole loop, and every block
+// that can reach a back edge to the header without going through it.
+struct loop {
+    int header;
+    // the one block outside the loop that jumps to the header, and jumps
+    // nowhere else, or -1 if there isn't one
+    int preheader;
+    // the innermost loop this one is nested in, or -1
+    int parent;
+    // 1 for an outermost loop
+    int depth;
+    // the blocks of the loop, including those of nested loops, by index
+    block_list_t blocks;
+    // how many times the header's exit test lets the body run, once
+    // find_induction_variables works it out, or -1
+    int64_t trip_count;
+};
+
+// The loop nesting forest of a function. Back edges to the same header make
+// one loop, so any two loops are either nested or disjoint. Cycles that no
+// block dominates, which goto can make, are not loops.
+struct loop_forest {
+    // every loop comes before the loops nested in it
+    list(struct loop) loops;
+    // the innermost loop of each block, or -1
+    int *loop_of;
+};
+
+// Find the loops of a function whose dominators are up to date.
+void find_loops(struct function *function, struct loop_forest *forest);
+void free_loops(struct loop_forest *forest);
+// The number of loops a block is in.
+int loop_depth(struct loop_forest *forest, int block);
+bool loop_contains(struct loop_forest *forest, int loop, int block);
+
+// Give every loop a preheader, adding a block in front of the header where
+// there isn't one already. The header's PHIs are split so that the new block
+// merges the values from outside the loop. If any blocks are added, the
+// dominators and the forest are recomputed. Returns the number added.
+int insert_preheaders(struct tu *tu, struct function *function, struct loop_forest *forest);
+
+// An induction variable of a loop: a register whose value on the nth
+// iteration is basic * scale + offset, where basic is a basic induction
+// variable, a PHI in the header that starts at start and goes up by step each
+// iteration. Each of scale, offset and step is a constant times, or plus, a
+// register that doesn't change in the loop, if there is one.
+struct induction {
+    // the loop, or -1 if the register isn't an induction variable
+    int loop;
+    reg basic;
+    reg scale_reg;
+    int64_t scale;
+    reg offset_reg;
+    int64_t offset;
+    // of the basic induction variable: the value from the preheader, and
+    // what is added to it every iteration, step_reg * step or just step
+    reg start;
+    reg step_reg;
+    int64_t step;
+    // the width of the value, which can be wider than the basic induction
+    // variable's if it was sign extended, and of scale_reg and offset_reg,
+    // which are narrower if they were applied before that
+    unsigned char width;
+    unsigned char scale_width;
+    unsigned char offset_width;
+};
+
+// Find the induction variables of every loop of a function in SSA form, with
+// one entry per register in ivs, and the trip counts of the loops that have
+// a constant one.
+void find_induction_variables(struct function *function, struct loop_forest *forest, struct induction *ivs);
+
+#endif //COMPILER_LOOP_H
@@ -5,6 +5,7 @@
 #include <getopt.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 
 #include "diag.h"
 #include "token.h"
@@ -12,17 +13,96 @@
 #include "tu.h"
 #include "type.h"
 #include "ir.h"
+#include "x86.h"
+#include "sched.h"
+#include "jit.h"
+#include "tier.h"
+
+static double elapsed_ms(struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
 
 int main(int argc, char **argv) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     struct tu *tu = &(struct tu){
-        .abort = false // true,
+        .abort = false, // true,
+        .opt_level = 2,
+    };
+    const char *output = nullptr;
+    bool object = false;
+    // with --jit, the function to run instead of writing anything
+    const char *jit = nullptr;
+    int jit_flags = JIT_PERF_MAP;
+    const char *inline_source = nullptr;
+    static const struct option long_options[] = {
+        { "jit", optional_argument, nullptr, 'J' },
+        { "jit-debug", no_argument, nullptr, 'D' },
+        { "tier", optional_argument, nullptr, 'T' },
+        { "print-loops", no_argument, nullptr, 'L' },
+        {},
     };
 
-    list_push(&tu->types, (struct type){});
+    type_table_init(&tu->types);
     list_push(&tu->scopes, (struct scope){.is_global = true});
 
-    if (argc < 2) {
-        tu->source = "int main() { const int x = 10; register short int y = 11; x + y; }";
+    int opt;
+    while ((opt = getopt_long(argc, argv, "ce:j:m:O:o:", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'c':
+            object = true;
+            break;
+        case 'e':
+            inline_source = optarg;
+            break;
+        case 'J':
+            jit = optarg ? optarg : "main";
+            break;
+        case 'D':
+            jit_flags |= JIT_DEBUG;
+            break;
+        case 'T':
+            jit = optarg ? optarg : "main";
+            tu->tiered = true;
+            break;
+        case 'L':
+            tu->print_loops = true;
+            break;
+        case 'j':
+            tu->jobs = atoi(optarg);
+            break;
+        case 'm': {
+            int tune = strncmp(optarg, "tune=", 5) ? -1 : find_tune(optarg + 5);
+            if (tune < 0) {
+                fprintf(stderr, "unknown machine option -m%s\n", optarg);
+                return 1;
+            }
+            tu->tune = tune;
+            break;
+        }
+        case 'O':
+            tu->opt_level = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c] [--jit[=function]] [--jit-debug] [--tier[=function]] [--print-loops] [-e source] [-j threads] [-mtune=cpu] [-O level] [-o output] [file]\n", argv[0]);
+            return 1;
+        }
+    }
+    char *program = argv[0];
+    // the passes' diagnostics are written a line at a time rather than a
+    // piece at a time, which otherwise takes most of the time to the first
+    // instruction
+    if (jit) setvbuf(stderr, nullptr, _IOLBF, BUFSIZ);
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 2 || inline_source) {
+        tu->source = inline_source ? inline_source : "int main() { const int x = 10; register short int y = 11; x + y; }";
         tu->source_len = strlen(tu->source);
     } else {
         int file = open(argv[1], O_RDONLY);
@@ -52,16 +132,60 @@ int main(int argc, char **argv) {
     tokenize(tu);
     // print_tokens(tu);
 
+    // a pass after one that reported errors would only trip over what it
+    // left behind
     parse(tu);
     print_ast(tu);
+    if (tu->errors) return 1;
 
     type(tu);
+    if (tu->errors) return 1;
 
     // fprintf(stderr, "\n");
 
-    // emit(tu);
+    emit(tu);
+    if (tu->errors) return 1;
 
-    // for (int i = 0; i < tu->ir_len; i += 1) {
-    //     print_ir_instr(tu, &tu->ir[i]);
-    // }
+    if (jit) {
+        // the program's arguments are its file and the ones after it, or
+        // with -e, the compiler's name and the ones after the options
+        if (inline_source) {
+            argv[0] = program;
+        } else {
+            argc -= 1;
+            argv += 1;
+        }
+        int result;
+        if (tu->tiered) {
+            struct tier *loaded = tier_load(tu, jit_flags & JIT_PERF_MAP);
+            if (!loaded) return 1;
+            fprintf(stderr, "jit: %.2f ms to the first instruction\n", elapsed_ms(&start));
+            if (!tier_call(loaded, jit, argc, argv, &result)) {
+                fprintf(stderr, "jit: no function %s\n", jit);
+                return 1;
+            }
+            tier_free(loaded);
+            return result;
+        }
+        struct jit *loaded = jit_load(tu, jit_flags);
+        if (!loaded) return 1;
+        fprintf(stderr, "jit: %.2f ms to the first instruction\n", elapsed_ms(&start));
+        if (!jit_call(loaded, jit, argc, argv, &result)) {
+            fprintf(stderr, "jit: no function %s\n", jit);
+            return 1;
+        }
+        jit_free(loaded);
+        return result;
+    }
+
+    // the assembly, or the object with -c, goes to stdout unless -o names a
+    // file
+    FILE *out = output ? fopen(output, object ? "wb" : "w") : stdout;
+    if (!out) {
+        print_error(tu, "unable to open file %s (%s)", output, strerror(errno));
+        return 1;
+    }
+    if (object) write_object(tu, out);
+    else write_assembly(tu, out);
+    if (out != stdout) fclose(out);
 }
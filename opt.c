@@ -0,0 +1,111 @@
+#include "opt.h"
+#include "ir.h"
+#include "ssa.h"
+#include "loop.h"
+#include "tu.h"
+#include "token.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// The passes, in the order they run. One pass often exposes work for
+// another, like constant branches that leave values unused or dead stores
+// whose values were the only use of a computation, so the whole list is
+// repeated until a round changes nothing.
+static const struct pass {
+    const char *name;
+    struct pass_stats (*run)(struct tu *, struct function *);
+} passes[] = {
+    { "sccp", sccp },
+    { "licm", licm },
+    { "iv", strength_reduce },
+    { "gvn", gvn },
+    { "dce", dce },
+    { "dse", dse },
+};
+
+#define N_PASSES (sizeof(passes) / sizeof(passes[0]))
+// a backstop; in practice the passes settle in two or three rounds
+#define MAX_ROUNDS 10
+
+static int instr_count(struct function *function) {
+    int n = 0;
+    for_each (&function->blocks) n += (int)it->instrs.len;
+    return n;
+}
+
+static bool changed(struct pass_stats stats) {
+    return stats.folded || stats.moved || stats.instrs_removed || stats.blocks_removed || stats.blocks_added;
+}
+
+static void add_stats(struct pass_stats *total, struct pass_stats stats) {
+    total->folded += stats.folded;
+    total->moved += stats.moved;
+    total->instrs_removed += stats.instrs_removed;
+    total->blocks_removed += stats.blocks_removed;
+    total->blocks_added += stats.blocks_added;
+}
+
+static void print_stats(const char *name, struct pass_stats stats) {
+    const char *sep = "";
+    fprintf(stderr, "    %s:", name);
+#define PRINT(field, what) \
+    if (stats.field) { \
+        fprintf(stderr, "%s %s %i", sep, what, stats.field); \
+        sep = ","; \
+    }
+    PRINT(folded, "folded")
+    PRINT(moved, "moved")
+    PRINT(instrs_removed, "removed instructions")
+    PRINT(blocks_removed, "removed blocks")
+    PRINT(blocks_added, "added blocks")
+#undef PRINT
+    fprintf(stderr, "\n");
+}
+
+static void print_loops(struct tu *tu, struct function *function) {
+    struct loop_forest forest;
+    find_loops(function, &forest);
+    struct induction *ivs = malloc(function->regs.len * sizeof(struct induction));
+    find_induction_variables(function, &forest, ivs);
+    for_each (&forest.loops) {
+        fprintf(stderr, "    loop %s: depth %i", tu_string(tu, function->blocks.data[it->header].label), it->depth);
+        if (it->trip_count != -1)
+            fprintf(stderr, ", %lli iteration%s", (long long)it->trip_count, it->trip_count == 1 ? "" : "s");
+        fprintf(stderr, "\n");
+    }
+    free(ivs);
+    free_loops(&forest);
+}
+
+void optimize(struct tu *tu, struct function *function) {
+    build_ssa(function);
+
+    int instrs = instr_count(function);
+    int blocks = (int)function->blocks.len;
+    struct pass_stats total[N_PASSES] = {};
+
+    for (int round = 0; round < MAX_ROUNDS; round++) {
+        bool any = false;
+        for (size_t p = 0; p < N_PASSES; p++) {
+            struct pass_stats stats = passes[p].run(tu, function);
+            add_stats(&total[p], stats);
+            any |= changed(stats);
+        }
+        if (!any) break;
+    }
+
+    bool any = false;
+    for (size_t p = 0; p < N_PASSES; p++) any |= changed(total[p]);
+    if (!any) return;
+
+    fprintf(stderr, "optimized ");
+    print_token(tu, function->scope->token);
+    fprintf(stderr, ": %i -> %i instructions, %i -> %zu blocks\n", instrs, instr_count(function), blocks,
+            function->blocks.len);
+    for (size_t p = 0; p < N_PASSES; p++) {
+        if (changed(total[p])) print_stats(passes[p].name, total[p]);
+    }
+    // the analysis is redone just for this, so only on request
+    if (tu->print_loops) print_loops(tu, function);
+}
@@ -0,0 +1,70 @@
+#pragma once
+#ifndef COMPILER_OPT_H
+#define COMPILER_OPT_H
+
+#include "ir.h"
+
+struct tu;
+struct scope;
+
+// What a pass changed in a function.
+struct pass_stats {
+    // instructions rewritten in place, like a computation replaced by its
+    // constant value or a branch made unconditional
+    int folded;
+    // instructions moved somewhere they run less often, like out of a loop
+    int moved;
+    int instrs_removed;
+    int blocks_removed;
+    int blocks_added;
+};
+
+// Put a function in SSA form and run the optimization passes over it until
+// they stop finding anything to change.
+void optimize(struct tu *tu, struct function *function);
+
+// Sparse conditional constant propagation over a function in SSA form.
+struct pass_stats sccp(struct tu *tu, struct function *function);
+// Replace computations and loads that repeat a dominating one with its result.
+struct pass_stats gvn(struct tu *tu, struct function *function);
+// Remove instructions whose results are never used.
+struct pass_stats dce(struct tu *tu, struct function *function);
+// Remove stores to stack slots that are never loaded afterwards.
+struct pass_stats dse(struct tu *tu, struct function *function);
+// Give every loop a preheader and hoist the computations and loads that are
+// the same on every iteration into it.
+struct pass_stats licm(struct tu *tu, struct function *function);
+// Replace induction variables computed with multiplications by ones that go
+// up by an addition every iteration, and merge those that are the same.
+struct pass_stats strength_reduce(struct tu *tu, struct function *function);
+
+// Where an address points: an offset into a named variable, or anywhere.
+struct address {
+    // the variable's register, or 0 if unknown
+    reg base;
+    bool known_offset;
+    int64_t offset;
+};
+
+struct alias_info {
+    // where each register points, if it is an address
+    struct address *addresses;
+    // whether each variable is a stack slot that no pointer can reach except
+    // through its own address, because the address is only ever used to
+    // load, store and compute addresses into the same slot
+    bool *private;
+};
+
+// Find where every address in a function in SSA form points.
+void analyze_aliases(struct function *function, struct alias_info *info);
+void free_aliases(struct alias_info *info);
+// Whether accesses of the given widths at two addresses might overlap.
+bool may_alias(struct alias_info *info, reg x, int x_width, reg y, int y_width);
+// Whether a call might write what an address points to.
+bool call_may_clobber(struct alias_info *info, reg address);
+
+// Whether a variable lives in the function's stack frame, rather than in
+// static storage that outlives the call.
+bool is_stack_slot(struct scope *scope);
+
+#endif //COMPILER_OPT_H
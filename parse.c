@@ -4,6 +4,7 @@
 #include "diag.h"
 #include "type.h"
 #include "tu.h"
+#include "walk.h"
 
 #include <stdarg.h>
 #include <stdlib.h>
@@ -16,6 +17,8 @@ typedef int node_pos;
 #define TOKEN(context) (&context->tokens[context->position])
 #define PEEK(context) (&context->tokens[context->position + 1])
 #define PEEKN(context, n) (&context->tokens[context->position + (n)])
+// the last token consumed, which ends the extent of a node that was just parsed
+#define PREV(context) (&context->tokens[context->position - 1])
 
 struct context {
     struct tu *tu;
@@ -23,6 +26,8 @@ struct context {
     int position;
     const char *source;
     int errors;
+    // declarators created so far, used to size the scope storage of each function
+    int n_declarators;
 };
 
 
@@ -30,6 +35,7 @@ struct context {
 static bool is_typename(struct context *, struct token *first, size_t count);
 static bool more_data(struct context *);
 static struct node *new(struct context *, enum node_type);
+static struct node *finish(struct context *, struct node *);
 static void report_error(struct context *, const char *message, ...);
 static struct node *report_error_node(struct context *, const char *message, ...);
 static void pass(struct context *);
@@ -58,6 +64,7 @@ int parse(struct tu *tu) {
         list_push(&root->root.children, parse_external_definition(context));
     }
 
+    root->token_end = TOKEN(context);
     tu->ast_root = root;
 
     return context->errors;
@@ -73,7 +80,19 @@ static struct node *new(struct context *context, enum node_type type) {
     struct node *node = calloc(1, sizeof(struct node));
     node->type = type;
     node->token = TOKEN(context);
+    node->token_begin = TOKEN(context);
+    node->token_end = TOKEN(context);
+
+    if (type == NODE_DECLARATOR) context->n_declarators += 1;
+
+    return node;
+}
 
+// Close the extent of node at the last token consumed. Every parse function
+// calls this (or sets token_end itself) once the node's last token is eaten,
+// so extents never have to be recovered from the children later.
+static struct node *finish(struct context *context, struct node *node) {
+    node->token_end = PREV(context);
     return node;
 }
 
@@ -127,8 +146,13 @@ static void fast_forward(struct context *context, int token_type) {
 
 #define eat(ctx, typ) eat(ctx, typ, __func__)
 
+// Past this depth nodes are indented no further and labeled with their depth
+// instead, so a long chain of operators prints in linear time.
+#define MAX_INDENT 32
+
 static void print_space(int level) {
-    for (int i = 0; i < level; i++) fputs("  ", stderr);
+    if (level <= MAX_INDENT) fprintf(stderr, "%*s", 2 * level, "");
+    else fprintf(stderr, "%*s(%i) ", 2 * MAX_INDENT, "", level);
 }
 
 const char *node_type_strings[NODE_TYPE_COUNT] = {
@@ -195,9 +219,8 @@ static void print_dcl_flat(struct tu *tu, struct node *node) {
 static void print_dcl_list(struct tu *tu, node_list_t *nodes) {
     fprintf(stderr, "print_dcl_list: ");
     for_each (nodes) {
-        struct node *d = list_first(&(*it)->decl.declarators);
-        if (d) {
-            print_dcl_flat(tu, d);
+        if ((*it)->decl.declarators.len) {
+            print_dcl_flat(tu, list_first(&(*it)->decl.declarators));
         }
         fprintf(stderr, " ");
         print_type(tu, (*it)->decl.decl_spec_c_type);
@@ -208,19 +231,13 @@ static void print_dcl_list(struct tu *tu, node_list_t *nodes) {
     }
 }
 
-#define RECUR(node) print_ast_recursive(nullptr, tu, (node), level + 1)
-#define RECUR_INFO(info, node) print_ast_recursive((info), tu, (node), level + 1)
-static void print_ast_recursive(const char *info, struct tu *tu, struct node *node, int level) {
+// Print one node of the tree; its children are printed by the walk in print_ast.
+static void print_ast_node(struct tu *tu, struct walk_frame *frame) {
+    struct node *node = frame->node;
+    int level = frame->depth;
+
     print_space(level);
-    if (info) fprintf(stderr, "%s ", info);
-    if (!node) {
-        print_internal_error(tu, "ast node is nullptr");
-        return;
-    }
-    if (level > 50) {
-        print_internal_error(tu, "ast more than 50 levels deep, loop?");
-        exit(1);
-    }
+    if (frame->label) fprintf(stderr, "%s ", frame->label);
     if (node == tu->ast_root && level > 0) {
         print_internal_error(tu, "found root node in non-root position");
         exit(1);
@@ -232,16 +249,10 @@ static void print_ast_recursive(const char *info, struct tu *tu, struct node *no
     switch (node->type) {
     case NODE_ROOT: {
         fprintf(stderr, "root:\n");
-        for_each (&node->root.children) {
-            RECUR(*it);
-        }
         break;
     }
     case NODE_BLOCK: {
         fprintf(stderr, "block:\n");
-        for_each (&node->block.children) {
-            RECUR(*it);
-        }
         break;
     }
     case NODE_INT_LITERAL: {
@@ -261,39 +272,26 @@ static void print_ast_recursive(const char *info, struct tu *tu, struct node *no
     }
     case NODE_BINARY_OP: {
         fprintf(stderr, "binop: %.*s\n", token->len, &source[token->index]);
-        RECUR(node->binop.lhs);
-        RECUR(node->binop.rhs);
         break;
     }
     case NODE_UNARY_OP: {
         fprintf(stderr, "unop: %.*s\n", token->len, &source[token->index]);
-        RECUR(node->unary_op.inner);
         break;
     }
     case NODE_POSTFIX_OP: {
         fprintf(stderr, "postfix: %.*s\n", token->len, &source[token->index]);
-        RECUR(node->unary_op.inner);
         break;
     }
     case NODE_SUBSCRIPT: {
         fprintf(stderr, "subscript:\n");
-        RECUR_INFO("arr:", node->subscript.inner);
-        RECUR_INFO("sub:", node->subscript.subscript);
         break;
     }
     case NODE_TERNARY: {
         fprintf(stderr, "ternary:\n");
-        RECUR_INFO("cnd:", node->ternary.condition);
-        RECUR_INFO("tru:", node->ternary.branch_true);
-        RECUR_INFO("fls:", node->ternary.branch_false);
         break;
     }
     case NODE_FUNCTION_CALL: {
         fprintf(stderr, "funcall:\n");
-        RECUR_INFO("fun:", node->funcall.inner);
-        for_each (&node->funcall.args) {
-            RECUR_INFO("arg", *it);
-        }
         break;
     }
     case NODE_DECLARATION: {
@@ -302,9 +300,6 @@ static void print_ast_recursive(const char *info, struct tu *tu, struct node *no
         fprintf(stderr, "typ: ");
         print_type(tu, node->decl.decl_spec_c_type);
         fprintf(stderr, "\n");
-        for_each (&node->decl.declarators) {
-            RECUR_INFO("dcl:", *it);
-        }
         break;
     }
     case NODE_TYPE_SPECIFIER: {
@@ -333,38 +328,24 @@ static void print_ast_recursive(const char *info, struct tu *tu, struct node *no
             fprintf(stderr, " -> ");
             n = n->d.inner;
         }
-        if (node->d.initializer)
-            RECUR_INFO("ini:", node->d.initializer);
         break;
     }
     case NODE_STATIC_ASSERT: {
         fprintf(stderr, "static assert:\n");
-        RECUR_INFO("tst:", node->st_assert.expr);
-        if (node->st_assert.message)
-            RECUR_INFO("msg:", node->st_assert.message);
         break;
     }
     case NODE_FUNCTION_DEFINITION: {
         fprintf(stderr, "function:\n");
-        RECUR_INFO("typ:", node->fun.decl);
-        RECUR_INFO("bdy:", node->fun.body);
         break;
     }
     case NODE_RETURN:
         fprintf(stderr, "return:\n");
-        RECUR(node->ret.expr);
         break;
     case NODE_IF:
         fprintf(stderr, "if:\n");
-        RECUR_INFO("cnd:", node->if_.cond);
-        RECUR_INFO("yes:", node->if_.block_true);
-        if (node->if_.block_false)
-            RECUR_INFO("no: ", node->if_.block_false);
         break;
     case NODE_WHILE:
         fprintf(stderr, "while:\n");
-        RECUR_INFO("cnd:", node->while_.cond);
-        RECUR_INFO("blk:", node->while_.block);
         break;
     case NODE_NULL:
         fprintf(stderr, "null:\n");
@@ -374,37 +355,24 @@ static void print_ast_recursive(const char *info, struct tu *tu, struct node *no
         break;
     case NODE_MEMBER:
         fprintf(stderr, "member:\n");
-        RECUR_INFO("val:", node->member.inner);
-        RECUR_INFO("nam:", node->member.ident);
         break;
     case NODE_LABEL:
         fprintf(stderr, "label:\n");
-        RECUR(node->label.name);
         break;
     case NODE_DO:
         fprintf(stderr, "do:\n");
-        RECUR_INFO("blk:", node->do_.block);
-        RECUR_INFO("cnd:", node->do_.cond);
         break;
     case NODE_FOR:
         fprintf(stderr, "for:\n");
-        RECUR_INFO("ini:", node->for_.init);
-        RECUR_INFO("cnd:", node->for_.cond);
-        RECUR_INFO("nxt:", node->for_.next);
-        RECUR_INFO("blk:", node->for_.block);
         break;
     case NODE_GOTO:
         fprintf(stderr, "goto:\n");
-        RECUR(node->goto_.label);
         break;
     case NODE_SWITCH:
         fprintf(stderr, "switch:\n");
-        RECUR_INFO("exp:", node->switch_.expr);
-        RECUR_INFO("blk:", node->switch_.block);
         break;
     case NODE_CASE:
         fprintf(stderr, "case:\n");
-        RECUR(node->case_.value);
         break;
     case NODE_CONTINUE:
         fprintf(stderr, "continue:\n");
@@ -417,71 +385,35 @@ static void print_ast_recursive(const char *info, struct tu *tu, struct node *no
         break;
     case NODE_STRUCT:
         fprintf(stderr, "struct:\n");
-        for_each (&node->struct_.decls) {
-            RECUR(*it);
-        }
         break;
     case NODE_UNION:
         fprintf(stderr, "union:\n");
-        for_each (&node->struct_.decls) {
-            RECUR(*it);
-        }
         break;
     default:
         fprintf(stderr, "UNKNOWN:\n");
         break;
     }
 }
-#undef RECUR
-#undef RECUR_INFO
 
 void print_ast(struct tu *tu) {
-    print_ast_recursive(nullptr, tu, tu->ast_root, 0);
+    struct walk walk = {};
+    walk_push(&walk, tu->ast_root);
+
+    struct walk_frame *frame;
+    enum walk_event event;
+    while ((frame = walk_next(&walk, &event))) {
+        if (event == WALK_ENTER) print_ast_node(tu, frame);
+    }
+
+    walk_free(&walk);
 }
 
 struct token *node_begin(struct node *node) {
-    switch (node->type) {
-    case NODE_BINARY_OP:
-        return node_begin(node->binop.lhs);
-    case NODE_POSTFIX_OP:
-        return node_begin(node->unary_op.inner);
-    case NODE_FUNCTION_DECLARATOR:
-    case NODE_ARRAY_DECLARATOR:
-        return node_begin(node->d.inner);
-    case NODE_TERNARY:
-        return node_begin(node->ternary.condition);
-    default:
-        return node->token;
-    }
+    return node->token_begin;
 }
 
 struct token *node_end(struct node *node) {
-    if (node->token_end) return node->token_end;
-
-    switch (node->type) {
-    case NODE_FUNCTION_DEFINITION:
-        return node_end(node->fun.body);
-    case NODE_IF:
-        if (node->if_.block_false)
-            return node_end(node->if_.block_false);
-        else
-            return node_end(node->if_.block_true);
-    case NODE_WHILE:
-        return node_end(node->while_.block);
-    case NODE_UNARY_OP:
-        return node_end(node->unary_op.inner);
-    case NODE_BINARY_OP:
-        return node_end(node->binop.rhs);
-    case NODE_DECLARATOR:
-        if (node->d.inner)
-            return node_end(node->d.inner);
-        else
-            return node->token;
-    case NODE_TERNARY:
-        return node_end(node->ternary.branch_false);
-    default:
-        return node->token;
-    }
+    return node->token_end;
 }
 
 static struct node *parse_ident(struct context *context) {
@@ -515,11 +447,12 @@ static struct node *parse_primary_expression(struct context *context) {
         return node;
     }
     case '(': {
+        struct token *open = TOKEN(context);
         pass(context);
         struct node *expr = parse_expression(context);
-        expr->token_end = TOKEN(context);
         eat(context, ')');
-        return expr;
+        expr->token_begin = open;
+        return finish(context, expr);
     }
     default:
         return report_error_node(context, "expected primary expression");
@@ -536,7 +469,8 @@ static struct node *parse_postfix_expression(struct context *context) {
             struct node *node = new(context, NODE_POSTFIX_OP);
             pass(context);
             node->unary_op.inner = inner;
-            inner = node;
+            node->token_begin = inner->token_begin;
+            inner = finish(context, node);
             break;
         }
         case '.':
@@ -548,9 +482,8 @@ static struct node *parse_postfix_expression(struct context *context) {
             pass(context);
             node->member.inner = inner;
             node->member.ident = parse_ident(context);
-            node->token_end = TOKEN(context);
-            pass(context);
-            inner = node;
+            node->token_begin = inner->token_begin;
+            inner = finish(context, node);
             break;
         }
         case '(': {
@@ -562,7 +495,8 @@ static struct node *parse_postfix_expression(struct context *context) {
                 if (TOKEN(context)->type != ')') eat(context, ',');
             }
             eat(context, ')');
-            inner = node;
+            node->token_begin = inner->token_begin;
+            inner = finish(context, node);
             break;
         }
         case '[': {
@@ -571,7 +505,8 @@ static struct node *parse_postfix_expression(struct context *context) {
             node->subscript.inner = inner;
             node->subscript.subscript = parse_expression(context);
             eat(context, ']');
-            inner = node;
+            node->token_begin = inner->token_begin;
+            inner = finish(context, node);
             break;
         }
         default:
@@ -583,7 +518,7 @@ static struct node *parse_postfix_expression(struct context *context) {
 
 static struct node *parse_prefix_expression(struct context *context) {
     struct token *token = TOKEN(context);
-    if (token->type == TOKEN_PLUS_PLUS || token->type == TOKEN_MINUS_EQUAL ||
+    if (token->type == TOKEN_PLUS_PLUS || token->type == TOKEN_MINUS_MINUS ||
         token->type == '+' || token->type == '-' || token->type == '*' ||
         token->type == '&' || token->type == '~' || token->type == '!' ||
         token->type == TOKEN_SIZEOF || token->type == TOKEN_ALIGNOF) {
@@ -591,7 +526,7 @@ static struct node *parse_prefix_expression(struct context *context) {
         struct node *node = new(context, NODE_UNARY_OP);
         pass(context);
         node->unary_op.inner = parse_prefix_expression(context);
-        return node;
+        return finish(context, node);
     } else {
         return parse_postfix_expression(context);
     }
@@ -610,7 +545,8 @@ static struct node *name(struct context *context) { \
         pass(context); \
         node->binop.lhs = result; \
         node->binop.rhs = upstream(context); \
-        result = node; \
+        node->token_begin = result->token_begin; \
+        result = finish(context, node); \
         token = TOKEN(context); \
     } \
     return result; \
@@ -642,7 +578,8 @@ static struct node *parse_ternary_expression(struct context *context) {
     node->ternary.condition = condition;
     node->ternary.branch_true = branch_true;
     node->ternary.branch_false = branch_false;
-    return node;
+    node->token_begin = condition->token_begin;
+    return finish(context, node);
 }
 
 static struct node *parse_assignment_expression(struct context *context) {
@@ -661,7 +598,8 @@ static struct node *parse_assignment_expression(struct context *context) {
 
         node->binop.lhs = expr;
         node->binop.rhs = parse_assignment_expression(context);
-        return node;
+        node->token_begin = expr->token_begin;
+        return finish(context, node);
     } else {
         *context = saved;
         return parse_ternary_expression(context);
@@ -698,9 +636,10 @@ static bool is_bare_type_specifier(struct token *token) {
         token->type == TOKEN_SHORT ||
            token->type == TOKEN_INT ||
         token->type == TOKEN_LONG ||
-           token->type == TOKEN_FLOAT_LITERAL ||
+        token->type == TOKEN_FLOAT ||
         token->type == TOKEN_DOUBLE ||
         token->type == TOKEN_SIGNED ||
+        token->type == TOKEN_UNSIGNED ||
         token->type == TOKEN_BOOL ||
         token->type == TOKEN__DECIMAL32 ||
         token->type == TOKEN__DECIMAL64 ||
@@ -749,6 +688,7 @@ static struct node *parse_struct(struct context *context) {
         node->struct_.name = name;
     }
     if (TOKEN(context)->type == ';') {
+        finish(context, node);
         eat(context, ';');
         return node;
     }
@@ -757,9 +697,8 @@ static struct node *parse_struct(struct context *context) {
         struct node *n = parse_declaration(context);
         list_push(&node->struct_.decls, n);
     }
-    node->token_end = TOKEN(context);
     eat(context, '}');
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_type_specifier(struct context *context) {
@@ -787,7 +726,7 @@ static struct node *parse_declarator(struct context *context) {
         pass(context);
         node->d.inner = parse_declarator(context);
         node->d.name = node->d.inner->d.name;
-        return node;
+        return finish(context, node);
     } else {
         return parse_direct_declarator(context);
     }
@@ -805,10 +744,12 @@ static struct node *parse_direct_declarator(struct context *context) {
         break;
     }
     case '(': {
+        struct token *open = TOKEN(context);
         pass(context);
         node = parse_declarator(context);
-        node->token_end = TOKEN(context);
         eat(context, ')');
+        node->token_begin = open;
+        finish(context, node);
         break;
     }
     case ',':
@@ -837,9 +778,9 @@ static struct node *parse_direct_declarator(struct context *context) {
             inner->d.name = inner->d.inner->d.name;
             if (TOKEN(context)->type != ']')
                 inner->d.arr.subscript = parse_assignment_expression(context);
-            node->token_end = TOKEN(context);
             eat(context, ']');
-            node = inner;
+            inner->token_begin = node->token_begin;
+            node = finish(context, inner);
             break;
         }
         case '(': {
@@ -847,14 +788,23 @@ static struct node *parse_direct_declarator(struct context *context) {
             eat(context, '(');
             inner->d.inner = node;
             inner->d.name = inner->d.inner->d.name;
-            // TODO: args
+            if (TOKEN(context)->type == ')') {
+                // C23 treats () as (void), but we accept calls to these without
+                // checking arguments so pre-C23 declarations keep working.
+                inner->d.fun.variadic = true;
+            }
             while (TOKEN(context)->type != ')') {
+                if (TOKEN(context)->type == TOKEN_ELLIPSES) {
+                    inner->d.fun.variadic = true;
+                    pass(context);
+                    break;
+                }
                 list_push(&inner->d.fun.args, parse_single_declaration(context));
                 if (TOKEN(context)->type != ')') eat(context, ',');
             }
-            node->token_end = TOKEN(context);
             eat(context, ')');
-            node = inner;
+            inner->token_begin = node->token_begin;
+            node = finish(context, inner);
             break;
         }
         default:
@@ -894,9 +844,8 @@ static struct node *parse_static_assert_declaration(struct context *context) {
         }
     }
     eat(context, ')');
-    node->token_end = TOKEN(context);
     eat(context, ';');
-    return node;
+    return finish(context, node);
 }
 
 enum parse_state {
@@ -906,7 +855,7 @@ enum parse_state {
     SEEN_TOKEN_LONG_TWICE = (1 << 3),
     SEEN_TOKEN_INT = (1 << 4),
     SEEN_TOKEN_SIGNED = (1 << 5),
-    SEEN_TOKEN_UNSIGNED = (6 << 6),
+    SEEN_TOKEN_UNSIGNED = (1 << 6),
     SEEN_TOKEN_FLOAT = (1 << 7),
     SEEN_TOKEN_DOUBLE = (1 << 8),
     SEEN_TOKEN_COMPLEX = (1 << 9),
@@ -1010,7 +959,7 @@ static struct node *parse_declaration_specifier_list(struct context *context, st
             state |= SEEN_TOKEN_CHAR;
             if (base_type == TYPE_UNSIGNED_INT) base_type = TYPE_UNSIGNED_CHAR;
             else if (base_type == TYPE_SIGNED_INT) base_type = TYPE_SIGNED_CHAR;
-            else if (base_type == 0) base_type = TYPE_SIGNED_CHAR;
+            else if (base_type == 0) base_type = TYPE_CHAR;
             else goto error;
             break;
         case TOKEN_SHORT:
@@ -1048,6 +997,7 @@ static struct node *parse_declaration_specifier_list(struct context *context, st
             else if (base_type == TYPE_SIGNED_INT) {}
             else if (base_type == TYPE_SIGNED_LONG) {}
             else if (base_type == TYPE_SIGNED_LONG_LONG) {}
+            else if (base_type == TYPE_CHAR) base_type = TYPE_SIGNED_CHAR;
             else if (base_type == 0) base_type = TYPE_SIGNED_INT;
             else goto error;
             break;
@@ -1057,6 +1007,7 @@ static struct node *parse_declaration_specifier_list(struct context *context, st
             else if (base_type == TYPE_UNSIGNED_INT) {}
             else if (base_type == TYPE_UNSIGNED_LONG) {}
             else if (base_type == TYPE_UNSIGNED_LONG_LONG) {}
+            else if (base_type == TYPE_CHAR) base_type = TYPE_UNSIGNED_CHAR;
             else if (base_type == 0) base_type = TYPE_UNSIGNED_INT;
             else goto error;
             break;
@@ -1102,10 +1053,9 @@ static struct node *parse_declaration(struct context *context) {
         if (TOKEN(context)->type != ';')
             eat(context, ',');
     }
-    node->token_end = TOKEN(context);
     eat(context, ';');
 
-    return node;
+    return finish(context, node);
 }
 
 // a "single declaration" contains 0 or 1 declarators and doesn't necessarily end with a ;
@@ -1116,12 +1066,10 @@ static struct node *parse_single_declaration(struct context *context) {
     struct node *err = parse_declaration_specifier_list(context, node);
     if (err) return err;
 
-    list_init_one(&node->decl.declarators);
-
     if (TOKEN(context)->type == '*' || TOKEN(context)->type == '(' || TOKEN(context)->type == TOKEN_IDENT)
-        node->decl.declarators.data[0] = parse_declarator(context);
+        list_push(&node->decl.declarators, parse_declarator(context));
 
-    return node;
+    return finish(context, node);
 }
 
 // parse_other_statements
@@ -1142,17 +1090,15 @@ static struct node *parse_compound_statement(struct context *context) {
     while (TOKEN(context)->type != '}') {
         list_push(&node->block.children, parse_statement(context));
     }
-    node->token_end = TOKEN(context);
     eat(context, '}');
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_label(struct context *context) {
     struct node *node = new(context, NODE_LABEL);
     node->label.name = parse_ident(context);
-    node->token_end = TOKEN(context);
     eat(context, ':');
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_return_statement(struct context *context) {
@@ -1161,15 +1107,14 @@ static struct node *parse_return_statement(struct context *context) {
     if (TOKEN(context)->type != ';') {
         node->ret.expr = parse_expression(context);
     }
-    node->token_end = TOKEN(context);
     eat(context, ';');
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_null_statement(struct context *context) {
     struct node *node = new(context, NODE_NULL);
     eat(context, ';');
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_if_statement(struct context *context) {
@@ -1187,7 +1132,7 @@ static struct node *parse_if_statement(struct context *context) {
     node->if_.cond = cond;
     node->if_.block_true = block_true;
     node->if_.block_false = block_false;
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_while_statement(struct context *context) {
@@ -1199,7 +1144,7 @@ static struct node *parse_while_statement(struct context *context) {
     struct node *block = parse_statement(context);
     node->while_.cond = cond;
     node->while_.block = block;
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_do_statement(struct context *context) {
@@ -1210,11 +1155,10 @@ static struct node *parse_do_statement(struct context *context) {
     eat(context, '(');
     struct node *cond = parse_expression(context);
     eat(context, ')');
-    node->token_end = TOKEN(context);
     eat(context, ';');
     node->do_.block = block;
     node->do_.cond = cond;
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_for_statement(struct context *context) {
@@ -1245,7 +1189,7 @@ static struct node *parse_for_statement(struct context *context) {
     node->for_.cond = cond;
     node->for_.next = next;
     node->for_.block = block;
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_switch_statement(struct context *context) {
@@ -1257,7 +1201,7 @@ static struct node *parse_switch_statement(struct context *context) {
     struct node *block = parse_statement(context);
     node->switch_.expr = expr;
     node->switch_.block = block;
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_case_statement(struct context *context) {
@@ -1267,7 +1211,7 @@ static struct node *parse_case_statement(struct context *context) {
     eat(context, ':');
     node->case_.value = value;
 
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_goto_statement(struct context *context) {
@@ -1276,28 +1220,28 @@ static struct node *parse_goto_statement(struct context *context) {
     struct node *ident = parse_ident(context);
     eat(context, ';');
     node->goto_.label = ident;
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_break_statement(struct context *context) {
     struct node *node = new(context, NODE_BREAK);
     eat(context, TOKEN_BREAK);
     eat(context, ';');
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_continue_statement(struct context *context) {
     struct node *node = new(context, NODE_CONTINUE);
     eat(context, TOKEN_CONTINUE);
     eat(context, ';');
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_default_statement(struct context *context) {
     struct node *node = new(context, NODE_DEFAULT);
     eat(context, TOKEN_DEFAULT);
     eat(context, ':');
-    return node;
+    return finish(context, node);
 }
 
 static struct node *parse_statement(struct context *context) {
@@ -1349,10 +1293,15 @@ static struct node *parse_statement(struct context *context) {
 
 static struct node *parse_function_definition(struct context *context) {
     struct node *node = new(context, NODE_FUNCTION_DEFINITION);
+    int n_declarators = context->n_declarators;
     node->fun.decl = parse_single_declaration(context);
+    if (node->fun.decl->type != NODE_DECLARATION || node->fun.decl->decl.declarators.len != 1) {
+        return report_error_node(context, "expected a function declarator");
+    }
     node->fun.body = parse_compound_statement(context);
     node->fun.d = node->fun.decl->decl.declarators.data[0];
-    return node;
+    node->fun.n_locals = context->n_declarators - n_declarators;
+    return finish(context, node);
 }
 
 static struct node *parse_external_definition(struct context *context) {
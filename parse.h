@@ -51,12 +51,19 @@ extern const char *node_type_strings[NODE_TYPE_COUNT];
 
 typedef list(struct node *) node_list_t;
 
+struct value;
+
 struct node {
+    // the token that identifies the node, like the operator of an expression
     struct token *token;
+    // the first and last tokens of the node's source extent, set by the parser
+    struct token *token_begin;
     struct token *token_end;
     struct token *attached_comment;
     enum node_type type;
     int c_type;
+    // cached result of eval(), nullptr until the node is evaluated
+    struct value *value;
     union {
         struct {
             node_list_t children;
@@ -104,6 +111,7 @@ struct node {
                 } arr;
                 struct {
                     node_list_t args;
+                    bool variadic;
                 } fun;
             };
         } d;
@@ -123,6 +131,8 @@ struct node {
             struct node *decl;
             struct node *body;
             struct node *d;
+            // upper bound on the scopes the parameters and body declare
+            int n_locals;
         } fun;
         struct {
             struct node *name;
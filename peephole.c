@@ -0,0 +1,674 @@
+#include "x86.h"
+#include "ir.h"
+#include "token.h"
+#include "tu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A peephole optimizer over the machine code of a function, after Davidson
+// and Fraser: a table of rules, each a window of consecutive instructions and
+// what to put in its place. Code generation lowers each IR instruction on its
+// own, so the seams between them are where the rules find work, like a value
+// moved to a register and straight back, a comparison with zero of a result
+// whose flags the arithmetic already set, or a branch over a jump.
+//
+// The rules are data, written in the small pattern language of the macros
+// below: a window is a list of shapes, each a set of operations with a kind
+// of operand in each slot, and an operand named by a variable is the same
+// wherever it appears. What a rule needs of the code around the window, like
+// a register that nothing reads after it, comes from the liveness of the
+// machine registers and the flags, computed over the jumps between labels.
+
+enum slot_kind : char {
+    // anything, or nothing
+    S_ANY,
+    S_REG,
+    // memory, in the stack frame or relative to rip
+    S_MEM,
+    // a register or an immediate
+    S_VALUE,
+    // the immediate 0
+    S_ZERO,
+    S_LABEL,
+    // a label that nothing jumps to
+    S_UNUSED_LABEL,
+};
+
+enum var : char {
+    V_NONE,
+    V_a,
+    V_b,
+    V_c,
+    N_VARS,
+};
+
+struct slot {
+    enum slot_kind kind;
+    enum var var;
+};
+
+// One instruction of a window: any of a set of operations, with any of a
+// set of conditions if it is a JCC or SETCC.
+struct shape {
+    uint64_t ops;
+    unsigned short conds;
+    struct slot operands[2];
+    // whether it is left out of CHECK_SAME_SIZE
+    bool any_size;
+};
+
+// One instruction of a replacement: a copy of the one at a place in the
+// window, counted from 1, with the operands that variables name replaced,
+// and its condition inverted or its operation changed if asked.
+struct output {
+    char from;
+    bool invert;
+    enum var operands[2];
+    bool retype;
+    enum x86_op op;
+};
+
+enum check : unsigned char {
+    // the instructions of the window that have an operand size share it
+    CHECK_SAME_SIZE = 1,
+    // nothing reads the flags after the window
+    CHECK_FLAGS_DEAD = 2,
+    // no move the replacement leaves out writes 32 bits of a register, which
+    // clears its top half even if the value is already there
+    CHECK_NO_CLEAR = 4,
+};
+
+#define MAX_WINDOW 4
+// a backstop; a rewrite exposes another at most once or twice
+#define MAX_ROUNDS 4
+
+struct peephole_rule {
+    const char *name;
+    struct shape window[MAX_WINDOW];
+    unsigned char checks;
+    // a register that nothing reads after the window
+    enum var dead;
+    // an operand that must not read a register, which the window writes
+    enum var reader;
+    enum var written;
+    struct output replace[MAX_WINDOW];
+};
+
+#define OP(op) (1ull << X86_##op)
+#define MOVES (OP(MOV) | OP(MOVSX) | OP(MOVZX) | OP(LEA))
+#define ARITHMETIC (OP(ADD) | OP(SUB))
+#define LOGIC (OP(AND) | OP(OR) | OP(XOR))
+#define FLAG_READERS (OP(JCC) | OP(SETCC))
+#define COND(c) (1u << X86_##c)
+// the conditions on ZF and SF alone, which arithmetic sets as a test of its
+// result would; it sets CF and OF differently
+#define ZERO_OR_SIGN (COND(E) | COND(NE) | COND(S))
+// every condition but S, which has no inverse to branch on
+#define INVERTIBLE (COND(S) - 1)
+
+#define SHAPE(ops, a, b) { ops, 0, { a, b } }
+#define ANY_SIZE(ops, a, b) { ops, 0, { a, b }, true }
+#define FLAG_READER(conds) { FLAG_READERS, conds, { ANY(NONE), ANY(NONE) } }
+#define JUMP(ops, conds, l) { ops, conds, { l, ANY(NONE) } }
+#define ANY(v) { S_ANY, V_##v }
+#define REG(v) { S_REG, V_##v }
+#define MEM(v) { S_MEM, V_##v }
+#define VALUE(v) { S_VALUE, V_##v }
+#define ZERO { S_ZERO, V_NONE }
+#define LABEL(v) { S_LABEL, V_##v }
+#define UNUSED_LABEL(v) { S_UNUSED_LABEL, V_##v }
+#define KEEP(n) { n, false, { V_NONE, V_NONE } }
+#define COPY(n, a, b) { n, false, { V_##a, V_##b } }
+#define INVERT(n, a) { n, true, { V_##a, V_NONE } }
+#define RETYPE(n, op, a, b) { n, false, { V_##a, V_##b }, true, X86_##op }
+
+// The first rule that matches wins, so the more specific come first.
+static const struct peephole_rule rules[] = {
+    {
+        .name = "move to itself",
+        .window = { SHAPE(OP(MOV) | OP(MOVAPS), REG(a), REG(a)) },
+        .checks = CHECK_NO_CLEAR,
+    },
+    {
+        .name = "repeated move",
+        .window = { SHAPE(OP(MOV), ANY(a), ANY(b)), SHAPE(OP(MOV), ANY(a), ANY(b)) },
+        .checks = CHECK_SAME_SIZE,
+        .reader = V_b,
+        .written = V_a,
+        .replace = { KEEP(1) },
+    },
+    {
+        .name = "move back",
+        .window = { SHAPE(OP(MOV), ANY(a), ANY(b)), SHAPE(OP(MOV), ANY(b), ANY(a)) },
+        .checks = CHECK_SAME_SIZE | CHECK_NO_CLEAR,
+        .reader = V_b,
+        .written = V_a,
+        .replace = { KEEP(1) },
+    },
+    {
+        .name = "load of a store",
+        .window = { SHAPE(OP(MOV), MEM(a), VALUE(b)), SHAPE(OP(MOV), REG(c), ANY(a)) },
+        .checks = CHECK_SAME_SIZE,
+        .replace = { KEEP(1), COPY(2, c, b) },
+    },
+    {
+        .name = "move through a dead register",
+        .window = { SHAPE(MOVES, REG(a), ANY(b)), SHAPE(OP(MOV), ANY(c), REG(a)) },
+        .checks = CHECK_SAME_SIZE,
+        .dead = V_a,
+        .reader = V_c,
+        .written = V_a,
+        .replace = { COPY(1, c, b) },
+    },
+    {
+        .name = "zero through a dead register",
+        .window = { SHAPE(OP(XOR), REG(a), REG(a)), SHAPE(OP(MOV), REG(c), REG(a)) },
+        .dead = V_a,
+        .replace = { COPY(1, c, c) },
+    },
+    {
+        // which sets the flags the same, in fewer bytes
+        .name = "compare with zero",
+        .window = { SHAPE(OP(CMP), REG(a), ZERO) },
+        .replace = { RETYPE(1, TEST, a, a) },
+    },
+    {
+        .name = "test after arithmetic",
+        .window = { SHAPE(ARITHMETIC, ANY(a), ANY(b)), SHAPE(OP(TEST), ANY(a), ANY(a)), FLAG_READER(ZERO_OR_SIGN) },
+        .checks = CHECK_SAME_SIZE | CHECK_FLAGS_DEAD,
+        .replace = { KEEP(1), KEEP(3) },
+    },
+    {
+        .name = "test after logic",
+        .window = { SHAPE(LOGIC, ANY(a), ANY(b)), SHAPE(OP(TEST), ANY(a), ANY(a)), FLAG_READER(0) },
+        .checks = CHECK_SAME_SIZE | CHECK_FLAGS_DEAD,
+        .replace = { KEEP(1), KEEP(3) },
+    },
+    // the same with a move in between, like the copies that join a branch's
+    // values before it
+    {
+        .name = "test after arithmetic and a move",
+        .window = {
+            SHAPE(ARITHMETIC, ANY(a), ANY(b)),
+            ANY_SIZE(OP(MOV), REG(c), ANY(NONE)),
+            SHAPE(OP(TEST), ANY(a), ANY(a)),
+            FLAG_READER(ZERO_OR_SIGN),
+        },
+        .checks = CHECK_SAME_SIZE | CHECK_FLAGS_DEAD,
+        .reader = V_a,
+        .written = V_c,
+        .replace = { KEEP(1), KEEP(2), KEEP(4) },
+    },
+    {
+        .name = "test after logic and a move",
+        .window = {
+            SHAPE(LOGIC, ANY(a), ANY(b)),
+            ANY_SIZE(OP(MOV), REG(c), ANY(NONE)),
+            SHAPE(OP(TEST), ANY(a), ANY(a)),
+            FLAG_READER(0),
+        },
+        .checks = CHECK_SAME_SIZE | CHECK_FLAGS_DEAD,
+        .reader = V_a,
+        .written = V_c,
+        .replace = { KEEP(1), KEEP(2), KEEP(4) },
+    },
+    {
+        .name = "jump to the next instruction",
+        .window = { JUMP(OP(JMP) | OP(JCC), 0, LABEL(a)), SHAPE(OP(LABEL), LABEL(a), ANY(NONE)) },
+        .replace = { KEEP(2) },
+    },
+    {
+        .name = "branch over a jump",
+        .window = {
+            JUMP(OP(JCC), INVERTIBLE, LABEL(a)),
+            JUMP(OP(JMP), 0, LABEL(b)),
+            SHAPE(OP(LABEL), LABEL(a), ANY(NONE)),
+        },
+        .replace = { INVERT(1, b), KEEP(3) },
+    },
+    {
+        .name = "branch over an empty block",
+        .window = {
+            JUMP(OP(JCC), INVERTIBLE, LABEL(a)),
+            SHAPE(OP(LABEL), UNUSED_LABEL(c), ANY(NONE)),
+            JUMP(OP(JMP), 0, LABEL(b)),
+            SHAPE(OP(LABEL), LABEL(a), ANY(NONE)),
+        },
+        .replace = { INVERT(1, b), KEEP(2), KEEP(4) },
+    },
+};
+
+#undef OP
+#undef MOVES
+#undef ARITHMETIC
+#undef LOGIC
+#undef FLAG_READERS
+#undef COND
+#undef ZERO_OR_SIGN
+#undef INVERTIBLE
+#undef SHAPE
+#undef ANY_SIZE
+#undef FLAG_READER
+#undef JUMP
+#undef ANY
+#undef REG
+#undef MEM
+#undef VALUE
+#undef ZERO
+#undef LABEL
+#undef UNUSED_LABEL
+#undef KEEP
+#undef COPY
+#undef INVERT
+#undef RETYPE
+
+#define N_RULES (sizeof(rules) / sizeof(rules[0]))
+
+#define ALL_REGS (X86_FLAGS | (X86_FLAGS - 1))
+
+static const enum x86_cond inverse_conds[] = {
+    [X86_E] = X86_NE, [X86_NE] = X86_E,
+    [X86_L] = X86_GE, [X86_LE] = X86_G, [X86_G] = X86_LE, [X86_GE] = X86_L,
+    [X86_B] = X86_AE, [X86_BE] = X86_A, [X86_A] = X86_BE, [X86_AE] = X86_B,
+    [X86_P] = X86_NP, [X86_NP] = X86_P,
+};
+
+static const enum machine_reg argument_regs[] = { RDI, RSI, RDX, RCX, R8, R9 };
+
+struct peephole {
+    x86_list_t *instrs;
+    // the registers live before each instruction, and after the last
+    uint64_t *live;
+    // where each label is placed, or -1, and how many jumps and operands
+    // refer to it
+    int *label_at;
+    int *refs;
+    int n_labels;
+    int hits[N_RULES];
+};
+
+struct bindings {
+    struct x86_operand operands[N_VARS];
+    bool bound[N_VARS];
+};
+
+static bool fits_imm32(int64_t imm) {
+    return imm >= INT32_MIN && imm <= INT32_MAX;
+}
+
+static uint64_t reg_bit(enum machine_reg r) {
+    return 1ull << r;
+}
+
+static bool is_memory(struct x86_operand *x) {
+    return x->kind == X86_MEM || x->kind == X86_RIP;
+}
+
+// The label an operand refers to within the function, or -1.
+static int label_of(struct x86_operand *x) {
+    return (x->kind == X86_TARGET || x->kind == X86_RIP) && !x->symbol ? x->label : -1;
+}
+
+static bool same_operand(struct x86_operand *x, struct x86_operand *y) {
+    if (x->kind != y->kind) return false;
+    switch (x->kind) {
+    case X86_NONE:
+        return true;
+    case X86_REG:
+        return x->reg == y->reg;
+    case X86_MEM:
+        return x->reg == y->reg && x->imm == y->imm && x->scale == y->scale && (!x->scale || x->index == y->index);
+    case X86_IMM:
+        return x->imm == y->imm;
+    case X86_RIP:
+        return x->symbol == y->symbol && x->label == y->label && x->imm == y->imm && x->indirect == y->indirect;
+    case X86_TARGET:
+        return x->symbol == y->symbol && x->label == y->label && x->indirect == y->indirect;
+    }
+    return false;
+}
+
+// The registers an operand reads: itself if it is one, and the base and
+// index of memory.
+static uint64_t operand_reads(struct x86_operand *x) {
+    switch (x->kind) {
+    case X86_REG:
+        return reg_bit(x->reg);
+    case X86_MEM:
+        return reg_bit(x->reg) | (x->scale ? reg_bit(x->index) : 0);
+    default:
+        return 0;
+    }
+}
+
+void x86_instr_regs(struct x86_instr *i, uint64_t *reads, uint64_t *writes) {
+    struct x86_operand *dst = &i->operands[0], *src = &i->operands[1];
+    uint64_t dst_reg = dst->kind == X86_REG ? reg_bit(dst->reg) : 0;
+    uint64_t dst_address = dst->kind == X86_MEM ? operand_reads(dst) : 0;
+    *reads = 0;
+    *writes = 0;
+    switch (i->op) {
+    case X86_LABEL:
+    case X86_JMP:
+        break;
+    case X86_JCC:
+        *reads = X86_FLAGS;
+        break;
+    case X86_MOV:
+    case X86_MOVSX:
+    case X86_MOVZX:
+    case X86_LEA:
+    case X86_MOVAPS:
+    case X86_MOVQ:
+    case X86_CVTTS2SI:
+        *reads = operand_reads(src) | dst_address;
+        *writes = dst_reg;
+        if (i->op == X86_MOV && i->size < 4) *reads |= dst_reg;
+        break;
+    case X86_MOVS:
+    case X86_CVTSI2S:
+    case X86_CVTS2S:
+        // these write the low lanes of an xmm register, and keep the rest
+        *reads = operand_reads(src) | operand_reads(dst);
+        *writes = dst_reg;
+        break;
+    case X86_ADD:
+    case X86_SUB:
+    case X86_IMUL:
+    case X86_AND:
+    case X86_OR:
+    case X86_XOR:
+    case X86_SHL:
+    case X86_SHR:
+    case X86_SAR:
+        *reads = operand_reads(dst) | operand_reads(src);
+        *writes = dst_reg | X86_FLAGS;
+        break;
+    case X86_NEG:
+    case X86_NOT:
+        *reads = operand_reads(dst);
+        *writes = dst_reg | (i->op == X86_NEG ? X86_FLAGS : 0);
+        break;
+    case X86_CMP:
+    case X86_TEST:
+    case X86_UCOMIS:
+        *reads = operand_reads(dst) | operand_reads(src);
+        *writes = X86_FLAGS;
+        break;
+    case X86_ADDS:
+    case X86_SUBS:
+    case X86_MULS:
+    case X86_DIVS:
+    case X86_XORPS:
+        *reads = operand_reads(dst) | operand_reads(src);
+        *writes = dst_reg;
+        break;
+    case X86_XCHG:
+        *reads = operand_reads(dst) | operand_reads(src);
+        *writes = dst_reg | (src->kind == X86_REG ? reg_bit(src->reg) : 0);
+        break;
+    case X86_CQO:
+        *reads = reg_bit(RAX);
+        *writes = reg_bit(RDX);
+        break;
+    case X86_DIV:
+    case X86_IDIV:
+        *reads = operand_reads(dst) | reg_bit(RAX) | reg_bit(RDX);
+        *writes = reg_bit(RAX) | reg_bit(RDX) | X86_FLAGS;
+        break;
+    case X86_SETCC:
+        *reads = X86_FLAGS | operand_reads(dst);
+        *writes = dst_reg;
+        break;
+    case X86_CALL:
+        *reads = operand_reads(dst) | reg_bit(RAX) | reg_bit(RSP);
+        for (size_t a = 0; a < sizeof(argument_regs) / sizeof(argument_regs[0]); a++) *reads |= reg_bit(argument_regs[a]);
+        for (int x = XMM0; x <= XMM7; x++) *reads |= reg_bit(x);
+        *writes = X86_FLAGS;
+        for (int r = 0; r < N_MACHINE_REGS; r++) {
+            if (is_caller_saved(r)) *writes |= reg_bit(r);
+        }
+        break;
+    case X86_RET:
+        *reads = ALL_REGS & ~X86_FLAGS;
+        break;
+    case X86_PUSH:
+        *reads = operand_reads(dst) | reg_bit(RSP);
+        *writes = reg_bit(RSP);
+        break;
+    case X86_LEAVE:
+        *reads = reg_bit(RBP);
+        *writes = reg_bit(RSP) | reg_bit(RBP);
+        break;
+    }
+}
+
+// The registers live where a jump goes, or all of them if it leaves the
+// function's code.
+static uint64_t live_at_target(struct peephole *p, struct x86_instr *i) {
+    int label = label_of(&i->operands[0]);
+    if (label < 0 || label >= p->n_labels || p->label_at[label] < 0) return ALL_REGS;
+    return p->live[p->label_at[label]];
+}
+
+static uint64_t live_after(struct peephole *p, size_t k) {
+    struct x86_instr *i = &p->instrs->data[k];
+    switch (i->op) {
+    case X86_RET: return 0;
+    case X86_JMP: return live_at_target(p, i);
+    case X86_JCC: return p->live[k + 1] | live_at_target(p, i);
+    default: return p->live[k + 1];
+    }
+}
+
+// Liveness by going back over the whole function until nothing changes,
+// once more for each loop nested in another.
+static void find_liveness(struct peephole *p) {
+    size_t n = p->instrs->len;
+    p->live = realloc(p->live, (n + 1) * sizeof(uint64_t));
+    memset(p->live, 0, (n + 1) * sizeof(uint64_t));
+    for (int l = 0; l < p->n_labels; l++) p->label_at[l] = -1;
+    for (int l = 0; l < p->n_labels; l++) p->refs[l] = 0;
+    for (size_t k = 0; k < n; k++) {
+        struct x86_instr *i = &p->instrs->data[k];
+        if (i->op == X86_LABEL) {
+            p->label_at[i->operands[0].label] = (int)k;
+            continue;
+        }
+        for (int o = 0; o < 2; o++) {
+            int label = label_of(&i->operands[o]);
+            if (label >= 0 && label < p->n_labels) p->refs[label] += 1;
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t k = n; k-- > 0;) {
+            uint64_t reads, writes;
+            x86_instr_regs(&p->instrs->data[k], &reads, &writes);
+            uint64_t live = reads | (live_after(p, k) & ~writes);
+            if (live != p->live[k]) {
+                p->live[k] = live;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool match_slot(struct peephole *p, struct slot slot, struct x86_operand *x, struct bindings *b) {
+    switch (slot.kind) {
+    case S_ANY:
+        break;
+    case S_REG:
+        if (x->kind != X86_REG) return false;
+        break;
+    case S_MEM:
+        if (!is_memory(x)) return false;
+        break;
+    case S_VALUE:
+        if (x->kind != X86_REG && x->kind != X86_IMM) return false;
+        break;
+    case S_ZERO:
+        if (x->kind != X86_IMM || x->imm != 0) return false;
+        break;
+    case S_LABEL:
+    case S_UNUSED_LABEL: {
+        int label = x->kind == X86_TARGET ? label_of(x) : -1;
+        if (label < 0 || label >= p->n_labels) return false;
+        if (slot.kind == S_UNUSED_LABEL && p->refs[label]) return false;
+        break;
+    }
+    }
+    if (!slot.var) return true;
+    if (b->bound[slot.var]) return same_operand(x, &b->operands[slot.var]);
+    b->operands[slot.var] = *x;
+    b->bound[slot.var] = true;
+    return true;
+}
+
+static bool has_size(enum x86_op op) {
+    return op != X86_LABEL && op != X86_JMP && op != X86_JCC && op != X86_SETCC;
+}
+
+// Whether the replacement of a rule copies instruction w of its window.
+static bool is_kept(const struct peephole_rule *rule, int w) {
+    for (int r = 0; r < MAX_WINDOW && rule->replace[r].from; r++) {
+        if (rule->replace[r].from == w + 1) return true;
+    }
+    return false;
+}
+
+// Match a rule's window at instruction k, binding its variables.
+static bool match_window(struct peephole *p, const struct peephole_rule *rule, size_t k, struct bindings *b, int *length) {
+    size_t n = p->instrs->len;
+    int size = 0, w;
+    *b = (struct bindings){};
+    for (w = 0; w < MAX_WINDOW && rule->window[w].ops; w++) {
+        if (k + (size_t)w >= n) return false;
+        const struct shape *shape = &rule->window[w];
+        struct x86_instr *i = &p->instrs->data[k + (size_t)w];
+        if (!(shape->ops & (1ull << i->op))) return false;
+        if (shape->conds && (i->op == X86_JCC || i->op == X86_SETCC) && !(shape->conds & (1u << i->cond))) return false;
+        if ((rule->checks & CHECK_SAME_SIZE) && has_size(i->op) && !shape->any_size) {
+            if (size && i->size != size) return false;
+            size = i->size;
+        }
+        if ((rule->checks & CHECK_NO_CLEAR) && i->op == X86_MOV && i->size == 4 && i->operands[0].kind == X86_REG &&
+            !is_kept(rule, w)) {
+            return false;
+        }
+        for (int o = 0; o < 2; o++) {
+            if (!match_slot(p, shape->operands[o], &i->operands[o], b)) return false;
+        }
+    }
+    *length = w;
+
+    uint64_t live = live_after(p, k + (size_t)w - 1);
+    if ((rule->checks & CHECK_FLAGS_DEAD) && (live & X86_FLAGS)) return false;
+    if (rule->dead && (live & operand_reads(&b->operands[rule->dead]))) return false;
+    if (rule->reader) {
+        struct x86_operand *written = &b->operands[rule->written];
+        if (written->kind == X86_REG && (operand_reads(&b->operands[rule->reader]) & reg_bit(written->reg))) return false;
+    }
+    return true;
+}
+
+// Whether the encoder has a form for an instruction a rule made.
+static bool is_encodable(struct x86_instr *i) {
+    struct x86_operand *dst = &i->operands[0], *src = &i->operands[1];
+    switch (i->op) {
+    case X86_MOV:
+        if (dst->kind == X86_REG) return true;
+        if (!is_memory(dst)) return false;
+        return src->kind == X86_REG || (src->kind == X86_IMM && fits_imm32(src->imm));
+    case X86_MOVSX:
+    case X86_MOVZX:
+    case X86_LEA:
+    case X86_XOR:
+        return dst->kind == X86_REG;
+    default:
+        return true;
+    }
+}
+
+// Put the replacement of a matched window at the end of out, or nothing if
+// the encoder can't take it.
+static bool replace(struct peephole *p, const struct peephole_rule *rule, size_t k, struct bindings *b, x86_list_t *out) {
+    struct x86_instr made[MAX_WINDOW];
+    int n_made = 0;
+    for (int r = 0; r < MAX_WINDOW && rule->replace[r].from; r++) {
+        const struct output *o = &rule->replace[r];
+        struct x86_instr i = p->instrs->data[k + (size_t)o->from - 1];
+        for (int x = 0; x < 2; x++) {
+            if (o->operands[x]) i.operands[x] = b->operands[o->operands[x]];
+        }
+        if (o->invert) i.cond = inverse_conds[i.cond];
+        if (o->retype) i.op = o->op;
+        if (!is_encodable(&i)) return false;
+        made[n_made++] = i;
+    }
+    for (int m = 0; m < n_made; m++) list_push(out, made[m]);
+    return true;
+}
+
+// One pass of the rules over the function, each window matched against the
+// liveness from before the pass. A rewrite never makes a register live
+// anywhere it wasn't, so that only errs on the safe side, and the windows
+// don't overlap.
+static bool rewrite(struct peephole *p) {
+    find_liveness(p);
+    x86_list_t out = {};
+    bool changed = false;
+    size_t n = p->instrs->len;
+    for (size_t k = 0; k < n;) {
+        int length = 0;
+        for (size_t r = 0; r < N_RULES; r++) {
+            struct bindings b;
+            if (!(rules[r].window[0].ops & (1ull << p->instrs->data[k].op))) continue;
+            if (!match_window(p, &rules[r], k, &b, &length) || !replace(p, &rules[r], k, &b, &out)) {
+                length = 0;
+                continue;
+            }
+            p->hits[r] += 1;
+            changed = true;
+            break;
+        }
+        if (length) {
+            k += (size_t)length;
+        } else {
+            list_push(&out, p->instrs->data[k]);
+            k++;
+        }
+    }
+    list_clear(p->instrs);
+    *p->instrs = out;
+    return changed;
+}
+
+void peephole(struct tu *tu, struct function *function, struct x86_function *code) {
+    struct peephole p = { .instrs = &code->instrs, .n_labels = code->n_labels };
+    p.label_at = malloc((p.n_labels ? p.n_labels : 1) * sizeof(int));
+    p.refs = malloc((p.n_labels ? p.n_labels : 1) * sizeof(int));
+    for (int round = 0; round < MAX_ROUNDS; round++) {
+        if (!rewrite(&p)) break;
+    }
+    free(p.live);
+    free(p.label_at);
+    free(p.refs);
+
+    const char *sep = "";
+    for (size_t r = 0; r < N_RULES; r++) {
+        if (!p.hits[r]) continue;
+        if (!*sep) {
+            fprintf(stderr, "peephole ");
+            print_token(tu, function->scope->token);
+            fprintf(stderr, ":");
+        }
+        fprintf(stderr, "%s %s %i", sep, rules[r].name, p.hits[r]);
+        sep = ",";
+    }
+    if (*sep) fputc('\n', stderr);
+}
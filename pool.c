@@ -0,0 +1,93 @@
+#include "pool.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+static void *worker(void *arg) {
+    struct pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->stop && pool->next == pool->jobs.len) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->stop) break;
+
+        struct job job = list_at(&pool->jobs, pool->next);
+        pool->next += 1;
+        pool->running += 1;
+
+        pthread_mutex_unlock(&pool->lock);
+        job.fn(job.arg);
+        pthread_mutex_lock(&pool->lock);
+
+        pool->running -= 1;
+        if (pool->running == 0 && pool->next == pool->jobs.len) {
+            // every job has run, so the queue can be reused from the start
+            pool->jobs.len = 0;
+            pool->next = 0;
+            pthread_cond_broadcast(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return nullptr;
+}
+
+struct pool *pool_create(int n_threads) {
+    if (n_threads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n > 0 ? (int)n : 1;
+    }
+
+    struct pool *pool = calloc(1, sizeof(struct pool));
+    pthread_mutex_init(&pool->lock, nullptr);
+    pthread_cond_init(&pool->work, nullptr);
+    pthread_cond_init(&pool->idle, nullptr);
+
+    pool->threads = calloc(n_threads, sizeof(pthread_t));
+    for (int i = 0; i < n_threads; i += 1) {
+        if (pthread_create(&pool->threads[i], nullptr, worker, pool) != 0) break;
+        pool->n_threads += 1;
+    }
+
+    return pool;
+}
+
+void pool_submit(struct pool *pool, void (*fn)(void *), void *arg) {
+    if (pool->n_threads == 0) {
+        fn(arg);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    list_push(&pool->jobs, ((struct job){ .fn = fn, .arg = arg }));
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(struct pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running || pool->next != pool->jobs.len) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(struct pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->n_threads; i += 1) {
+        pthread_join(pool->threads[i], nullptr);
+    }
+
+    list_clear(&pool->jobs);
+    free(pool->threads);
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
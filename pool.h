@@ -0,0 +1,40 @@
+#pragma once
+#ifndef COMPILER_POOL_H
+#define COMPILER_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "list.h"
+
+struct job {
+    void (*fn)(void *);
+    void *arg;
+};
+
+// A fixed set of worker threads running jobs from a shared queue.
+struct pool {
+    pthread_mutex_t lock;
+    // signalled when jobs are submitted or the pool is stopping
+    pthread_cond_t work;
+    // signalled when the queue drains and no job is running
+    pthread_cond_t idle;
+
+    list(struct job) jobs;
+    // index of the next job in jobs to start
+    size_t next;
+    size_t running;
+    bool stop;
+
+    int n_threads;
+    pthread_t *threads;
+};
+
+// Start a pool with n_threads workers, or one per online CPU if n_threads is 0.
+struct pool *pool_create(int n_threads);
+void pool_submit(struct pool *, void (*fn)(void *), void *arg);
+// Block until every submitted job has finished.
+void pool_wait(struct pool *);
+void pool_destroy(struct pool *);
+
+#endif //COMPILER_POOL_H
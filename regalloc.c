@@ -0,0 +1,1236 @@
+#include "regalloc.h"
+#include "ir.h"
+#include "loop.h"
+#include "opt.h"
+#include "ssa.h"
+#include "token.h"
+#include "tu.h"
+#include "type.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Linear scan register allocation with interval splitting, after Wimmer and
+// Mössenböck, "Optimized Interval Splitting in a Linear Scan Register
+// Allocator".
+//
+// The blocks are laid out in reverse postorder and their instructions
+// numbered two apart: an instruction at p reads its operands at p and writes
+// its result at p + 1. The live interval of a register is the list of ranges
+// of positions where it holds a value that will be read, with holes where it
+// doesn't, built backwards from liveness sets found by walking from each use
+// up to the definitions that reach it.
+//
+// Intervals are visited in order of their start. Each takes the register that
+// stays free the longest, and if that is only free for part of the interval,
+// the interval is split there and the rest goes back in the queue. When no
+// register is free, whichever is cheaper to spill, by uses weighted by loop
+// depth over length, goes to the stack: the interval itself, or the ones
+// holding the cheapest register, which are split at the current position.
+// Calls overwrite the caller-saved registers, so an interval that lives
+// across one is split in front of it.
+//
+// Splitting means a register can be in different places at different points,
+// so afterwards each piece is renamed to a register of its own, with MOVEs
+// where one piece hands over to the next in a block and on the edges where
+// the pieces at the two ends differ.
+
+const char *const machine_reg_names[N_MACHINE_REGS] = {
+    "rax",   "rcx",   "rdx",   "rbx",   "rsp",   "rbp",   "rsi",   "rdi",
+    "r8",    "r9",    "r10",   "r11",   "r12",   "r13",   "r14",   "r15",
+    "xmm0",  "xmm1",  "xmm2",  "xmm3",  "xmm4",  "xmm5",  "xmm6",  "xmm7",
+    "xmm8",  "xmm9",  "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15",
+};
+
+bool is_caller_saved(enum machine_reg r) {
+    switch (r) {
+    case RBX:
+    case RSP:
+    case RBP:
+    case R12:
+    case R13:
+    case R14:
+    case R15:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// Caller-saved registers come first, so an interval that doesn't cross a
+// call leaves the callee-saved ones, which cost a save and restore in the
+// prologue, to those that do.
+static const enum machine_reg int_regs[] = { RSI, RDI, R8, R9, R10, RBX, R12, R13, R14, R15 };
+static const enum machine_reg float_regs[] = {
+    XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7, XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14,
+};
+static const enum machine_reg int_arg_regs[] = { RDI, RSI, RDX, RCX, R8, R9 };
+
+#define N_INT_REGS (int)(sizeof(int_regs) / sizeof(int_regs[0]))
+#define N_FLOAT_REGS (int)(sizeof(float_regs) / sizeof(float_regs[0]))
+#define N_INT_ARG_REGS (int)(sizeof(int_arg_regs) / sizeof(int_arg_regs[0]))
+#define N_FLOAT_ARG_REGS 8
+
+const enum machine_reg *allocatable_regs(bool is_float, int *n) {
+    *n = is_float ? N_FLOAT_REGS : N_INT_REGS;
+    return is_float ? float_regs : int_regs;
+}
+
+signed char param_register(bool is_float, int n) {
+    if (is_float) return n < N_FLOAT_ARG_REGS ? (signed char)(XMM0 + n) : -1;
+    return n < N_INT_ARG_REGS ? int_arg_regs[n] : -1;
+}
+
+// loop depths past this weigh the same
+#define MAX_WEIGHT_DEPTH 6
+
+// positions [from, to)
+struct range {
+    int from;
+    int to;
+};
+
+struct use {
+    int pos;
+    // 10 to the loop depth of the block it is in
+    float weight;
+};
+
+struct interval {
+    // the register the interval was built for, and the one this piece is
+    // renamed to once they are split
+    reg origin;
+    reg vreg;
+    list(struct range) ranges;
+    list(struct use) uses;
+    float weight;
+    // the next piece of the same register, or -1
+    int next;
+    // where the piece was split from the one before it, or -1 for the first
+    int split_at;
+    // an interval whose register to prefer: the other side of a MOVE, or the
+    // piece this was split from, or -1; and a machine register to prefer
+    int hint;
+    signed char fixed_hint;
+    // the machine register, or -1 if the interval is spilled
+    signed char reg;
+    bool is_float;
+};
+
+// A copy in a set of copies that all happen at once.
+struct move {
+    reg to;
+    reg from;
+};
+
+typedef list(struct move) move_list_t;
+
+// A copy from one piece of a register to the next, in front of the
+// instruction at pos.
+struct split_move {
+    int pos;
+    struct move move;
+};
+
+struct allocator {
+    struct tu *tu;
+    struct function *function;
+    struct allocation *result;
+    list(struct interval) intervals;
+    // the first interval of each register, or -1
+    int *first;
+    bool *is_float;
+    // the number of instructions defining each register, none for a
+    // parameter
+    int *defs;
+    // the IMM defining each register that has no other definition
+    bool *can_remat;
+    struct ir_instr *remat;
+
+    // the blocks in the order they are numbered, and the positions of each
+    // block's first instruction and one past its last
+    block_list_t order;
+    int *from;
+    int *to;
+    // 10 to the loop depth of each block
+    float *frequency;
+    // the positions of the calls, in order
+    block_list_t calls;
+
+    // a heap of intervals by start
+    block_list_t unhandled;
+    // intervals with a register that cover the current position, and those
+    // that have one but are in a hole
+    block_list_t active;
+    block_list_t inactive;
+
+    // the stack slot of each spilled register, or 0
+    int *slot;
+    // once the pieces are renamed, the register each was split from
+    reg *origin;
+    // the registers that are stored to their slot right where they are
+    // defined, so a piece never needs to be stored again, and a piece in the
+    // slot to store to if the definition is in a register, or 0
+    bool *in_slot;
+    reg *store_at_def;
+    int frame_size;
+};
+
+#define IV(i) (&a->intervals.data[i])
+
+static int start_of(struct interval *it) {
+    return it->ranges.data[0].from;
+}
+
+static int end_of(struct interval *it) {
+    return list_last(&it->ranges).to;
+}
+
+// The first range of an interval that ends after pos.
+static size_t find_range(struct interval *it, int pos) {
+    size_t lo = 0, hi = it->ranges.len;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (it->ranges.data[mid].to <= pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static bool covers(struct interval *it, int pos) {
+    size_t r = find_range(it, pos);
+    return r < it->ranges.len && it->ranges.data[r].from <= pos;
+}
+
+// The first position at or after pos that both intervals cover, or INT_MAX.
+static int next_intersection(struct interval *x, struct interval *y, int pos) {
+    size_t i = find_range(x, pos), j = find_range(y, pos);
+    while (i < x->ranges.len && j < y->ranges.len) {
+        struct range *rx = &x->ranges.data[i], *ry = &y->ranges.data[j];
+        int from = rx->from > ry->from ? rx->from : ry->from;
+        if (from < pos) from = pos;
+        if (from < rx->to && from < ry->to) return from;
+        if (rx->to <= ry->to) i++;
+        else j++;
+    }
+    return INT_MAX;
+}
+
+// The index in the order of the block holding a position.
+static size_t block_at(struct allocator *a, int pos) {
+    size_t lo = 0, hi = a->order.len;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (a->from[a->order.data[mid]] <= pos) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static bool is_block_start(struct allocator *a, int pos) {
+    return a->from[a->order.data[block_at(a, pos)]] == pos;
+}
+
+bool is_allocated(struct function *function, reg r) {
+    struct scope *scope = function->regs.data[r].scope;
+    return r && (!scope || is_stack_slot(scope));
+}
+
+bool def_is_float(struct ir_instr *i) {
+    return i->is_float && i->op != TEST && i->op != NOT && i->op != FTOI;
+}
+
+int use_is_float(struct ir_instr *i, int n) {
+    switch (i->op) {
+    case ST:
+        return n == 0 ? 0 : i->is_float;
+    case LD:
+    case ITOF:
+        return 0;
+    case FTOI:
+    case FTOF:
+        return 1;
+    case CALL:
+        return n == 0 ? 0 : -1;
+    default:
+        return i->is_float;
+    }
+}
+
+static int new_interval(struct allocator *a, reg origin) {
+    list_push(&a->intervals, ((struct interval){
+                                 .origin = origin,
+                                 .vreg = origin,
+                                 .next = -1,
+                                 .split_at = -1,
+                                 .hint = -1,
+                                 .fixed_hint = -1,
+                                 .reg = -1,
+                                 .is_float = a->is_float[origin],
+                             }));
+    return (int)a->intervals.len - 1;
+}
+
+static struct interval *interval_of(struct allocator *a, reg r) {
+    if (a->first[r] == -1) a->first[r] = new_interval(a, r);
+    return IV(a->first[r]);
+}
+
+// Intervals are built backwards, so ranges arrive in decreasing order and a
+// new one can only touch the one added last.
+static void add_range(struct interval *it, int from, int to) {
+    if (it->ranges.len) {
+        struct range *last = &list_last(&it->ranges);
+        if (to >= last->from) {
+            if (from < last->from) last->from = from;
+            if (to > last->to) last->to = to;
+            return;
+        }
+    }
+    list_push(&it->ranges, ((struct range){ from, to }));
+}
+
+// A definition ends the range that reaches back to the start of the block,
+// or makes one of its own if nothing reads it.
+static void add_def(struct interval *it, int pos) {
+    if (it->ranges.len) {
+        struct range *last = &list_last(&it->ranges);
+        if (last->from <= pos && pos < last->to) {
+            last->from = pos;
+            return;
+        }
+    }
+    list_push(&it->ranges, ((struct range){ pos, pos + 1 }));
+}
+
+// Uses weighted by how often they run, over the length of the interval. A
+// constant that can be rematerialized costs less to spill than one that has
+// to be stored.
+static void compute_weight(struct allocator *a, struct interval *interval) {
+    float uses = 0;
+    for_each (&interval->uses) uses += it->weight;
+    int length = 0;
+    for_each (&interval->ranges) length += it->to - it->from;
+    interval->weight = uses / (float)(length / 2 + 1);
+    if (a->can_remat[interval->origin]) interval->weight /= 2;
+}
+
+struct occurrence {
+    reg r;
+    int block;
+};
+
+typedef list(struct occurrence) occurrence_list_t;
+
+// Group the blocks of occurrences by register: the blocks of register r end
+// up in blocks[start[r]] up to blocks[start[r + 1]].
+static void group_by_reg(occurrence_list_t *list, size_t n_regs, int **start, int **blocks) {
+    *start = calloc(n_regs + 1, sizeof(int));
+    *blocks = malloc((list->len + 1) * sizeof(int));
+    for_each (list) (*start)[it->r + 1] += 1;
+    for (size_t r = 1; r <= n_regs; r++) (*start)[r] += (*start)[r - 1];
+    int *next = malloc((n_regs + 1) * sizeof(int));
+    for (size_t r = 0; r <= n_regs; r++) next[r] = (*start)[r];
+    for_each (list) (*blocks)[next[it->r]++] = it->block;
+    free(next);
+}
+
+// Liveness by walking up from every use that isn't preceded by a definition
+// in its block, through predecessors, until blocks that define the register.
+// Each block is visited at most once per register live in it, so this is
+// linear in the total size of the live ranges.
+void compute_liveness(struct function *function, reg_list_t *live_in, reg_list_t *live_out) {
+    size_t n_regs = function->regs.len;
+    size_t n_blocks = function->blocks.len;
+
+    occurrence_list_t defs = {}, uses = {};
+    int *def_mark = calloc(n_regs, sizeof(int));
+    int *use_mark = calloc(n_regs, sizeof(int));
+    for (size_t b = 0; b < n_blocks; b++) {
+        for_each_n (instr, &function->blocks.data[b].instrs) {
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                reg r = *ir_use(function, instr, u);
+                if (!is_allocated(function, r) || def_mark[r] == (int)b + 1 || use_mark[r] == (int)b + 1) continue;
+                use_mark[r] = (int)b + 1;
+                list_push(&uses, ((struct occurrence){ r, (int)b }));
+            }
+            reg d = ir_def(instr);
+            if (!is_allocated(function, d) || def_mark[d] == (int)b + 1) continue;
+            def_mark[d] = (int)b + 1;
+            list_push(&defs, ((struct occurrence){ d, (int)b }));
+        }
+    }
+
+    int *def_start, *def_blocks, *use_start, *use_blocks;
+    group_by_reg(&defs, n_regs, &def_start, &def_blocks);
+    group_by_reg(&uses, n_regs, &use_start, &use_blocks);
+
+    // per block, the last register marked as defined there, live in and
+    // live out
+    reg *defines = calloc(n_blocks, sizeof(reg));
+    reg *in_mark = calloc(n_blocks, sizeof(reg));
+    reg *out_mark = calloc(n_blocks, sizeof(reg));
+    block_list_t work = {};
+    for (reg r = 1; r < n_regs; r++) {
+        for (int d = def_start[r]; d < def_start[r + 1]; d++) defines[def_blocks[d]] = r;
+        for (int u = use_start[r]; u < use_start[r + 1]; u++) {
+            int b = use_blocks[u];
+            if (in_mark[b] == r) continue;
+            in_mark[b] = r;
+            list_push(&live_in[b], r);
+            list_push(&work, b);
+        }
+        while (work.len) {
+            int b = work.data[--work.len];
+            for_each (&function->blocks.data[b].preds) {
+                int p = *it;
+                if (out_mark[p] == r) continue;
+                out_mark[p] = r;
+                list_push(&live_out[p], r);
+                if (defines[p] == r || in_mark[p] == r) continue;
+                in_mark[p] = r;
+                list_push(&live_in[p], r);
+                list_push(&work, p);
+            }
+        }
+    }
+
+    list_clear(&work);
+    list_clear(&defs);
+    list_clear(&uses);
+    free(def_mark);
+    free(use_mark);
+    free(def_start);
+    free(def_blocks);
+    free(use_start);
+    free(use_blocks);
+    free(defines);
+    free(in_mark);
+    free(out_mark);
+}
+
+static void build_intervals(struct allocator *a, reg_list_t *live_out) {
+    struct function *function = a->function;
+    for (size_t k = a->order.len; k-- > 0;) {
+        int b = a->order.data[k];
+        ir_list_t *instrs = &function->blocks.data[b].instrs;
+        int from = a->from[b];
+        float frequency = a->frequency[b];
+        for_each (&live_out[b]) add_range(interval_of(a, *it), from, a->to[b]);
+
+        for (size_t n = instrs->len; n-- > 0;) {
+            struct ir_instr *instr = &instrs->data[n];
+            int pos = from + 2 * (int)n;
+            reg d = ir_def(instr);
+            if (is_allocated(function, d)) {
+                struct interval *it = interval_of(a, d);
+                add_def(it, pos + 1);
+                list_push(&it->uses, ((struct use){ pos + 1, frequency }));
+            }
+            for (int u = ir_use_count(function, instr); u-- > 0;) {
+                reg r = *ir_use(function, instr, u);
+                if (!is_allocated(function, r)) continue;
+                struct interval *it = interval_of(a, r);
+                add_range(it, from, pos + 1);
+                list_push(&it->uses, ((struct use){ pos, frequency }));
+            }
+            // the two sides of a copy want the same register, so the copy
+            // can go away
+            if (instr->op == MOVE && is_allocated(function, d) && is_allocated(function, instr->r[1])) {
+                struct interval *x = IV(a->first[d]), *y = IV(a->first[instr->r[1]]);
+                if (x->hint == -1) x->hint = a->first[instr->r[1]];
+                if (y->hint == -1) y->hint = a->first[d];
+            }
+            if (instr->op == CALL) list_push(&a->calls, pos);
+        }
+    }
+
+    for (size_t l = 0, r = a->calls.len; l + 1 < r; l++, r--) {
+        int t = a->calls.data[l];
+        a->calls.data[l] = a->calls.data[r - 1];
+        a->calls.data[r - 1] = t;
+    }
+    for_each_n (it, &a->intervals) {
+        for (size_t l = 0, r = it->ranges.len; l + 1 < r; l++, r--) {
+            struct range t = it->ranges.data[l];
+            it->ranges.data[l] = it->ranges.data[r - 1];
+            it->ranges.data[r - 1] = t;
+        }
+        for (size_t l = 0, r = it->uses.len; l + 1 < r; l++, r--) {
+            struct use t = it->uses.data[l];
+            it->uses.data[l] = it->uses.data[r - 1];
+            it->uses.data[r - 1] = t;
+        }
+        compute_weight(a, it);
+    }
+
+    // parameters arrive in the registers the ABI passes them in
+    int n_ints = 0, n_floats = 0;
+    for_each (&function->params) {
+        bool is_float = a->is_float[*it];
+        int n = is_float ? n_floats++ : n_ints++;
+        if (a->first[*it] != -1) IV(a->first[*it])->fixed_hint = param_register(is_float, n);
+    }
+}
+
+static bool heap_less(struct allocator *a, int x, int y) {
+    int sx = start_of(IV(x)), sy = start_of(IV(y));
+    return sx != sy ? sx < sy : x < y;
+}
+
+static void heap_push(struct allocator *a, int i) {
+    block_list_t *h = &a->unhandled;
+    list_push(h, i);
+    for (size_t n = h->len - 1; n > 0;) {
+        size_t parent = (n - 1) / 2;
+        if (!heap_less(a, h->data[n], h->data[parent])) break;
+        int t = h->data[n];
+        h->data[n] = h->data[parent];
+        h->data[parent] = t;
+        n = parent;
+    }
+}
+
+static int heap_pop(struct allocator *a) {
+    block_list_t *h = &a->unhandled;
+    int top = h->data[0];
+    h->data[0] = h->data[--h->len];
+    for (size_t n = 0;;) {
+        size_t least = n, l = 2 * n + 1, r = 2 * n + 2;
+        if (l < h->len && heap_less(a, h->data[l], h->data[least])) least = l;
+        if (r < h->len && heap_less(a, h->data[r], h->data[least])) least = r;
+        if (least == n) break;
+        int t = h->data[n];
+        h->data[n] = h->data[least];
+        h->data[least] = t;
+        n = least;
+    }
+    return top;
+}
+
+// Split an interval at pos, which it must cover some of on each side. The
+// piece from pos on is returned, and linked in after it, but not queued.
+static int split_interval(struct allocator *a, int i, int pos) {
+    int child = new_interval(a, IV(i)->origin);
+    struct interval *it = IV(i), *c = IV(child);
+    c->next = it->next;
+    c->split_at = pos;
+    c->hint = i;
+    it->next = child;
+
+    size_t r = find_range(it, pos), kept = r;
+    if (r < it->ranges.len && it->ranges.data[r].from < pos) {
+        list_push(&c->ranges, ((struct range){ pos, it->ranges.data[r].to }));
+        it->ranges.data[r].to = pos;
+        kept = ++r;
+    }
+    for (; r < it->ranges.len; r++) list_push(&c->ranges, it->ranges.data[r]);
+    it->ranges.len = kept;
+
+    size_t u = 0;
+    while (u < it->uses.len && it->uses.data[u].pos < pos) u++;
+    for (size_t n = u; n < it->uses.len; n++) list_push(&c->uses, it->uses.data[n]);
+    it->uses.len = u;
+
+    compute_weight(a, it);
+    compute_weight(a, c);
+    a->result->splits += 1;
+    return child;
+}
+
+// The best place to split an interval between two positions: the start of
+// the block in the shallowest loop, so the moves joining the pieces stay out
+// of loops, and otherwise as late as possible. Only instruction positions
+// can be split at. Returns -1 if there is none in the range.
+static int split_position(struct allocator *a, int min, int max) {
+    int best = max & ~1;
+    if (best < min) return -1;
+    size_t k = block_at(a, best);
+    float lowest = a->frequency[a->order.data[k]];
+    // a few blocks back is enough to find the way into a loop
+    for (int steps = 0; steps < 32 && k > 0; steps++, k--) {
+        int b = a->order.data[k], before = a->order.data[k - 1];
+        if (a->from[b] < min) break;
+        // the moves go on the edges into the block, which run about as often
+        // as the block in front of it in the order, for a loop header
+        float frequency = a->frequency[b] < a->frequency[before] ? a->frequency[b] : a->frequency[before];
+        if (frequency < lowest) {
+            lowest = frequency;
+            best = a->from[b];
+        }
+    }
+    return best;
+}
+
+// The position of the first call an interval lives across, which the
+// caller-saved registers are only free until, or INT_MAX.
+static int call_limit(struct allocator *a, struct interval *it) {
+    int start = start_of(it), end = end_of(it);
+    size_t lo = 0, hi = a->calls.len;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (a->calls.data[mid] < start) lo = mid + 1;
+        else hi = mid;
+    }
+    for (size_t c = lo; c < a->calls.len && a->calls.data[c] < end; c++) {
+        int call = a->calls.data[c];
+        if (covers(it, call + 1) && start <= call) return call;
+    }
+    return INT_MAX;
+}
+
+static const enum machine_reg *class_regs(struct interval *it, int *n) {
+    return allocatable_regs(it->is_float, n);
+}
+
+// The position of the first use of an interval after pos, or -1.
+static int next_use(struct interval *interval, int pos) {
+    for_each (&interval->uses) {
+        if (it->pos > pos) return it->pos;
+    }
+    return -1;
+}
+
+// Spill an interval up to the best place after min to load it back for the
+// use at use, from where the rest goes back in the queue. With no use, -1,
+// all of it is spilled.
+static void spill_until(struct allocator *a, int i, int min, int use) {
+    IV(i)->reg = -1;
+    if (use == -1) return;
+    int start = start_of(IV(i));
+    int pos = split_position(a, min > start + 1 ? min : start + 1, use);
+    if (pos != -1) heap_push(a, split_interval(a, i, pos));
+}
+
+// Give the interval a register that is free at its start, splitting it where
+// that register stops being free.
+static bool try_allocate_free(struct allocator *a, int i) {
+    struct interval *current = IV(i);
+    int start = start_of(current), end = end_of(current);
+    int limit = call_limit(a, current);
+
+    int free_until[N_MACHINE_REGS] = {};
+    int n;
+    const enum machine_reg *regs = class_regs(current, &n);
+    for (int r = 0; r < n; r++) free_until[regs[r]] = is_caller_saved(regs[r]) ? limit : INT_MAX;
+    for_each (&a->active) {
+        if (IV(*it)->is_float == current->is_float) free_until[IV(*it)->reg] = 0;
+    }
+    for_each (&a->inactive) {
+        struct interval *other = IV(*it);
+        if (other->is_float != current->is_float) continue;
+        int x = next_intersection(other, current, start);
+        if (x < free_until[other->reg]) free_until[other->reg] = x;
+    }
+
+    // registers outside the class are never free, so a hint from one
+    // doesn't count
+    int best = -1;
+    int hint = current->hint != -1 ? IV(current->hint)->reg : -1;
+    if (hint == -1) hint = current->fixed_hint;
+    if (hint != -1 && free_until[hint] >= end) {
+        best = hint;
+    } else {
+        for (int r = 0; r < n; r++) {
+            if (best == -1 || free_until[regs[r]] > free_until[best]) best = regs[r];
+        }
+    }
+    if (free_until[best] <= start) return false;
+
+    if (free_until[best] < end) {
+        int pos = split_position(a, start + 1, free_until[best]);
+        if (pos == -1) return false;
+        // holding a register up to where nothing reads it is no use, like a
+        // value that lives across a call before its first use
+        int use = next_use(current, start - 1);
+        if (use == -1 || use >= pos) {
+            spill_until(a, i, start + 1, use);
+            return true;
+        }
+        heap_push(a, split_interval(a, i, pos));
+    }
+    IV(i)->reg = (signed char)best;
+    return true;
+}
+
+// Take the register away from an interval that holds it at pos. It is
+// spilled from the best place after its last use before pos, which keeps the
+// store out of a loop it isn't used in, until its next use after pos.
+static void evict(struct allocator *a, int i, int pos) {
+    struct interval *victim = IV(i);
+    int last = start_of(victim);
+    for_each (&victim->uses) {
+        if (it->pos < pos) last = it->pos;
+    }
+    int split = split_position(a, last + 1, pos);
+    if (split == -1) split = pos & ~1;
+    int child = i;
+    if (split > start_of(victim)) child = split_interval(a, i, split);
+    spill_until(a, child, pos + 1, next_use(IV(child), pos));
+}
+
+static void remove_from(block_list_t *list, size_t n) {
+    list->data[n] = list->data[--list->len];
+}
+
+// No register is free at the start of the interval. Take the one whose
+// intervals weigh the least from them, unless the interval itself weighs
+// less.
+static void allocate_blocked(struct allocator *a, int i) {
+    struct interval *current = IV(i);
+    int start = start_of(current), end = end_of(current);
+    int limit = call_limit(a, current);
+
+    float blocked[N_MACHINE_REGS] = {};
+    int n;
+    const enum machine_reg *regs = class_regs(current, &n);
+    for_each (&a->active) {
+        if (IV(*it)->is_float == current->is_float) blocked[IV(*it)->reg] += IV(*it)->weight;
+    }
+    for_each (&a->inactive) {
+        struct interval *other = IV(*it);
+        if (other->is_float != current->is_float) continue;
+        if (next_intersection(other, current, start) != INT_MAX) blocked[other->reg] += other->weight;
+    }
+
+    int best = -1;
+    for (int r = 0; r < n; r++) {
+        if (is_caller_saved(regs[r]) && limit <= start) continue;
+        if (best == -1 || blocked[regs[r]] < blocked[best]) best = regs[r];
+    }
+
+    if (best == -1 || blocked[best] >= current->weight) {
+        // spilled, up to where a use in a deeper loop wants it back
+        float frequency = a->frequency[a->order.data[block_at(a, start)]];
+        int use = -1;
+        for_each (&current->uses) {
+            if (it->pos <= start || it->weight <= frequency) continue;
+            use = it->pos;
+            break;
+        }
+        spill_until(a, i, start + 1, use);
+        return;
+    }
+
+    for (size_t k = 0; k < a->active.len;) {
+        int other = a->active.data[k];
+        if (IV(other)->reg != best) {
+            k++;
+            continue;
+        }
+        remove_from(&a->active, k);
+        evict(a, other, start);
+    }
+    for (size_t k = 0; k < a->inactive.len;) {
+        int other = a->inactive.data[k];
+        if (IV(other)->reg != best || next_intersection(IV(other), IV(i), start) == INT_MAX) {
+            k++;
+            continue;
+        }
+        remove_from(&a->inactive, k);
+        evict(a, other, start);
+    }
+
+    IV(i)->reg = (signed char)best;
+    if (is_caller_saved(best) && limit < end) {
+        int pos = split_position(a, start + 1, limit);
+        if (pos != -1) heap_push(a, split_interval(a, i, pos));
+    }
+}
+
+static void linear_scan(struct allocator *a) {
+    for (size_t i = 0; i < a->intervals.len; i++) heap_push(a, (int)i);
+
+    while (a->unhandled.len) {
+        int i = heap_pop(a);
+        int pos = start_of(IV(i));
+
+        for (size_t k = 0; k < a->active.len;) {
+            struct interval *it = IV(a->active.data[k]);
+            if (end_of(it) <= pos) {
+                remove_from(&a->active, k);
+            } else if (!covers(it, pos)) {
+                list_push(&a->inactive, a->active.data[k]);
+                remove_from(&a->active, k);
+            } else {
+                k++;
+            }
+        }
+        for (size_t k = 0; k < a->inactive.len;) {
+            struct interval *it = IV(a->inactive.data[k]);
+            if (end_of(it) <= pos) {
+                remove_from(&a->inactive, k);
+            } else if (covers(it, pos)) {
+                list_push(&a->active, a->inactive.data[k]);
+                remove_from(&a->inactive, k);
+            } else {
+                k++;
+            }
+        }
+
+        if (!try_allocate_free(a, i)) allocate_blocked(a, i);
+        if (IV(i)->reg != -1) list_push(&a->active, i);
+    }
+}
+
+int layout_frame(struct tu *tu, struct function *function) {
+    int frame_size = 0;
+    bool *placed = calloc(function->regs.len, sizeof(bool));
+    for_each_n (block, &function->blocks) {
+        for_each_n (instr, &block->instrs) {
+            if (instr->op != ADDR || !instr->r[1] || placed[instr->r[1]]) continue;
+            struct scope *scope = function->regs.data[instr->r[1]].scope;
+            if (!is_stack_slot(scope)) continue;
+            placed[instr->r[1]] = true;
+            int size = (int)type_size(tu, scope->c_type);
+            int align = (int)type_align(tu, scope->c_type);
+            if (align < 1) align = 1;
+            frame_size = (frame_size + size + align - 1) / align * align;
+            scope->frame_offset = -frame_size;
+        }
+    }
+    free(placed);
+    return frame_size;
+}
+
+static struct location location_of(struct allocator *a, struct interval *it) {
+    if (it->reg != -1) return (struct location){ .kind = LOC_REG, .reg = it->reg, .is_float = it->is_float };
+    if (a->can_remat[it->origin]) {
+        return (struct location){
+            .kind = LOC_REMAT,
+            .constant = (int)a->remat[it->origin].r[1],
+            .width = a->remat[it->origin].width,
+            .is_float = it->is_float,
+        };
+    }
+    if (!a->slot[it->origin]) {
+        a->frame_size += 8;
+        a->slot[it->origin] = -a->frame_size;
+    }
+    return (struct location){ .kind = LOC_STACK, .offset = a->slot[it->origin], .is_float = it->is_float };
+}
+
+bool same_location(struct location *x, struct location *y) {
+    if (x->kind != y->kind) return false;
+    switch (x->kind) {
+    case LOC_REG:
+        return x->reg == y->reg;
+    case LOC_STACK:
+        return x->offset == y->offset;
+    case LOC_REMAT:
+        return x->constant == y->constant;
+    default:
+        return true;
+    }
+}
+
+#define LOC(r) (&a->result->locations.data[r])
+
+static struct ir_instr copy(struct allocator *a, reg to, reg from) {
+    return (struct ir_instr){ .op = MOVE, .r = { to, from }, .width = 8, .is_float = LOC(to)->is_float };
+}
+
+// Emit a set of copies that all happen at once as a sequence: a copy goes
+// once nothing else still needs to read its destination, and a cycle is
+// broken by moving one value aside to the scratch register.
+static void sequentialize(struct allocator *a, move_list_t *moves, ir_list_t *out) {
+    // a constant needs nothing in its destination, and doesn't read
+    // anything, so it can wait until the end
+    ir_list_t constants = {};
+    size_t n = 0;
+    for_each (moves) {
+        if (same_location(LOC(it->to), LOC(it->from)) || LOC(it->to)->kind == LOC_REMAT) continue;
+        // the slot has had the value since it was defined
+        if (LOC(it->to)->kind == LOC_STACK && a->in_slot[a->origin[it->to]]) continue;
+        if (LOC(it->from)->kind != LOC_REMAT) {
+            moves->data[n++] = *it;
+            continue;
+        }
+        struct ir_instr imm = a->remat[a->origin[it->from]];
+        imm.r[0] = it->to;
+        list_push(&constants, imm);
+    }
+    moves->len = n;
+
+    while (moves->len) {
+        bool progress = false;
+        for (size_t m = 0; m < moves->len;) {
+            bool blocked = false;
+            for_each (moves) {
+                if (it != &moves->data[m] && same_location(LOC(it->from), LOC(moves->data[m].to))) blocked = true;
+            }
+            if (blocked) {
+                m++;
+                continue;
+            }
+            list_push(out, copy(a, moves->data[m].to, moves->data[m].from));
+            moves->data[m] = moves->data[--moves->len];
+            progress = true;
+        }
+        if (progress) continue;
+
+        // every destination is still to be read: save one aside
+        struct move *m = &moves->data[0];
+        bool is_float = LOC(m->to)->is_float;
+        reg t = new_temporary(a->function);
+        list_push(&a->result->locations,
+                  ((struct location){ .kind = LOC_REG, .reg = is_float ? SCRATCH_FLOAT_REG : SCRATCH_REG, .is_float = is_float }));
+        struct location blocked = *LOC(m->to);
+        reg saved = 0;
+        for_each (moves) {
+            if (!same_location(LOC(it->from), &blocked)) continue;
+            if (!saved) {
+                saved = it->from;
+                list_push(out, copy(a, t, saved));
+            }
+            it->from = t;
+        }
+    }
+
+    for_each (&constants) list_push(out, *it);
+    list_clear(&constants);
+}
+
+// The piece of a register that covers a position.
+static int piece_at(struct allocator *a, reg r, int pos) {
+    int i = a->first[r];
+    while (IV(i)->next != -1 && end_of(IV(i)) <= pos) i = IV(i)->next;
+    return i;
+}
+
+static int by_position(const void *x, const void *y) {
+    const struct split_move *a = x, *b = y;
+    return a->pos - b->pos;
+}
+
+// A register with one definition that is spilled can be stored once, where it
+// is defined, instead of everywhere a piece in a register moves to the slot,
+// if the definition runs no more often than those moves would.
+static void choose_spill_stores(struct allocator *a, size_t n_regs) {
+    a->in_slot = calloc(n_regs, sizeof(bool));
+    a->store_at_def = calloc(n_regs, sizeof(reg));
+    for (reg r = 1; r < n_regs; r++) {
+        if (a->first[r] == -1 || a->defs[r] > 1 || a->can_remat[r]) continue;
+        struct interval *first = IV(a->first[r]);
+        if (first->reg == -1) {
+            a->in_slot[r] = true;
+            continue;
+        }
+
+        float stores = 0;
+        reg slot = 0;
+        for (int p = a->first[r], i = first->next; i != -1; p = i, i = IV(i)->next) {
+            if (IV(i)->reg != -1 || IV(p)->reg == -1) continue;
+            slot = IV(i)->vreg;
+            stores += a->frequency[a->order.data[block_at(a, IV(i)->split_at)]];
+        }
+        float def = a->frequency[a->order.data[block_at(a, start_of(first))]];
+        if (!slot || def > stores) continue;
+        a->in_slot[r] = true;
+        a->store_at_def[r] = slot;
+    }
+}
+
+// Rename every piece to a register of its own, and rewrite the function with
+// the moves that join them.
+static void rewrite(struct allocator *a, reg_list_t *live_in) {
+    struct function *function = a->function;
+    size_t n_regs = function->regs.len;
+
+    for (reg r = 1; r < n_regs; r++) {
+        if (a->first[r] == -1) continue;
+        for (int i = IV(a->first[r])->next; i != -1; i = IV(i)->next) IV(i)->vreg = new_temporary(function);
+    }
+    a->origin = calloc(function->regs.len, sizeof(reg));
+    for (size_t r = 0; r < function->regs.len; r++) list_push(&a->result->locations, ((struct location){}));
+    for_each (&a->intervals) {
+        a->origin[it->vreg] = it->origin;
+        *LOC(it->vreg) = location_of(a, it);
+        if (it->reg == -1 && a->can_remat[it->origin]) a->result->rematerialized += 1;
+        else if (it->reg == -1) a->result->spilled += 1;
+        else if (!is_caller_saved(it->reg)) a->result->saved_regs |= 1u << it->reg;
+    }
+    choose_spill_stores(a, n_regs);
+
+    // where a piece takes over from the one before it in the middle of a
+    // block, while the value is live
+    list(struct split_move) splits = {};
+    for (reg r = 1; r < n_regs; r++) {
+        if (a->first[r] == -1) continue;
+        for (int i = a->first[r]; IV(i)->next != -1; i = IV(i)->next) {
+            struct interval *prev = IV(i), *next = IV(prev->next);
+            int pos = next->split_at;
+            if (is_block_start(a, pos) || !covers(prev, pos - 1) || !covers(next, pos)) continue;
+            list_push(&splits, ((struct split_move){ pos, { next->vreg, prev->vreg } }));
+        }
+    }
+    qsort(splits.data, splits.len, sizeof(struct split_move), by_position);
+
+    int *cursor = malloc(n_regs * sizeof(int));
+    for (reg r = 0; r < n_regs; r++) cursor[r] = a->first[r];
+    size_t s = 0;
+    move_list_t moves = {};
+    for_each (&a->order) {
+        ir_list_t *instrs = &function->blocks.data[*it].instrs;
+        ir_list_t out = {};
+        if (*it == 0) {
+            // the parameters are defined on the way in
+            for (reg r = 1; r < n_regs; r++) {
+                if (a->store_at_def[r] && !a->defs[r]) list_push(&out, copy(a, a->store_at_def[r], IV(a->first[r])->vreg));
+            }
+        }
+        for (size_t n = 0; n < instrs->len; n++) {
+            int pos = a->from[*it] + 2 * (int)n;
+            moves.len = 0;
+            for (; s < splits.len && splits.data[s].pos == pos; s++) list_push(&moves, splits.data[s].move);
+            sequentialize(a, &moves, &out);
+
+            struct ir_instr instr = instrs->data[n];
+            for (int u = 0; u < ir_use_count(function, &instr); u++) {
+                reg *use = ir_use(function, &instr, u);
+                if (!is_allocated(function, *use)) continue;
+                int *c = &cursor[*use];
+                while (IV(*c)->next != -1 && end_of(IV(*c)) <= pos) *c = IV(*c)->next;
+                *use = IV(*c)->vreg;
+            }
+            reg d = ir_def(&instr);
+            if (is_allocated(function, d)) {
+                int *c = &cursor[d];
+                while (IV(*c)->next != -1 && end_of(IV(*c)) <= pos + 1) *c = IV(*c)->next;
+                instr.r[0] = IV(*c)->vreg;
+            }
+
+            if (instr.op == IMM && LOC(instr.r[0])->kind == LOC_REMAT) continue;
+            reg stored = is_allocated(function, d) ? a->store_at_def[d] : 0;
+            if (instr.op == MOVE && same_location(LOC(instr.r[0]), LOC(instr.r[1]))) {
+                a->result->coalesced += 1;
+            } else {
+                if (instr.op == MOVE && LOC(instr.r[1])->kind == LOC_REMAT) {
+                    reg to = instr.r[0];
+                    instr = a->remat[a->origin[instr.r[1]]];
+                    instr.r[0] = to;
+                }
+                list_push(&out, instr);
+            }
+            if (stored) list_push(&out, copy(a, stored, instr.r[0]));
+        }
+        list_clear(instrs);
+        *instrs = out;
+    }
+
+    // the edges, where the pieces at the end of the predecessor and the
+    // start of the successor may be in different places
+    size_t n_blocks = function->blocks.len;
+    for (size_t b = 0; b < n_blocks; b++) {
+        for (int e = 0; e < function->blocks.data[b].n_succs; e++) {
+            int succ = function->blocks.data[b].succs[e];
+            // already split, by a JZ with both targets the same
+            if (succ >= (int)n_blocks) continue;
+            moves.len = 0;
+            for_each (&live_in[succ]) {
+                int x = piece_at(a, *it, a->to[b] - 1), y = piece_at(a, *it, a->from[succ]);
+                if (x != y && LOC(IV(y)->vreg)->kind != LOC_REMAT) {
+                    list_push(&moves, ((struct move){ IV(y)->vreg, IV(x)->vreg }));
+                }
+            }
+            ir_list_t seq = {};
+            sequentialize(a, &moves, &seq);
+            if (!seq.len) continue;
+
+            ir_list_t *instrs = &function->blocks.data[b].instrs;
+            if (list_last(instrs).op == JMP) {
+                struct ir_instr jmp = list_last(instrs);
+                instrs->len -= 1;
+                for_each (&seq) list_push(instrs, *it);
+                list_push(instrs, jmp);
+            } else if (function->blocks.data[succ].preds.len == 1) {
+                ir_list_t *target = &function->blocks.data[succ].instrs;
+                for_each (target) list_push(&seq, *it);
+                list_clear(target);
+                *target = seq;
+                continue;
+            } else {
+                int edge = split_edge(a->tu, function, (int)b, succ);
+                ir_list_t *target = &function->blocks.data[edge].instrs;
+                list_push(&seq, list_last(target));
+                list_clear(target);
+                *target = seq;
+                continue;
+            }
+            list_clear(&seq);
+        }
+    }
+
+    list_clear(&moves);
+    list_clear(&splits);
+    free(cursor);
+}
+
+void classify_registers(struct function *function, bool *is_float, bool *can_remat, struct ir_instr *remat, int *defs) {
+    size_t n_regs = function->regs.len;
+    // the class of each register from its definitions, or from its uses if
+    // it has none, like a parameter
+    bool *classified = calloc(n_regs, sizeof(bool));
+    for_each_n (block, &function->blocks) {
+        for_each_n (instr, &block->instrs) {
+            reg d = ir_def(instr);
+            if (!d) continue;
+            defs[d] += 1;
+            is_float[d] = def_is_float(instr);
+            classified[d] = true;
+            can_remat[d] = instr->op == IMM;
+            remat[d] = *instr;
+        }
+    }
+    for_each_n (block, &function->blocks) {
+        for_each_n (instr, &block->instrs) {
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                reg r = *ir_use(function, instr, u);
+                int f = use_is_float(instr, u);
+                if (classified[r] || f == -1) continue;
+                is_float[r] = f;
+                classified[r] = true;
+            }
+        }
+    }
+    for (size_t r = 0; r < n_regs; r++) can_remat[r] &= defs[r] == 1;
+    free(classified);
+}
+
+float *block_frequencies(struct function *function) {
+    size_t n_blocks = function->blocks.len;
+    compute_dominators(function);
+    struct loop_forest forest;
+    find_loops(function, &forest);
+    float *frequency = malloc(n_blocks * sizeof(float));
+    for (size_t b = 0; b < n_blocks; b++) {
+        int depth = loop_depth(&forest, (int)b);
+        frequency[b] = 1;
+        for (int d = 0; d < depth && d < MAX_WEIGHT_DEPTH; d++) frequency[b] *= 10;
+    }
+    free_loops(&forest);
+    return frequency;
+}
+
+void print_allocation(struct tu *tu, struct function *function, const char *method) {
+    struct allocation *result = function->allocation;
+    // every operand in a stack slot is a load or a store, in blocks that may
+    // have been added for the moves on edges
+    float *frequency = block_frequencies(function);
+    for (size_t b = 0; b < function->blocks.len; b++) {
+        for_each_n (instr, &function->blocks.data[b].instrs) {
+            int accesses = 0;
+            reg d = ir_def(instr);
+            if (is_allocated(function, d) && result->locations.data[d].kind == LOC_STACK) accesses += 1;
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                reg r = *ir_use(function, instr, u);
+                if (is_allocated(function, r) && result->locations.data[r].kind == LOC_STACK) accesses += 1;
+            }
+            result->spill_cost += (float)accesses * frequency[b];
+        }
+    }
+    free(frequency);
+
+    if (!result->splits && !result->spilled && !result->rematerialized && !result->coalesced) return;
+    fprintf(stderr, "allocated ");
+    print_token(tu, function->scope->token);
+    fprintf(stderr, " with %s: %i splits, %i spilled, %i rematerialized, %i moves coalesced, %i byte frame", method,
+            result->splits, result->spilled, result->rematerialized, result->coalesced, result->frame_size);
+    if (result->spill_cost) fprintf(stderr, ", spill cost %g", result->spill_cost);
+    fputc('\n', stderr);
+}
+
+void allocate_registers(struct tu *tu, struct function *function) {
+    leave_ssa(function);
+    remove_unreachable_blocks(function);
+
+    size_t n_regs = function->regs.len;
+    size_t n_blocks = function->blocks.len;
+    struct allocator a = { .tu = tu, .function = function };
+    a.result = calloc(1, sizeof(struct allocation));
+    a.first = malloc(n_regs * sizeof(int));
+    a.is_float = calloc(n_regs, sizeof(bool));
+    a.can_remat = calloc(n_regs, sizeof(bool));
+    a.remat = calloc(n_regs, sizeof(struct ir_instr));
+    a.slot = calloc(n_regs, sizeof(int));
+    for (size_t r = 0; r < n_regs; r++) a.first[r] = -1;
+
+    a.defs = calloc(n_regs, sizeof(int));
+    classify_registers(function, a.is_float, a.can_remat, a.remat, a.defs);
+    a.frequency = block_frequencies(function);
+
+    // loops come out of reverse postorder in one piece, so the intervals of
+    // the values used in one don't stretch over unrelated code
+    reverse_postorder(function, &a.order);
+    a.from = malloc(n_blocks * sizeof(int));
+    a.to = malloc(n_blocks * sizeof(int));
+    int pos = 0;
+    for_each (&a.order) {
+        a.from[*it] = pos;
+        pos += 2 * (int)function->blocks.data[*it].instrs.len;
+        a.to[*it] = pos;
+    }
+
+    reg_list_t *live_in = calloc(n_blocks, sizeof(reg_list_t));
+    reg_list_t *live_out = calloc(n_blocks, sizeof(reg_list_t));
+    compute_liveness(function, live_in, live_out);
+    build_intervals(&a, live_out);
+    linear_scan(&a);
+    // the variables that live in memory go at the top of the frame, then
+    // one slot for each spilled register
+    a.frame_size = layout_frame(tu, function);
+    rewrite(&a, live_in);
+    a.result->frame_size = (a.frame_size + 15) & ~15;
+    function->allocation = a.result;
+    print_allocation(tu, function, "linear scan");
+
+    for (size_t b = 0; b < n_blocks; b++) {
+        list_clear(&live_in[b]);
+        list_clear(&live_out[b]);
+    }
+    free(live_in);
+    free(live_out);
+    for_each (&a.intervals) {
+        list_clear(&it->ranges);
+        list_clear(&it->uses);
+    }
+    list_clear(&a.intervals);
+    list_clear(&a.order);
+    list_clear(&a.calls);
+    list_clear(&a.unhandled);
+    list_clear(&a.active);
+    list_clear(&a.inactive);
+    free(a.first);
+    free(a.is_float);
+    free(a.can_remat);
+    free(a.remat);
+    free(a.defs);
+    free(a.slot);
+    free(a.origin);
+    free(a.in_slot);
+    free(a.store_at_def);
+    free(a.frequency);
+    free(a.from);
+    free(a.to);
+}
+
+void free_allocation(struct allocation *allocation) {
+    list_clear(&allocation->locations);
+}
+
+void print_location(struct location *location) {
+    switch (location->kind) {
+    case LOC_REG:
+        fprintf(stderr, "%s", machine_reg_names[location->reg]);
+        break;
+    case LOC_STACK:
+        fprintf(stderr, "[rbp%+i]", location->offset);
+        break;
+    case LOC_REMAT:
+        fprintf(stderr, "imm");
+        break;
+    case LOC_NONE:
+        break;
+    }
+}
@@ -0,0 +1,119 @@
+#pragma once
+#ifndef COMPILER_REGALLOC_H
+#define COMPILER_REGALLOC_H
+
+#include "ir.h"
+
+struct tu;
+
+// The x86-64 registers, in encoding order within each class.
+enum machine_reg : char {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+    XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7,
+    XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15,
+    N_MACHINE_REGS,
+};
+
+// RAX, RCX, RDX and R11 are never allocated, so code generation always has
+// them free for division, shift counts, return values and memory operands,
+// and R11 and XMM15 hold a value while a cycle of moves is broken.
+#define SCRATCH_REG R11
+#define SCRATCH_FLOAT_REG XMM15
+
+extern const char *const machine_reg_names[N_MACHINE_REGS];
+// Whether the System V ABI lets a call overwrite a register.
+bool is_caller_saved(enum machine_reg r);
+
+enum location_kind : char {
+    // a function or global named by CALL, or a register nothing reads
+    LOC_NONE,
+    LOC_REG,
+    // a slot in the stack frame, at offset bytes from the frame pointer
+    LOC_STACK,
+    // a constant that is materialized wherever it is used instead of being
+    // kept anywhere, the IMM whose constant is in constant
+    LOC_REMAT,
+};
+
+struct location {
+    enum location_kind kind;
+    enum machine_reg reg;
+    int offset;
+    int constant;
+    // the width of the constant, which a float is materialized at
+    unsigned char width;
+    bool is_float;
+};
+
+// Where every register of a function lives after allocation. Each register
+// has one location for its whole life; the allocator splits a register that
+// moves between locations into one register per piece, joined by MOVEs.
+struct allocation {
+    // one entry per register of the function
+    list(struct location) locations;
+    // the bytes of stack below the frame pointer: the stack slot variables,
+    // then the spill slots, rounded up to 16
+    int frame_size;
+    // the callee-saved registers that are used, as a bitmask of machine_reg
+    uint32_t saved_regs;
+
+    // what the allocator did, for printing
+    int splits;
+    int spilled;
+    int rematerialized;
+    int coalesced;
+    // the operands in stack slots, each counted 10 times for every loop it
+    // is in: a guess at what the spills cost when the code runs
+    float spill_cost;
+};
+
+// Take a function out of SSA form and give every register a machine register
+// or a stack slot with linear scan, after Wimmer and Mössenböck: live
+// intervals with holes, split where a register is only free for part of one
+// and around calls, evictions chosen by spill weight, constants
+// rematerialized instead of spilled and moves coalesced through register
+// hints. Variables that live in memory get their frame_offset. Time is linear
+// in the size of the function times the number of registers.
+void allocate_registers(struct tu *tu, struct function *function);
+// The same with iterated register coalescing, after George and Appel: an
+// interference graph colored by simplifying, coalescing the two sides of
+// MOVEs that don't make it harder to color, and spilling whole registers
+// where it has to. Slower than linear scan, which splits instead, but it
+// removes more MOVEs and sees the whole function at once. Used at -O3.
+void color_registers(struct tu *tu, struct function *function);
+void free_allocation(struct allocation *allocation);
+void print_location(struct location *location);
+bool same_location(struct location *x, struct location *y);
+
+// For the allocators.
+
+// The registers an allocator can give a value of each class, those a call
+// preserves last.
+const enum machine_reg *allocatable_regs(bool is_float, int *n);
+// The register the ABI passes the nth int or float parameter in, which need
+// not be allocatable, or -1 past those.
+signed char param_register(bool is_float, int n);
+// Whether a register of the function holds a value, rather than naming a
+// function or global for CALL.
+bool is_allocated(struct function *function, reg r);
+bool def_is_float(struct ir_instr *i);
+// Whether operand n of an instruction is a float, or -1 if the instruction
+// doesn't say.
+int use_is_float(struct ir_instr *i, int n);
+// For each register: its class, the number of instructions defining it, and
+// whether its one definition is an IMM, which is copied into remat.
+void classify_registers(struct function *function, bool *is_float, bool *can_remat, struct ir_instr *remat, int *defs);
+// The registers live into and out of each block of a function out of SSA
+// form.
+void compute_liveness(struct function *function, reg_list_t *live_in, reg_list_t *live_out);
+// 10 to the loop depth of each block, in a new array.
+float *block_frequencies(struct function *function);
+// Give the variables that live in memory their frame_offset, and return the
+// bytes they take.
+int layout_frame(struct tu *tu, struct function *function);
+// Work out the spill cost of a finished allocation and print what the
+// allocator did.
+void print_allocation(struct tu *tu, struct function *function, const char *method);
+
+#endif //COMPILER_REGALLOC_H
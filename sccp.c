@@ -0,0 +1,407 @@
+#include "opt.h"
+#include "ir.h"
+#include "ssa.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Wegman and Zadeck, "Constant Propagation with Conditional Branches". Every
+// register starts out unknown and is only lowered, to a constant or to
+// varying, as the blocks that can execute are discovered. A branch on a
+// constant only makes one of its edges executable, so code that a constant
+// turns off never makes anything varying.
+
+enum lattice : char {
+    // no definition has been seen executing yet
+    UNKNOWN,
+    CONSTANT,
+    VARYING,
+};
+
+struct lattice_value {
+    enum lattice state;
+    bool is_float;
+    union {
+        uint64_t i;
+        double f;
+    };
+};
+
+struct sccp {
+    struct function *function;
+    struct lattice_value *values;
+    bool *executable;
+    // whether each CFG edge has executed, indexed by pred_start[block] plus
+    // the edge's position in the block's preds
+    bool *edge_executable;
+    int *pred_start;
+    // the instructions that read each register, as block and index pairs
+    int *use_start;
+    struct { int block; int index; } *uses;
+
+    list(struct { int from; int to; }) flow_work;
+    reg_list_t ssa_work;
+};
+
+// An integer as the instruction's width and signedness see it.
+static uint64_t normalize(uint64_t v, int width, bool is_signed) {
+    if (width <= 0 || width >= 8) return v;
+    int bits = width * 8;
+    uint64_t mask = (1ull << bits) - 1;
+    v &= mask;
+    if (is_signed && (v >> (bits - 1)) & 1) v |= ~mask;
+    return v;
+}
+
+static double round_float(double f, int width) {
+    return width == 4 ? (double)(float)f : f;
+}
+
+static struct lattice_value varying(void) {
+    return (struct lattice_value){ .state = VARYING };
+}
+
+static struct lattice_value int_value(struct ir_instr *i, uint64_t v) {
+    return (struct lattice_value){ .state = CONSTANT, .i = normalize(v, i->width, i->is_signed) };
+}
+
+static struct lattice_value float_value(struct ir_instr *i, double f) {
+    return (struct lattice_value){ .state = CONSTANT, .is_float = true, .f = round_float(f, i->width) };
+}
+
+static bool same_value(struct lattice_value a, struct lattice_value b) {
+    if (a.state != b.state) return false;
+    if (a.state != CONSTANT) return true;
+    // compare bits, so 0.0 and -0.0 stay apart and NaN equals itself
+    return a.is_float == b.is_float && a.i == b.i;
+}
+
+static struct lattice_value meet(struct lattice_value a, struct lattice_value b) {
+    if (a.state == UNKNOWN) return b;
+    if (b.state == UNKNOWN) return a;
+    if (a.state == VARYING || b.state == VARYING || !same_value(a, b)) return varying();
+    return a;
+}
+
+static void set_value(struct sccp *s, reg r, struct lattice_value v) {
+    struct lattice_value *old = &s->values[r];
+    v = meet(*old, v);
+    if (same_value(*old, v)) return;
+    *old = v;
+    list_push(&s->ssa_work, r);
+}
+
+static bool compare(enum ir_cond cond, struct ir_instr *i, struct lattice_value a, struct lattice_value b) {
+    if (i->is_float) {
+        switch (cond) {
+        case COND_EQ: return a.f == b.f;
+        case COND_NE: return a.f != b.f;
+        case COND_LT: return a.f < b.f;
+        case COND_LE: return a.f <= b.f;
+        case COND_GT: return a.f > b.f;
+        case COND_GE: return a.f >= b.f;
+        }
+    }
+    uint64_t x = normalize(a.i, i->width, i->is_signed);
+    uint64_t y = normalize(b.i, i->width, i->is_signed);
+    if (cond == COND_EQ) return x == y;
+    if (cond == COND_NE) return x != y;
+    bool lt = i->is_signed ? (int64_t)x < (int64_t)y : x < y;
+    bool gt = i->is_signed ? (int64_t)x > (int64_t)y : x > y;
+    switch (cond) {
+    case COND_LT: return lt;
+    case COND_LE: return !gt;
+    case COND_GT: return gt;
+    case COND_GE: return !lt;
+    default: return false;
+    }
+}
+
+// The value an instruction computes from the values of its operands. Anything
+// that reads memory or calls out is varying, as is anything that would trap
+// or is undefined when folded.
+static struct lattice_value evaluate(struct sccp *s, struct ir_instr *i) {
+    switch (i->op) {
+    case IMM: {
+        struct ir_constant *c = &s->function->constants.data[i->r[1]];
+        return i->is_float ? float_value(i, c->f) : int_value(i, c->i);
+    }
+    case LD:
+    case ADDR:
+    case CALL:
+        return varying();
+    default:
+        break;
+    }
+
+    struct lattice_value a = {}, b = {};
+    int n = ir_use_count(s->function, i);
+    if (n >= 1) a = s->values[*ir_use(s->function, i, 0)];
+    if (n >= 2) b = s->values[*ir_use(s->function, i, 1)];
+    if (a.state == VARYING || b.state == VARYING) return varying();
+    if (a.state == UNKNOWN || (n >= 2 && b.state == UNKNOWN)) return (struct lattice_value){};
+
+    int bits = i->width * 8;
+    uint64_t x = normalize(a.i, i->width, i->is_signed);
+    uint64_t y = normalize(b.i, i->width, i->is_signed);
+
+    switch (i->op) {
+    case MOVE:
+        return a.is_float ? a : int_value(i, a.i);
+    case TEST:
+        return (struct lattice_value){ .state = CONSTANT, .i = compare(i->cond, i, a, b) };
+    case EXT:
+        return int_value(i, normalize(a.i, i->from_width, i->is_signed));
+    case ITOF:
+        return float_value(i, i->is_signed ? (double)(int64_t)normalize(a.i, i->from_width, true)
+                                           : (double)normalize(a.i, i->from_width, false));
+    case FTOI:
+        if (!isfinite(a.f) || fabs(a.f) >= 0x1p63) return varying();
+        return int_value(i, (uint64_t)(int64_t)a.f);
+    case FTOF:
+        return float_value(i, a.f);
+    default:
+        break;
+    }
+
+    if (i->is_float) {
+        switch (i->op) {
+        case ADD: return float_value(i, a.f + b.f);
+        case SUB: return float_value(i, a.f - b.f);
+        case MUL: return float_value(i, a.f * b.f);
+        case DIV: return float_value(i, a.f / b.f);
+        case NEG: return float_value(i, -a.f);
+        case NOT: return (struct lattice_value){ .state = CONSTANT, .i = a.f == 0 };
+        default: return varying();
+        }
+    }
+
+    switch (i->op) {
+    case ADD: return int_value(i, x + y);
+    case SUB: return int_value(i, x - y);
+    case MUL: return int_value(i, x * y);
+    case AND: return int_value(i, x & y);
+    case OR: return int_value(i, x | y);
+    case XOR: return int_value(i, x ^ y);
+    case NEG: return int_value(i, -x);
+    case INV: return int_value(i, ~x);
+    case NOT: return int_value(i, x == 0);
+    case DIV:
+    case MOD:
+        if (y == 0) return varying();
+        if (i->is_signed) {
+            // the one quotient that overflows, which traps on most machines
+            if (x == normalize(1ull << (bits - 1), i->width, true) && (int64_t)y == -1) return varying();
+            return int_value(i, i->op == DIV ? (uint64_t)((int64_t)x / (int64_t)y) : (uint64_t)((int64_t)x % (int64_t)y));
+        }
+        return int_value(i, i->op == DIV ? x / y : x % y);
+    case SHL:
+    case SHR:
+        if (y >= (uint64_t)bits) return varying();
+        if (i->op == SHL) return int_value(i, x << y);
+        return int_value(i, i->is_signed ? (uint64_t)((int64_t)x >> y) : x >> y);
+    default:
+        return varying();
+    }
+}
+
+static void add_edge(struct sccp *s, int from, int to) {
+    list_push(&s->flow_work, ((typeof(*s->flow_work.data)){ from, to }));
+}
+
+static void visit(struct sccp *s, int b, struct ir_instr *i) {
+    struct function *function = s->function;
+    struct ir_block *block = &function->blocks.data[b];
+
+    switch (i->op) {
+    case PHI: {
+        struct lattice_value v = {};
+        for (size_t p = 0; p < block->preds.len; p++) {
+            if (s->edge_executable[s->pred_start[b] + p]) v = meet(v, s->values[*ir_use(function, i, (int)p)]);
+        }
+        set_value(s, i->r[0], v);
+        return;
+    }
+    case JMP:
+        add_edge(s, b, (int)i->r[0]);
+        return;
+    case JZ: {
+        struct lattice_value cond = s->values[i->r[0]];
+        if (cond.state == VARYING) {
+            add_edge(s, b, (int)i->r[1]);
+            add_edge(s, b, (int)i->r[2]);
+        } else if (cond.state == CONSTANT) {
+            bool zero = i->is_float ? cond.f == 0 : normalize(cond.i, i->width, i->is_signed) == 0;
+            add_edge(s, b, (int)(zero ? i->r[1] : i->r[2]));
+        }
+        return;
+    }
+    default:
+        break;
+    }
+
+    reg d = ir_def(i);
+    if (d) set_value(s, d, evaluate(s, i));
+}
+
+static void propagate(struct sccp *s) {
+    struct function *function = s->function;
+    add_edge(s, -1, 0);
+
+    while (s->flow_work.len || s->ssa_work.len) {
+        while (s->flow_work.len) {
+            typeof(*s->flow_work.data) edge = s->flow_work.data[--s->flow_work.len];
+            struct ir_block *block = &function->blocks.data[edge.to];
+            if (edge.from >= 0) {
+                size_t p = 0;
+                while (block->preds.data[p] != edge.from) p++;
+                if (s->edge_executable[s->pred_start[edge.to] + p]) continue;
+                s->edge_executable[s->pred_start[edge.to] + p] = true;
+            }
+
+            // a block is visited in full the first time it executes; after
+            // that only its PHIs can see anything new
+            bool first = !s->executable[edge.to];
+            s->executable[edge.to] = true;
+            for_each_n (instr, &block->instrs) {
+                if (!first && instr->op != PHI) break;
+                visit(s, edge.to, instr);
+            }
+        }
+
+        while (s->ssa_work.len) {
+            reg r = s->ssa_work.data[--s->ssa_work.len];
+            for (int u = s->use_start[r]; u < s->use_start[r + 1]; u++) {
+                int b = s->uses[u].block;
+                if (s->executable[b]) visit(s, b, &function->blocks.data[b].instrs.data[s->uses[u].index]);
+            }
+        }
+    }
+}
+
+static void find_uses(struct sccp *s) {
+    struct function *function = s->function;
+    size_t n_regs = function->regs.len;
+    s->use_start = calloc(n_regs + 2, sizeof(int));
+    for_each_n (block, &function->blocks) {
+        for_each_n (instr, &block->instrs) {
+            for (int u = 0; u < ir_use_count(function, instr); u++) s->use_start[*ir_use(function, instr, u) + 2] += 1;
+        }
+    }
+    for (size_t r = 1; r <= n_regs + 1; r++) s->use_start[r] += s->use_start[r - 1];
+    s->uses = malloc((s->use_start[n_regs + 1] + 1) * sizeof(*s->uses));
+    for (int b = 0; b < (int)function->blocks.len; b++) {
+        struct ir_block *block = &function->blocks.data[b];
+        for (int n = 0; n < (int)block->instrs.len; n++) {
+            struct ir_instr *instr = &block->instrs.data[n];
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                int slot = s->use_start[*ir_use(function, instr, u) + 1]++;
+                s->uses[slot].block = b;
+                s->uses[slot].index = n;
+            }
+        }
+    }
+}
+
+// Replace what turned out to be constant, make branches on constants
+// unconditional and delete the blocks that never execute.
+static struct pass_stats rewrite(struct sccp *s) {
+    struct function *function = s->function;
+    struct pass_stats stats = {};
+
+    for (int b = 0; b < (int)function->blocks.len; b++) {
+        struct ir_block *block = &function->blocks.data[b];
+        if (!s->executable[b]) {
+            stats.instrs_removed += (int)block->instrs.len;
+            continue;
+        }
+
+        // PHIs have to stay together at the start of the block, so constant
+        // ones turn into IMMs placed after them
+        size_t n_phis = 0;
+        while (n_phis < block->instrs.len && block->instrs.data[n_phis].op == PHI) n_phis++;
+        // read from a copy, since the first loop writes over PHIs the second
+        // has yet to read
+        struct ir_instr *phis = malloc(n_phis * sizeof(struct ir_instr) + 1);
+        memcpy(phis, block->instrs.data, n_phis * sizeof(struct ir_instr));
+        size_t kept = 0;
+        for (size_t n = 0; n < n_phis; n++) {
+            if (s->values[phis[n].r[0]].state != CONSTANT) block->instrs.data[kept++] = phis[n];
+        }
+        for (size_t n = 0; n < n_phis; n++) {
+            if (s->values[phis[n].r[0]].state == CONSTANT) block->instrs.data[kept++] = phis[n];
+        }
+        free(phis);
+
+        for_each_n (instr, &block->instrs) {
+            reg d = ir_def(instr);
+            if (d && instr->op != IMM && s->values[d].state == CONSTANT) {
+                struct lattice_value v = s->values[d];
+                struct ir_instr folded = v.is_float ? ir_fimm(function, v.f, d) : ir_imm(function, v.i, d);
+                folded.width = instr->width;
+                folded.is_signed = instr->is_signed;
+                folded.is_float = instr->is_float;
+                if (instr->op == TEST) {
+                    folded.width = 4;
+                    folded.is_signed = true;
+                    folded.is_float = false;
+                }
+                *instr = folded;
+                stats.folded += 1;
+            }
+        }
+
+        struct ir_instr *last = &list_last(&block->instrs);
+        if (last->op == JZ && s->values[last->r[0]].state == CONSTANT) {
+            struct lattice_value cond = s->values[last->r[0]];
+            bool zero = last->is_float ? cond.f == 0 : normalize(cond.i, last->width, last->is_signed) == 0;
+            int taken = (int)(zero ? last->r[1] : last->r[2]);
+            int not_taken = (int)(zero ? last->r[2] : last->r[1]);
+            if (taken != not_taken) remove_edge(function, b, not_taken);
+            *last = ir_jmp(taken);
+            stats.folded += 1;
+        }
+    }
+
+    stats.blocks_removed = remove_unreachable_blocks(function);
+    return stats;
+}
+
+struct pass_stats sccp(struct tu *tu, struct function *function) {
+    struct sccp s = { .function = function };
+    size_t n_blocks = function->blocks.len;
+
+    s.values = calloc(function->regs.len, sizeof(struct lattice_value));
+    s.executable = calloc(n_blocks, sizeof(bool));
+    s.pred_start = calloc(n_blocks + 1, sizeof(int));
+    for (size_t b = 0; b < n_blocks; b++) s.pred_start[b + 1] = s.pred_start[b] + (int)function->blocks.data[b].preds.len;
+    s.edge_executable = calloc(s.pred_start[n_blocks] + 1, sizeof(bool));
+
+    // Parameters and registers nothing defines, like a variable read before
+    // it is assigned, can hold anything.
+    bool *defined = calloc(function->regs.len, sizeof(bool));
+    for_each_n (block, &function->blocks) {
+        for_each_n (instr, &block->instrs) defined[ir_def(instr)] = true;
+    }
+    for (size_t r = 1; r < function->regs.len; r++) {
+        if (!defined[r]) s.values[r] = varying();
+    }
+    for_each (&function->params) s.values[*it] = varying();
+    free(defined);
+
+    find_uses(&s);
+    propagate(&s);
+    struct pass_stats stats = rewrite(&s);
+    if (stats.blocks_removed) compute_dominators(function);
+
+    list_clear(&s.flow_work);
+    list_clear(&s.ssa_work);
+    free(s.values);
+    free(s.executable);
+    free(s.pred_start);
+    free(s.edge_executable);
+    free(s.use_start);
+    free(s.uses);
+    return stats;
+}
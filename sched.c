@@ -0,0 +1,822 @@
+#include "sched.h"
+#include "x86.h"
+#include "ir.h"
+#include "opt.h"
+#include "regalloc.h"
+#include "token.h"
+#include "tu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// List scheduling, once over the IR of each block before registers are
+// allocated and once over the machine code after. A block is cut into regions
+// at calls, which stay where they are, and each region's instructions are
+// nodes of a graph of what has to come before what: the instruction that
+// computes a value before those that read it, stores in order with the loads
+// and stores that may touch the same memory, and after allocation, any reuse
+// of a machine register after the reads of what it held. Going one cycle at a
+// time, the scheduler issues the ready node with the longest path to the end
+// of the region, as many each cycle as the machine model has room for. Before
+// allocation that path only decides while the values live fit in the
+// registers; past that the node that frees the most goes first, since a spill
+// costs more than the latency it hides. A region keeps the new order only if
+// the model says it is faster, or needs fewer registers than there are.
+
+// The kinds of execution unit of the model. An instruction that reads memory
+// and does something with it is modeled as the something, after the load.
+enum unit_class : char {
+    U_ALU,
+    U_MUL,
+    U_DIV,
+    U_LOAD,
+    U_STORE,
+    U_FADD,
+    U_FMUL,
+    U_FDIV,
+    U_CONVERT,
+    N_UNIT_CLASSES,
+};
+
+#define MAX_UNITS 4
+
+struct unit {
+    // cycles until the result can be used
+    unsigned char latency;
+    // how many of the kind there are, each taking a new instruction every
+    // interval cycles
+    unsigned char count;
+    unsigned char interval;
+};
+
+struct machine_model {
+    const char *name;
+    // instructions issued each cycle
+    int width;
+    struct unit units[N_UNIT_CLASSES];
+};
+
+// Rounded from published measurements, for 32 bit division and double
+// precision floats. Generic is the worst of the others, so code tuned for it
+// isn't much worse on any of them.
+static const struct machine_model models[N_TUNES] = {
+    [TUNE_GENERIC] = { "generic", 4, {
+        [U_ALU] = { 1, 3, 1 }, [U_MUL] = { 3, 1, 1 }, [U_DIV] = { 26, 1, 9 },
+        [U_LOAD] = { 5, 2, 1 }, [U_STORE] = { 1, 1, 1 },
+        [U_FADD] = { 4, 1, 1 }, [U_FMUL] = { 5, 1, 1 }, [U_FDIV] = { 14, 1, 8 },
+        [U_CONVERT] = { 6, 1, 1 },
+    } },
+    [TUNE_HASWELL] = { "haswell", 4, {
+        [U_ALU] = { 1, 4, 1 }, [U_MUL] = { 3, 1, 1 }, [U_DIV] = { 22, 1, 9 },
+        [U_LOAD] = { 5, 2, 1 }, [U_STORE] = { 1, 1, 1 },
+        [U_FADD] = { 3, 1, 1 }, [U_FMUL] = { 5, 2, 1 }, [U_FDIV] = { 14, 1, 8 },
+        [U_CONVERT] = { 4, 1, 1 },
+    } },
+    [TUNE_SKYLAKE] = { "skylake", 4, {
+        [U_ALU] = { 1, 4, 1 }, [U_MUL] = { 3, 1, 1 }, [U_DIV] = { 26, 1, 6 },
+        [U_LOAD] = { 5, 2, 1 }, [U_STORE] = { 1, 1, 1 },
+        [U_FADD] = { 4, 2, 1 }, [U_FMUL] = { 4, 2, 1 }, [U_FDIV] = { 14, 1, 4 },
+        [U_CONVERT] = { 5, 1, 1 },
+    } },
+    [TUNE_ZNVER2] = { "znver2", 5, {
+        [U_ALU] = { 1, 4, 1 }, [U_MUL] = { 3, 1, 1 }, [U_DIV] = { 18, 1, 14 },
+        [U_LOAD] = { 4, 2, 1 }, [U_STORE] = { 1, 1, 1 },
+        [U_FADD] = { 3, 2, 1 }, [U_FMUL] = { 3, 2, 1 }, [U_FDIV] = { 13, 1, 5 },
+        [U_CONVERT] = { 5, 1, 1 },
+    } },
+    [TUNE_ZNVER3] = { "znver3", 6, {
+        [U_ALU] = { 1, 4, 1 }, [U_MUL] = { 3, 1, 1 }, [U_DIV] = { 10, 1, 6 },
+        [U_LOAD] = { 4, 3, 1 }, [U_STORE] = { 1, 2, 1 },
+        [U_FADD] = { 3, 2, 1 }, [U_FMUL] = { 3, 2, 1 }, [U_FDIV] = { 13, 1, 5 },
+        [U_CONVERT] = { 4, 1, 1 },
+    } },
+};
+
+int find_tune(const char *name) {
+    for (int t = 0; t < N_TUNES; t++) {
+        if (!strcmp(models[t].name, name)) return t;
+    }
+    return -1;
+}
+
+const char *tune_name(enum tune tune) {
+    return models[tune].name;
+}
+
+// A region is at most this long, so the nodes each one comes after fit in a
+// bitmask. A longer stretch is cut into several.
+#define MAX_REGION 64
+
+struct region {
+    int n;
+    enum unit_class unit[MAX_REGION];
+    unsigned char latency[MAX_REGION];
+    // the nodes each has to come after, and of those, the ones whose results
+    // it has to wait for
+    uint64_t after[MAX_REGION];
+    uint64_t waits[MAX_REGION];
+};
+
+// The values a region reads and writes before allocation, for keeping track
+// of how many are live.
+#define MAX_VALUES (4 * MAX_REGION)
+
+struct pressure {
+    int n_values;
+    // of each value: how many reads of it the region has, how many of those
+    // are still to come while scheduling, and whether it is still live after
+    // the region
+    int reads[MAX_VALUES];
+    int left[MAX_VALUES];
+    bool lives_on[MAX_VALUES];
+    bool is_float[MAX_VALUES];
+    // of each node: the values it reads and the one it writes, -1 for none
+    short uses[MAX_REGION][3];
+    short def[MAX_REGION];
+    // the values of each class live at the start of the region and now, and
+    // the registers there are for them
+    int start[2];
+    int live[2];
+    int limit[2];
+};
+
+static uint64_t bit(int n) {
+    return 1ull << n;
+}
+
+// Node i starts in a cycle: the nodes after it can't start before it, or
+// before its result is ready if they wait for it.
+static void release(struct region *g, int i, int cycle, int *earliest) {
+    for (int j = i + 1; j < g->n; j++) {
+        if (!(g->after[j] & bit(i))) continue;
+        int t = cycle + ((g->waits[j] & bit(i)) ? g->latency[i] : 0);
+        if (t > earliest[j]) earliest[j] = t;
+    }
+}
+
+// A unit of a kind that can take an instruction in a cycle, or -1.
+static int free_unit(const struct machine_model *model, int (*free_at)[MAX_UNITS], enum unit_class u, int cycle) {
+    for (int k = 0; k < model->units[u].count && k < MAX_UNITS; k++) {
+        if (free_at[u][k] <= cycle) return k;
+    }
+    return -1;
+}
+
+static void reset_pressure(struct pressure *p) {
+    for (int v = 0; v < p->n_values; v++) p->left[v] = p->reads[v];
+    p->live[0] = p->start[0];
+    p->live[1] = p->start[1];
+}
+
+// How many more values of each class are live after node i than before.
+static void pressure_delta(struct pressure *p, int i, int delta[2]) {
+    delta[0] = delta[1] = 0;
+    for (int u = 0; u < 3; u++) {
+        int v = p->uses[i][u];
+        if (v < 0) continue;
+        int reads = 0;
+        for (int w = 0; w < 3; w++) reads += p->uses[i][w] == v;
+        // count each value once, at its first slot
+        bool first = true;
+        for (int w = 0; w < u; w++) first &= p->uses[i][w] != v;
+        if (first && p->left[v] == reads && !p->lives_on[v]) delta[p->is_float[v]] -= 1;
+    }
+    int d = p->def[i];
+    if (d >= 0 && (p->left[d] > 0 || p->lives_on[d])) delta[p->is_float[d]] += 1;
+}
+
+static void commit_pressure(struct pressure *p, int i) {
+    int delta[2];
+    pressure_delta(p, i, delta);
+    for (int u = 0; u < 3; u++) {
+        if (p->uses[i][u] >= 0) p->left[p->uses[i][u]] -= 1;
+    }
+    p->live[0] += delta[0];
+    p->live[1] += delta[1];
+}
+
+// How far past the registers there are the values live in an order go, added
+// over the classes.
+static int excess(struct pressure *p, struct region *g, const int *order) {
+    reset_pressure(p);
+    int peak[2] = { p->live[0], p->live[1] };
+    for (int k = 0; k < g->n; k++) {
+        commit_pressure(p, order[k]);
+        for (int c = 0; c < 2; c++) {
+            if (p->live[c] > peak[c]) peak[c] = p->live[c];
+        }
+    }
+    int over = 0;
+    for (int c = 0; c < 2; c++) {
+        if (peak[c] > p->limit[c]) over += peak[c] - p->limit[c];
+    }
+    return over;
+}
+
+// The cycles an order takes to finish, issued in order.
+static int simulate(const struct machine_model *model, struct region *g, const int *order) {
+    int earliest[MAX_REGION] = {};
+    int free_at[N_UNIT_CLASSES][MAX_UNITS] = {};
+    int cycle = 0, issued = 0, end = 0;
+    for (int k = 0; k < g->n; k++) {
+        int i = order[k];
+        if (earliest[i] > cycle) {
+            cycle = earliest[i];
+            issued = 0;
+        }
+        int unit;
+        while (issued >= model->width || (unit = free_unit(model, free_at, g->unit[i], cycle)) < 0) {
+            cycle += 1;
+            issued = 0;
+        }
+        release(g, i, cycle, earliest);
+        free_at[g->unit[i]][unit] = cycle + model->units[g->unit[i]].interval;
+        issued += 1;
+        if (cycle + g->latency[i] > end) end = cycle + g->latency[i];
+    }
+    return end;
+}
+
+// Top down, a cycle at a time. A node is ready once everything it comes
+// after is issued, and can issue once what it waits for is done and a unit
+// is free; of those that can, the one with the longest path to the end goes
+// first. With pressure, and more values live than there are registers for,
+// the ready node that frees the most goes first instead, however long it
+// has to wait.
+static void list_schedule(const struct machine_model *model, struct region *g, struct pressure *p, int *order) {
+    int height[MAX_REGION], earliest[MAX_REGION] = {};
+    for (int i = g->n - 1; i >= 0; i--) {
+        height[i] = g->latency[i];
+        for (int j = i + 1; j < g->n; j++) {
+            if (!(g->after[j] & bit(i))) continue;
+            int h = ((g->waits[j] & bit(i)) ? g->latency[i] : 0) + height[j];
+            if (h > height[i]) height[i] = h;
+        }
+    }
+    if (p) reset_pressure(p);
+
+    int free_at[N_UNIT_CLASSES][MAX_UNITS] = {};
+    uint64_t done = 0;
+    int cycle = 0, issued = 0;
+    for (int k = 0; k < g->n;) {
+        bool crowded = p && (p->live[0] >= p->limit[0] || p->live[1] >= p->limit[1]);
+        int best = -1, best_freed = 0;
+        bool best_now = false;
+        for (int i = 0; i < g->n; i++) {
+            if ((done & bit(i)) || (g->after[i] & ~done)) continue;
+            bool now = earliest[i] <= cycle && issued < model->width &&
+                       free_unit(model, free_at, g->unit[i], cycle) >= 0;
+            if (!crowded && !now) continue;
+            int freed = 0;
+            if (crowded) {
+                int delta[2];
+                pressure_delta(p, i, delta);
+                for (int c = 0; c < 2; c++) {
+                    if (p->live[c] >= p->limit[c]) freed -= delta[c];
+                }
+            }
+            bool better = best < 0 || freed > best_freed ||
+                          (freed == best_freed && (now > best_now || (now == best_now && height[i] > height[best])));
+            if (better) {
+                best = i;
+                best_freed = freed;
+                best_now = now;
+            }
+        }
+        if (best < 0) {
+            cycle += 1;
+            issued = 0;
+            continue;
+        }
+
+        if (earliest[best] > cycle) {
+            cycle = earliest[best];
+            issued = 0;
+        }
+        int unit;
+        while (issued >= model->width || (unit = free_unit(model, free_at, g->unit[best], cycle)) < 0) {
+            cycle += 1;
+            issued = 0;
+        }
+        release(g, best, cycle, earliest);
+        free_at[g->unit[best]][unit] = cycle + model->units[g->unit[best]].interval;
+        issued += 1;
+        done |= bit(best);
+        if (p) commit_pressure(p, best);
+        order[k++] = best;
+    }
+}
+
+// What the schedulers of a function changed, for printing.
+struct sched_stats {
+    int regions;
+    int reordered;
+    int cycles_before;
+    int cycles_after;
+    int excess_before;
+    int excess_after;
+};
+
+static void print_stats(struct tu *tu, struct function *function, struct sched_stats *stats, const char *when) {
+    if (!stats->reordered) return;
+    fprintf(stderr, "scheduled ");
+    print_token(tu, function->scope->token);
+    fprintf(stderr, " %s for %s: %i of %i regions, %i -> %i cycles", when, tune_name(tu->tune), stats->reordered,
+            stats->regions, stats->cycles_before, stats->cycles_after);
+    if (stats->excess_before != stats->excess_after) {
+        fprintf(stderr, ", %i -> %i values over the registers", stats->excess_before, stats->excess_after);
+    }
+    fprintf(stderr, "\n");
+}
+
+// Schedule a region, and whether its order is better than the one it had: it
+// needs fewer registers than there are, or the same and is faster.
+static bool reorder(const struct machine_model *model, struct region *g, struct pressure *p, int *order,
+                    struct sched_stats *stats) {
+    int original[MAX_REGION];
+    for (int i = 0; i < g->n; i++) original[i] = i;
+    list_schedule(model, g, p, order);
+    int cycles_before = simulate(model, g, original), cycles_after = simulate(model, g, order);
+    int excess_before = p ? excess(p, g, original) : 0, excess_after = p ? excess(p, g, order) : 0;
+    bool changed = false;
+    for (int i = 0; i < g->n; i++) changed |= order[i] != i;
+    bool better = changed && (excess_after < excess_before || (excess_after == excess_before && cycles_after < cycles_before));
+
+    stats->regions += 1;
+    stats->cycles_before += cycles_before;
+    stats->excess_before += excess_before;
+    stats->cycles_after += better ? cycles_after : cycles_before;
+    stats->excess_after += better ? excess_after : excess_before;
+    if (better) stats->reordered += 1;
+    return better;
+}
+
+// Before allocation.
+
+struct ir_scheduler {
+    struct function *function;
+    const struct machine_model *model;
+    struct alias_info aliases;
+    // per register: its class, and how many instructions define it
+    bool *is_float;
+    int *defs;
+    // per register: whether it is live out of the block being scheduled, and
+    // for the liveness at each instruction, whether it is live there
+    int *out_mark;
+    int *live_mark;
+    int block_mark;
+    // per register: how many reads of it the block has from where the
+    // scheduler has got to on
+    int *later;
+    // per register: the node of the region being built that defines it, and
+    // for a register defined more than once, the last node that touches it,
+    // or stale if their region isn't this one; and the value it is for the
+    // region's pressure
+    int *def_node;
+    int *def_region;
+    int *touch_node;
+    int *touch_region;
+    int *value;
+    int *value_region;
+    int region;
+    struct sched_stats stats;
+};
+
+static enum unit_class ir_unit(struct ir_instr *i) {
+    switch (i->op) {
+    case ADD:
+    case SUB:
+    case TEST:
+        return i->is_float ? U_FADD : U_ALU;
+    case MUL:
+        return i->is_float ? U_FMUL : U_MUL;
+    case DIV:
+    case MOD:
+        return i->is_float ? U_FDIV : U_DIV;
+    case LD:
+        return U_LOAD;
+    case ST:
+        return U_STORE;
+    case ITOF:
+    case FTOI:
+    case FTOF:
+        return U_CONVERT;
+    default:
+        return U_ALU;
+    }
+}
+
+// The register an access to memory goes through, and how wide it is.
+static reg ir_address(struct ir_instr *i, int *width) {
+    *width = i->width;
+    if (i->op == LD) return i->r[1];
+    if (i->op == ST) return i->r[0];
+    return 0;
+}
+
+static bool is_division(struct ir_instr *i) {
+    return (i->op == DIV || i->op == MOD) && !i->is_float;
+}
+
+// The index of a register among the values of a region's pressure.
+static int pressure_value(struct ir_scheduler *s, struct pressure *p, reg r) {
+    if (!is_allocated(s->function, r)) return -1;
+    if (s->value_region[r] == s->region) return s->value[r];
+    if (p->n_values >= MAX_VALUES) return -1;
+    int v = p->n_values++;
+    s->value_region[r] = s->region;
+    s->value[r] = v;
+    p->reads[v] = 0;
+    p->is_float[v] = s->is_float[r];
+    p->lives_on[v] = s->out_mark[r] == s->block_mark;
+    return v;
+}
+
+static void schedule_ir_region(struct ir_scheduler *s, struct ir_instr *instrs, int n, const int live[2]) {
+    struct function *function = s->function;
+    struct region g = { .n = n };
+    struct pressure p = { .start = { live[0], live[1] } };
+    allocatable_regs(false, &p.limit[0]);
+    allocatable_regs(true, &p.limit[1]);
+    s->region += 1;
+
+    for (int i = 0; i < n; i++) {
+        struct ir_instr *instr = &instrs[i];
+        g.unit[i] = ir_unit(instr);
+        g.latency[i] = s->model->units[g.unit[i]].latency;
+        p.uses[i][0] = p.uses[i][1] = p.uses[i][2] = -1;
+        p.def[i] = -1;
+
+        for (int u = 0; u < ir_use_count(function, instr); u++) {
+            reg r = *ir_use(function, instr, u);
+            if (!r) continue;
+            if (s->def_region[r] == s->region) {
+                g.after[i] |= bit(s->def_node[r]);
+                g.waits[i] |= bit(s->def_node[r]);
+            }
+            if (s->defs[r] > 1) {
+                if (s->touch_region[r] == s->region) g.after[i] |= bit(s->touch_node[r]);
+                s->touch_region[r] = s->region;
+                s->touch_node[r] = i;
+            }
+            int v = u < 3 ? pressure_value(s, &p, r) : -1;
+            if (v < 0) continue;
+            p.uses[i][u] = (short)v;
+            p.reads[v] += 1;
+        }
+        reg d = ir_def(instr);
+        if (d) {
+            if (s->defs[d] > 1) {
+                if (s->touch_region[d] == s->region) g.after[i] |= bit(s->touch_node[d]);
+                s->touch_region[d] = s->region;
+                s->touch_node[d] = i;
+            }
+            s->def_region[d] = s->region;
+            s->def_node[d] = i;
+            p.def[i] = (short)pressure_value(s, &p, d);
+        }
+
+        // stores stay in order with the loads and stores that may touch the
+        // same memory, and with divisions, which can trap
+        int width;
+        reg address = ir_address(instr, &width);
+        if (!address && !is_division(instr)) continue;
+        for (int j = 0; j < i; j++) {
+            int other_width;
+            reg other = ir_address(&instrs[j], &other_width);
+            bool store = instr->op == ST, other_store = instrs[j].op == ST;
+            if (!store && !other_store) continue;
+            if (address && other && !may_alias(&s->aliases, address, width, other, other_width)) continue;
+            if (!other && !is_division(&instrs[j])) continue;
+            if (!address && !other) continue;
+            g.after[i] |= bit(j);
+            if (other_store && instr->op == LD) g.waits[i] |= bit(j);
+        }
+    }
+    // a value lives on if the block reads it again after the region
+    for (int i = 0; i < n; i++) {
+        for (int u = 0; u < ir_use_count(function, &instrs[i]) && u < 3; u++) {
+            reg r = *ir_use(function, &instrs[i], u);
+            int v = p.uses[i][u];
+            if (v >= 0 && s->later[r] > p.reads[v]) p.lives_on[v] = true;
+        }
+        reg d = ir_def(&instrs[i]);
+        if (p.def[i] >= 0 && s->later[d] > p.reads[p.def[i]]) p.lives_on[p.def[i]] = true;
+    }
+
+    int order[MAX_REGION];
+    if (reorder(s->model, &g, &p, order, &s->stats)) {
+        struct ir_instr copy[MAX_REGION];
+        memcpy(copy, instrs, (size_t)n * sizeof(struct ir_instr));
+        for (int k = 0; k < n; k++) instrs[k] = copy[order[k]];
+    }
+}
+
+// Count an instruction's reads as behind the scheduler.
+static void pass(struct ir_scheduler *s, struct ir_instr *instr) {
+    for (int u = 0; u < ir_use_count(s->function, instr); u++) {
+        reg r = *ir_use(s->function, instr, u);
+        if (r) s->later[r] -= 1;
+    }
+}
+
+static void schedule_ir_block(struct ir_scheduler *s, int b, reg_list_t *live_out) {
+    struct function *function = s->function;
+    struct ir_block *block = &function->blocks.data[b];
+    int n = (int)block->instrs.len;
+    struct ir_instr *instrs = block->instrs.data;
+    s->block_mark = b + 1;
+
+    // the values of each class live before each instruction, going back from
+    // those live out of the block; a PHI's operands are read on the edges
+    // into it, not in it
+    int (*live)[2] = malloc((size_t)(n + 1) * sizeof(*live));
+    int count[2] = {};
+    for_each (live_out) {
+        s->out_mark[*it] = s->block_mark;
+        s->live_mark[*it] = s->block_mark;
+        count[s->is_float[*it]] += 1;
+    }
+    for (int k = n - 1; k >= 0; k--) {
+        struct ir_instr *instr = &instrs[k];
+        reg d = ir_def(instr);
+        if (d && s->live_mark[d] == s->block_mark) {
+            s->live_mark[d] = 0;
+            count[s->is_float[d]] -= 1;
+        }
+        if (instr->op != PHI) {
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                reg r = *ir_use(function, instr, u);
+                if (!r) continue;
+                s->later[r] += 1;
+                if (!is_allocated(function, r) || s->live_mark[r] == s->block_mark) continue;
+                s->live_mark[r] = s->block_mark;
+                count[s->is_float[r]] += 1;
+            }
+        }
+        live[k][0] = count[0];
+        live[k][1] = count[1];
+    }
+
+    // the PHIs stay first and the terminator last, with the TEST it branches
+    // on right before it
+    int k = 0, end = n - 1;
+    while (k < n && instrs[k].op == PHI) k++;
+    if (end - 1 >= k && instrs[end].op == JZ && instrs[end - 1].op == TEST && instrs[end - 1].r[0] == instrs[end].r[0]) {
+        end -= 1;
+    }
+    while (k < end) {
+        if (instrs[k].op == CALL) {
+            pass(s, &instrs[k++]);
+            continue;
+        }
+        int stop = k;
+        while (stop < end && stop - k < MAX_REGION && instrs[stop].op != CALL) stop++;
+        if (stop - k > 1) schedule_ir_region(s, &instrs[k], stop - k, live[k]);
+        for (; k < stop; k++) pass(s, &instrs[k]);
+    }
+    for (; k < n; k++) {
+        if (instrs[k].op != PHI) pass(s, &instrs[k]);
+    }
+    free(live);
+}
+
+void schedule_function(struct tu *tu, struct function *function) {
+    size_t n_regs = function->regs.len;
+    size_t n_blocks = function->blocks.len;
+    struct ir_scheduler s = { .function = function, .model = &models[tu->tune] };
+    s.is_float = calloc(n_regs, sizeof(bool));
+    s.defs = calloc(n_regs, sizeof(int));
+    bool *can_remat = calloc(n_regs, sizeof(bool));
+    struct ir_instr *remat = calloc(n_regs, sizeof(struct ir_instr));
+    classify_registers(function, s.is_float, can_remat, remat, s.defs);
+    free(can_remat);
+    free(remat);
+
+    reg_list_t *live_in = calloc(n_blocks, sizeof(reg_list_t));
+    reg_list_t *live_out = calloc(n_blocks, sizeof(reg_list_t));
+    compute_liveness(function, live_in, live_out);
+    analyze_aliases(function, &s.aliases);
+
+    s.out_mark = calloc(n_regs, sizeof(int));
+    s.live_mark = calloc(n_regs, sizeof(int));
+    s.later = calloc(n_regs, sizeof(int));
+    s.def_node = calloc(n_regs, sizeof(int));
+    s.def_region = calloc(n_regs, sizeof(int));
+    s.touch_node = calloc(n_regs, sizeof(int));
+    s.touch_region = calloc(n_regs, sizeof(int));
+    s.value = calloc(n_regs, sizeof(int));
+    s.value_region = calloc(n_regs, sizeof(int));
+
+    for (size_t b = 0; b < n_blocks; b++) schedule_ir_block(&s, (int)b, &live_out[b]);
+    print_stats(tu, function, &s.stats, "before allocation");
+
+    for (size_t b = 0; b < n_blocks; b++) {
+        list_clear(&live_in[b]);
+        list_clear(&live_out[b]);
+    }
+    free(live_in);
+    free(live_out);
+    free_aliases(&s.aliases);
+    free(s.is_float);
+    free(s.defs);
+    free(s.out_mark);
+    free(s.live_mark);
+    free(s.later);
+    free(s.def_node);
+    free(s.def_region);
+    free(s.touch_node);
+    free(s.touch_region);
+    free(s.value);
+    free(s.value_region);
+}
+
+// After allocation.
+
+// Where a region of machine code ends: anything that goes somewhere else, or
+// moves the stack pointer in a way the operands don't show.
+static bool is_barrier(enum x86_op op) {
+    switch (op) {
+    case X86_LABEL:
+    case X86_JMP:
+    case X86_JCC:
+    case X86_CALL:
+    case X86_RET:
+    case X86_PUSH:
+    case X86_LEAVE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_memory(struct x86_operand *x) {
+    return x->kind == X86_MEM || x->kind == X86_RIP;
+}
+
+// Whether an instruction reads and writes its destination, if that is memory.
+static bool reads_destination(enum x86_op op) {
+    switch (op) {
+    case X86_MOV:
+    case X86_MOVSX:
+    case X86_MOVZX:
+    case X86_LEA:
+    case X86_MOVS:
+    case X86_MOVAPS:
+    case X86_MOVQ:
+    case X86_SETCC:
+    case X86_CVTSI2S:
+    case X86_CVTTS2SI:
+    case X86_CVTS2S:
+        return false;
+    default:
+        return true;
+    }
+}
+
+static bool writes_destination(enum x86_op op) {
+    switch (op) {
+    case X86_CMP:
+    case X86_TEST:
+    case X86_UCOMIS:
+    case X86_DIV:
+    case X86_IDIV:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// The memory an instruction reads or writes, if any: lea only computes an
+// address, and xchg writes both its operands.
+static struct x86_operand *memory_access(struct x86_instr *i, bool *reads, bool *writes) {
+    *reads = *writes = false;
+    if (is_memory(&i->operands[1]) && i->op != X86_LEA) {
+        *reads = true;
+        *writes = i->op == X86_XCHG;
+        return &i->operands[1];
+    }
+    if (is_memory(&i->operands[0])) {
+        *reads = reads_destination(i->op);
+        *writes = writes_destination(i->op);
+        return &i->operands[0];
+    }
+    return nullptr;
+}
+
+static int access_size(struct x86_instr *i) {
+    int size = i->size > i->from_size ? i->size : i->from_size;
+    return size ? size : 8;
+}
+
+// Whether two accesses might touch the same bytes. The function's constants
+// and the GOT are never written, and the stack frame is apart from static
+// storage; slots of the frame at known offsets only overlap if their bytes do.
+static bool may_overlap(struct x86_operand *x, int x_size, struct x86_operand *y, int y_size) {
+    bool x_constant = x->kind == X86_RIP && (!x->symbol || x->indirect);
+    bool y_constant = y->kind == X86_RIP && (!y->symbol || y->indirect);
+    if (x_constant || y_constant) return false;
+    bool x_frame = x->kind == X86_MEM && x->reg == RBP, y_frame = y->kind == X86_MEM && y->reg == RBP;
+    if ((x_frame && y->kind == X86_RIP) || (y_frame && x->kind == X86_RIP)) return false;
+    bool x_fixed = x_frame && !x->scale, y_fixed = y_frame && !y->scale;
+    bool same_symbol = x->kind == X86_RIP && y->kind == X86_RIP && x->symbol == y->symbol;
+    if (x->kind == X86_RIP && y->kind == X86_RIP && !same_symbol) return false;
+    if ((x_fixed && y_fixed) || same_symbol) return x->imm < y->imm + y_size && y->imm < x->imm + x_size;
+    return true;
+}
+
+static enum unit_class machine_unit(struct x86_instr *i, bool loads, bool stores) {
+    switch (i->op) {
+    case X86_IMUL:
+        return U_MUL;
+    case X86_DIV:
+    case X86_IDIV:
+        return U_DIV;
+    case X86_ADDS:
+    case X86_SUBS:
+    case X86_UCOMIS:
+        return U_FADD;
+    case X86_MULS:
+        return U_FMUL;
+    case X86_DIVS:
+        return U_FDIV;
+    case X86_CVTSI2S:
+    case X86_CVTTS2SI:
+    case X86_CVTS2S:
+        return U_CONVERT;
+    case X86_MOV:
+    case X86_MOVSX:
+    case X86_MOVZX:
+    case X86_MOVS:
+    case X86_MOVQ:
+        return stores ? U_STORE : loads ? U_LOAD : U_ALU;
+    default:
+        return U_ALU;
+    }
+}
+
+static bool schedule_machine_region(const struct machine_model *model, struct x86_instr *instrs, int n,
+                                    struct sched_stats *stats) {
+    struct region g = { .n = n };
+    struct x86_operand *memory[MAX_REGION];
+    bool loads[MAX_REGION], stores[MAX_REGION];
+    int writer[N_MACHINE_REGS + 1];
+    uint64_t readers[N_MACHINE_REGS + 1] = {};
+    for (int r = 0; r <= N_MACHINE_REGS; r++) writer[r] = -1;
+
+    for (int i = 0; i < n; i++) {
+        uint64_t reads, writes;
+        x86_instr_regs(&instrs[i], &reads, &writes);
+        for (int r = 0; r <= N_MACHINE_REGS; r++) {
+            if (!((reads | writes) & bit(r))) continue;
+            if (writer[r] >= 0) {
+                g.after[i] |= bit(writer[r]);
+                if (reads & bit(r)) g.waits[i] |= bit(writer[r]);
+            }
+            if (writes & bit(r)) {
+                g.after[i] |= readers[r];
+                writer[r] = i;
+                readers[r] = 0;
+            } else {
+                readers[r] |= bit(i);
+            }
+        }
+
+        memory[i] = memory_access(&instrs[i], &loads[i], &stores[i]);
+        g.unit[i] = machine_unit(&instrs[i], loads[i], stores[i]);
+        g.latency[i] = model->units[g.unit[i]].latency;
+        if (loads[i] && g.unit[i] != U_LOAD) g.latency[i] += model->units[U_LOAD].latency;
+        if (!memory[i]) continue;
+        for (int j = 0; j < i; j++) {
+            if (!memory[j] || (!stores[i] && !stores[j])) continue;
+            if (!may_overlap(memory[i], access_size(&instrs[i]), memory[j], access_size(&instrs[j]))) continue;
+            g.after[i] |= bit(j);
+            if (stores[j] && loads[i]) g.waits[i] |= bit(j);
+        }
+    }
+
+    int order[MAX_REGION];
+    if (!reorder(model, &g, nullptr, order, stats)) return false;
+    struct x86_instr copy[MAX_REGION];
+    memcpy(copy, instrs, (size_t)n * sizeof(struct x86_instr));
+    for (int k = 0; k < n; k++) instrs[k] = copy[order[k]];
+    return true;
+}
+
+void schedule_machine_code(struct tu *tu, struct function *function, struct x86_function *code) {
+    struct sched_stats stats = {};
+    struct x86_instr *instrs = code->instrs.data;
+    int n = (int)code->instrs.len;
+    for (int k = 0; k < n;) {
+        if (is_barrier(instrs[k].op)) {
+            k++;
+            continue;
+        }
+        int stop = k;
+        while (stop < n && stop - k < MAX_REGION && !is_barrier(instrs[stop].op)) stop++;
+        if (stop - k > 1) schedule_machine_region(&models[tu->tune], &instrs[k], stop - k, &stats);
+        k = stop;
+    }
+    print_stats(tu, function, &stats, "after allocation");
+}
@@ -0,0 +1,33 @@
+#pragma once
+#ifndef COMPILER_SCHED_H
+#define COMPILER_SCHED_H
+
+#include "ir.h"
+
+struct tu;
+struct x86_function;
+
+// The microarchitectures -mtune can name, whose latencies and throughputs the
+// schedulers plan for.
+enum tune : char {
+    TUNE_GENERIC,
+    TUNE_HASWELL,
+    TUNE_SKYLAKE,
+    TUNE_ZNVER2,
+    TUNE_ZNVER3,
+    N_TUNES,
+};
+
+// The tune that -mtune calls name, or -1 if there is none.
+int find_tune(const char *name);
+const char *tune_name(enum tune tune);
+
+// Reorder the instructions of each block of a function in SSA form, before
+// its registers are allocated: along the critical path, except where that
+// would need more registers than there are, then to free them.
+void schedule_function(struct tu *tu, struct function *function);
+// Reorder the machine code of a function between its labels, jumps and
+// calls, along the critical path, now that registers are allocated.
+void schedule_machine_code(struct tu *tu, struct function *function, struct x86_function *code);
+
+#endif //COMPILER_SCHED_H
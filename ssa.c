@@ -0,0 +1,357 @@
+#include "ssa.h"
+#include "ir.h"
+
+#include <stdlib.h>
+
+// Iterative depth-first search; each stack entry is a block and the index of
+// the next successor to visit.
+void reverse_postorder(struct function *function, block_list_t *order) {
+    size_t n = function->blocks.len;
+    bool *seen = calloc(n, sizeof(bool));
+    list(struct { int block; int next; }) stack = {};
+
+    order->len = 0;
+    list_push(&stack, ((typeof(*stack.data)){ 0, 0 }));
+    seen[0] = true;
+    while (stack.len) {
+        typeof(stack.data) top = &list_last(&stack);
+        struct ir_block *block = &function->blocks.data[top->block];
+        if (top->next < block->n_succs) {
+            int succ = block->succs[top->next++];
+            if (!seen[succ]) {
+                seen[succ] = true;
+                list_push(&stack, ((typeof(*stack.data)){ succ, 0 }));
+            }
+        } else {
+            list_push(order, top->block);
+            stack.len -= 1;
+        }
+    }
+
+    for (size_t i = 0, j = order->len - 1; i < j; i++, j--) {
+        int t = order->data[i];
+        order->data[i] = order->data[j];
+        order->data[j] = t;
+    }
+
+    list_clear(&stack);
+    free(seen);
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm": iterate
+// over the blocks in reverse postorder, intersecting the dominators of each
+// block's processed predecessors, until nothing changes.
+void compute_dominators(struct function *function) {
+    size_t n = function->blocks.len;
+    block_list_t order = {};
+    reverse_postorder(function, &order);
+
+    int *rpo = malloc(n * sizeof(int));
+    for (size_t b = 0; b < n; b++) {
+        rpo[b] = -1;
+        function->blocks.data[b].idom = -1;
+    }
+    for (size_t i = 0; i < order.len; i++) rpo[order.data[i]] = (int)i;
+
+    struct ir_block *blocks = function->blocks.data;
+    blocks[0].idom = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < order.len; i++) {
+            struct ir_block *block = &blocks[order.data[i]];
+            int idom = -1;
+            for_each (&block->preds) {
+                int p = *it;
+                if (blocks[p].idom == -1) continue;
+                if (idom == -1) {
+                    idom = p;
+                    continue;
+                }
+                int a = p, b = idom;
+                while (a != b) {
+                    while (rpo[a] > rpo[b]) a = blocks[a].idom;
+                    while (rpo[b] > rpo[a]) b = blocks[b].idom;
+                }
+                idom = a;
+            }
+            if (block->idom != idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+    blocks[0].idom = -1;
+
+    free(rpo);
+    list_clear(&order);
+}
+
+bool dominates(struct function *function, int a, int b) {
+    for (; b != -1; b = function->blocks.data[b].idom) {
+        if (b == a) return true;
+    }
+    return false;
+}
+
+static bool is_phi(struct ir_instr *i) {
+    return i->op == PHI;
+}
+
+// A fresh register for a new definition of r: the next version of a variable,
+// or a new temporary.
+static reg new_version(struct function *function, reg r, int *versions) {
+    struct scope *scope = function->regs.data[r].scope;
+    if (!scope) return new_temporary(function);
+    return new_reg(function, scope, ++versions[r]);
+}
+
+// Cytron et al.: PHIs go on the iterated dominance frontier of each register's
+// definitions, then a walk over the dominator tree renames every definition to
+// a new version and every use to the version that reaches it. The SSA is
+// semi-pruned: only registers read in a block other than the one that assigns
+// them get PHIs.
+void build_ssa(struct function *function) {
+    if (function->ssa) return;
+    remove_unreachable_blocks(function);
+    compute_dominators(function);
+
+    size_t n_blocks = function->blocks.len;
+    size_t n_regs = function->regs.len;
+    struct ir_block *blocks = function->blocks.data;
+
+    // Which registers to rename. Variables are renamed even when they are
+    // assigned once, because the assignment might not dominate every read.
+    int *defs = calloc(n_regs, sizeof(int));
+    bool *rename = calloc(n_regs, sizeof(bool));
+    bool *global = calloc(n_regs, sizeof(bool));
+    int *local = calloc(n_regs, sizeof(int));
+    // the first definition of each register, which PHIs copy their type from
+    struct ir_instr *type = calloc(n_regs, sizeof(struct ir_instr));
+
+    for (size_t b = 0; b < n_blocks; b++) {
+        for_each_n (instr, &blocks[b].instrs) {
+            reg d = ir_def(instr);
+            if (d && !defs[d]++) type[d] = *instr;
+        }
+    }
+    for_each (&function->params) defs[*it] += 1;
+    for (size_t r = 1; r < n_regs; r++) {
+        rename[r] = function->regs.data[r].scope ? defs[r] > 0 : defs[r] > 1;
+    }
+
+    for (size_t b = 0; b < n_blocks; b++) {
+        for_each_n (instr, &blocks[b].instrs) {
+            for (int u = 0; u < ir_use_count(function, instr); u++) {
+                reg r = *ir_use(function, instr, u);
+                if (rename[r] && local[r] != (int)b + 1) global[r] = true;
+            }
+            reg d = ir_def(instr);
+            if (d) local[d] = (int)b + 1;
+        }
+    }
+
+    // the blocks that define each register, grouped by register
+    int *def_start = calloc(n_regs + 1, sizeof(int));
+    for (size_t r = 1; r < n_regs; r++) def_start[r + 1] = def_start[r] + (global[r] ? defs[r] : 0);
+    int *def_blocks = malloc((def_start[n_regs] + 1) * sizeof(int));
+    int *def_fill = calloc(n_regs, sizeof(int));
+    for_each (&function->params) {
+        if (global[*it]) def_blocks[def_start[*it] + def_fill[*it]++] = 0;
+    }
+    for (size_t b = 0; b < n_blocks; b++) {
+        for_each_n (instr, &blocks[b].instrs) {
+            reg d = ir_def(instr);
+            if (d && global[d]) def_blocks[def_start[d] + def_fill[d]++] = (int)b;
+        }
+    }
+
+    // dominance frontiers, by walking up from each predecessor of a join
+    block_list_t *frontier = calloc(n_blocks, sizeof(block_list_t));
+    for (size_t b = 0; b < n_blocks; b++) {
+        if (blocks[b].preds.len < 2) continue;
+        for_each (&blocks[b].preds) {
+            for (int runner = *it; runner != -1 && runner != blocks[b].idom; runner = blocks[runner].idom) {
+                block_list_t *df = &frontier[runner];
+                if (df->len && list_last(df) == (int)b) break;
+                list_push(df, (int)b);
+            }
+        }
+    }
+
+    // place PHIs, with every operand naming the register until renaming
+    ir_list_t *phis = calloc(n_blocks, sizeof(ir_list_t));
+    int *has_phi = calloc(n_blocks, sizeof(int));
+    int *queued = calloc(n_blocks, sizeof(int));
+    block_list_t work = {};
+    for (size_t r = 1; r < n_regs; r++) {
+        if (!global[r]) continue;
+        for (int d = def_start[r]; d < def_start[r + 1]; d++) {
+            if (queued[def_blocks[d]] == (int)r) continue;
+            queued[def_blocks[d]] = (int)r;
+            list_push(&work, def_blocks[d]);
+        }
+        while (work.len) {
+            int b = work.data[--work.len];
+            for_each (&frontier[b]) {
+                int f = *it;
+                if (has_phi[f] == (int)r) continue;
+                has_phi[f] = (int)r;
+
+                struct ir_instr phi = type[r];
+                phi.op = PHI;
+                phi.r[0] = (reg)r;
+                phi.r[1] = (reg)function->operands.len;
+                phi.r[2] = 0;
+                list_push(&function->operands, (reg)blocks[f].preds.len);
+                for (size_t p = 0; p < blocks[f].preds.len; p++) list_push(&function->operands, (reg)r);
+                list_push(&phis[f], phi);
+
+                if (queued[f] != (int)r) {
+                    queued[f] = (int)r;
+                    list_push(&work, f);
+                }
+            }
+        }
+    }
+
+    for (size_t b = 0; b < n_blocks; b++) {
+        if (!phis[b].len) continue;
+        ir_list_t *instrs = &blocks[b].instrs;
+        for_each (instrs) list_push(&phis[b], *it);
+        list_clear(instrs);
+        *instrs = phis[b];
+        phis[b] = (ir_list_t){};
+    }
+
+    // the dominator tree, as each block's children
+    int *child_start = calloc(n_blocks + 2, sizeof(int));
+    int *children = malloc(n_blocks * sizeof(int));
+    for (size_t b = 1; b < n_blocks; b++) child_start[blocks[b].idom + 2] += 1;
+    for (size_t b = 1; b <= n_blocks; b++) child_start[b] += child_start[b - 1];
+    for (size_t b = 1; b < n_blocks; b++) children[child_start[blocks[b].idom + 1]++] = (int)b;
+
+    // Rename in dominator tree preorder. current[r] is the version of r that
+    // reaches the instruction being renamed, 0 while r is undefined. Each
+    // definition logs the version it replaces so it can be restored when the
+    // walk leaves the block. A negative entry on the stack leaves a block.
+    reg *current = calloc(n_regs, sizeof(reg));
+    int *versions = calloc(n_regs, sizeof(int));
+    int *log_start = malloc(n_blocks * sizeof(int));
+    list(struct { reg r; reg replaced; }) log = {};
+    block_list_t stack = {};
+
+#define DEFINE(slot) do { \
+    reg _r = *(slot); \
+    list_push(&log, ((typeof(*log.data)){ _r, current[_r] })); \
+    current[_r] = *(slot) = new_version(function, _r, versions); \
+} while (0)
+
+    for_each (&function->params) {
+        if (rename[*it]) DEFINE(it);
+    }
+
+    list_push(&stack, 0);
+    while (stack.len) {
+        int b = stack.data[--stack.len];
+        if (b < 0) {
+            for (size_t i = log.len; i-- > (size_t)log_start[-b - 1];) current[log.data[i].r] = log.data[i].replaced;
+            log.len = log_start[-b - 1];
+            continue;
+        }
+        log_start[b] = (int)log.len;
+        list_push(&stack, -b - 1);
+
+        struct ir_block *block = &function->blocks.data[b];
+        for_each_n (instr, &block->instrs) {
+            if (!is_phi(instr)) {
+                for (int u = 0; u < ir_use_count(function, instr); u++) {
+                    reg *use = ir_use(function, instr, u);
+                    if (rename[*use] && current[*use]) *use = current[*use];
+                }
+            }
+            reg d = ir_def(instr);
+            if (d && d < n_regs && rename[d]) DEFINE(&instr->r[0]);
+        }
+
+        for (int s = 0; s < block->n_succs; s++) {
+            struct ir_block *succ = &function->blocks.data[block->succs[s]];
+            size_t p = 0;
+            while (succ->preds.data[p] != b) p++;
+            for_each_n (instr, &succ->instrs) {
+                if (!is_phi(instr)) break;
+                reg *use = ir_use(function, instr, (int)p);
+                if (current[*use]) *use = current[*use];
+            }
+        }
+
+        for (int c = child_start[b]; c < child_start[b + 1]; c++) list_push(&stack, children[c]);
+    }
+
+#undef DEFINE
+
+    function->ssa = true;
+
+    list_clear(&log);
+    list_clear(&stack);
+    list_clear(&work);
+    for (size_t b = 0; b < n_blocks; b++) list_clear(&frontier[b]);
+    free(frontier);
+    free(phis);
+    free(has_phi);
+    free(queued);
+    free(defs);
+    free(rename);
+    free(global);
+    free(local);
+    free(type);
+    free(def_start);
+    free(def_blocks);
+    free(def_fill);
+    free(child_start);
+    free(children);
+    free(current);
+    free(versions);
+    free(log_start);
+}
+
+static void insert_before_terminator(struct ir_block *block, struct ir_instr i) {
+    struct ir_instr terminator = list_last(&block->instrs);
+    list_last(&block->instrs) = i;
+    list_push(&block->instrs, terminator);
+}
+
+// Each PHI gets a temporary that every predecessor copies its operand into
+// just before it jumps, and the PHI becomes a copy out of that temporary.
+// Since every PHI has its own temporary, the copies into them don't interfere
+// with each other or with the values the jump reads, so no edges need to be
+// split and no cycles of copies need to be broken.
+void leave_ssa(struct function *function) {
+    if (!function->ssa) return;
+
+    for (size_t b = 0; b < function->blocks.len; b++) {
+        for (size_t i = 0; i < function->blocks.data[b].instrs.len; i++) {
+            struct ir_block *block = &function->blocks.data[b];
+            if (!is_phi(&block->instrs.data[i])) break;
+
+            struct ir_instr phi = block->instrs.data[i];
+            reg t = new_temporary(function);
+            reg *args = &function->operands.data[phi.r[1]];
+            for (size_t p = 0; p < block->preds.len; p++) {
+                struct ir_instr copy = phi;
+                copy.op = MOVE;
+                copy.r[0] = t;
+                copy.r[1] = args[1 + p];
+                copy.r[2] = 0;
+                insert_before_terminator(&function->blocks.data[block->preds.data[p]], copy);
+            }
+
+            // a self loop may have grown this block
+            block = &function->blocks.data[b];
+            block->instrs.data[i].op = MOVE;
+            block->instrs.data[i].r[1] = t;
+        }
+    }
+
+    function->ssa = false;
+}
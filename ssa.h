@@ -0,0 +1,25 @@
+#pragma once
+#ifndef COMPILER_SSA_H
+#define COMPILER_SSA_H
+
+#include "ir.h"
+
+// Blocks reachable from the entry in reverse postorder, so every block comes
+// before its successors except along back edges.
+void reverse_postorder(struct function *function, block_list_t *order);
+// Fill in the immediate dominator of every block.
+void compute_dominators(struct function *function);
+// Whether every path from the entry to block b goes through block a, by
+// walking up the dominator tree from b.
+bool dominates(struct function *function, int a, int b);
+
+// Put the function in SSA form: unreachable blocks are removed, every
+// register variable and every register that is assigned more than once is
+// split into versions that are each assigned once, and PHIs are placed where
+// versions meet.
+void build_ssa(struct function *function);
+// Replace the PHIs with copies, so the function can be executed or allocated
+// without knowing about them.
+void leave_ssa(struct function *function);
+
+#endif //COMPILER_SSA_H
@@ -0,0 +1,84 @@
+int print(int);
+double scale(double);
+int printf(const char *, ...);
+
+int counter = 3;
+long wide = 0x123456789abcdef;
+double ratio = 2.5;
+int *where = &counter;
+const char *format = "%d %ld %f\n";
+
+int next() {
+    static int calls = 10;
+    return calls++ + counter;
+}
+
+int stacked(int a, int b, int c, int d, int e, int f, int g, int h, int i) {
+    return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h + 9 * i;
+}
+
+double fstacked(double a, double b, double c, double d, double e, double f, double g, double h, double i, int n) {
+    return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h + 9 * i + n;
+}
+
+double mixed(int a, double b, long c, float d, char e, double f) {
+    return a * b + c * d - e / f;
+}
+
+int swapped(int a, int b) {
+    return stacked(b, a, b, a, b, a, b, a, b);
+}
+
+int narrow(char c, unsigned char u, short s, unsigned short us) {
+    char d = c + 1;
+    unsigned char v = u + 1;
+    short t = s * 2;
+    unsigned short w = us + 3;
+    return d + v + t + w;
+}
+
+int divide(int a, int b, unsigned x, unsigned y) {
+    return a / b + a % b + x / y + x % y;
+}
+
+int shift(int a, unsigned b, long c, int n) {
+    return (a << n) + (a >> n) + (b >> n) + (c >> n);
+}
+
+int compare(double a, double b) {
+    return (a < b) + 2 * (a <= b) + 4 * (a > b) + 8 * (a >= b) + 16 * (a == b) + 32 * (a != b) + 64 * !a;
+}
+
+int convert(double d, unsigned long ul, float f) {
+    unsigned long a = d;
+    double b = ul;
+    long c = f;
+    unsigned u = d;
+    return a / 1000 + b / 1e15 + c + u;
+}
+
+int apply(int (*f)(int), int x) {
+    return f(x) + f(x + 1);
+}
+
+int fact(int n) {
+    return n <= 1 ? 1 : n * fact(n - 1);
+}
+
+int main() {
+    print(next());
+    print(next());
+    printf(format, *where, wide, ratio);
+    print(stacked(1, 2, 3, 4, 5, 6, 7, 8, 9));
+    print(fstacked(1, 2, 3, 4, 5, 6, 7, 8, 9, 10));
+    print(scale(mixed(3, 2.5, 100, 0.5, 7, 3.5)));
+    print(swapped(3, 4));
+    print(narrow(-5, 255, -300, 65535));
+    print(divide(-100, 7, 4000000000, 7));
+    print(shift(-12345, 4000000000, -99999999999, 5));
+    print(compare(1, 2));
+    print(compare(2, 2));
+    print(compare(0.0 / 0.0, 0));
+    print(convert(4e6, 18000000000000000000u, -2.5));
+    print(apply(fact, 5));
+}
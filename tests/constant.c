@@ -0,0 +1,25 @@
+constexpr int size = 4 * 2 + 1;
+int table[size + 1];
+int *middle = &table[size / 2];
+unsigned long big = 0xffffffff + 1ul;
+double half = 1.0 / 2;
+
+static_assert(sizeof(table) == 40);
+static_assert(-1 > 0u);
+static_assert(size == 9 && (size << 2) == 36);
+
+int never(int x) {
+    if (x) return 1 / 0;
+    if (x > 5) return 1 << 40;
+    return 2;
+}
+
+int main() {
+    int x = size;
+    switch (x) {
+    case size - 9:
+        break;
+    case sizeof(table) / sizeof(table[0]):
+        return 1;
+    }
+}
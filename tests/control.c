@@ -0,0 +1,47 @@
+int print(int a);
+
+int control(int n) {
+    int s = 0;
+    for (int i = 0; i < n; i++) {
+        if (i == 3) continue;
+        if (i > 10) break;
+        s += i;
+    }
+    do {
+        s--;
+    } while (s > 100);
+    while (s < 0) s++;
+    switch (n) {
+    case 1:
+        s = 1; // falls through
+    case 2:
+        s = 2;
+        break;
+    default:
+        s = 9;
+    case 5: {
+        s = 5;
+    }
+    }
+    for (;;) {
+        goto out;
+    }
+out:
+    return s && n || !s ? n : s;
+}
+
+int irreducible(int n) {
+    int x = 0;
+    if (n) goto inside;
+    while (x < 10) {
+        x++;
+    inside:
+        x += 2;
+    }
+    return x;
+}
+
+int main() {
+    print(control(3));
+    print(irreducible(1));
+}
@@ -0,0 +1,33 @@
+int print(int);
+int touch(int *);
+
+int g;
+
+int cse(int *p, int n) {
+    int a[8];
+    int s = 0;
+    for (int i = 0; i < n; i++) {
+        a[i] = p[i] * p[i] + i;
+        s += a[i] + a[i];
+    }
+    int x = n * 3 + 1;
+    int y = 1 + n * 3;
+    if (n) {
+        s += n * 3;
+    }
+    int before = g;
+    *p = 4;
+    int after = g;
+    int again = g;
+    touch(a);
+    int called = g;
+    return s + x + y + before + after + again + called;
+}
+
+int main() {
+    int v[4];
+    for (int i = 0; i < 4; i++) {
+        v[i] = i * 7 - 5;
+    }
+    print(cse(v, 4));
+}
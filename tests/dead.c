@@ -0,0 +1,32 @@
+int print(int);
+int sink(int *);
+
+int dead(int n) {
+    int unused = n * 3 + 1;
+    int a[4];
+    a[0] = 1;
+    a[0] = n;
+    int x;
+    int *p = &x;
+    *p = 5;
+    *p = n + 2;
+    if (n) {
+        x = 7;
+    }
+    print(x);
+    x = 9;
+    return a[0];
+}
+
+int escapes(int n) {
+    int x;
+    x = n;
+    sink(&x);
+    x = 1;
+    return x;
+}
+
+int main() {
+    print(dead(1));
+    print(escapes(2));
+}
@@ -0,0 +1,31 @@
+int print(int a);
+int printf(const char *fmt, ...);
+int g = 5;
+static long arr[4];
+
+int sum(int *p, int n) {
+    int s = 0;
+    int i = 0;
+    while (i < n) {
+        s += p[i];
+        i++;
+    }
+    return s;
+}
+
+double mix(char c, unsigned short u, float f) {
+    long x = c + u;
+    x <<= 2;
+    int *q = &g;
+    *q = x > 3 && u != 0 ? 1 : 2;
+    arr[1] = x - 1;
+    printf("%f %d\n", f, c);
+    return x * f;
+}
+
+int main() {
+    int a = 3;
+    int *pa = &a;
+    pa[0] = -a;
+    return sum(pa, 1) + !a;
+}
@@ -0,0 +1,31 @@
+int print(int a);
+
+int fold(int n) {
+    const int debug = 0;
+    int mode = 2;
+    int x = 10;
+    if (debug) {
+        print(x);
+        x = 11;
+    }
+    while (mode == 2 && n) {
+        x = x + mode;
+        n--;
+    }
+    int k = mode * 4 + (x > 100 ? 1 : 0);
+    switch (mode) {
+    case 1:
+        k = 1;
+        break;
+    case 2:
+        k += 1;
+        break;
+    }
+    unsigned u = -1;
+    int shifted = u >> 28;
+    return k + shifted + -17 / 4 + -17 % 4;
+}
+
+int main() {
+    print(fold(3));
+}
@@ -0,0 +1,49 @@
+int print(int);
+
+long sum(int *p, int n, int stride) {
+    long s = 0;
+    for (int i = 0; i < n; i++) {
+        s += p[i * stride] + p[i];
+    }
+    return s;
+}
+
+int counted() {
+    int a[10];
+    int t = 0;
+    for (int i = 0; i < 10; i++) {
+        a[i] = i * 3;
+    }
+    for (int i = 9; i >= 0; i -= 2) {
+        t += a[i];
+    }
+    for (int i = 0; i != 12; i += 4) {
+        int j = 0;
+        for (int k = 1; k <= 5; k++) {
+            t += k * i;
+            j++;
+        }
+        t += j;
+    }
+    return t;
+}
+
+long offsets(int *p, int n, long o) {
+    long s = 0;
+    for (int j = -2; j < 2; j++) {
+        for (int k = 0; k < 2; k++) {
+            s += p[k * n + j + 4] + p[j * n + o];
+        }
+    }
+    return s;
+}
+
+int main() {
+    int v[16];
+    for (int i = 0; i < 16; i++) {
+        v[i] = i * 5 - 20;
+    }
+    print(sum(v, 8, 1));
+    print(offsets(v, 4, 8));
+    print(counted());
+}
@@ -0,0 +1,125 @@
+int print(int);
+double scale(double);
+int atoi(char *);
+long clock();
+
+int matmul(int *a, int *b, int *c, int n) {
+    int checksum = 0;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            int s = 0;
+            for (int k = 0; k < n; k++) {
+                s += a[i * n + k] * b[k * n + j];
+            }
+            c[i * n + j] = s;
+            checksum ^= s;
+        }
+    }
+    return checksum;
+}
+
+int horner(int *coef, int x, int n) {
+    int c0 = coef[0];
+    int c1 = coef[1];
+    int c2 = coef[2];
+    int c3 = coef[3];
+    int c4 = coef[4];
+    int c5 = coef[5];
+    int c6 = coef[6];
+    int c7 = coef[7];
+    int s = 0;
+    for (int i = 0; i < n; i++) {
+        int v = x + i;
+        int y = ((((((c7 * v + c6) * v + c5) * v + c4) * v + c3) * v + c2) * v + c1) * v + c0;
+        s += y;
+    }
+    return s;
+}
+
+int stencil(int *in, int *out, int n) {
+    int prev = in[0];
+    int cur = in[1];
+    int total = 0;
+    for (int i = 1; i < n - 1; i++) {
+        int next = in[i + 1];
+        int v = (prev + 2 * cur + next) / 4;
+        out[i] = v;
+        total += v;
+        prev = cur;
+        cur = next;
+    }
+    return total;
+}
+
+double dot(double *x, double *y, int n) {
+    double s0 = 0;
+    double s1 = 0;
+    for (int i = 0; i + 1 < n; i += 2) {
+        s0 += x[i] * y[i];
+        s1 += x[i + 1] * y[i + 1];
+    }
+    return scale(s0 + s1);
+}
+
+int reduce(int *p, int n) {
+    int s = 0;
+    int lo = p[0];
+    int hi = p[0];
+    int evens = 0;
+    for (int i = 0; i < n; i++) {
+        int v = p[i];
+        s += v;
+        if (v < lo) lo = v;
+        if (v > hi) hi = v;
+        if (v % 2 == 0) evens++;
+        print(v);
+    }
+    return s + lo * 3 + hi * 5 + evens * 7;
+}
+
+int main() {
+    int a[16];
+    int b[16];
+    int c[16];
+    double x[4];
+    for (int i = 0; i < 16; i++) {
+        a[i] = i % 5 - 2;
+        b[i] = i * 3 + 1;
+        c[i] = 0;
+    }
+    for (int i = 0; i < 4; i++) {
+        x[i] = i * 0.5 + 1;
+    }
+    print(matmul(a, b, c, 4));
+    print(horner(a, 3, 10));
+    print(stencil(a, b, 16));
+    int d = dot(x, x, 4);
+    print(d);
+    print(reduce(c, 16));
+}
+
+int bench(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 200000;
+    int a[64];
+    int b[64];
+    int c[64];
+    double x[64];
+    for (int i = 0; i < 64; i++) {
+        a[i] = i % 5 - 2;
+        b[i] = i * 3 + 1;
+        c[i] = 0;
+        x[i] = i * 0.5 + 1;
+    }
+    long start = clock();
+    int sum = 0;
+    for (int r = 0; r < rounds; r++) {
+        sum ^= matmul(a, b, c, 8);
+        sum ^= horner(a, r % 7, 10);
+        sum ^= stencil(a, b, 64);
+        int d = dot(x, x, 64);
+        sum ^= d;
+    }
+    print(sum);
+    print((clock() - start) / 1000);
+    return 0;
+}
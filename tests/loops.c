@@ -0,0 +1,47 @@
+int print(int);
+
+int g;
+
+int invariant(int *p, int n, int k) {
+    int a[16];
+    int s = 0;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            a[j] = k * 4 + i;
+            s += k * 4 + g / 3;
+        }
+        s += p[1];
+    }
+    int t = 0;
+    while (t < n) {
+        if (t > 4) {
+            s += n / k;
+        }
+        t += n / 7 + 1;
+    }
+    do {
+        s += g;
+        print(s);
+    } while (s < k);
+    return s + a[0];
+}
+
+int preheader(int n, int k) {
+    int s = 0;
+    if (n > 3) goto loop;
+    s = 5;
+loop:
+    s += k * k;
+    n--;
+    if (n) goto loop;
+    return s;
+}
+
+int main() {
+    int v[4];
+    for (int i = 0; i < 4; i++) {
+        v[i] = i + 3;
+    }
+    print(invariant(v, 8, 2));
+    print(preheader(4, 2));
+}
@@ -0,0 +1,54 @@
+int print(int);
+double scale(double);
+
+int many(int a, int b, int c, int d) {
+    int e = a * b;
+    int f = b * c;
+    int g = c * d;
+    int h = d * a;
+    int i = a + c;
+    int j = b + d;
+    int k = e - f;
+    int l = g - h;
+    int m = i * j;
+    int n = k * l;
+    int o = e + g;
+    int p = f + h;
+    int s = 0;
+    for (int t = 0; t < a; t++) {
+        s += e + f + g + h + i + j + k + l + m + n + o + p + t;
+        s ^= e * t + f * t + g * t;
+    }
+    return s + e + f + g + h + i + j + k + l + m + n + o + p;
+}
+
+int across(int x, int y) {
+    int a = x * 3;
+    int b = y * 5;
+    int c = a + b;
+    print(a);
+    print(b);
+    int s = 0;
+    for (int i = 0; i < x; i++) {
+        s += print(c + i);
+    }
+    return s + a + b + c + 1000;
+}
+
+double floats(double x, double y, int n) {
+    double a = x * y;
+    double b = x + y;
+    double c = x - y;
+    double s = 0.5;
+    for (int i = 0; i < n; i++) {
+        s += scale(a) * b + c;
+        s = s * 0.25;
+    }
+    return s + a + b + c;
+}
+
+int main() {
+    print(many(1, 2, 3, 4));
+    print(across(3, 4));
+    print(floats(1.5, 2.5, 3) > 0);
+}
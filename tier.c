@@ -0,0 +1,383 @@
+#include "tier.h"
+#include "jit.h"
+#include "ir.h"
+#include "tu.h"
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Tiered execution: the module's data is loaded like --jit loads it, but
+// each function is only an entry stub to start with, jumping through a slot
+// to a thunk that enters the interpreter. Compiling a function fills in the
+// slot, so callers in machine code and in the interpreter both switch over,
+// and the function's address, its stub, stays the same throughout.
+//
+// The mapping holds, each part starting a page:
+//  - the entry stubs, the thunks, a stub for each symbol of another module
+//    and the trampoline into the interpreter
+//  - the slots, the trampoline's pointer to enter_interpreter and the GOT
+//  - the read only data, then the data and the bss
+//  - room for the compiled functions, which stays inaccessible until used
+// so everything is within the 2GB a call or rip relative address reaches.
+
+// the address space set aside for compiled functions
+#define CODE_RESERVE (256u << 20)
+
+// A stub is jmp *slot(%rip), padded to 8 bytes.
+enum { STUB_SIZE = 8 };
+// A thunk is movabs $f, %r11 and jmp trampoline, padded to 16 bytes.
+enum { THUNK_SIZE = 16 };
+
+static const unsigned char trampoline[] = {
+    0x55,                               // push %rbp
+    0x48, 0x89, 0xe5,                   // mov %rsp, %rbp
+    0x48, 0x83, 0xec, 0x70,             // sub $112, %rsp
+    0x48, 0x89, 0x3c, 0x24,             // mov %rdi, (%rsp)
+    0x48, 0x89, 0x74, 0x24, 0x08,       // mov %rsi, 8(%rsp)
+    0x48, 0x89, 0x54, 0x24, 0x10,       // mov %rdx, 16(%rsp)
+    0x48, 0x89, 0x4c, 0x24, 0x18,       // mov %rcx, 24(%rsp)
+    0x4c, 0x89, 0x44, 0x24, 0x20,       // mov %r8, 32(%rsp)
+    0x4c, 0x89, 0x4c, 0x24, 0x28,       // mov %r9, 40(%rsp)
+    0xf2, 0x0f, 0x11, 0x44, 0x24, 0x30, // movsd %xmm0, 48(%rsp)
+    0xf2, 0x0f, 0x11, 0x4c, 0x24, 0x38, // movsd %xmm1, 56(%rsp)
+    0xf2, 0x0f, 0x11, 0x54, 0x24, 0x40, // movsd %xmm2, 64(%rsp)
+    0xf2, 0x0f, 0x11, 0x5c, 0x24, 0x48, // movsd %xmm3, 72(%rsp)
+    0xf2, 0x0f, 0x11, 0x64, 0x24, 0x50, // movsd %xmm4, 80(%rsp)
+    0xf2, 0x0f, 0x11, 0x6c, 0x24, 0x58, // movsd %xmm5, 88(%rsp)
+    0xf2, 0x0f, 0x11, 0x74, 0x24, 0x60, // movsd %xmm6, 96(%rsp)
+    0xf2, 0x0f, 0x11, 0x7c, 0x24, 0x68, // movsd %xmm7, 104(%rsp)
+    0x4c, 0x89, 0xdf,                   // mov %r11, %rdi
+    0x48, 0x89, 0xe6,                   // mov %rsp, %rsi
+    0x48, 0x8d, 0x55, 0x10,             // lea 16(%rbp), %rdx
+    0xff, 0x15, 0x00, 0x00, 0x00, 0x00, // call *enter(%rip)
+    0xc9,                               // leave
+    0xc3,                               // ret
+};
+
+static size_t round_up(size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+static bool fits_rel32(int64_t value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static void put_rel32(char *at, char *target, char *end) {
+    int32_t disp = (int32_t)(target - end);
+    memcpy(at, &disp, 4);
+}
+
+int tier_function_index(struct tier *tier, int name) {
+    for (size_t f = 0; f < tier->functions.len; f++) {
+        if (tier->functions.data[f].symbol == name) return (int)f;
+    }
+    return -1;
+}
+
+int tier_symbol_index(struct tier *tier, int name) {
+    for (size_t s = 0; s < tier->symbols.len; s++) {
+        if (tier->symbols.data[s].name == name) return (int)s;
+    }
+    return -1;
+}
+
+static void add_symbol(struct tier *tier, int name, char *address, int stub) {
+    list_push(&tier->symbols, ((struct tier_symbol){ .name = name, .address = address, .stub = stub }));
+}
+
+// Find a symbol the module uses in the process if the module doesn't
+// define it, and give it a stub for calls to go through.
+static bool add_external(struct tier *tier, int name, int *n_stubs) {
+    if (tier_symbol_index(tier, name) != -1) return true;
+    const char *string = tu_string(tier->tu, name);
+    char *address = dlsym(RTLD_DEFAULT, string);
+    if (!address) {
+        fprintf(stderr, "tier: undefined symbol %s\n", string);
+        return false;
+    }
+    add_symbol(tier, name, address, (*n_stubs)++);
+    return true;
+}
+
+typedef list(int) name_list_t;
+
+// The symbols the functions refer to, with the string literals among them
+// added to the data.
+static void collect_references(struct tier *tier, name_list_t *names) {
+    struct tu *tu = tier->tu;
+    for_each_n (f, &tier->functions) {
+        struct function *function = f->ir;
+        for_each_n (block, &function->blocks) {
+            for_each_n (instr, &block->instrs) {
+                if (instr->op == ADDR && !instr->r[1]) {
+                    int name = function->constants.data[instr->r[2]].name;
+                    add_string_literal(tu, &tier->data, name);
+                    list_push(names, name);
+                    continue;
+                }
+                if (instr->op != ADDR && instr->op != CALL) continue;
+                struct scope *scope = function->regs.data[instr->r[1]].scope;
+                if (!scope || !names_symbol(tu, scope)) continue;
+                bool is_global;
+                list_push(names, scope_symbol(tu, scope, &is_global));
+            }
+        }
+    }
+}
+
+static void write_perf_map(char *address, size_t size, const char *name) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%i.map", (int)getpid());
+    FILE *map = fopen(path, "a");
+    if (!map) {
+        perror("tier: perf map");
+        return;
+    }
+    fprintf(map, "%lx %zx %s\n", (unsigned long)address, size, name);
+    fclose(map);
+}
+
+static bool relocate(struct tier *tier, char *code, struct x86_reloc *r) {
+    int s = tier_symbol_index(tier, r->symbol);
+    if (s == -1) {
+        fprintf(stderr, "tier: undefined symbol %s\n", tu_string(tier->tu, r->symbol));
+        return false;
+    }
+    struct tier_symbol *symbol = &tier->symbols.data[s];
+    char *at = code + r->offset;
+    char *target = symbol->address;
+    if (r->kind == X86_RELOC_64) {
+        uint64_t value = (uint64_t)(target + r->addend);
+        memcpy(at, &value, 8);
+        return true;
+    }
+    if (r->kind == X86_RELOC_GOTPCREL) target = (char *)&tier->got[s];
+    else if (r->kind == X86_RELOC_PLT32 && symbol->stub != -1) target = tier->stubs + symbol->stub * STUB_SIZE;
+    int64_t value = target + r->addend - at;
+    if (!fits_rel32(value)) {
+        fprintf(stderr, "tier: %s is out of reach of a 32 bit displacement\n", tu_string(tier->tu, r->symbol));
+        return false;
+    }
+    int32_t narrow = (int32_t)value;
+    memcpy(at, &narrow, 4);
+    return true;
+}
+
+// Optimize and compile a function in the background, and point its slot at
+// the machine code. Anything that goes wrong leaves it interpreted.
+static void compile(struct tier *tier, struct tier_function *f) {
+    struct tu *tu = tier->tu;
+    prepare_function(tu, f->ir);
+    struct x86_function code = {};
+    generate_function(tu, f->ir, &code);
+    struct x86_section_data text = {};
+    encode_function(&code, &text);
+    free_x86_function(&code);
+
+    size_t size = round_up(text.bytes.len, (size_t)sysconf(_SC_PAGESIZE));
+    char *at = tier->code + tier->code_used;
+    const char *name = tu_string(tu, f->symbol);
+    if (tier->code_used + size > tier->code_size) {
+        fprintf(stderr, "tier: no room left to compile %s\n", name);
+    } else if (mprotect(at, size, PROT_READ | PROT_WRITE)) {
+        perror("tier: mprotect");
+    } else {
+        memcpy(at, text.bytes.data, text.bytes.len);
+        bool ok = true;
+        for_each (&text.relocs) ok = ok && relocate(tier, at, it);
+        if (ok && !mprotect(at, size, PROT_READ | PROT_EXEC)) {
+            tier->code_used += size;
+            atomic_store_explicit(f->slot, at, memory_order_release);
+            fprintf(stderr, "tier: compiled %s, %zu bytes\n", name, text.bytes.len);
+            if (tier->flags & JIT_PERF_MAP) write_perf_map(at, text.bytes.len, name);
+        }
+    }
+    list_clear(&text.bytes);
+    list_clear(&text.relocs);
+}
+
+static void *compiler(void *arg) {
+    struct tier *tier = arg;
+    pthread_mutex_lock(&tier->lock);
+    while (true) {
+        while (!tier->stop && tier->next == tier->queue.len) {
+            pthread_cond_wait(&tier->work, &tier->lock);
+        }
+        if (tier->stop) break;
+        struct tier_function *f = tier->queue.data[tier->next++];
+        pthread_mutex_unlock(&tier->lock);
+        compile(tier, f);
+        pthread_mutex_lock(&tier->lock);
+    }
+    pthread_mutex_unlock(&tier->lock);
+    return nullptr;
+}
+
+// The compiler thread starts with the first function to get hot, so a
+// program that never has one doesn't pay for it, and until then nothing but
+// the main thread touches the translation unit.
+void request_compile(struct tier *tier, struct tier_function *f) {
+    pthread_mutex_lock(&tier->lock);
+    if (!f->queued) {
+        f->queued = true;
+        list_push(&tier->queue, f);
+        if (!tier->started) tier->started = pthread_create(&tier->thread, nullptr, compiler, tier) == 0;
+        pthread_cond_signal(&tier->work);
+    }
+    pthread_mutex_unlock(&tier->lock);
+}
+
+static void put_stub(char *stub, char *slot) {
+    memcpy(stub, (unsigned char[]){ 0xff, 0x25 }, 2);
+    put_rel32(stub + 2, slot, stub + 6);
+    memcpy(stub + 6, (unsigned char[]){ 0xcc, 0xcc }, 2);
+}
+
+// Lay out and fill in the mapping, once every symbol is known.
+static bool map(struct tier *tier, int n_stubs) {
+    struct x86_module *module = &tier->data;
+    struct x86_section_data *rodata = &module->sections[X86_RODATA], *data = &module->sections[X86_DATA],
+                            *bss = &module->sections[X86_BSS];
+    size_t n_functions = tier->functions.len, n_symbols = tier->symbols.len;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t thunks_at = n_functions * STUB_SIZE;
+    size_t stubs_at = thunks_at + n_functions * THUNK_SIZE;
+    size_t trampoline_at = round_up(stubs_at + n_stubs * STUB_SIZE, 16);
+    size_t slots_at = round_up(trampoline_at + sizeof(trampoline), page);
+    size_t enter_at = slots_at + n_functions * sizeof(char *);
+    size_t got_at = enter_at + sizeof(char *);
+    size_t rodata_at = round_up(got_at + n_symbols * sizeof(char *), page);
+    size_t data_at = rodata_at + round_up(rodata->bytes.len, page);
+    size_t bss_at = data_at + round_up(data->bytes.len, bss->align);
+    size_t code_at = round_up(bss_at + bss->size, page);
+    tier->size = code_at + CODE_RESERVE;
+    tier->memory = mmap(nullptr, tier->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (tier->memory == MAP_FAILED) {
+        perror("tier: mmap");
+        tier->memory = nullptr;
+        return false;
+    }
+
+    char *m = tier->memory;
+    tier->sections[X86_TEXT] = m;
+    tier->sections[X86_RODATA] = m + rodata_at;
+    tier->sections[X86_DATA] = m + data_at;
+    tier->sections[X86_BSS] = m + bss_at;
+    tier->stubs = m + stubs_at;
+    tier->got = (char **)(m + got_at);
+    tier->code = m + code_at;
+    tier->code_size = CODE_RESERVE;
+    memcpy(m + rodata_at, rodata->bytes.data, rodata->bytes.len);
+    memcpy(m + data_at, data->bytes.data, data->bytes.len);
+
+    char *entry = m + trampoline_at;
+    memcpy(entry, trampoline, sizeof(trampoline));
+    // the call's displacement ends before the leave and ret
+    char *call_end = entry + sizeof(trampoline) - 2;
+    put_rel32(call_end - 4, m + enter_at, call_end);
+    struct words (*enter)(struct tier_function *, const uint64_t *, const uint64_t *) = enter_interpreter;
+    memcpy(m + enter_at, &enter, sizeof(enter));
+
+    for (size_t f = 0; f < n_functions; f++) {
+        struct tier_function *function = &tier->functions.data[f];
+        function->stub = m + f * STUB_SIZE;
+        function->thunk = m + thunks_at + f * THUNK_SIZE;
+        function->slot = (_Atomic(char *) *)(m + slots_at + f * sizeof(char *));
+        atomic_init(function->slot, function->thunk);
+        put_stub(function->stub, (char *)function->slot);
+        char *t = function->thunk;
+        memcpy(t, (unsigned char[]){ 0x49, 0xbb }, 2);
+        memcpy(t + 2, &function, 8);
+        t[10] = (char)0xe9;
+        put_rel32(t + 11, entry, t + 15);
+        t[15] = (char)0xcc;
+    }
+
+    for (size_t s = 0; s < n_symbols; s++) {
+        struct tier_symbol *symbol = &tier->symbols.data[s];
+        if (s < n_functions) {
+            symbol->address = tier->functions.data[s].stub;
+        } else if (!symbol->address) {
+            struct x86_symbol *defined = &module->symbols.data[find_symbol(module, symbol->name)];
+            symbol->address = tier->sections[defined->section] + defined->offset;
+        }
+        tier->got[s] = symbol->address;
+        if (symbol->stub != -1) put_stub(tier->stubs + symbol->stub * STUB_SIZE, (char *)&tier->got[s]);
+    }
+    for_each (&data->relocs) {
+        if (!relocate(tier, tier->sections[X86_DATA], it)) return false;
+    }
+
+    if (mprotect(m, slots_at, PROT_READ | PROT_EXEC) || mprotect(m + rodata_at, data_at - rodata_at, PROT_READ) ||
+        mprotect(tier->code, CODE_RESERVE, PROT_NONE)) {
+        perror("tier: mprotect");
+        return false;
+    }
+    if (tier->flags & JIT_PERF_MAP) write_perf_map(m, trampoline_at + sizeof(trampoline), "[tier stubs]");
+    return true;
+}
+
+struct tier *tier_load(struct tu *tu, int flags) {
+    struct tier *tier = calloc(1, sizeof(struct tier));
+    tier->tu = tu;
+    tier->flags = flags;
+    pthread_mutex_init(&tier->lock, nullptr);
+    pthread_cond_init(&tier->work, nullptr);
+    for (int s = 0; s < N_X86_SECTIONS; s++) tier->data.sections[s].align = 1;
+
+    // the functions come first among the symbols, in the same order
+    for_each (&tu->module.functions) {
+        bool is_global;
+        int symbol = scope_symbol(tu, (*it)->scope, &is_global);
+        list_push(&tier->functions, ((struct tier_function){ .tier = tier, .ir = *it, .symbol = symbol }));
+        add_symbol(tier, symbol, nullptr, -1);
+    }
+    name_list_t names = {};
+    collect_references(tier, &names);
+    build_data(tu, &tier->data);
+    for_each (&tier->data.symbols) add_symbol(tier, it->name, nullptr, -1);
+
+    int n_stubs = 0;
+    bool ok = true;
+    for_each (&names) ok = ok && add_external(tier, *it, &n_stubs);
+    for_each (&tier->data.sections[X86_DATA].relocs) ok = ok && add_external(tier, it->symbol, &n_stubs);
+    list_clear(&names);
+    ok = ok && map(tier, n_stubs);
+    for_each (&tier->functions) ok = ok && build_bytecode(tier, it);
+    if (!ok) {
+        tier_free(tier);
+        return nullptr;
+    }
+    return tier;
+}
+
+bool tier_call(struct tier *tier, const char *name, int argc, char **argv, int *result) {
+    int f = tier_function_index(tier, tu_intern(tier->tu, name, strlen(name)));
+    if (f == -1) return false;
+    int (*function)(int, char **);
+    memcpy(&function, &tier->functions.data[f].stub, sizeof(function));
+    *result = function(argc, argv);
+    return true;
+}
+
+void tier_free(struct tier *tier) {
+    pthread_mutex_lock(&tier->lock);
+    tier->stop = true;
+    pthread_cond_broadcast(&tier->work);
+    pthread_mutex_unlock(&tier->lock);
+    if (tier->started) pthread_join(tier->thread, nullptr);
+
+    if (tier->memory) munmap(tier->memory, tier->size);
+    for_each (&tier->functions) free_bytecode(&it->code);
+    list_clear(&tier->functions);
+    list_clear(&tier->symbols);
+    list_clear(&tier->queue);
+    free_module(&tier->data);
+    pthread_mutex_destroy(&tier->lock);
+    pthread_cond_destroy(&tier->work);
+    free(tier);
+}
@@ -0,0 +1,132 @@
+#pragma once
+#ifndef COMPILER_TIER_H
+#define COMPILER_TIER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "list.h"
+#include "x86.h"
+
+struct tu;
+struct function;
+
+// Tiered execution of a translation unit whose IR has been emitted with
+// tu->tiered set, so nothing has been optimized yet. Every function starts out
+// interpreted, from bytecode translated from its IR, and counts its calls and
+// the backward jumps it takes. One that reaches either threshold is queued
+// for a background thread, which optimizes, allocates, generates and encodes
+// it like --jit would, and installs the machine code; calls from then on go
+// there instead. A call in progress carries on in the interpreter.
+
+// calls, or backward jumps, before a function is compiled
+#define TIER_CALLS 1000
+#define TIER_BACK_EDGES 10000
+
+struct bc_instr;
+struct bc_call;
+
+// A function translated for the interpreter: instructions that read and
+// write slots, one for each IR register and then a few scratch ones, with
+// their constants and call sites in side tables.
+struct bytecode {
+    list(struct bc_instr) instrs;
+    list(uint64_t) constants;
+    list(struct bc_call) calls;
+    // the slot of each argument of each call, and of each parameter, with
+    // FLOAT_SLOT set on the floats, which are passed in xmm registers
+    list(uint32_t) args;
+    list(uint32_t) params;
+    uint32_t n_slots;
+    // the bytes of the variables that live in memory
+    uint32_t frame_size;
+};
+
+#define FLOAT_SLOT 0x80000000u
+
+struct tier_function {
+    struct tier *tier;
+    struct function *ir;
+    int symbol;
+    struct bytecode code;
+    int calls;
+    int back_edges;
+    // whether it has been queued to be compiled, under the tier's lock
+    bool queued;
+    // Calls from machine code go to the entry stub, which jumps to wherever
+    // the slot says: the thunk into the interpreter until the function is
+    // compiled. Its address is the function's address.
+    char *stub;
+    char *thunk;
+    _Atomic(char *) *slot;
+};
+
+// A symbol the module defines or uses, and its GOT entry at the same index.
+struct tier_symbol {
+    int name;
+    char *address;
+    // the stub that calls to a symbol of another module go through, or -1
+    int stub;
+};
+
+struct tier {
+    struct tu *tu;
+    int flags;
+    // the module's data; the functions are compiled one at a time
+    struct x86_module data;
+    char *memory;
+    size_t size;
+    char *sections[N_X86_SECTIONS];
+    list(struct tier_function) functions;
+    list(struct tier_symbol) symbols;
+    char **got;
+    char *stubs;
+    // where compiled functions go, a page or more each, so that a page
+    // never changes protection while code on it might run
+    char *code;
+    size_t code_used;
+    size_t code_size;
+
+    pthread_t thread;
+    bool started;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    list(struct tier_function *) queue;
+    size_t next;
+    bool stop;
+};
+
+// The registers a value comes back in, as the System V ABI returns a struct
+// of an integer and a double in rax and xmm0.
+struct words {
+    uint64_t i;
+    double f;
+};
+
+// Translate a function's IR to bytecode, and interpret it with the values
+// of its parameters.
+bool build_bytecode(struct tier *tier, struct tier_function *f);
+uint64_t interpret(struct tier *tier, struct tier_function *f, const uint64_t *args, size_t n_args);
+void free_bytecode(struct bytecode *code);
+// Where the thunk of a function that hasn't been compiled goes, by way of a
+// trampoline that stores the argument registers in order, rdi to r9 then
+// xmm0 to xmm7, and passes them with the arguments on the caller's stack.
+struct words enter_interpreter(struct tier_function *f, const uint64_t *registers, const uint64_t *stack);
+
+// The function or symbol a name refers to, or -1.
+int tier_function_index(struct tier *tier, int name);
+int tier_symbol_index(struct tier *tier, int name);
+// Queue a function that has got hot to be compiled.
+void request_compile(struct tier *tier, struct tier_function *f);
+
+// Load a translation unit for tiered execution, with the JIT_PERF_MAP flag of
+// jit.h describing each function as it is compiled. Returns nullptr if a
+// symbol can't be found.
+struct tier *tier_load(struct tu *tu, int flags);
+// Call a function as int name(int argc, char **argv), like jit_call.
+bool tier_call(struct tier *tier, const char *name, int argc, char **argv, int *result);
+// Wait for the function being compiled, if any, and free everything.
+void tier_free(struct tier *tier);
+
+#endif //COMPILER_TIER_H
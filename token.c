@@ -318,6 +318,14 @@ static void read_number(struct state *state) {
         report_error(state, "number literal out of range");
     }
 
+    // suffixes are kept as part of the token, the typer reads them to find
+    // the type of the literal.
+    if (token->type == TOKEN_INT_LITERAL) {
+        while (*after == 'u' || *after == 'U' || *after == 'l' || *after == 'L') after += 1;
+    } else {
+        if (*after == 'f' || *after == 'F' || *after == 'l' || *after == 'L') after += 1;
+    }
+
     state->position += (int)(after - str);
 
     end(state, token);
@@ -327,8 +335,8 @@ static void read_string(struct state *state) {
     struct token *token = new(state, TOKEN_STRING_LITERAL);
 
     eat(state, '"');
-    // TODO: escaping "s
-    while (CHAR(state) != '"') {
+    while (CHAR(state) != '"' && more_data(state)) {
+        if (CHAR(state) == '\\') pass(state);
         pass(state);
     }
     eat(state, '"');
@@ -336,6 +344,52 @@ static void read_string(struct state *state) {
     end(state, token);
 }
 
+// Decode the escape sequences in a string literal token. Returns the length of
+// the string without its terminating null, and writes the bytes to out if it is
+// not nullptr.
+size_t string_literal_decode(const char *source, struct token *token, char *out) {
+    const char *s = &source[token->index + 1];
+    const char *end = &source[token->index + token->len - 1];
+    size_t len = 0;
+
+    while (s < end) {
+        char c = *s++;
+        if (c == '\\' && s < end) {
+            c = *s++;
+            switch (c) {
+            case 'a': c = '\a'; break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'v': c = '\v'; break;
+            case 'x': {
+                int v = 0;
+                while (s < end && isxdigit(*s)) {
+                    v = v * 16 + (isdigit(*s) ? *s - '0' : (tolower(*s) - 'a' + 10));
+                    s += 1;
+                }
+                c = (char)v;
+                break;
+            }
+            default:
+                if (c >= '0' && c < '8') {
+                    int v = c - '0';
+                    for (int i = 0; i < 2 && s < end && *s >= '0' && *s < '8'; i += 1) {
+                        v = v * 8 + (*s++ - '0');
+                    }
+                    c = (char)v;
+                }
+            }
+        }
+        if (out) out[len] = c;
+        len += 1;
+    }
+
+    return len;
+}
+
 static void read_char(struct state *state) {
     struct token *token = new(state, TOKEN_INT_LITERAL);
     uint64_t value = 0;
@@ -454,7 +508,7 @@ static void read_symbol(struct state *state) {
         } else if (pull(state, '=')) token->type = TOKEN_BITAND_EQUAL;
         break;
     case '.':
-        if (PEEK(state) == '.' && state->source[state->position + 2] == '.') {
+        if (CHAR(state) == '.' && PEEK(state) == '.') {
             pass(state);
             pass(state);
             token->type = TOKEN_ELLIPSES;
@@ -3,6 +3,7 @@
 #define COMPILER_TOKEN_H
 
 #include <stdlib.h>
+#include <stdint.h>
 
 enum {
     TOKEN_NULL = 0,
@@ -125,5 +126,6 @@ void print_tokens(struct tu *);
 void print_token(struct tu *tu, struct token *token);
 void print_token_type(struct token *);
 const char *token_type_string(int token_type);
+size_t string_literal_decode(const char *source, struct token *token, char *out);
 
 #endif //COMPILER_TOKEN_H
@@ -1,3 +1,84 @@
 #include "tu.h"
 #include "token.h"
 #include "parse.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+static uint32_t strtab_hash(const char *str, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void strtab_rehash(struct tu *tu) {
+    int capacity = tu->strtab.hash_capacity ? tu->strtab.hash_capacity * 2 : 256;
+    int *hash = malloc(capacity * sizeof(int));
+    for (int i = 0; i < capacity; i++) hash[i] = -1;
+
+    for (int i = 0; i < tu->strtab.hash_capacity; i++) {
+        int offset = tu->strtab.hash[i];
+        if (offset < 0) continue;
+        const char *str = tu_string(tu, offset);
+        uint32_t slot = strtab_hash(str, strlen(str)) & (capacity - 1);
+        while (hash[slot] >= 0) slot = (slot + 1) & (capacity - 1);
+        hash[slot] = offset;
+    }
+
+    free(tu->strtab.hash);
+    tu->strtab.hash = hash;
+    tu->strtab.hash_capacity = capacity;
+}
+
+// Add a string to the string table, or find the copy that is already there.
+int tu_intern(struct tu *tu, const char *str, size_t len) {
+    if (len == 0) return 0;
+    if (!tu->strtab.strtab) {
+        tu->strtab.capacity = 4096;
+        tu->strtab.strtab = malloc(tu->strtab.capacity);
+        tu->strtab.strtab[0] = 0;
+        tu->strtab.len = 1;
+    }
+    if ((tu->strtab.count + 1) * 2 > tu->strtab.hash_capacity) strtab_rehash(tu);
+
+    int mask = tu->strtab.hash_capacity - 1;
+    uint32_t slot = strtab_hash(str, len) & mask;
+    for (; tu->strtab.hash[slot] >= 0; slot = (slot + 1) & mask) {
+        const char *existing = tu_string(tu, tu->strtab.hash[slot]);
+        if (strncmp(existing, str, len) == 0 && existing[len] == 0) return tu->strtab.hash[slot];
+    }
+
+    while (tu->strtab.len + (int)len + 1 > tu->strtab.capacity) {
+        tu->strtab.capacity *= 2;
+        tu->strtab.strtab = realloc(tu->strtab.strtab, tu->strtab.capacity);
+    }
+    int offset = tu->strtab.len;
+    memcpy(&tu->strtab.strtab[offset], str, len);
+    tu->strtab.strtab[offset + len] = 0;
+    tu->strtab.len += (int)len + 1;
+
+    tu->strtab.hash[slot] = offset;
+    tu->strtab.count += 1;
+    return offset;
+}
+
+int tu_printf(struct tu *tu, const char *format, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    if (len < (int)sizeof(buffer)) return tu_intern(tu, buffer, len);
+
+    char *long_buffer = malloc(len + 1);
+    va_start(args, format);
+    vsnprintf(long_buffer, len + 1, format, args);
+    va_end(args);
+    int offset = tu_intern(tu, long_buffer, len);
+    free(long_buffer);
+    return offset;
+}
@@ -2,16 +2,20 @@
 #ifndef COMPILER_TU_H
 #define COMPILER_TU_H
 
+#include <stdatomic.h>
 #include <stdlib.h>
 
 #include "list.h"
 #include "token.h"
 #include "parse.h"
 #include "type.h"
+#include "ir.h"
+#include "sched.h"
+
+struct pool;
 
 typedef list(struct token) token_list_t;
 typedef list(struct scope) scope_list_t;
-typedef list(struct function) function_list_t;
 
 struct tu {
     const char *filename;
@@ -25,22 +29,53 @@ struct tu {
     struct node *ast_root;
 
     scope_list_t scopes;
-    type_list_t types;
-    function_list_t functions;
+    struct type_table types;
+    struct module module;
 
+    // Interned strings, addressed by offset since the buffer moves as it
+    // grows. Offset 0 is the empty string.
     struct {
         int capacity;
         int len;
         char *strtab;
+        // open addressed set of the offsets of every string, for interning
+        int *hash;
+        int hash_capacity;
+        int count;
     } strtab;
 
+    // worker threads for the parallel passes, 0 for one per CPU
+    int jobs;
+    // from -O: 2 schedules instructions, and 3 allocates registers by graph
+    // coloring instead of linear scan
+    int opt_level;
+    // from -mtune: the machine the schedulers plan for
+    enum tune tune;
+    // from --tier: emit leaves functions as they are, to be interpreted, and
+    // each is optimized once it has run enough to be worth compiling
+    bool tiered;
+    // from --print-loops: optimize lists each function's loops and their
+    // trip counts
+    bool print_loops;
+    struct pool *pool;
+
     bool abort;
+    // the errors reported, counted by the threads of the parallel passes too,
+    // after which there is nothing to emit
+    _Atomic int errors;
 };
 
 #include "token.h"
 #include "parse.h"
 
 
+int tu_intern(struct tu *, const char *str, size_t len);
+int tu_printf(struct tu *, const char *format, ...);
+
+static inline const char *tu_string(struct tu *tu, int offset) {
+    return &tu->strtab.strtab[offset];
+}
+
 static inline struct token *tu_token(struct tu *tu, int token_id) {
     return &tu->tokens[token_id];
 }
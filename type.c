@@ -4,6 +4,9 @@
 #include "parse.h"
 #include "util.h"
 #include "diag.h"
+#include "eval.h"
+#include "walk.h"
+#include "pool.h"
 
 #include <assert.h>
 #include <stdlib.h>
@@ -11,22 +14,86 @@
 #include <string.h>
 
 #define SCOPE(n) list_ptr(&tu->scopes, n)
-#define TYPE(n) list_ptr(&tu->types, n)
+#define TYPE(n) type_at(&tu->types, n)
 #define TOKEN_STR(tok) (&tu->source[(tok)->index])
 
-int type_recur(struct tu *tu, struct node *node, int block_depth, int parent_scope);
-static int debug_create_type(struct tu *tu, int parent, enum layer_type base, enum type_flags flags);
+static int type_declaration(struct tu *tu, struct walk *exprs, struct node *node, int block_depth, int scope);
+static void type_statement(struct tu *tu, struct node *root, int block_depth, int scope, int return_type);
+static void type_function_body(struct tu *tu, struct node *node, int block_depth, int scope);
 
-static struct type *new_type(struct tu *tu);
 static struct scope *new_scope(struct tu *tu);
 
+// A function body typed on a worker thread. Its scopes are allocated from a
+// range of tu->scopes reserved before the parallel pass starts, so the list
+// is never reallocated while other threads are reading the global scopes.
+struct function_job {
+    struct tu *tu;
+    struct node *node;
+    int scope;
+    int first_scope;
+    int end_scope;
+};
+
+static thread_local struct function_job *current_job;
+
+static void type_function_job(void *arg) {
+    struct function_job *job = arg;
+    current_job = job;
+    type_function_body(job->tu, job->node, 0, job->scope);
+    current_job = nullptr;
+}
+
 int type(struct tu *tu) {
     // discard index 0, so it can be used for "none"
     // moved to main for now since this has to happen during parse() now
     // (void) new_type(tu);
     // (void) new_scope(tu);
 
-    type_recur(tu, tu->ast_root, 0, 0);
+    struct node *root = tu->ast_root;
+    list(struct function_job) jobs = {};
+    int scope = 0;
+
+    // File scope declarations and function declarators are resolved in order,
+    // since each one can see the ones before it. After this nothing global
+    // changes, so function bodies only read global state.
+    struct walk exprs = {};
+    for_each (&root->root.children) {
+        struct node *node = *it;
+        if (node->type == NODE_FUNCTION_DEFINITION) {
+            scope = type_declaration(tu, &exprs, node->fun.decl, 0, scope);
+            list_push(&jobs, ((struct function_job){ .tu = tu, .node = node, .scope = scope }));
+        } else if (node->type == NODE_DECLARATION) {
+            scope = type_declaration(tu, &exprs, node, 0, scope);
+        } else {
+            type_statement(tu, node, 0, scope, 0);
+        }
+    }
+    walk_free(&exprs);
+
+    for_each (&jobs) {
+        it->first_scope = (int)tu->scopes.len;
+        it->end_scope = it->first_scope + it->node->fun.n_locals;
+        for (int i = 0; i < it->node->fun.n_locals; i += 1) {
+            list_push(&tu->scopes, (struct scope){});
+        }
+    }
+
+    if (jobs.len > 1 && tu->jobs != 1) {
+        if (!tu->pool) tu->pool = pool_create(tu->jobs);
+        for_each (&jobs) {
+            pool_submit(tu->pool, type_function_job, it);
+        }
+        pool_wait(tu->pool);
+        // nothing after typing runs in parallel
+        pool_destroy(tu->pool);
+        tu->pool = nullptr;
+    } else {
+        for_each (&jobs) {
+            type_function_job(it);
+        }
+    }
+
+    list_clear(&jobs);
 
     return 0;
 }
@@ -50,21 +117,110 @@ static void report_error_node(struct tu *tu, struct node *node, const char *mess
 }
 
 static struct scope *new_scope(struct tu *tu) {
+    if (current_job) {
+        assert(current_job->first_scope < current_job->end_scope);
+        struct scope *scope = SCOPE(current_job->first_scope);
+        current_job->first_scope += 1;
+        return scope;
+    }
     list_push(&tu->scopes, (struct scope){});
     return &list_last(&tu->scopes);
 }
 
-static struct type *new_type(struct tu *tu) {
-    list_push(&tu->types, (struct type){});
-    return &list_last(&tu->types);
-}
-
 int scope_id(struct tu *tu, struct scope *scope) {
     return (int)(list_indexof(&tu->scopes, scope));
 }
 
-int type_id(struct tu *tu, struct type *type) {
-    return (int)(list_indexof(&tu->types, type));
+void type_table_init(struct type_table *table) {
+    pthread_mutex_init(&table->lock, nullptr);
+    table->n_buckets = 256;
+    table->buckets = calloc(table->n_buckets, sizeof(int));
+
+    // index 0 is "none"
+    table->chunks[0] = calloc(TYPE_CHUNK_SIZE, sizeof(struct type));
+    table->len = 1;
+}
+
+static uint64_t type_hash(struct type *type) {
+    uint64_t hash = 14695981039346656037u;
+#define MIX(v) (hash = (hash ^ (uint64_t)(v)) * 1099511628211u)
+    MIX(type->layer);
+    MIX(type->flags);
+    MIX(type->inner);
+    if (type->layer == TYPE_ARRAY) MIX(type->array.len);
+    if (type->layer == TYPE_FUNCTION) {
+        MIX(type->function.variadic);
+        for_each (&type->function.params) MIX(*it);
+    }
+#undef MIX
+    return hash;
+}
+
+static bool type_equal(struct type *a, struct type *b) {
+    if (a->layer != b->layer || a->flags != b->flags || a->inner != b->inner)
+        return false;
+    if (a->layer == TYPE_ARRAY)
+        return a->array.len == b->array.len;
+    if (a->layer == TYPE_FUNCTION) {
+        if (a->function.variadic != b->function.variadic || a->function.params.len != b->function.params.len)
+            return false;
+        return a->function.params.len == 0 ||
+            memcmp(a->function.params.data, b->function.params.data, a->function.params.len * sizeof(int)) == 0;
+    }
+    return true;
+}
+
+// Insert id into the hash set, which must have a free bucket.
+static void insert_bucket(struct type_table *table, int id) {
+    size_t mask = table->n_buckets - 1;
+    size_t i = type_hash(type_at(table, id)) & mask;
+    while (table->buckets[i]) i = (i + 1) & mask;
+    table->buckets[i] = id;
+}
+
+// Find the type equal to key, or add a copy of it. This is the only way types
+// are created, and it is safe to call from several threads at once.
+static int intern_type(struct tu *tu, struct type *key) {
+    struct type_table *table = &tu->types;
+    uint64_t hash = type_hash(key);
+
+    pthread_mutex_lock(&table->lock);
+
+    size_t mask = table->n_buckets - 1;
+    size_t i;
+    for (i = hash & mask; table->buckets[i]; i = (i + 1) & mask) {
+        int id = table->buckets[i];
+        if (type_equal(type_at(table, id), key)) {
+            pthread_mutex_unlock(&table->lock);
+            return id;
+        }
+    }
+
+    int id = (int)table->len;
+    if ((id & (TYPE_CHUNK_SIZE - 1)) == 0) {
+        if (id >> TYPE_CHUNK_BITS >= TYPE_MAX_CHUNKS) {
+            error_abort(tu, "too many types");
+        }
+        table->chunks[id >> TYPE_CHUNK_BITS] = calloc(TYPE_CHUNK_SIZE, sizeof(struct type));
+    }
+    struct type *type = type_at(table, id);
+    *type = *key;
+    if (key->layer == TYPE_FUNCTION) {
+        type->function.params = (typeof(type->function.params)){};
+        for_each (&key->function.params) list_push(&type->function.params, *it);
+    }
+    table->len += 1;
+    table->buckets[i] = id;
+
+    if (table->len * 2 > table->n_buckets) {
+        free(table->buckets);
+        table->n_buckets *= 2;
+        table->buckets = calloc(table->n_buckets, sizeof(int));
+        for (int t = 1; t < (int)table->len; t += 1) insert_bucket(table, t);
+    }
+
+    pthread_mutex_unlock(&table->lock);
+    return id;
 }
 
 // This doesn't currently print in C syntax, but it's good enough to know
@@ -84,7 +240,8 @@ void print_type(struct tu *tu, int type_id) {
 #define CASE(type_id, type_name) case (type_id): fputs((type_name), stderr); break
     switch (type->layer) {
     CASE(TYPE_VOID, "void");
-    CASE(TYPE_SIGNED_CHAR, "char");
+    CASE(TYPE_CHAR, "char");
+    CASE(TYPE_SIGNED_CHAR, "signed char");
     CASE(TYPE_SIGNED_SHORT, "short");
     CASE(TYPE_SIGNED_INT, "int");
     CASE(TYPE_SIGNED_LONG, "long");
@@ -102,8 +259,19 @@ void print_type(struct tu *tu, int type_id) {
     CASE(TYPE_COMPLEX_DOUBLE, "complex double");
     CASE(TYPE_COMPLEX_LONG_DOUBLE, "complex long double");
     CASE(TYPE_POINTER, "pointer to");
-    CASE(TYPE_ARRAY, "array [] of");
-    CASE(TYPE_FUNCTION, "function () returning");
+    case TYPE_ARRAY:
+        if (type->array.len) fprintf(stderr, "array [%lli] of", (long long)type->array.len);
+        else fputs("array [] of", stderr);
+        break;
+    case TYPE_FUNCTION:
+        fputs("function (", stderr);
+        for (size_t i = 0; i < type->function.params.len; i += 1) {
+            if (i) fputs(", ", stderr);
+            print_type(tu, type->function.params.data[i]);
+        }
+        if (type->function.variadic) fputs(type->function.params.len ? ", ..." : "...", stderr);
+        fputs(") returning", stderr);
+        break;
     CASE(TYPE_ENUM, "(enum)");
     CASE(TYPE_STRUCT, "(struct)");
     CASE(TYPE_UNION, "(union)");
@@ -135,17 +303,10 @@ void print_storage_class(enum storage_class class) {
     }
 }
 
-static int debug_create_type(struct tu *tu, int parent, enum layer_type base, enum type_flags flags) {
-    struct type *type = new_type(tu);
-    type->inner = parent;
-    type->layer = base;
-    type->flags = flags;
-    return type_id(tu, type);
-}
-
 static const char *base_type_ids[] = {
     [TYPE_VOID] = "void",
-    [TYPE_SIGNED_CHAR] = "char",
+    [TYPE_CHAR] = "char",
+    [TYPE_SIGNED_CHAR] = "signed char",
     [TYPE_SIGNED_SHORT] = "short",
     [TYPE_SIGNED_INT] = "int",
     [TYPE_SIGNED_LONG] = "long",
@@ -155,17 +316,65 @@ static const char *base_type_ids[] = {
 };
 
 int find_or_create_type(struct tu *tu, int inner, enum layer_type base, enum type_flags flags) {
-    for_each (&tu->types) {
-        if (it->inner == inner && it->layer == base && it->flags == flags)
-            return list_indexof(&tu->types, it);
+    assert(base != TYPE_ARRAY && base != TYPE_FUNCTION);
+    struct type key = { .layer = base, .flags = flags, .inner = inner };
+    return intern_type(tu, &key);
+}
+
+int find_or_create_array_type(struct tu *tu, int inner, int64_t len) {
+    struct type key = { .layer = TYPE_ARRAY, .inner = inner, .array.len = len };
+    return intern_type(tu, &key);
+}
+
+int find_or_create_function_type(struct tu *tu, int ret, int *params, size_t n_params, bool variadic) {
+    struct type key = { .layer = TYPE_FUNCTION, .inner = ret };
+    key.function.params.data = params;
+    key.function.params.len = n_params;
+    key.function.variadic = variadic;
+    return intern_type(tu, &key);
+}
+
+// C23(N3096) 6.4.4.1.6: the type of an integer constant is the first of the
+// list for its suffix and base in which its value can be represented.
+int int_literal_type(struct tu *tu, struct token *token) {
+    const char *str = TOKEN_STR(token);
+    if (str[0] == '\'') {
+        return find_or_create_type(tu, 0, TYPE_SIGNED_INT, 0);
     }
 
-    struct type *ty = new_type(tu);
-    ty->layer = base;
-    ty->flags = flags;
-    ty->inner = inner;
+    bool is_unsigned = false;
+    int longs = 0;
+    for (int i = 0; i < token->len; i += 1) {
+        if (str[i] == 'u' || str[i] == 'U') is_unsigned = true;
+        if (str[i] == 'l' || str[i] == 'L') longs += 1;
+    }
+    bool is_decimal = str[0] != '0' || token->len == 1 || str[1] == 'u' || str[1] == 'U' ||
+        str[1] == 'l' || str[1] == 'L';
+
+    uint64_t value = token->int_.value;
+    enum layer_type layer;
+
+    if (longs == 0 && !is_unsigned && value <= INT32_MAX) layer = TYPE_SIGNED_INT;
+    else if (longs == 0 && (is_unsigned || !is_decimal) && value <= UINT32_MAX) layer = TYPE_UNSIGNED_INT;
+    else if (longs < 2 && !is_unsigned && value <= INT64_MAX) layer = TYPE_SIGNED_LONG;
+    else if (longs < 2 && (is_unsigned || !is_decimal)) layer = TYPE_UNSIGNED_LONG;
+    else if (!is_unsigned && value <= INT64_MAX) layer = TYPE_SIGNED_LONG_LONG;
+    else if (is_unsigned || !is_decimal) layer = TYPE_UNSIGNED_LONG_LONG;
+    else {
+        print_error_token(tu, token, "integer literal is too large to be represented in any integer type");
+        layer = TYPE_UNSIGNED_LONG_LONG;
+    }
 
-    return type_id(tu, ty);
+    return find_or_create_type(tu, 0, layer, 0);
+}
+
+int float_literal_type(struct tu *tu, struct token *token) {
+    char suffix = TOKEN_STR(token)[token->len - 1];
+    if (suffix == 'f' || suffix == 'F')
+        return find_or_create_type(tu, 0, TYPE_FLOAT, 0);
+    if (suffix == 'l' || suffix == 'L')
+        return find_or_create_type(tu, 0, TYPE_LONG_DOUBLE, 0);
+    return find_or_create_type(tu, 0, TYPE_DOUBLE, 0);
 }
 
 int find_or_create_type_inner(struct tu *tu, int typ, struct node *decl) {
@@ -178,11 +387,35 @@ int find_or_create_type_inner(struct tu *tu, int typ, struct node *decl) {
             return find_or_create_type_inner(tu, layer, decl->d.inner);
         }
     case NODE_FUNCTION_DECLARATOR: {
-        int layer = find_or_create_type(tu, typ, TYPE_FUNCTION, 0);
+        list(int) params = {};
+        for_each (&decl->d.fun.args) {
+            struct node *arg = *it;
+            if (arg->type != NODE_DECLARATION) continue;
+            int param = arg->decl.decl_spec_c_type;
+            if (arg->decl.declarators.len)
+                param = find_or_create_type_inner(tu, param, list_first(&arg->decl.declarators));
+            else if (TYPE(param)->layer == TYPE_VOID && decl->d.fun.args.len == 1)
+                break;
+            // C23(N3096) 6.7.6.3.7: array and function parameters are adjusted to pointers
+            list_push(&params, type_rvalue(tu, param));
+        }
+        int layer = find_or_create_function_type(tu, typ, params.data, params.len, decl->d.fun.variadic);
+        free(params.data);
         return find_or_create_type_inner(tu, layer, decl->d.inner);
     }
     case NODE_ARRAY_DECLARATOR: {
-        int layer = find_or_create_type(tu, typ, TYPE_ARRAY, 0);
+        int64_t len = 0;
+        if (decl->d.arr.subscript) {
+            struct value *v = eval(tu, decl->d.arr.subscript);
+            if (v->kind != VALUE_INT) {
+                report_error_node(tu, decl->d.arr.subscript, "array size is not an integer constant expression");
+            } else if ((int64_t)v->i <= 0) {
+                report_error_node(tu, decl->d.arr.subscript, "array size must be greater than zero");
+            } else {
+                len = (int64_t)v->i;
+            }
+        }
+        int layer = find_or_create_array_type(tu, typ, len);
         return find_or_create_type_inner(tu, layer, decl->d.inner);
     }
     default:
@@ -221,6 +454,7 @@ size_t type_size(struct tu *tu, int type_id) {
     case TYPE_SIGNED_SHORT:
     case TYPE_UNSIGNED_SHORT:
         return 2;
+    case TYPE_CHAR:
     case TYPE_SIGNED_CHAR:
     case TYPE_UNSIGNED_CHAR:
     case TYPE_BOOL:
@@ -234,8 +468,11 @@ size_t type_size(struct tu *tu, int type_id) {
         report_error(tu, "struct and union type sizes are not implemented");
         return 0;
     case TYPE_ARRAY:
-        report_error(tu, "array type sizes are not implemented");
-        return 0;
+        if (type->array.len == 0) {
+            report_error(tu, "incomplete array types do not have a size");
+            return 0;
+        }
+        return type->array.len * type_size(tu, type->inner);
     case TYPE_FUNCTION:
         report_error(tu, "function types do not have a size");
         return 0;
@@ -267,6 +504,7 @@ size_t type_align(struct tu *tu, int type_id) {
     case TYPE_SIGNED_SHORT:
     case TYPE_UNSIGNED_SHORT:
         return 2;
+    case TYPE_CHAR:
     case TYPE_SIGNED_CHAR:
     case TYPE_UNSIGNED_CHAR:
     case TYPE_BOOL:
@@ -291,6 +529,130 @@ size_t type_align(struct tu *tu, int type_id) {
     }
 }
 
+bool type_is_integer(struct tu *tu, int type_id) {
+    struct type *type = TYPE(type_id);
+    return (type->layer >= TYPE_CHAR && type->layer <= TYPE_BOOL) || type->layer == TYPE_ENUM;
+}
+
+bool type_is_floating(struct tu *tu, int type_id) {
+    struct type *type = TYPE(type_id);
+    return type->layer >= TYPE_FLOAT && type->layer <= TYPE_COMPLEX_LONG_DOUBLE;
+}
+
+bool type_is_arithmetic(struct tu *tu, int type_id) {
+    return type_is_integer(tu, type_id) || type_is_floating(tu, type_id);
+}
+
+bool type_is_signed(struct tu *tu, int type_id) {
+    struct type *type = TYPE(type_id);
+    if (type->layer == TYPE_ENUM) return type_is_signed(tu, type->inner);
+    return type->layer >= TYPE_CHAR && type->layer <= TYPE_SIGNED_LONG_LONG;
+}
+
+bool type_is_pointer(struct tu *tu, int type_id) {
+    return TYPE(type_id)->layer == TYPE_POINTER;
+}
+
+// C23(N3096) 6.3.1.1.1
+static int integer_rank(enum layer_type layer) {
+    switch (layer) {
+    case TYPE_BOOL:
+        return 0;
+    case TYPE_CHAR:
+    case TYPE_SIGNED_CHAR:
+    case TYPE_UNSIGNED_CHAR:
+        return 1;
+    case TYPE_SIGNED_SHORT:
+    case TYPE_UNSIGNED_SHORT:
+        return 2;
+    case TYPE_SIGNED_INT:
+    case TYPE_UNSIGNED_INT:
+        return 3;
+    case TYPE_SIGNED_LONG:
+    case TYPE_UNSIGNED_LONG:
+        return 4;
+    case TYPE_SIGNED_LONG_LONG:
+    case TYPE_UNSIGNED_LONG_LONG:
+        return 5;
+    default:
+        return -1;
+    }
+}
+
+static enum layer_type unsigned_layer(enum layer_type layer) {
+    if (layer == TYPE_CHAR)
+        return TYPE_UNSIGNED_CHAR;
+    if (layer >= TYPE_SIGNED_CHAR && layer <= TYPE_SIGNED_LONG_LONG)
+        return layer - TYPE_SIGNED_CHAR + TYPE_UNSIGNED_CHAR;
+    return layer;
+}
+
+// Integer promotions, C23(N3096) 6.3.1.1.2. Non-integer types are returned
+// with their qualifiers removed.
+int type_promote(struct tu *tu, int type_id) {
+    struct type *type = TYPE(type_id);
+    if (type->layer == TYPE_ENUM)
+        return type_promote(tu, type->inner);
+    if (type_is_integer(tu, type_id) && integer_rank(type->layer) < integer_rank(TYPE_SIGNED_INT))
+        return find_or_create_type(tu, 0, TYPE_SIGNED_INT, 0);
+    if (type->flags == 0)
+        return type_id;
+    if (type->layer == TYPE_ARRAY)
+        return find_or_create_array_type(tu, type->inner, type->array.len);
+    return find_or_create_type(tu, type->inner, type->layer, 0);
+}
+
+// Lvalue conversion, C23(N3096) 6.3.2.1: arrays and functions decay to
+// pointers and qualifiers are removed.
+int type_rvalue(struct tu *tu, int type_id) {
+    struct type *type = TYPE(type_id);
+    if (type->layer == TYPE_ARRAY)
+        return find_or_create_type(tu, type->inner, TYPE_POINTER, 0);
+    if (type->layer == TYPE_FUNCTION)
+        return find_or_create_type(tu, type_id, TYPE_POINTER, 0);
+    if (type->flags == 0)
+        return type_id;
+    return find_or_create_type(tu, type->inner, type->layer, 0);
+}
+
+// Usual arithmetic conversions, C23(N3096) 6.3.1.8
+int type_common(struct tu *tu, int a, int b) {
+    enum layer_type la = TYPE(a)->layer;
+    enum layer_type lb = TYPE(b)->layer;
+
+    if (la == TYPE_LONG_DOUBLE || lb == TYPE_LONG_DOUBLE)
+        return find_or_create_type(tu, 0, TYPE_LONG_DOUBLE, 0);
+    if (la == TYPE_DOUBLE || lb == TYPE_DOUBLE)
+        return find_or_create_type(tu, 0, TYPE_DOUBLE, 0);
+    if (la == TYPE_FLOAT || lb == TYPE_FLOAT)
+        return find_or_create_type(tu, 0, TYPE_FLOAT, 0);
+
+    a = type_promote(tu, a);
+    b = type_promote(tu, b);
+    la = TYPE(a)->layer;
+    lb = TYPE(b)->layer;
+
+    if (la == lb)
+        return a;
+
+    bool sa = type_is_signed(tu, a);
+    bool sb = type_is_signed(tu, b);
+    int ra = integer_rank(la);
+    int rb = integer_rank(lb);
+
+    if (sa == sb)
+        return ra > rb ? a : b;
+
+    int s = sa ? a : b, u = sa ? b : a;
+    int rs = sa ? ra : rb, ru = sa ? rb : ra;
+
+    if (ru >= rs)
+        return u;
+    if (type_size(tu, s) > type_size(tu, u))
+        return s;
+    return find_or_create_type(tu, 0, unsigned_layer(TYPE(s)->layer), 0);
+}
+
 int token_cmp(struct tu *tu, struct token *a, struct token *b) {
     int len = a->len > b->len ? a->len : b->len;
     return strncmp(&tu->source[a->index], &tu->source[b->index], len);
@@ -326,10 +688,12 @@ int create_scope(struct tu *tu, int parent, int c_type, int depth, enum storage_
     scope->block_depth = depth;
     scope->sc = sc;
 
+    flockfile(stderr);
     fprintf(stderr, "%.*s has type ", scope->token->len, TOKEN_STR(scope->token));
     print_storage_class(sc);
     print_type(tu, c_type);
     fprintf(stderr, "\n");
+    funlockfile(stderr);
 
     return scope_id(tu, scope);
 }
@@ -348,151 +712,569 @@ struct scope *name_exists(struct tu *tu, struct token *token, int scope_id, int
     return nullptr;
 }
 
-// Recursively resolve types and names on the AST.
-// If the node creates a new visible name (like a function definition or declaration), return
-// a scope ID containing that name, otherwise return 0.
-// You can create sub-scopes internally without returning them, for example BLOCK creates
-// a scope with a higher block depth and uses it for child recursions, but does not return
-// anything because BLOCKs don't create new names visible after them in their peer scope.
-int type_recur(struct tu *tu, struct node *node, int block_depth, int parent_scope) {
-    int scope = parent_scope;
+static int int_type(struct tu *tu) {
+    return find_or_create_type(tu, 0, TYPE_SIGNED_INT, 0);
+}
+
+static bool is_scalar(struct tu *tu, int type_id) {
+    return type_is_arithmetic(tu, type_id) || type_is_pointer(tu, type_id);
+}
 
+static bool is_lvalue(struct tu *tu, struct node *node) {
     switch (node->type) {
-    case NODE_DECLARATION: {
-        // struct node *base_type = node->decl.decl_spec;
-        for_each (&node->decl.declarators) {
-            struct node *d = *it;
-            struct scope *before;
-            if ((before = name_exists(tu, d->d.name, scope, block_depth))) {
-                report_error_node(tu, d, "redefinition of name");
-                print_info_node(tu, before->decl, "previous definition is here");
-            }
-            struct scope *parent = SCOPE(parent_scope);
-            if (parent->is_global && node->decl.sc == ST_AUTOMATIC) {
-                node->decl.sc = ST_STATIC;
-            }
-            int type_id = find_or_create_decl_type(tu, node, d);
-            scope = create_scope(tu, scope, type_id, block_depth, node->decl.sc, d, nullptr);
+    case NODE_IDENT:
+        return TYPE(node->c_type)->layer != TYPE_FUNCTION;
+    case NODE_SUBSCRIPT:
+    case NODE_STRING_LITERAL:
+        return true;
+    case NODE_UNARY_OP:
+        return node->token->type == '*';
+    default:
+        return false;
+    }
+}
 
-            d->d.scope_id = scope;
+// C23(N3096) 6.3.2.1.1
+static bool check_modifiable_lvalue(struct tu *tu, struct node *node) {
+    if (!is_lvalue(tu, node)) {
+        report_error_node(tu, node, "expression is not assignable");
+        return false;
+    }
+    struct type *type = TYPE(node->c_type);
+    if (type->flags & TF_CONST || type->layer == TYPE_ARRAY) {
+        report_error_node(tu, node, "cannot assign to a const-qualified or array lvalue");
+        return false;
+    }
+    return true;
+}
 
-            if (d->d.initializer) {
-                type_recur(tu, d->d.initializer, block_depth, scope);
-            }
-        }
-        return scope;
+// Simple assignment constraints, C23(N3096) 6.5.16.1. Pointer target
+// compatibility is not checked yet.
+static void check_assignable(struct tu *tu, struct node *node, int to, int from) {
+    if (type_is_arithmetic(tu, to) && type_is_arithmetic(tu, from))
+        return;
+    if (type_is_pointer(tu, to) && (type_is_pointer(tu, from) || type_is_integer(tu, from)))
+        return;
+    if (TYPE(to)->layer == TYPE_BOOL && type_is_pointer(tu, from))
+        return;
+    report_error_node(tu, node, "incompatible types in assignment");
+}
+
+static bool is_compound_assignment(int op) {
+    return op == TOKEN_PLUS_EQUAL || op == TOKEN_MINUS_EQUAL || op == TOKEN_STAR_EQUAL ||
+        op == TOKEN_DIVIDE_EQUAL || op == TOKEN_MOD_EQUAL || op == TOKEN_SHIFT_LEFT_EQUAL ||
+        op == TOKEN_SHIFT_RIGHT_EQUAL || op == TOKEN_BITAND_EQUAL || op == TOKEN_BITOR_EQUAL ||
+        op == TOKEN_BITXOR_EQUAL;
+}
+
+static int type_binary(struct tu *tu, struct node *node) {
+    int op = node->token->type;
+    struct node *lhs = node->binop.lhs;
+    struct node *rhs = node->binop.rhs;
+    if (!lhs->c_type || !rhs->c_type) return 0;
+
+    int l = type_rvalue(tu, lhs->c_type);
+    int r = type_rvalue(tu, rhs->c_type);
+
+    if (op == '=') {
+        if (!check_modifiable_lvalue(tu, lhs)) return 0;
+        check_assignable(tu, node, l, r);
+        return l;
     }
-    case NODE_ROOT:
-        for_each (&node->root.children) {
-            int s = type_recur(tu, *it, block_depth, scope);
-            if (s) scope = s;
+    if (is_compound_assignment(op)) {
+        if (!check_modifiable_lvalue(tu, lhs)) return 0;
+        bool pointer_step = (op == TOKEN_PLUS_EQUAL || op == TOKEN_MINUS_EQUAL) &&
+            type_is_pointer(tu, l) && type_is_integer(tu, r);
+        if (!pointer_step && !(type_is_arithmetic(tu, l) && type_is_arithmetic(tu, r))) {
+            report_error_node(tu, node, "invalid operands to compound assignment");
+            return 0;
         }
+        return l;
+    }
+
+    switch (op) {
+    case ',':
+        return r;
+    case '+':
+        if (type_is_arithmetic(tu, l) && type_is_arithmetic(tu, r)) return type_common(tu, l, r);
+        if (type_is_pointer(tu, l) && type_is_integer(tu, r)) return l;
+        if (type_is_integer(tu, l) && type_is_pointer(tu, r)) return r;
         break;
-    case NODE_BLOCK:
-        for_each (&node->block.children) {
-            int s = type_recur(tu, *it, block_depth + 1, scope);
-            if (s) scope = s;
-        }
+    case '-':
+        if (type_is_arithmetic(tu, l) && type_is_arithmetic(tu, r)) return type_common(tu, l, r);
+        if (type_is_pointer(tu, l) && type_is_integer(tu, r)) return l;
+        // ptrdiff_t
+        if (type_is_pointer(tu, l) && type_is_pointer(tu, r))
+            return find_or_create_type(tu, 0, TYPE_SIGNED_LONG, 0);
         break;
-    case NODE_FUNCTION_DEFINITION: {
-        int new_outer = type_recur(tu, node->fun.decl, block_depth, scope);
-        struct node *n = node->fun.decl;
-        struct node *d = n->decl.declarators.data[0];
-        for_each (&d->d.fun.args) {
-            int s = type_recur(tu, *it, block_depth + 1, scope);
-            if (s) scope = s;
+    case '*':
+    case '/':
+        if (type_is_arithmetic(tu, l) && type_is_arithmetic(tu, r)) return type_common(tu, l, r);
+        break;
+    case '%':
+    case '&':
+    case '|':
+    case '^':
+        if (type_is_integer(tu, l) && type_is_integer(tu, r)) return type_common(tu, l, r);
+        break;
+    case TOKEN_SHIFT_LEFT:
+    case TOKEN_SHIFT_RIGHT:
+        if (type_is_integer(tu, l) && type_is_integer(tu, r)) return type_promote(tu, l);
+        break;
+    case '<':
+    case '>':
+    case TOKEN_LESS_EQUAL:
+    case TOKEN_GREATER_EQUAL:
+    case TOKEN_EQUAL_EQUAL:
+    case TOKEN_NOT_EQUAL:
+        if (type_is_arithmetic(tu, l) && type_is_arithmetic(tu, r)) return int_type(tu);
+        if (type_is_pointer(tu, l) && (type_is_pointer(tu, r) || type_is_integer(tu, r))) return int_type(tu);
+        if (type_is_integer(tu, l) && type_is_pointer(tu, r)) return int_type(tu);
+        break;
+    case TOKEN_AND_AND:
+    case TOKEN_OR_OR:
+        if (is_scalar(tu, l) && is_scalar(tu, r)) return int_type(tu);
+        break;
+    }
+
+    report_error_node(tu, node, "invalid operands to binary %s", token_type_string(op));
+    return 0;
+}
+
+static int type_unary(struct tu *tu, struct node *node) {
+    int op = node->token->type;
+    struct node *inner = node->unary_op.inner;
+    if (!inner->c_type) return 0;
+
+    int t = type_rvalue(tu, inner->c_type);
+
+    switch (op) {
+    case TOKEN_SIZEOF:
+    case TOKEN_ALIGNOF:
+        if (TYPE(inner->c_type)->layer == TYPE_FUNCTION) break;
+        return find_or_create_type(tu, 0, TYPE_UNSIGNED_LONG, 0);
+    case '&':
+        if (!is_lvalue(tu, inner) && TYPE(inner->c_type)->layer != TYPE_FUNCTION) {
+            report_error_node(tu, node, "cannot take the address of an rvalue");
+            return 0;
         }
-        // function body is a compound statement - that increments block_depth on its own, so
-        // this drops back to outer scope to avoid the body of the function being deeper than
-        // arguments.
-        type_recur(tu, node->fun.body, block_depth, scope);
+        if (inner->type == NODE_IDENT) {
+            struct scope *scope = SCOPE(inner->ident.scope_id);
+            if (scope->sc == ST_REGISTER) {
+                report_error_node(tu, node, "cannot take the address of a register variable");
+            }
+            // globals are read-only while function bodies are typed in parallel,
+            // and live in memory anyway
+            if (!scope->is_global) scope->address_taken = true;
+        }
+        return find_or_create_type(tu, inner->c_type, TYPE_POINTER, 0);
+    case '*':
+        if (type_is_pointer(tu, t)) return TYPE(t)->inner;
+        report_error_node(tu, node, "indirection requires a pointer operand");
+        return 0;
+    case '+':
+    case '-':
+        if (type_is_arithmetic(tu, t)) return type_promote(tu, t);
+        break;
+    case '~':
+        if (type_is_integer(tu, t)) return type_promote(tu, t);
+        break;
+    case '!':
+        if (is_scalar(tu, t)) return int_type(tu);
+        break;
+    case TOKEN_PLUS_PLUS:
+    case TOKEN_MINUS_MINUS:
+        if (!check_modifiable_lvalue(tu, inner)) return 0;
+        if (is_scalar(tu, t)) return t;
+        break;
+    }
+
+    report_error_node(tu, node, "invalid operand to unary %s", token_type_string(op));
+    return 0;
+}
+
+static int type_call(struct tu *tu, struct node *node) {
+    if (!node->funcall.inner->c_type) return 0;
 
-        return new_outer;
+    int callee = type_rvalue(tu, node->funcall.inner->c_type);
+    if (!type_is_pointer(tu, callee) || TYPE(TYPE(callee)->inner)->layer != TYPE_FUNCTION) {
+        report_error_node(tu, node->funcall.inner, "called object is not a function");
+        return 0;
     }
-    case NODE_BINARY_OP:
-        type_recur(tu, node->binop.lhs, block_depth, scope);
-        type_recur(tu, node->binop.rhs, block_depth, scope);
+
+    // types can be created while checking the arguments, so hold on to the id
+    // rather than a pointer into tu->types
+    int function = TYPE(callee)->inner;
+    size_t n_params = TYPE(function)->function.params.len;
+    size_t n_args = node->funcall.args.len;
+
+    if (n_args < n_params || (n_args > n_params && !TYPE(function)->function.variadic)) {
+        report_error_node(tu, node, "expected %zu arguments to function call, found %zu", n_params, n_args);
+    }
+
+    for (size_t i = 0; i < n_args && i < n_params; i += 1) {
+        struct node *arg = node->funcall.args.data[i];
+        if (arg->c_type)
+            check_assignable(tu, arg, TYPE(function)->function.params.data[i], type_rvalue(tu, arg->c_type));
+    }
+
+    return TYPE(function)->inner;
+}
+
+// Compute the type of an expression node after its operands have been typed,
+// C23(N3096) 6.5. The type recorded is the type of the expression before
+// lvalue conversion, so arrays and functions have not decayed yet; use
+// type_rvalue() to get the type of the value.
+static void type_expression(struct tu *tu, struct node *node) {
+    switch (node->type) {
+    case NODE_INT_LITERAL:
+        node->c_type = int_literal_type(tu, node->token);
         break;
-    case NODE_UNARY_OP:
-    case NODE_POSTFIX_OP:
-        type_recur(tu, node->unary_op.inner, block_depth, scope);
+    case NODE_FLOAT_LITERAL:
+        node->c_type = float_literal_type(tu, node->token);
         break;
-    case NODE_SUBSCRIPT:
-        type_recur(tu, node->subscript.inner, block_depth, scope);
-        type_recur(tu, node->subscript.subscript, block_depth, scope);
+    case NODE_STRING_LITERAL: {
+        size_t len = string_literal_decode(tu->source, node->token, nullptr);
+        int ch = find_or_create_type(tu, 0, TYPE_CHAR, 0);
+        node->c_type = find_or_create_array_type(tu, ch, (int64_t)len + 1);
         break;
-    case NODE_TERNARY:
-        type_recur(tu, node->ternary.condition, block_depth, scope);
-        type_recur(tu, node->ternary.branch_true, block_depth, scope);
-        type_recur(tu, node->ternary.branch_false, block_depth, scope);
+    }
+    case NODE_IDENT:
+        node->c_type = SCOPE(node->ident.scope_id)->c_type;
         break;
-    case NODE_RETURN:
-        type_recur(tu, node->ret.expr, block_depth, scope);
+    case NODE_BINARY_OP:
+        node->c_type = type_binary(tu, node);
         break;
-    case NODE_IDENT: {
-        int scope_id = resolve_name(tu, node->token, scope);
-        if (!scope_id) {
-            report_error_node(tu, node, "undeclared identifier");
-            exit(1);
+    case NODE_UNARY_OP:
+        node->c_type = type_unary(tu, node);
+        break;
+    case NODE_POSTFIX_OP: {
+        struct node *inner = node->unary_op.inner;
+        if (!inner->c_type || !check_modifiable_lvalue(tu, inner)) break;
+        int t = type_rvalue(tu, inner->c_type);
+        if (!is_scalar(tu, t)) {
+            report_error_node(tu, node, "invalid operand to postfix %s", token_type_string(node->token->type));
+            break;
         }
-        fprintf(stderr, "resolving %.*s (line %i) to ", node->token->len, TOKEN_STR(node->token), node->token->line);
-        print_type(tu, SCOPE(scope_id)->c_type);
-        fprintf(stderr, " declared on line %i ", SCOPE(scope_id)->token->line);
-        fprintf(stderr, "(depth %i)\n", block_depth);
-        node->ident.scope_id = scope_id;
+        node->c_type = t;
         break;
     }
-    case NODE_IF: {
-        type_recur(tu, node->if_.cond, block_depth, scope);
-        type_recur(tu, node->if_.block_true, block_depth + 1, scope);
-        if (node->if_.block_false)
-            type_recur(tu, node->if_.block_false, block_depth + 1, scope);
+    case NODE_SUBSCRIPT: {
+        struct node *inner = node->subscript.inner;
+        struct node *subscript = node->subscript.subscript;
+        if (!inner->c_type || !subscript->c_type) break;
+        int a = type_rvalue(tu, inner->c_type);
+        int b = type_rvalue(tu, subscript->c_type);
+        if (type_is_pointer(tu, a) && type_is_integer(tu, b)) node->c_type = TYPE(a)->inner;
+        else if (type_is_integer(tu, a) && type_is_pointer(tu, b)) node->c_type = TYPE(b)->inner;
+        else report_error_node(tu, node, "subscripted value is not an array or pointer");
         break;
     }
-    case NODE_WHILE: {
-        type_recur(tu, node->while_.cond, block_depth, scope);
-        type_recur(tu, node->while_.block, block_depth + 1, scope);
+    case NODE_TERNARY: {
+        struct node *t = node->ternary.branch_true;
+        struct node *f = node->ternary.branch_false;
+        if (!node->ternary.condition->c_type || !t->c_type || !f->c_type) break;
+        if (!is_scalar(tu, type_rvalue(tu, node->ternary.condition->c_type))) {
+            report_error_node(tu, node->ternary.condition, "condition must have scalar type");
+        }
+        int a = type_rvalue(tu, t->c_type);
+        int b = type_rvalue(tu, f->c_type);
+        if (type_is_arithmetic(tu, a) && type_is_arithmetic(tu, b)) node->c_type = type_common(tu, a, b);
+        else if (type_is_integer(tu, a) && type_is_pointer(tu, b)) node->c_type = b;
+        else node->c_type = a;
         break;
     }
-    case NODE_DO: {
-        type_recur(tu, node->do_.cond, block_depth, scope);
-        type_recur(tu, node->do_.block, block_depth + 1, scope);
+    case NODE_FUNCTION_CALL:
+        node->c_type = type_call(tu, node);
         break;
-    }
-    case NODE_FOR: {
-        int for_scope = type_recur(tu, node->for_.init, block_depth + 1, scope);
-        type_recur(tu, node->for_.cond, block_depth + 1, for_scope);
-        type_recur(tu, node->for_.next, block_depth + 1, for_scope);
-        type_recur(tu, node->for_.block, block_depth + 1, for_scope);
+    case NODE_MEMBER:
+        report_error_node(tu, node, "struct and union members are not implemented");
         break;
-    }
-    case NODE_SWITCH: {
-        type_recur(tu, node->switch_.expr, block_depth, scope);
-        type_recur(tu, node->switch_.block, block_depth + 1, scope);
+    default:
         break;
     }
-    case NODE_CASE: {
-        type_recur(tu, node->case_.value, block_depth, scope);
-        break;
+}
+
+// The function declarator that owns the parameters of a declarator, which is
+// the one closest to the name: for `int *(*f(int))(long)` that is `f(int)`.
+struct node *function_declarator(struct node *d) {
+    struct node *result = nullptr;
+    for (; d; d = d->d.inner) {
+        if (d->type == NODE_FUNCTION_DECLARATOR) result = d;
     }
-    case NODE_FUNCTION_CALL: {
-        type_recur(tu, node->funcall.inner, block_depth, scope);
-        for_each (&node->funcall.args) {
-            type_recur(tu, *it, block_depth, scope);
+    return result;
+}
+
+// Resolve names and compute the type of every node of an expression, children
+// before parents. Constant subexpressions are folded here too, so later
+// eval() calls on the tree find their operands cached and don't recurse.
+// walk is scratch space reused between expressions.
+static void type_expression_tree(struct tu *tu, struct walk *walk, struct node *expr, int block_depth, int scope) {
+    if (!expr) return;
+
+    walk_push(walk, expr);
+
+    struct walk_frame *frame;
+    enum walk_event event;
+    while ((frame = walk_next(walk, &event))) {
+        if (event != WALK_LEAVE) continue;
+        struct node *node = frame->node;
+
+        if (node->type == NODE_IDENT) {
+            // the member name in a.b is not a variable
+            struct walk_frame *parent = walk->stack.len > 1 ? &walk->stack.data[walk->stack.len - 2] : nullptr;
+            if (parent && parent->node->type == NODE_MEMBER && parent->node->member.ident == node)
+                continue;
+
+            int scope_id = resolve_name(tu, node->token, scope);
+            if (!scope_id) {
+                report_error_node(tu, node, "undeclared identifier");
+                exit(1);
+            }
+            flockfile(stderr);
+            fprintf(stderr, "resolving %.*s (line %i) to ", node->token->len, TOKEN_STR(node->token), node->token->line);
+            print_type(tu, SCOPE(scope_id)->c_type);
+            fprintf(stderr, " declared on line %i ", SCOPE(scope_id)->token->line);
+            fprintf(stderr, "(depth %i)\n", block_depth);
+            funlockfile(stderr);
+            node->ident.scope_id = scope_id;
+        }
+
+        type_expression(tu, node);
+
+        switch (node->type) {
+        case NODE_IDENT:
+        case NODE_BINARY_OP:
+        case NODE_UNARY_OP:
+        case NODE_TERNARY:
+            if (node->c_type) eval(tu, node);
+            break;
+        default:
+            break;
         }
     }
-    case NODE_BREAK:
-    case NODE_CONTINUE:
-    case NODE_NULL:
+}
+
+// Type a declaration and create scopes for its declarators. Returns the scope
+// of the last declarator, which the statements after it can see.
+static int type_declaration(struct tu *tu, struct walk *exprs, struct node *node, int block_depth, int scope) {
+    // struct node *base_type = node->decl.decl_spec;
+    for_each (&node->decl.declarators) {
+        struct node *d = *it;
+        struct scope *before;
+        if ((before = name_exists(tu, d->d.name, scope, block_depth))) {
+            flockfile(stderr);
+            report_error_node(tu, d, "redefinition of name");
+            print_info_node(tu, before->decl, "previous definition is here");
+            funlockfile(stderr);
+        }
+        // array sizes are constant expressions that can refer to earlier names
+        for (struct node *n = d; n; n = n->d.inner) {
+            if (n->type == NODE_ARRAY_DECLARATOR && n->d.arr.subscript)
+                type_expression_tree(tu, exprs, n->d.arr.subscript, block_depth, scope);
+        }
+        int type_id = find_or_create_decl_type(tu, node, d);
+        scope = create_scope(tu, scope, type_id, block_depth, node->decl.sc, d, nullptr);
+
+        d->d.scope_id = scope;
+
+        if (d->d.initializer) {
+            type_expression_tree(tu, exprs, d->d.initializer, block_depth, scope);
+
+            struct scope *s = SCOPE(scope);
+            bool is_static = s->is_global || s->sc == ST_STATIC || s->sc == ST_THREAD_LOCAL;
+            if (d->d.initializer->c_type) {
+                check_assignable(tu, d->d.initializer, type_rvalue(tu, type_id),
+                                 type_rvalue(tu, d->d.initializer->c_type));
+            }
+            if (s->sc == ST_CONSTEXPR && eval(tu, d->d.initializer)->kind == VALUE_NONE) {
+                report_error_node(tu, d->d.initializer, "constexpr initializer is not a constant expression");
+            } else if (is_static && eval(tu, d->d.initializer)->kind == VALUE_NONE) {
+                report_error_node(tu, d->d.initializer, "initializer element is not a compile-time constant");
+            }
+        } else if (node->decl.sc == ST_CONSTEXPR) {
+            report_error_node(tu, d, "constexpr declaration requires an initializer");
+        }
+    }
+    return scope;
+}
+
+static bool is_expression(struct node *node) {
+    switch (node->type) {
+    case NODE_BINARY_OP:
+    case NODE_UNARY_OP:
+    case NODE_POSTFIX_OP:
+    case NODE_IDENT:
     case NODE_INT_LITERAL:
     case NODE_FLOAT_LITERAL:
     case NODE_STRING_LITERAL:
-    case NODE_GOTO:
-    case NODE_DEFAULT:
-    case NODE_LABEL:
-        break;
+    case NODE_MEMBER:
+    case NODE_SUBSCRIPT:
+    case NODE_TERNARY:
+    case NODE_FUNCTION_CALL:
+        return true;
     default:
-        fprintf(stderr, "typer: unrecognised ast node %s\n", node_type_strings[node->type]);
+        return false;
     }
-    return scope;
+}
+
+// Resolve types and names in a statement and everything inside it. Nested
+// statements are visited with an explicit stack, so deeply nested blocks
+// don't use native stack.
+// Each frame carries the block depth and the innermost scope its statement
+// can see. A BLOCK passes the scope of each declaration on to the statements
+// after it, but nothing declared inside a statement is visible after it.
+// return_type is that of the enclosing function, or 0 outside of one.
+static void type_statement(struct tu *tu, struct node *root, int block_depth, int scope, int return_type) {
+    struct walk walk = {};
+    struct walk exprs = {};
+
+    struct walk_frame *frame = walk_push(&walk, root);
+    frame->depth = block_depth;
+    frame->scope = scope;
+
+    while ((frame = walk_top(&walk))) {
+        struct node *node = frame->node;
+        int depth = frame->depth;
+        struct node *next = nullptr;
+        int next_depth = depth + 1;
+        bool done = true;
+
+        if (!node) {
+            walk_return(&walk, (union walk_value){});
+            continue;
+        }
+
+        switch (node->type) {
+        case NODE_BLOCK:
+            while (frame->index < node->block.children.len && !next) {
+                struct node *child = node->block.children.data[frame->index++];
+                if (child->type == NODE_DECLARATION)
+                    frame->scope = type_declaration(tu, &exprs, child, depth + 1, frame->scope);
+                else
+                    next = child;
+            }
+            done = !next;
+            break;
+        case NODE_DECLARATION:
+            type_declaration(tu, &exprs, node, depth, frame->scope);
+            break;
+        case NODE_IF:
+            if (frame->phase == 0) {
+                type_expression_tree(tu, &exprs, node->if_.cond, depth, frame->scope);
+                next = node->if_.block_true;
+            } else if (frame->phase == 1) {
+                next = node->if_.block_false;
+            }
+            done = frame->phase++ == 2;
+            break;
+        case NODE_WHILE:
+            if (frame->phase == 0) {
+                type_expression_tree(tu, &exprs, node->while_.cond, depth, frame->scope);
+                next = node->while_.block;
+            }
+            done = frame->phase++ == 1;
+            break;
+        case NODE_DO:
+            if (frame->phase == 0) {
+                next = node->do_.block;
+            } else {
+                type_expression_tree(tu, &exprs, node->do_.cond, depth, frame->scope);
+            }
+            done = frame->phase++ == 1;
+            break;
+        case NODE_FOR:
+            if (frame->phase == 0) {
+                struct node *init = node->for_.init;
+                if (init && init->type == NODE_DECLARATION)
+                    frame->scope = type_declaration(tu, &exprs, init, depth + 1, frame->scope);
+                else
+                    type_expression_tree(tu, &exprs, init, depth + 1, frame->scope);
+                type_expression_tree(tu, &exprs, node->for_.cond, depth + 1, frame->scope);
+                type_expression_tree(tu, &exprs, node->for_.next, depth + 1, frame->scope);
+                next = node->for_.block;
+            }
+            done = frame->phase++ == 1;
+            break;
+        case NODE_SWITCH:
+            if (frame->phase == 0) {
+                type_expression_tree(tu, &exprs, node->switch_.expr, depth, frame->scope);
+                next = node->switch_.block;
+            }
+            done = frame->phase++ == 1;
+            break;
+        case NODE_CASE:
+            type_expression_tree(tu, &exprs, node->case_.value, depth, frame->scope);
+            if (eval(tu, node->case_.value)->kind != VALUE_INT)
+                report_error_node(tu, node->case_.value, "case label is not an integer constant expression");
+            break;
+        case NODE_STATIC_ASSERT: {
+            type_expression_tree(tu, &exprs, node->st_assert.expr, depth, frame->scope);
+            struct value *v = eval(tu, node->st_assert.expr);
+            if (v->kind != VALUE_INT) {
+                report_error_node(tu, node->st_assert.expr, "static assertion expression is not an integer constant expression");
+            } else if (v->i == 0) {
+                report_error_node(tu, node, "static assertion failed");
+            }
+            break;
+        }
+        case NODE_RETURN:
+            type_expression_tree(tu, &exprs, node->ret.expr, depth, frame->scope);
+            // C23(N3096) 6.8.6.4.3: the value is converted as if by assignment
+            if (return_type && TYPE(return_type)->layer != TYPE_VOID && node->ret.expr && node->ret.expr->c_type)
+                check_assignable(tu, node->ret.expr, return_type, type_rvalue(tu, node->ret.expr->c_type));
+            break;
+        case NODE_BREAK:
+        case NODE_CONTINUE:
+        case NODE_NULL:
+        case NODE_GOTO:
+        case NODE_DEFAULT:
+        case NODE_LABEL:
+        case NODE_ERROR:
+            break;
+        default:
+            if (is_expression(node))
+                type_expression_tree(tu, &exprs, node, depth, frame->scope);
+            else
+                fprintf(stderr, "typer: unrecognised ast node %s\n", node_type_strings[node->type]);
+        }
+
+        if (next) {
+            int next_scope = frame->scope;
+            frame = walk_push(&walk, next);
+            frame->depth = next_depth;
+            frame->scope = next_scope;
+        } else if (done) {
+            walk_return(&walk, (union walk_value){});
+        }
+    }
+
+    walk_free(&exprs);
+    walk_free(&walk);
+}
+
+// Type the parameters and body of a function definition whose declaration
+// has already been typed. scope is the scope of the function's own name, so
+// the parameters and body can see it.
+static void type_function_body(struct tu *tu, struct node *node, int block_depth, int scope) {
+    struct node *d = function_declarator(node->fun.d);
+    if (!d) {
+        report_error_node(tu, node->fun.d, "function definition does not have a function type");
+        return;
+    }
+    struct walk exprs = {};
+    for_each (&d->d.fun.args) {
+        if ((*it)->type != NODE_DECLARATION) continue;
+        int s = type_declaration(tu, &exprs, *it, block_depth + 1, scope);
+        if (s != scope) {
+            // C23(N3096) 6.7.6.3.7: array and function parameters are adjusted to pointers
+            SCOPE(s)->c_type = type_rvalue(tu, SCOPE(s)->c_type);
+            scope = s;
+        }
+    }
+    walk_free(&exprs);
+    // function body is a compound statement - that increments block_depth on its own, so
+    // this drops back to outer scope to avoid the body of the function being deeper than
+    // arguments.
+    type_statement(tu, node->fun.body, block_depth, scope, TYPE(SCOPE(node->fun.d->d.scope_id)->c_type)->inner);
 }
\ No newline at end of file
@@ -2,10 +2,15 @@
 #ifndef COMPILER_TYPE_H
 #define COMPILER_TYPE_H
 
+#include <pthread.h>
+#include <stdint.h>
+
 #include "list.h"
 
 enum layer_type {
     TYPE_VOID,
+    // plain char, which is signed but a different type from signed char
+    TYPE_CHAR,
     TYPE_SIGNED_CHAR,
     TYPE_SIGNED_SHORT,
     TYPE_SIGNED_INT,
@@ -83,11 +88,39 @@ struct type {
             type_list_t fields;
         } struct_;
         struct {
-            type_list_t args;
+            list(int) params;
+            // also set for functions declared with (), whose arguments are not checked
+            bool variadic;
         } function;
+        struct {
+            // 0 if the array is incomplete
+            int64_t len;
+        } array;
     };
 };
 
+// Types live in fixed size chunks that never move, so a struct type * stays
+// valid while other threads intern new types. Every type is created through
+// the interner in type.c, which hashes its contents under lock, so equal types
+// always have the same id.
+#define TYPE_CHUNK_BITS 10
+#define TYPE_CHUNK_SIZE (1 << TYPE_CHUNK_BITS)
+#define TYPE_MAX_CHUNKS 4096
+
+struct type_table {
+    struct type *chunks[TYPE_MAX_CHUNKS];
+    size_t len;
+
+    pthread_mutex_t lock;
+    // open addressed hash set of type ids, 0 is empty
+    int *buckets;
+    size_t n_buckets;
+};
+
+static inline struct type *type_at(struct type_table *table, int type_id) {
+    return &table->chunks[type_id >> TYPE_CHUNK_BITS][type_id & (TYPE_CHUNK_SIZE - 1)];
+}
+
 struct scope {
     struct token *token;
     struct node *decl;
@@ -97,14 +130,38 @@ struct scope {
     int c_type;
     int parent;
     int block_depth;
-    int ir_index;
+    // the IR register of the variable, see new_scope_reg
+    uint32_t ir_reg;
     int frame_offset;
+    // set by the typer when & is applied to the name, so the object has to
+    // live in memory
+    bool address_taken;
 };
 
 struct tu;
+struct token;
 
+void type_table_init(struct type_table *);
 int find_or_create_type(struct tu *, int inner, enum layer_type base, enum type_flags flags);
+int find_or_create_array_type(struct tu *, int inner, int64_t len);
+int find_or_create_function_type(struct tu *, int ret, int *params, size_t n_params, bool variadic);
+int int_literal_type(struct tu *, struct token *);
+int float_literal_type(struct tu *, struct token *);
 void print_type(struct tu *tu, int type_id);
 int type(struct tu *tu);
 
+size_t type_size(struct tu *, int type_id);
+size_t type_align(struct tu *, int type_id);
+bool type_is_integer(struct tu *, int type_id);
+bool type_is_floating(struct tu *, int type_id);
+bool type_is_arithmetic(struct tu *, int type_id);
+bool type_is_signed(struct tu *, int type_id);
+bool type_is_pointer(struct tu *, int type_id);
+int type_promote(struct tu *, int type_id);
+int type_rvalue(struct tu *, int type_id);
+int type_common(struct tu *, int a, int b);
+
+struct node;
+struct node *function_declarator(struct node *d);
+
 #endif //COMPILER_TYPE_H
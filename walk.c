@@ -0,0 +1,156 @@
+#include "walk.h"
+#include "parse.h"
+
+#include <stdint.h>
+
+struct walk_frame *walk_push(struct walk *walk, struct node *node) {
+    list_push(&walk->stack, (struct walk_frame){ .node = node });
+    return &list_last(&walk->stack);
+}
+
+struct walk_frame *walk_top(struct walk *walk) {
+    if (walk->stack.len == 0) return nullptr;
+    return &list_last(&walk->stack);
+}
+
+void walk_return(struct walk *walk, union walk_value ret) {
+    walk->stack.len -= 1;
+    walk->ret = ret;
+}
+
+void walk_free(struct walk *walk) {
+    list_clear(&walk->stack);
+}
+
+struct walk_frame *walk_next(struct walk *walk, enum walk_event *event) {
+    if (walk->pop_pending) {
+        walk->stack.len -= 1;
+        walk->pop_pending = false;
+    }
+
+    while (walk->stack.len) {
+        struct walk_frame *frame = &list_last(&walk->stack);
+
+        if (frame->phase == 0) {
+            frame->phase = 1;
+            *event = WALK_ENTER;
+            return frame;
+        }
+
+        if (frame->index != SIZE_MAX && frame->index < node_child_count(frame->node)) {
+            size_t i = frame->index++;
+            struct node *child = node_child(frame->node, i);
+            if (!child) continue;
+            const char *label = node_child_label(frame->node, i);
+            int depth = frame->depth + 1;
+            struct walk_frame *next = walk_push(walk, child);
+            next->label = label;
+            next->depth = depth;
+            continue;
+        }
+
+        walk->pop_pending = true;
+        *event = WALK_LEAVE;
+        return frame;
+    }
+
+    return nullptr;
+}
+
+size_t node_child_count(struct node *node) {
+    switch (node->type) {
+    case NODE_ROOT: return node->root.children.len;
+    case NODE_BLOCK: return node->block.children.len;
+    case NODE_BINARY_OP: return 2;
+    case NODE_UNARY_OP: return 1;
+    case NODE_POSTFIX_OP: return 1;
+    case NODE_MEMBER: return 2;
+    case NODE_SUBSCRIPT: return 2;
+    case NODE_TERNARY: return 3;
+    case NODE_FUNCTION_CALL: return 1 + node->funcall.args.len;
+    case NODE_DECLARATION: return node->decl.declarators.len;
+    case NODE_DECLARATOR:
+    case NODE_ARRAY_DECLARATOR:
+    case NODE_FUNCTION_DECLARATOR: return 1;
+    case NODE_STATIC_ASSERT: return 2;
+    case NODE_FUNCTION_DEFINITION: return 2;
+    case NODE_RETURN: return 1;
+    case NODE_LABEL: return 1;
+    case NODE_IF: return 3;
+    case NODE_WHILE: return 2;
+    case NODE_DO: return 2;
+    case NODE_FOR: return 4;
+    case NODE_GOTO: return 1;
+    case NODE_SWITCH: return 2;
+    case NODE_CASE: return 1;
+    case NODE_STRUCT:
+    case NODE_UNION: return node->struct_.decls.len;
+    default: return 0;
+    }
+}
+
+struct node *node_child(struct node *node, size_t i) {
+    switch (node->type) {
+    case NODE_ROOT: return node->root.children.data[i];
+    case NODE_BLOCK: return node->block.children.data[i];
+    case NODE_BINARY_OP: return i == 0 ? node->binop.lhs : node->binop.rhs;
+    case NODE_UNARY_OP:
+    case NODE_POSTFIX_OP: return node->unary_op.inner;
+    case NODE_MEMBER: return i == 0 ? node->member.inner : node->member.ident;
+    case NODE_SUBSCRIPT: return i == 0 ? node->subscript.inner : node->subscript.subscript;
+    case NODE_TERNARY:
+        if (i == 0) return node->ternary.condition;
+        return i == 1 ? node->ternary.branch_true : node->ternary.branch_false;
+    case NODE_FUNCTION_CALL: return i == 0 ? node->funcall.inner : node->funcall.args.data[i - 1];
+    case NODE_DECLARATION: return node->decl.declarators.data[i];
+    case NODE_DECLARATOR:
+    case NODE_ARRAY_DECLARATOR:
+    case NODE_FUNCTION_DECLARATOR: return node->d.initializer;
+    case NODE_STATIC_ASSERT: return i == 0 ? node->st_assert.expr : node->st_assert.message;
+    case NODE_FUNCTION_DEFINITION: return i == 0 ? node->fun.decl : node->fun.body;
+    case NODE_RETURN: return node->ret.expr;
+    case NODE_LABEL: return node->label.name;
+    case NODE_IF:
+        if (i == 0) return node->if_.cond;
+        return i == 1 ? node->if_.block_true : node->if_.block_false;
+    case NODE_WHILE: return i == 0 ? node->while_.cond : node->while_.block;
+    case NODE_DO: return i == 0 ? node->do_.block : node->do_.cond;
+    case NODE_FOR:
+        switch (i) {
+        case 0: return node->for_.init;
+        case 1: return node->for_.cond;
+        case 2: return node->for_.next;
+        default: return node->for_.block;
+        }
+    case NODE_GOTO: return node->goto_.label;
+    case NODE_SWITCH: return i == 0 ? node->switch_.expr : node->switch_.block;
+    case NODE_CASE: return node->case_.value;
+    case NODE_STRUCT:
+    case NODE_UNION: return node->struct_.decls.data[i];
+    default: return nullptr;
+    }
+}
+
+const char *node_child_label(struct node *node, size_t i) {
+    static const char *labels[NODE_TYPE_COUNT][4] = {
+        [NODE_SUBSCRIPT] = { "arr:", "sub:" },
+        [NODE_MEMBER] = { "val:", "nam:" },
+        [NODE_TERNARY] = { "cnd:", "tru:", "fls:" },
+        [NODE_DECLARATOR] = { "ini:" },
+        [NODE_ARRAY_DECLARATOR] = { "ini:" },
+        [NODE_FUNCTION_DECLARATOR] = { "ini:" },
+        [NODE_STATIC_ASSERT] = { "tst:", "msg:" },
+        [NODE_FUNCTION_DEFINITION] = { "typ:", "bdy:" },
+        [NODE_IF] = { "cnd:", "yes:", "no: " },
+        [NODE_WHILE] = { "cnd:", "blk:" },
+        [NODE_DO] = { "blk:", "cnd:" },
+        [NODE_FOR] = { "ini:", "cnd:", "nxt:", "blk:" },
+        [NODE_SWITCH] = { "exp:", "blk:" },
+    };
+
+    switch (node->type) {
+    case NODE_FUNCTION_CALL: return i == 0 ? "fun:" : "arg";
+    case NODE_DECLARATION: return "dcl:";
+    default: return i < 4 ? labels[node->type][i] : nullptr;
+    }
+}
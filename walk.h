@@ -0,0 +1,72 @@
+#pragma once
+#ifndef COMPILER_WALK_H
+#define COMPILER_WALK_H
+
+#include <stddef.h>
+
+#include "list.h"
+
+#include "ir.h"
+
+struct node;
+
+union walk_value {
+    int i;
+    struct node *node;
+    uint32_t reg;
+    const char *name;
+    reg_list_t *args;
+    void *ptr;
+};
+
+// One node being visited. Passes that need to do work between children run a
+// small state machine per node type through `phase`, and keep whatever they
+// need between child visits in the other fields.
+struct walk_frame {
+    struct node *node;
+    // the role of the node in its parent, like "cnd:" for an if condition
+    const char *label;
+    int phase;
+    int depth;
+    int scope;
+    int mode;
+    // the next child to visit
+    size_t index;
+    union walk_value v[4];
+};
+
+// An explicit traversal stack, so a pass uses heap memory proportional to the
+// nesting depth of the AST instead of native stack.
+struct walk {
+    list(struct walk_frame) stack;
+    // the value the last finished frame handed back to its parent
+    union walk_value ret;
+    bool pop_pending;
+};
+
+enum walk_event : char {
+    WALK_ENTER,
+    WALK_LEAVE,
+};
+
+// Push a frame for node and return it. Pointers to frames are invalidated by
+// the next push.
+struct walk_frame *walk_push(struct walk *, struct node *node);
+// The frame on top of the stack, or nullptr if the walk is finished.
+struct walk_frame *walk_top(struct walk *);
+// Pop the top frame, handing ret to its parent.
+void walk_return(struct walk *, union walk_value ret);
+void walk_free(struct walk *);
+
+// Generic pre- and post-order traversal over every child from node_child().
+// Returns the frame being entered or left, or nullptr when the walk is done.
+// Setting index to SIZE_MAX on enter skips the node's children.
+struct walk_frame *walk_next(struct walk *, enum walk_event *event);
+
+// The children of a node in source order. Optional children that are absent
+// are nullptr.
+size_t node_child_count(struct node *);
+struct node *node_child(struct node *, size_t i);
+const char *node_child_label(struct node *, size_t i);
+
+#endif //COMPILER_WALK_H
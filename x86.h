@@ -0,0 +1,307 @@
+#pragma once
+#ifndef COMPILER_X86_H
+#define COMPILER_X86_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "list.h"
+#include "regalloc.h"
+
+struct tu;
+struct scope;
+struct ir_global;
+struct node;
+
+// The x86-64 instructions code generation lowers the IR to. Each is one
+// machine instruction, except X86_LABEL, which marks a place a jump can go.
+// Operands are in Intel order, destination first, and the op comments name
+// them op[0] and op[1].
+enum x86_op : unsigned char {
+    X86_LABEL,      // label op[0]
+    X86_MOV,
+    X86_MOVSX,      // op[0] <- op[1] sign extended from from_size bytes
+    X86_MOVZX,      // op[0] <- op[1] zero extended from from_size bytes
+    X86_LEA,
+    X86_ADD,
+    X86_SUB,
+    X86_IMUL,
+    X86_AND,
+    X86_OR,
+    X86_XOR,
+    X86_SHL,        // shifts are by an immediate or by cl
+    X86_SHR,
+    X86_SAR,
+    X86_NEG,
+    X86_NOT,
+    X86_CMP,
+    X86_TEST,
+    X86_XCHG,
+    X86_CQO,        // sign extend rax into rdx, cdq at size 4
+    X86_DIV,        // rdx:rax / op[0]
+    X86_IDIV,
+    X86_SETCC,      // op[0] <- cond, one byte
+    X86_JCC,
+    X86_JMP,
+    X86_CALL,
+    X86_RET,
+    X86_PUSH,
+    X86_LEAVE,
+
+    // SSE, at size 4 for float and 8 for double
+    X86_MOVS,       // movss, movsd
+    X86_MOVAPS,     // a whole xmm register
+    X86_MOVQ,       // between a general purpose and an xmm register, movd at size 4
+    X86_ADDS,
+    X86_SUBS,
+    X86_MULS,
+    X86_DIVS,
+    X86_UCOMIS,
+    X86_XORPS,
+    X86_CVTSI2S,    // op[0] <- op[1], a from_size byte integer
+    X86_CVTTS2SI,   // op[0], a size byte integer <- op[1], a from_size byte float
+    X86_CVTS2S,     // op[0] <- op[1], a from_size byte float
+};
+
+// The condition codes of SETCC and JCC.
+enum x86_cond : char {
+    X86_E, X86_NE,
+    X86_L, X86_LE, X86_G, X86_GE,
+    X86_B, X86_BE, X86_A, X86_AE,
+    X86_P, X86_NP,
+    X86_S,
+};
+
+enum x86_operand_kind : char {
+    X86_NONE,
+    X86_REG,
+    X86_IMM,
+    // [base + index * scale + disp], with no index if scale is 0
+    X86_MEM,
+    // symbol + disp relative to rip, or the function's label if symbol is 0
+    X86_RIP,
+    // the target of a jump or call: the function's label, or symbol
+    X86_TARGET,
+};
+
+struct x86_operand {
+    enum x86_operand_kind kind;
+    enum machine_reg reg;
+    enum machine_reg index;
+    unsigned char scale;
+    // reached through the GOT or PLT, for a symbol that may be defined in
+    // another module
+    bool indirect;
+    int64_t imm;
+    // a name in tu->strtab
+    int symbol;
+    int label;
+};
+
+struct x86_instr {
+    enum x86_op op;
+    enum x86_cond cond;
+    // the operand size in bytes
+    unsigned char size;
+    unsigned char from_size;
+    struct x86_operand operands[2];
+};
+
+typedef list(struct x86_instr) x86_list_t;
+
+// Bytes of read only data that the function's code refers to by label.
+struct x86_constant {
+    int label;
+    uint64_t bits;
+    unsigned char size;
+};
+
+// The machine code of one function. Labels are numbered from 0 within the
+// function; block b of the IR starts at label b.
+struct x86_function {
+    int symbol;
+    bool is_global;
+    x86_list_t instrs;
+    list(struct x86_constant) constants;
+    int n_labels;
+};
+
+// What instruction selection reduces a subtree of the IR to.
+enum nonterminal : char {
+    // an instruction whose value, if it has one, nothing reads
+    NT_STMT,
+    // a value in the location allocated to its register
+    NT_REG,
+    // a register or the frame pointer, as the base of an address
+    NT_BASE,
+    // a register times 1, 2, 4 or 8, plus a displacement
+    NT_INDEX,
+    // a base plus an index or a displacement, which lea computes
+    NT_MODE,
+    // anything memory can be addressed with
+    NT_ADDR,
+    N_NONTERMINALS,
+};
+
+// How code generation lowers the instruction at the root of a selected rule.
+enum emitter : char {
+    // nothing: the instruction is folded into the one that uses it
+    EMIT_NONE,
+    // its own lowering, with the operands the rule matched as constants read
+    // as immediates
+    EMIT_DEFAULT,
+    EMIT_LEA,
+    EMIT_LOAD,
+    EMIT_STORE,
+    // a comparison and a conditional jump on its flags
+    EMIT_BRANCH,
+};
+
+// base + index * scale + disp, where base is a register or the frame
+// pointer, and there is no index if scale is 0.
+struct address_mode {
+    reg base;
+    bool frame;
+    reg index;
+    unsigned char scale;
+    int64_t disp;
+};
+
+// How one instruction of the IR is lowered.
+struct cover {
+    enum emitter emit;
+    // the operands, as slots of r[], that are read as immediates
+    unsigned char immediates;
+    // the memory of EMIT_LOAD and EMIT_STORE, or what EMIT_LEA computes
+    struct address_mode mode;
+    // the TEST that EMIT_BRANCH compares with
+    struct ir_instr *compare;
+};
+
+struct selection {
+    // one per instruction, a block's in order from block_start[b]
+    struct cover *covers;
+    size_t *block_start;
+    // the index in the constant pool of each register that is an integer
+    // constant, defined once by an IMM, or 0
+    int *constants;
+};
+
+// Choose the machine instructions of a function whose registers have been
+// allocated, by bottom-up rewriting of the trees of each block.
+void select_instructions(struct tu *tu, struct function *function, struct selection *out);
+void free_selection(struct selection *selection);
+
+// Lower a function whose registers have been allocated to machine code.
+void generate_function(struct tu *tu, struct function *function, struct x86_function *out);
+// The flags, as one more register after the machine registers.
+#define X86_FLAGS (1ull << N_MACHINE_REGS)
+// The machine registers and flags an instruction reads and writes, as bits
+// 1 << machine_reg and X86_FLAGS. Writing part of a register reads the rest
+// of it, and what a call or return reads is guessed generously.
+void x86_instr_regs(struct x86_instr *i, uint64_t *reads, uint64_t *writes);
+// Rewrite the windows of a function's machine code that the rules of the
+// peephole table match, and report how often each rule did.
+void peephole(struct tu *tu, struct function *function, struct x86_function *code);
+void free_x86_function(struct x86_function *function);
+// Generate the machine code of a function definition straight from its AST,
+// with no IR in between, for -O0. The result is freed with the module.
+struct x86_function *baseline_function(struct tu *tu, struct node *definition);
+// The symbol of a function or object with static storage, and whether it is
+// visible outside the module. A static local is named after its scope, so
+// two of the same name don't collide.
+int scope_symbol(struct tu *tu, struct scope *scope, bool *is_global);
+// Whether a variable is reached through its symbol rather than the stack
+// frame: one with static storage, or a function.
+bool names_symbol(struct tu *tu, struct scope *scope);
+// Whether a symbol is a string literal, whose name is its text, quotes and
+// all, and which is labelled by where that is in the string table instead.
+bool is_string_symbol(struct tu *tu, int symbol);
+// Whether global g is a tentative definition that another of the same
+// symbol replaces: the one with an initializer, or the last if none has one.
+bool is_redefined(struct tu *tu, size_t g, int symbol);
+// The bytes of a global initialized with a scalar constant.
+uint64_t global_bits(struct ir_global *global);
+
+// Write the module as GNU assembler source for the System V ABI.
+void write_assembly(struct tu *tu, FILE *out);
+
+// The sections of a module of machine code.
+enum x86_section : char {
+    X86_TEXT,
+    X86_RODATA,
+    X86_DATA,
+    X86_BSS,
+    N_X86_SECTIONS,
+};
+
+enum x86_reloc_kind : char {
+    // a 32 bit displacement from the end of the field, or one to a function
+    // reached through the PLT
+    X86_RELOC_PC32,
+    X86_RELOC_PLT32,
+    // a 32 bit displacement to the symbol's GOT entry
+    X86_RELOC_GOTPCREL,
+    // the 64 bit address
+    X86_RELOC_64,
+};
+
+// A field in a section that holds where symbol + addend is, once that is
+// known. The addend of a displacement already counts the bytes from the
+// field to the end of its instruction.
+struct x86_reloc {
+    uint32_t offset;
+    enum x86_reloc_kind kind;
+    int symbol;
+    int64_t addend;
+};
+
+typedef list(unsigned char) byte_list_t;
+
+struct x86_section_data {
+    byte_list_t bytes;
+    list(struct x86_reloc) relocs;
+    // the size of the bss, which has no bytes
+    size_t size;
+    size_t align;
+};
+
+struct x86_symbol {
+    int name;
+    enum x86_section section;
+    uint32_t offset;
+    uint32_t size;
+    bool is_global;
+    bool is_function;
+};
+
+// The machine code and data of a translation unit, with the symbols it
+// defines. A relocation to a symbol it doesn't define is to another module.
+struct x86_module {
+    struct x86_section_data sections[N_X86_SECTIONS];
+    list(struct x86_symbol) symbols;
+};
+
+// Encode a function's machine code at the end of the text section, followed
+// by its constants. Returns where it starts.
+uint32_t encode_function(struct x86_function *function, struct x86_section_data *text);
+// Generate and encode every function of the module, and lay out its data.
+void build_module(struct tu *tu, struct x86_module *module);
+// Lay out the data of the module's globals, and of the string literals its
+// sections refer to so far.
+void build_data(struct tu *tu, struct x86_module *module);
+// A string literal the first time something refers to it, decoded into
+// rodata.
+void add_string_literal(struct tu *tu, struct x86_module *module, int symbol);
+void free_module(struct x86_module *module);
+// The index of the symbol a module defines with a name, or -1.
+int find_symbol(struct x86_module *module, int name);
+
+// An ELF64 relocatable object of a module. Given the address each section
+// was loaded at, it is instead the symbol file a debugger reads for the
+// loaded module, which has no relocations left.
+void elf_image(struct tu *tu, struct x86_module *module, char *const *addresses, byte_list_t *out);
+// Write the module as an ELF64 relocatable object.
+void write_object(struct tu *tu, FILE *out);
+
+#endif //COMPILER_X86_H